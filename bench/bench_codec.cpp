@@ -0,0 +1,81 @@
+#include <benchmark/benchmark.h>
+#include <stdint.h>
+#include <vector>
+
+extern "C" {
+#include "image.h"
+#include "indexed_color.h"
+#include "rgb565_codec.h"
+}
+
+// RGB565 codec and indexed colour quantisation on a cover sized image of smooth gradients with
+// mild noise, like a photo.
+
+namespace {
+
+std::vector<uint8_t> makeCover() {
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  uint16_t *pixels = (uint16_t *)rgb565.data();
+  uint32_t noise = 1;
+
+  for (uint32_t y = 0; y < TARGET_IMG_HEIGHT; y++) {
+    for (uint32_t x = 0; x < TARGET_IMG_WIDTH; x++) {
+      noise = noise * 1103515245 + 12345;
+      uint32_t r = (x * 31 / TARGET_IMG_WIDTH + (noise >> 16) % 2) & 31;
+      uint32_t g = (y * 63 / TARGET_IMG_HEIGHT + (noise >> 20) % 2) & 63;
+      uint32_t b = ((x + y) * 31 / (2 * TARGET_IMG_WIDTH)) & 31;
+      pixels[y * TARGET_IMG_WIDTH + x] = (uint16_t)((r << 11) | (g << 5) | b);
+    }
+  }
+
+  return rgb565;
+}
+
+void BM_Rgb565Encode(benchmark::State &state) {
+  auto cover = makeCover();
+  std::vector<uint8_t> encoded(RGB565_ENCODED_MAX_SIZE(TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT));
+  size_t size = 0;
+
+  for (auto _ : state) {
+    size = rgb565_encode(cover.data(), TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, encoded.data(),
+                         encoded.size());
+    benchmark::DoNotOptimize(encoded.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * cover.size());
+  state.counters["ratio"] = (double)cover.size() / size;
+}
+BENCHMARK(BM_Rgb565Encode);
+
+void BM_Rgb565Decode(benchmark::State &state) {
+  auto cover = makeCover();
+  std::vector<uint8_t> encoded(RGB565_ENCODED_MAX_SIZE(TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT));
+  size_t size = rgb565_encode(cover.data(), TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, encoded.data(),
+                              encoded.size());
+  std::vector<uint8_t> decoded(RGB565_BUFFER_SIZE);
+
+  for (auto _ : state) {
+    rgb565_decode(encoded.data(), size, decoded.data(), decoded.size());
+    benchmark::DoNotOptimize(decoded.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * decoded.size());
+}
+BENCHMARK(BM_Rgb565Decode);
+
+void BM_Rgb565ToIndexed(benchmark::State &state) {
+  auto cover = makeCover();
+  std::vector<uint8_t> indexed(INDEXED_BUFFER_SIZE);
+  IndexedOptions options = {.max_colors = INDEXED_MAX_COLORS, .dither = state.range(0) != 0};
+
+  for (auto _ : state) {
+    rgb565_to_indexed(cover.data(), TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, &options,
+                      indexed.data());
+    benchmark::DoNotOptimize(indexed.data());
+  }
+
+  state.SetBytesProcessed(state.iterations() * cover.size());
+}
+BENCHMARK(BM_Rgb565ToIndexed)->Arg(0)->Arg(1)->Unit(benchmark::kMicrosecond);
+
+} // namespace
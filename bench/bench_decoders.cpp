@@ -0,0 +1,100 @@
+#include "../test/test_fixtures.h"
+#include <benchmark/benchmark.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "image_decoder.h"
+}
+
+// Compares every registered decoder backend on cover sized pictures, so the fastest backend for
+// the hardware can be picked with image_decoder_prefer.
+
+namespace {
+
+struct Cover {
+  std::string name;
+  ImageType type;
+  std::vector<uint8_t> data;
+};
+
+std::vector<Cover> makeCovers() {
+  auto rgb = makeGradientRgb888(1000, 1000);
+  return {
+      {"png_1000", PNG, encodePng(rgb, 1000, 1000, false)},
+      {"png_1000_interlaced", PNG, encodePng(rgb, 1000, 1000, true)},
+      {"jpeg_1000", JPEG, encodeJpeg(rgb, 1000, 1000, false, 90)},
+      {"jpeg_1000_progressive", JPEG, encodeJpeg(rgb, 1000, 1000, true, 90)},
+  };
+}
+
+bool discardRow(const uint8_t *, uint32_t, void *) { return true; }
+
+void benchDecode(benchmark::State &state, const ImageDecoder *decoder, const Cover *cover) {
+  for (auto _ : state) {
+    Image image = {};
+    if (!decoder->decode(cover->data.data(), cover->data.size(), &image, 1)) {
+      state.SkipWithError("decode failed");
+      break;
+    }
+    benchmark::DoNotOptimize(image.buffer);
+    free(image.buffer);
+  }
+}
+
+void benchDecodeRows(benchmark::State &state, const ImageDecoder *decoder, const Cover *cover) {
+  for (auto _ : state) {
+    if (!decoder->decode_rows(cover->data.data(), cover->data.size(), &discardRow, nullptr)) {
+      state.SkipWithError("decode_rows failed");
+      break;
+    }
+  }
+}
+
+void benchDecodeScaled(benchmark::State &state, const ImageDecoder *decoder, const Cover *cover) {
+  std::vector<uint8_t> buffer(RGB888_BUFFER_SIZE);
+  Image scaled = {.buffer = buffer.data(),
+                  .length = RGB888_BUFFER_SIZE,
+                  .img_width = TARGET_IMG_WIDTH,
+                  .img_height = TARGET_IMG_HEIGHT};
+
+  for (auto _ : state) {
+    if (!decoder->decode_scaled(cover->data.data(), cover->data.size(), &scaled)) {
+      state.SkipWithError("decode_scaled failed");
+      break;
+    }
+    benchmark::DoNotOptimize(buffer.data());
+  }
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+  static const std::vector<Cover> covers = makeCovers();
+
+  for (size_t i = 0; i < image_decoder_count(); i++) {
+    const ImageDecoder *decoder = image_decoder_at(i);
+
+    for (const Cover &cover : covers) {
+      if (cover.type != decoder->type) {
+        continue;
+      }
+
+      std::string suffix = std::string(decoder->name) + "/" + cover.name;
+      benchmark::RegisterBenchmark(("Decode/" + suffix).c_str(), benchDecode, decoder, &cover)
+          ->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark(("DecodeRows/" + suffix).c_str(), benchDecodeRows, decoder,
+                                   &cover)
+          ->Unit(benchmark::kMillisecond);
+      benchmark::RegisterBenchmark(("DecodeScaled/" + suffix).c_str(), benchDecodeScaled, decoder,
+                                   &cover)
+          ->Unit(benchmark::kMillisecond);
+    }
+  }
+
+  benchmark::Initialize(&argc, argv);
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+  return 0;
+}
@@ -0,0 +1,69 @@
+#include <benchmark/benchmark.h>
+#include <random>
+#include <stdint.h>
+#include <vector>
+
+extern "C" {
+#include "dhash_index.h"
+#include "image.h"
+#include "img_processing.h"
+}
+
+// Near-duplicate lookups in a library sized index and the hash of a downscaled cover.
+
+namespace {
+
+void BM_DhashIndexNearest(benchmark::State &state) {
+  const size_t count = (size_t)state.range(0);
+  const uint32_t max_distance = (uint32_t)state.range(1);
+  std::mt19937_64 random(41);
+
+  DhashIndex *index = dhash_index_create(max_distance);
+  std::vector<uint64_t> hashes(count);
+  for (uint64_t &hash : hashes) {
+    uint32_t id;
+    hash = random();
+    dhash_index_add(index, hash, &id);
+  }
+
+  // half of the queries are slightly changed library hashes, half are new covers
+  std::vector<uint64_t> queries(1024);
+  for (size_t i = 0; i < queries.size(); i++) {
+    queries[i] = i % 2 == 0 ? hashes[random() % count] ^ ((uint64_t)1 << (random() % 64))
+                            : random();
+  }
+
+  size_t i = 0;
+  for (auto _ : state) {
+    uint32_t id;
+    benchmark::DoNotOptimize(
+        dhash_index_nearest(index, queries[i++ % queries.size()], max_distance, &id));
+  }
+
+  dhash_index_destroy(index);
+}
+BENCHMARK(BM_DhashIndexNearest)
+    ->Args({1 << 20, 4})
+    ->Args({1 << 22, 4})
+    ->Args({1 << 20, 8})
+    ->Unit(benchmark::kMicrosecond);
+
+void BM_ImageDhash(benchmark::State &state) {
+  std::mt19937 random(41);
+  std::vector<uint8_t> buffer(RGB888_BUFFER_SIZE);
+  for (uint8_t &value : buffer) {
+    value = (uint8_t)random();
+  }
+
+  Image image;
+  image_set_planar(&image, buffer.data(), TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT);
+
+  for (auto _ : state) {
+    benchmark::DoNotOptimize(image_dhash(&image));
+  }
+
+  state.SetBytesProcessed(state.iterations() * buffer.size());
+}
+BENCHMARK(BM_ImageDhash);
+
+} // namespace
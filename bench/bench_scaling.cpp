@@ -0,0 +1,145 @@
+#include <benchmark/benchmark.h>
+#include <stdint.h>
+#include <vector>
+
+extern "C" {
+#include "img_processing.h"
+}
+
+// Scaling kernels on a cover sized source, interleaved against planar layouts.
+
+namespace {
+
+constexpr uint32_t SOURCE_SIZE = 1000;
+
+std::vector<uint8_t> makeSource() {
+  std::vector<uint8_t> rgb(SOURCE_SIZE * SOURCE_SIZE * 3);
+  for (size_t i = 0; i < rgb.size(); i++) {
+    rgb[i] = (uint8_t)(i * 7 + i / 3);
+  }
+  return rgb;
+}
+
+struct Images {
+  std::vector<uint8_t> source = makeSource();
+  std::vector<uint8_t> source_planes = std::vector<uint8_t>(source.size());
+  std::vector<uint8_t> target = std::vector<uint8_t>(RGB888_BUFFER_SIZE);
+  Image interleaved_src = {.buffer = source.data(),
+                           .length = source.size(),
+                           .img_width = SOURCE_SIZE,
+                           .img_height = SOURCE_SIZE};
+  Image planar_src = {};
+  Image interleaved_dst = {.buffer = target.data(),
+                           .length = target.size(),
+                           .img_width = TARGET_IMG_WIDTH,
+                           .img_height = TARGET_IMG_HEIGHT};
+  Image planar_dst = {};
+
+  Images() {
+    image_set_planar(&planar_src, source_planes.data(), SOURCE_SIZE, SOURCE_SIZE);
+    deinterleave_rgb888(source.data(), planar_src.planes[0], planar_src.planes[1],
+                        planar_src.planes[2], (size_t)SOURCE_SIZE * SOURCE_SIZE);
+    image_set_planar(&planar_dst, target.data(), TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT);
+  }
+};
+
+void BM_DownscaleReference(benchmark::State &state) {
+  Images images;
+  for (auto _ : state) {
+    downscale_area_average(&images.interleaved_src, &images.interleaved_dst);
+    benchmark::DoNotOptimize(images.target.data());
+  }
+}
+BENCHMARK(BM_DownscaleReference)->Unit(benchmark::kMillisecond);
+
+void BM_DownscaleRowsInterleaved(benchmark::State &state) {
+  Images images;
+  for (auto _ : state) {
+    downscale_area_average_rows(&images.interleaved_src, &images.interleaved_dst);
+    benchmark::DoNotOptimize(images.target.data());
+  }
+}
+BENCHMARK(BM_DownscaleRowsInterleaved)->Unit(benchmark::kMillisecond);
+
+void BM_DownscaleRowsPlanar(benchmark::State &state) {
+  Images images;
+  for (auto _ : state) {
+    downscale_area_average_rows(&images.planar_src, &images.planar_dst);
+    benchmark::DoNotOptimize(images.target.data());
+  }
+}
+BENCHMARK(BM_DownscaleRowsPlanar)->Unit(benchmark::kMillisecond);
+
+void BM_DownscalePlanarRotated(benchmark::State &state) {
+  Images images;
+  images.planar_src.orientation = ORIENTATION_ROTATE_90;
+  for (auto _ : state) {
+    scale_square_image(&images.planar_src, &images.planar_dst);
+    benchmark::DoNotOptimize(images.target.data());
+  }
+}
+BENCHMARK(BM_DownscalePlanarRotated)->Unit(benchmark::kMillisecond);
+
+void BM_DownscalePlanarLinearLight(benchmark::State &state) {
+  Images images;
+  for (auto _ : state) {
+    scale_square_image_ex(&images.planar_src, &images.planar_dst, nullptr, true);
+    benchmark::DoNotOptimize(images.target.data());
+  }
+}
+BENCHMARK(BM_DownscalePlanarLinearLight)->Unit(benchmark::kMillisecond);
+
+void BM_DownscalePlanarWithPalette(benchmark::State &state) {
+  Images images;
+  std::vector<ColorHistogram> histogram(1);
+  for (auto _ : state) {
+    histogram[0] = {};
+    scale_square_image_ex(&images.planar_src, &images.planar_dst, histogram.data(), false);
+    Palette palette = {.max_colors = 8};
+    color_histogram_palette(histogram.data(), &palette);
+    benchmark::DoNotOptimize(palette.colors);
+  }
+}
+BENCHMARK(BM_DownscalePlanarWithPalette)->Unit(benchmark::kMillisecond);
+
+void BM_Deinterleave(benchmark::State &state) {
+  Images images;
+  for (auto _ : state) {
+    deinterleave_rgb888(images.source.data(), images.planar_src.planes[0],
+                        images.planar_src.planes[1], images.planar_src.planes[2],
+                        (size_t)SOURCE_SIZE * SOURCE_SIZE);
+    benchmark::DoNotOptimize(images.source_planes.data());
+  }
+  state.SetBytesProcessed(state.iterations() * images.source.size());
+}
+BENCHMARK(BM_Deinterleave);
+
+void BM_PackInterleaved(benchmark::State &state) {
+  Images images;
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  Image dst = {.buffer = rgb565.data(),
+               .length = rgb565.size(),
+               .img_width = TARGET_IMG_WIDTH,
+               .img_height = TARGET_IMG_HEIGHT};
+  for (auto _ : state) {
+    rgb888_to_rgb565_scalar(&images.interleaved_dst, &dst);
+    benchmark::DoNotOptimize(rgb565.data());
+  }
+}
+BENCHMARK(BM_PackInterleaved);
+
+void BM_PackPlanar(benchmark::State &state) {
+  Images images;
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  Image dst = {.buffer = rgb565.data(),
+               .length = rgb565.size(),
+               .img_width = TARGET_IMG_WIDTH,
+               .img_height = TARGET_IMG_HEIGHT};
+  for (auto _ : state) {
+    rgb888_planar_to_rgb565(&images.planar_dst, &dst);
+    benchmark::DoNotOptimize(rgb565.data());
+  }
+}
+BENCHMARK(BM_PackPlanar);
+
+} // namespace
@@ -1,6 +1,11 @@
 #ifndef ALBUM_ART_H
 #define ALBUM_ART_H
 
+#include "./art_diag.h"
+#include "./art_memory.h"
+#include "./image.h"
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 
 typedef enum {
@@ -14,8 +19,181 @@ typedef enum {
   COULD_NOT_SEEK_TO_POS,
   COULD_NOT_READ_HEADER,
   IMAGE_PROCESSING_ERROR,
+  CANCELLED,
+  COULD_NOT_WRITE_TAG,
+  IMAGE_TOO_LARGE,
 } IO_ERROR;
 
+/**
+ * Optional settings for get_album_art_ex, passing NULL behaves exactly like get_album_art.
+ *
+ * is_cancelled:          polled between tag scan, decode and downscale, returning true aborts
+ *                        the conversion with CANCELLED (the rgb565 buffer is then left in an
+ *                        undefined state)
+ * cancel_data:           passed to is_cancelled
+ * jpeg_decode_threads:   threads decoding a single baseline JPEG with restart markers, meant for
+ *                        interactive requests of very large covers. 0 or 1 decodes serially
+ * art_dhash:             optional, set to the image_dhash of the downscaled picture on success.
+ *                        It is computed from the 200x200 intermediate the RGB565 buffer is packed
+ *                        from, so near-duplicate covers can be found without decoding them again
+ * palette:               optional, filled with the dominant colours of the picture on success.
+ *                        Their histogram is gathered while the downscaler writes its output rows,
+ *                        see scale_square_image_ex
+ * linear_light:          downscale in linear light instead of averaging sRGB bytes, keeps fine
+ *                        bright detail such as white text on dark covers from turning grey, see
+ *                        row_downscaler_init_ex
+ * memory:                optional, context every allocation of the call comes from, including
+ *                        the APIC buffer, decoded images and the memory of libjpeg and libpng.
+ *                        NULL allocates from the C library, see art_memory.h
+ * memory_stats:          optional, set to the bytes allocated by this call when it returns, also
+ *                        on failure. Without memory the call is counted in art_memory_default
+ * max_pixels:            pixel budget of the picture, 0 disables it. Pictures above it are never
+ *                        decoded in full, baseline JPEGs and non-interlaced PNGs are decoded
+ *                        straight to the target size a band of rows at a time instead (always
+ *                        averaging sRGB values, linear_light does not apply). Other pictures, and
+ *                        pictures of which even a band of rows exceeds the budget, fail with
+ *                        IMAGE_TOO_LARGE before anything is allocated for their pixels. Budgets
+ *                        below TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT count as that size
+ * diag:                  optional, set to the first warning or error the call ran into, its code
+ *                        is ART_DIAG_NONE if there was none. Reports the build compiles out are
+ *                        not recorded either, see art_diag.h
+ */
+typedef struct {
+  bool (*is_cancelled)(void *cancel_data);
+  void *cancel_data;
+  uint32_t jpeg_decode_threads;
+  uint64_t *art_dhash;
+  Palette *palette;
+  bool linear_light;
+  ArtMemory *memory;
+  ArtMemoryStats *memory_stats;
+  uint64_t max_pixels;
+  ArtDiagRecord *diag;
+} AlbumArtOptions;
+
+// biggest baseline JPEG get_album_art_jpeg hands out unchanged
+#define PASSTHROUGH_DEFAULT_MAX_SIZE (64 * 1024)
+#define PASSTHROUGH_DEFAULT_QUALITY 85
+
+/**
+ * Optional settings of get_album_art_jpeg, NULL uses the defaults.
+ *
+ * max_size:  covers that are baseline JPEGs of at most this many bytes are passed through, 0 uses
+ *            PASSTHROUGH_DEFAULT_MAX_SIZE
+ * quality:   JPEG quality (1 to 100) of transcoded covers, 0 uses PASSTHROUGH_DEFAULT_QUALITY
+ */
+typedef struct {
+  uint32_t max_size;
+  uint8_t quality;
+} PassthroughOptions;
+
+/**
+ * Compressed cover for players that decode baseline JPEG themselves, see get_album_art_jpeg.
+ *
+ * data:          the JPEG of size bytes
+ * transcoded:    false if data is the picture of the APIC frame as stored in the file
+ * owned_buffer:  released by album_art_jpeg_free, NULL if data points into the caller's memory
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  bool transcoded;
+  uint8_t *owned_buffer;
+} AlbumArtJpeg;
+
+/**
+ * Phase reported to a preview_callback.
+ *
+ * PREVIEW_COARSE:  low resolution approximation (1/8 DCT-scaled JPEG, DC scans of a progressive
+ *                  JPEG or the first Adam7 pass of an interlaced PNG)
+ * PREVIEW_FINAL:   the full quality image, identical to the output of get_album_art
+ */
+typedef enum { PREVIEW_COARSE, PREVIEW_FINAL } PreviewPhase;
+
+/**
+ * Called every time the rgb565 buffer has been filled for a phase.
+ * Returning false after PREVIEW_COARSE skips the refinement (e.g. the item was scrolled away).
+ */
+typedef bool (*preview_callback)(PreviewPhase phase, uint8_t *rgb565_buffer, void *user_data);
+
+/**
+ * Source of MP3 data for get_album_art_from_reader, for callers that stream the file from
+ * somewhere else than the filesystem.
+ *
+ * read:    reads up to size bytes at the current position, returns the number of bytes read
+ * seek:    moves the current position to offset bytes from the start, returns false on failure
+ * size:    optional, total number of bytes of the source or NULL if unknown
+ * handle:  passed to every callback
+ */
+typedef struct {
+  size_t (*read)(void *handle, uint8_t *buffer, size_t size);
+  bool (*seek)(void *handle, uint64_t offset);
+  uint64_t (*size)(void *handle);
+  void *handle;
+} ArtReader;
+
 IO_ERROR get_album_art(const char *file_path, uint8_t *rgb565_buffer);
+IO_ERROR get_album_art_ex(const char *file_path, uint8_t *rgb565_buffer,
+                          const AlbumArtOptions *options);
+
+/**
+ * Converts the album art of an MP3 file that is already in memory.
+ * The picture is decoded straight from data, nothing is copied. options may be NULL.
+ */
+IO_ERROR get_album_art_from_memory(const uint8_t *data, size_t size, uint8_t *rgb565_buffer,
+                                   const AlbumArtOptions *options);
+
+/**
+ * Converts the album art read through the reader callbacks. Only the tag header, the frame headers
+ * and the biggest APIC frame are read. options may be NULL.
+ */
+IO_ERROR get_album_art_from_reader(const ArtReader *reader, uint8_t *rgb565_buffer,
+                                   const AlbumArtOptions *options);
+
+/**
+ * Converts the album art like get_album_art_ex and compresses it with rgb565_encode for the
+ * transfer to the device, see rgb565_codec.h. encoded must hold
+ * RGB565_ENCODED_MAX_SIZE(TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT) bytes, on success encoded_size is
+ * set to the number of bytes used. options may be NULL.
+ */
+IO_ERROR get_album_art_encoded(const char *file_path, uint8_t *encoded, size_t capacity,
+                               size_t *encoded_size, const AlbumArtOptions *options);
+
+/**
+ * Converts the album art like get_album_art_ex and quantises it with rgb565_to_indexed for players
+ * with 256 colour displays, see indexed_color.h. indexed must hold INDEXED_BUFFER_SIZE bytes.
+ * dither enables error diffusion. options may be NULL.
+ */
+IO_ERROR get_album_art_indexed(const char *file_path, uint8_t *indexed, bool dither,
+                               const AlbumArtOptions *options);
+
+/**
+ * Returns the biggest APIC picture compressed instead of converting it to RGB565.
+ *
+ * A cover that is an upright baseline JPEG of at most max_size bytes is returned as stored, nothing
+ * is decoded. Any other cover is decoded once with decoder side scaling (DCT scaling for JPEG) to
+ * TARGET_IMG_WIDTH x TARGET_IMG_HEIGHT, turned upright and compressed to a baseline JPEG. Release
+ * the result with album_art_jpeg_free. options may be NULL.
+ */
+IO_ERROR get_album_art_jpeg(const char *file_path, AlbumArtJpeg *jpeg,
+                            const PassthroughOptions *options);
+
+/**
+ * get_album_art_jpeg for an MP3 file in memory, a passed through cover points into data.
+ */
+IO_ERROR get_album_art_jpeg_from_memory(const uint8_t *data, size_t size, AlbumArtJpeg *jpeg,
+                                        const PassthroughOptions *options);
+
+void album_art_jpeg_free(AlbumArtJpeg *jpeg);
+
+/**
+ * Two-phase variant of get_album_art for latency critical callers.
+ *
+ * Writes a coarse preview into the rgb565 buffer as soon as possible and refines the same buffer to
+ * full quality afterwards, calling the callback after each phase. Non-interlaced PNGs have no cheap
+ * coarse representation, for those only PREVIEW_FINAL is reported.
+ */
+IO_ERROR get_album_art_preview(const char *file_path, uint8_t *rgb565_buffer,
+                               preview_callback callback, void *user_data);
 
 #endif // ALBUM_ART_H
@@ -0,0 +1,77 @@
+#ifndef ART_ATLAS_H
+#define ART_ATLAS_H
+
+#include "./art_pipeline.h"
+#include "./image.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Picture of one tile, either a file that is converted or an already converted thumbnail.
+ *
+ * file_path:         MP3 file to read the cover from, ignored if rgb565_thumbnail is set
+ * rgb565_thumbnail:  optional cached conversion of RGB565_BUFFER_SIZE bytes (e.g. from
+ *                    library_scan), copied into the tile without touching the file
+ */
+typedef struct {
+  const char *file_path;
+  const uint8_t *rgb565_thumbnail;
+} AtlasSource;
+
+/**
+ * Entry of the tile index map, tile i covers the TARGET_IMG_WIDTH x TARGET_IMG_HEIGHT pixels at
+ * column x and row y of the atlas.
+ *
+ * result:    same values get_album_art would return for the last picture rendered into the tile,
+ *            NO_APIC for tiles that were never rendered. Tiles without a picture are cleared
+ * dirty:     the tile has been written since the flag was last cleared with art_atlas_clear_dirty
+ */
+typedef struct {
+  uint32_t x;
+  uint32_t y;
+  IO_ERROR result;
+  bool dirty;
+} AtlasTile;
+
+/**
+ * Texture holding tile_count covers in a grid of columns tiles per row.
+ *
+ * image:     the whole texture, IMAGE_RGB565 or IMAGE_RGBA8888 with rows starting on
+ *            IMAGE_ROW_ALIGNMENT byte boundaries, image.stride is the row pitch for the upload
+ * tiles:     tile index map of tile_count entries in row major order
+ */
+typedef struct {
+  Image image;
+  uint32_t columns;
+  uint32_t tile_count;
+  AtlasTile *tiles;
+} ArtAtlas;
+
+/**
+ * Allocates an atlas of tile_count cleared tiles, returns NULL if format is not IMAGE_RGB565 or
+ * IMAGE_RGBA8888, tile_count or columns is 0 or the memory could not be allocated.
+ */
+ArtAtlas *art_atlas_create(uint32_t tile_count, uint32_t columns, PixelFormat format);
+void art_atlas_destroy(ArtAtlas *atlas);
+
+/**
+ * Renders count sources into the tiles listed in tile_indices (NULL renders source i into tile i)
+ * and marks them dirty, the other tiles are not touched. Thumbnails are copied on the calling
+ * thread, files are converted in parallel by art_pipeline_run straight into their tiles, so an
+ * incremental update only pays for the tiles that changed. A tile may appear once per call.
+ *
+ * config:    pipeline settings, may be NULL. on_item_done is called for converted files as usual
+ *
+ * Returns false if a tile index is out of range or the pipeline could not be set up, the tiles
+ * rendered before the failure keep their new pictures.
+ */
+bool art_atlas_render(ArtAtlas *atlas, const uint32_t *tile_indices, const AtlasSource *sources,
+                      size_t count, const ArtPipelineConfig *config);
+
+/**
+ * Clears the dirty flag of every tile, e.g. once the dirty tiles have been uploaded.
+ */
+void art_atlas_clear_dirty(ArtAtlas *atlas);
+
+#endif // ART_ATLAS_H
@@ -0,0 +1,145 @@
+#ifndef ART_BUNDLE_H
+#define ART_BUNDLE_H
+
+#include "./art_pipeline.h"
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Single file archive of converted album art for the device and a random access art store for the
+ * desktop app. All values are stored little endian, the structs below are the on-disk layout so
+ * a mapped bundle is read in place.
+ *
+ * header:    ArtBundleHeader at offset 0
+ * blobs:     art data, every blob starts on an ART_BUNDLE_ALIGNMENT byte boundary. Tracks with the
+ *            same art share one blob
+ * index:     entry_count ArtBundleEntry structs at index_offset, sorted by track_id
+ *
+ * Appending writes new blobs and a new index behind the old ones and replaces the header last, a
+ * bundle that was being appended to when the writer crashed still holds the previous contents.
+ */
+#define ART_BUNDLE_ALIGNMENT 4096
+#define ART_BUNDLE_VERSION 1
+
+typedef enum { ART_BUNDLE_RGB565, ART_BUNDLE_RGB565_ENCODED } ArtBundleFormat;
+
+/**
+ * magic:         "MP3ARTB" and a terminating zero
+ * entry_size:    size of an index entry, sizeof(ArtBundleEntry) for this version
+ * entry_count:   number of index entries
+ * index_offset:  file offset of the index
+ * data_end:      end of the last blob, appended blobs start at the first aligned offset behind the
+ *                data and the index
+ */
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t entry_size;
+  uint64_t entry_count;
+  uint64_t index_offset;
+  uint64_t data_end;
+  uint8_t reserved[24];
+} ArtBundleHeader;
+
+/**
+ * track_id:      key of the entry, see art_bundle_track_id
+ * content_hash:  hash of the blob, used to share blobs between tracks
+ * blob_offset:   file offset of the art data
+ * blob_size:     bytes of art data
+ * format:        ArtBundleFormat of the art data, ART_BUNDLE_RGB565_ENCODED is decoded with
+ *                rgb565_decode
+ */
+typedef struct {
+  uint64_t track_id;
+  uint64_t content_hash;
+  uint64_t blob_offset;
+  uint32_t blob_size;
+  uint32_t format;
+} ArtBundleEntry;
+
+static_assert(sizeof(ArtBundleHeader) == 64, "bundle header layout");
+static_assert(sizeof(ArtBundleEntry) == 32, "bundle entry layout");
+
+/**
+ * Track id of a file path, the key under which art_bundle_build stores the art of the file.
+ */
+uint64_t art_bundle_track_id(const char *file_path);
+
+typedef struct ArtBundle ArtBundle;
+
+/**
+ * Maps a bundle read only. Only the header is checked, lookups binary search the mapped index.
+ * Returns NULL if the file can not be mapped or is not a bundle.
+ */
+ArtBundle *art_bundle_open(const char *path);
+void art_bundle_close(ArtBundle *bundle);
+
+size_t art_bundle_count(const ArtBundle *bundle);
+const ArtBundleEntry *art_bundle_entry_at(const ArtBundle *bundle, size_t index);
+
+/**
+ * Index entry of the track in O(log n), NULL if the bundle has no art for it.
+ */
+const ArtBundleEntry *art_bundle_find(const ArtBundle *bundle, uint64_t track_id);
+
+/**
+ * Art data of an entry inside the mapping, valid until the bundle is closed. NULL if the entry
+ * points outside of the file.
+ */
+const uint8_t *art_bundle_blob(const ArtBundle *bundle, const ArtBundleEntry *entry);
+
+typedef struct ArtBundleWriter ArtBundleWriter;
+
+/**
+ * Creates the bundle or opens an existing one to append to it. Returns NULL if the file could not
+ * be opened or exists but is not a bundle.
+ */
+ArtBundleWriter *art_bundle_writer_open(const char *path);
+
+/**
+ * Stores the art of a track, replacing earlier art of the same track. Art identical to a blob of
+ * the bundle is not written again. Returns false if the blob could not be written.
+ */
+bool art_bundle_writer_add(ArtBundleWriter *writer, uint64_t track_id, const uint8_t *data,
+                           uint32_t size, ArtBundleFormat format);
+
+/**
+ * Writes the index and the header, syncs the file and frees the writer. Returns false if anything
+ * failed since the writer was opened, the bundle then still holds its previous contents.
+ */
+bool art_bundle_writer_finish(ArtBundleWriter *writer);
+
+/**
+ * Settings of art_bundle_build, a NULL config uses the defaults for every field.
+ *
+ * pipeline:          settings of the art_pipeline_run batches, on_item_done and user_data are not
+ *                    used
+ * encode:            store the art compressed with rgb565_encode instead of raw RGB565
+ * batch_size:        files converted per pipeline run, bounds the memory held for converted art.
+ *                    0 uses 64
+ * share_similar:     tracks whose art is at most similar_distance bits of image_dhash away from
+ *                    art stored earlier in the same build share that blob instead of storing their
+ *                    own, e.g. the same cover embedded at different sizes or JPEG qualities
+ * similar_distance:  see share_similar, at most DHASH_INDEX_MAX_DISTANCE
+ */
+typedef struct {
+  ArtPipelineConfig pipeline;
+  bool encode;
+  uint32_t batch_size;
+  bool share_similar;
+  uint32_t similar_distance;
+} ArtBundleBuildConfig;
+
+/**
+ * Converts the files in parallel with the art pipeline and appends their art to the bundle under
+ * art_bundle_track_id of their paths. Encoding and hashing run on the pipeline's scale workers,
+ * only writing is serial. Files without usable art are left out, added is set to the number of
+ * files stored. Returns false if the bundle could not be written or the pipeline or the
+ * similarity index not set up.
+ */
+bool art_bundle_build(const char *bundle_path, const char *const *file_paths, size_t count,
+                      const ArtBundleBuildConfig *config, size_t *added);
+
+#endif // ART_BUNDLE_H
@@ -0,0 +1,123 @@
+#ifndef ART_DIAG_H
+#define ART_DIAG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Diagnostics of the conversions. Nothing is printed, failures are reported as records to the sink
+ * the host installs and to the record of the call that ran into them. Without a sink and outside
+ * of such a call a report costs a function call and two compares, no stdio lock is taken.
+ */
+
+typedef enum {
+  ART_DIAG_DEBUG,
+  ART_DIAG_INFO,
+  ART_DIAG_WARNING,
+  ART_DIAG_ERROR,
+  // as minimum level: no record at all
+  ART_DIAG_OFF,
+} ArtDiagLevel;
+
+typedef enum {
+  ART_DIAG_NONE,
+  ART_DIAG_OPEN_FAILED,
+  ART_DIAG_READ_FAILED,
+  ART_DIAG_SEEK_FAILED,
+  ART_DIAG_WRITE_FAILED,
+  ART_DIAG_ALLOC_FAILED,
+  ART_DIAG_NO_ID3,
+  ART_DIAG_TRUNCATED,
+  ART_DIAG_NO_IMAGE_DATA,
+  ART_DIAG_UNSUPPORTED_TYPE,
+  ART_DIAG_NO_DECODER,
+  ART_DIAG_DECODE_FAILED,
+  ART_DIAG_ENCODE_FAILED,
+  ART_DIAG_TOO_LARGE,
+  ART_DIAG_UNSUPPORTED_TAG,
+  ART_DIAG_NOT_A_BUNDLE,
+  ART_DIAG_THREAD_FAILED,
+  ART_DIAG_WATCH_FAILED,
+  ART_DIAG_WATCH_OVERFLOW,
+  ART_DIAG_IO_FALLBACK,
+  ART_DIAG_NOT_SQUARE,
+} ArtDiagCode;
+
+// bytes of the subject kept in a record, longer subjects are cut
+#define ART_DIAG_SUBJECT_SIZE 256
+
+/**
+ * One diagnostic.
+ *
+ * level:     severity, failed calls report at least one ART_DIAG_ERROR
+ * code:      what went wrong, stable across releases
+ * message:   English description of the site, a static string
+ * subject:   file path, MIME type or similar the record is about, empty if there is none
+ * values:    numbers belonging to the message, e.g. the size of a picture, 0 if unused
+ * function:  function that reported the record, a static string
+ */
+typedef struct {
+  ArtDiagLevel level;
+  ArtDiagCode code;
+  const char *message;
+  char subject[ART_DIAG_SUBJECT_SIZE];
+  uint64_t values[2];
+  const char *function;
+} ArtDiagRecord;
+
+/**
+ * Receives records of at least the level it was installed with, concurrently from every thread
+ * that converts. The record is only valid during the call.
+ */
+typedef void (*art_diag_sink)(const ArtDiagRecord *record, void *user_data);
+
+/**
+ * Installs the sink of the process, NULL removes it. Like the decoder registry this is not
+ * synchronised, install the sink before the first conversion starts.
+ */
+void art_diag_set_sink(art_diag_sink sink, void *user_data, ArtDiagLevel min_level);
+
+/**
+ * Sink writing one line per record to stderr, for tools and debugging. user_data is unused.
+ */
+void art_diag_stderr_sink(const ArtDiagRecord *record, void *user_data);
+
+const char *art_diag_code_name(ArtDiagCode code);
+const char *art_diag_level_name(ArtDiagLevel level);
+
+/**
+ * Record of a call on the current thread, entered by the album art entry points for
+ * AlbumArtOptions.diag. Keeps the first record of at least ART_DIAG_WARNING, the cause that the
+ * later ones follow from. Scopes nest, a finished scope hands its record to the enclosing one if
+ * that has none yet.
+ */
+typedef struct ArtDiagScope {
+  ArtDiagRecord *record;
+  struct ArtDiagScope *previous;
+} ArtDiagScope;
+
+void art_diag_scope_enter(ArtDiagScope *scope, ArtDiagRecord *record);
+void art_diag_scope_leave(ArtDiagScope *scope);
+
+void art_diag_report(ArtDiagLevel level, ArtDiagCode code, const char *message,
+                     const char *subject, uint64_t value0, uint64_t value1, const char *function);
+
+/**
+ * Reports below this level are compiled out together with their arguments, the build sets it
+ * with MP3CORE_DIAG_MIN_LEVEL. ART_DIAG_OFF removes every report.
+ */
+#ifndef ART_DIAG_MIN_LEVEL
+#define ART_DIAG_MIN_LEVEL ART_DIAG_DEBUG
+#endif
+
+#define ART_DIAG_VALUES(level, code, message, subject, value0, value1)                             \
+  do {                                                                                             \
+    if ((level) >= ART_DIAG_MIN_LEVEL) {                                                           \
+      art_diag_report((level), (code), (message), (subject), (value0), (value1), __func__);        \
+    }                                                                                              \
+  } while (0)
+
+#define ART_DIAG(level, code, message, subject)                                                    \
+  ART_DIAG_VALUES(level, code, message, subject, 0, 0)
+
+#endif // ART_DIAG_H
@@ -0,0 +1,106 @@
+#ifndef ART_MEMORY_H
+#define ART_MEMORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Allocator of the host application the conversions allocate from instead of the C library.
+ *
+ * malloc:      returns size bytes aligned for any type or NULL
+ * realloc:     resizes a block of this allocator like realloc, never gets NULL or a size of 0
+ * free:        releases a block of this allocator, never gets NULL
+ * user_data:   passed to every callback
+ *
+ * The callbacks are called from the thread of the conversion, and from the band threads of a
+ * parallel JPEG decode (see AlbumArtOptions.jpeg_decode_threads), so they have to be thread safe
+ * if the context is shared between threads or that option is used.
+ */
+typedef struct {
+  void *(*malloc)(void *user_data, size_t size);
+  void *(*realloc)(void *user_data, void *pointer, size_t size);
+  void (*free)(void *user_data, void *pointer);
+  void *user_data;
+} ArtAllocator;
+
+/**
+ * Bytes requested through a context or within a call, the bookkeeping of the allocator itself is
+ * not included.
+ *
+ * current_bytes:   bytes allocated and not yet freed
+ * peak_bytes:      highest current_bytes seen
+ * allocations:     number of allocations, including every realloc
+ */
+typedef struct {
+  size_t current_bytes;
+  size_t peak_bytes;
+  uint64_t allocations;
+} ArtMemoryStats;
+
+/**
+ * Memory context: an allocator plus the statistics of everything allocated through it, e.g. one
+ * per worker to keep per-worker budgets. The statistics are updated atomically, a context can be
+ * used by several conversions at once.
+ */
+typedef struct ArtMemory ArtMemory;
+
+/**
+ * Creates a context allocating from the given allocator, NULL counts allocations of the C library.
+ * The context itself is allocated from the allocator. Returns NULL if it could not be allocated.
+ */
+ArtMemory *art_memory_create(const ArtAllocator *allocator);
+
+/**
+ * Destroys the context, every conversion using it has to be finished.
+ */
+void art_memory_destroy(ArtMemory *memory);
+
+void art_memory_stats(const ArtMemory *memory, ArtMemoryStats *stats);
+
+/**
+ * Process wide context allocating from the C library, used for calls that ask for statistics
+ * without passing a context.
+ */
+ArtMemory *art_memory_default(void);
+
+/**
+ * Allocation scope of a call on the current thread, entered by the album art entry points for
+ * AlbumArtOptions.memory. Scopes nest, a finished scope adds its statistics to the enclosing one.
+ */
+typedef struct ArtMemoryScope {
+  ArtMemory *memory;
+  ArtMemoryStats stats;
+  struct ArtMemoryScope *previous;
+} ArtMemoryScope;
+
+void art_memory_scope_enter(ArtMemoryScope *scope, ArtMemory *memory);
+void art_memory_scope_leave(ArtMemoryScope *scope);
+
+/**
+ * Context of the scope active on the calling thread, NULL outside of any scope. Threads a call
+ * starts enter their own scope for it and hand their statistics to art_memory_scope_merge.
+ */
+ArtMemory *art_memory_current(void);
+
+/**
+ * Adds the statistics of scopes that ran on other threads to the scope of the calling thread, as if
+ * they had run at this point. Their peaks are added up, they ran concurrently.
+ */
+void art_memory_scope_merge(const ArtMemoryStats *stats);
+
+/**
+ * Allocation functions of the conversions. Inside a scope they allocate from its context and count
+ * the bytes, outside of any scope they are the C library functions. A block has to be freed inside
+ * the scope it was allocated in, or outside of any scope if it was allocated there, so everything a
+ * scoped call allocates is freed before it returns.
+ *
+ * art_aligned_alloc:   alignment is a power of two, size does not have to be a multiple of it
+ */
+void *art_malloc(size_t size);
+void *art_calloc(size_t count, size_t size);
+void *art_realloc(void *pointer, size_t size);
+void *art_aligned_alloc(size_t alignment, size_t size);
+void art_free(void *pointer);
+
+#endif // ART_MEMORY_H
@@ -0,0 +1,67 @@
+#ifndef ART_PIPELINE_H
+#define ART_PIPELINE_H
+
+#include "./album_art.h"
+#include "./image.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * One file of a batch conversion.
+ *
+ * file_path:       MP3 file to read the cover from
+ * rgb565_buffer:   output buffer of RGB565_BUFFER_SIZE bytes
+ * result:          set by the pipeline, same values get_album_art would return
+ * view:            optional, IMAGE_RGB565 or IMAGE_RGBA8888 view of the target size the picture is
+ *                  packed into instead of rgb565_buffer, e.g. a tile of an atlas
+ * dhash:           set by the pipeline for converted items, image_dhash of the downscaled picture
+ */
+typedef struct {
+  const char *file_path;
+  uint8_t *rgb565_buffer;
+  IO_ERROR result;
+  Image *view;
+  uint64_t dhash;
+} ArtBatchItem;
+
+typedef void (*art_batch_callback)(ArtBatchItem *item, void *user_data);
+
+/**
+ * Settings of art_pipeline_run, a NULL config uses the defaults for every field.
+ *
+ * decode_workers:    threads decoding pictures, 0 uses the number of online CPUs
+ * scale_workers:     threads scaling and packing decoded pictures, 0 uses 1
+ * queue_depth:       items that may wait between two stages, 0 uses twice the decode workers
+ * io_queue_depth:    files whose tags are read at once, 0 uses the tag reader default
+ * disable_io_uring:  always read tags with pread
+ * on_item_done:      optional, called once per item from the stage thread that finished it
+ * user_data:         passed to on_item_done
+ * max_pixels:        pixel budget of every picture, see AlbumArtOptions.max_pixels. 0 disables it
+ */
+typedef struct {
+  uint32_t decode_workers;
+  uint32_t scale_workers;
+  uint32_t queue_depth;
+  uint32_t io_queue_depth;
+  bool disable_io_uring;
+  art_batch_callback on_item_done;
+  void *user_data;
+  uint64_t max_pixels;
+} ArtPipelineConfig;
+
+/**
+ * Converts a batch of files in three overlapping stages:
+ *
+ * I/O:         runs on the calling thread, reads the tags of io_queue_depth files at once (see
+ *              tag_reader.h) and finds the biggest APIC frame of each
+ * decode:      decode_workers threads decoding the APIC payloads to RGB888
+ * scale/pack:  scale_workers threads downscaling and packing into the items' rgb565 buffers
+ *
+ * The stages are connected by bounded lock-free queues, so the I/O stage only reads ahead as far
+ * as the decoders can keep up with and memory use stays bounded. Returns false if the pipeline
+ * could not be set up, otherwise every item has its result set when this returns.
+ */
+bool art_pipeline_run(ArtBatchItem *items, size_t count, const ArtPipelineConfig *config);
+
+#endif // ART_PIPELINE_H
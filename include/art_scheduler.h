@@ -0,0 +1,65 @@
+#ifndef ART_SCHEDULER_H
+#define ART_SCHEDULER_H
+
+#include "./album_art.h"
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Asynchronous, prioritized get_album_art on a fixed pool of worker threads.
+ *
+ * Jobs with a higher priority are started first, jobs with the same priority in submission order.
+ * Queued jobs can be reprioritized, queued and running jobs can be cancelled. Running jobs notice
+ * the cancellation between tag scan, decode and downscale.
+ */
+typedef struct ArtScheduler ArtScheduler;
+typedef struct ArtJob ArtJob;
+
+/**
+ * Called exactly once per job from the thread that completed it: a worker thread, or the thread
+ * calling art_job_cancel/art_scheduler_destroy for jobs that never started.
+ */
+typedef void (*art_job_callback)(ArtJob *job, IO_ERROR result, uint8_t *rgb565_buffer,
+                                 void *user_data);
+
+/**
+ * worker_count: number of worker threads, 0 uses the number of online CPUs
+ */
+ArtScheduler *art_scheduler_create(uint32_t worker_count);
+
+/**
+ * Cancels all queued and running jobs, waits for the workers and frees the scheduler.
+ * Job handles stay valid until they are released.
+ */
+void art_scheduler_destroy(ArtScheduler *scheduler);
+
+/**
+ * Queues a conversion of file_path into rgb565_buffer, both have to stay valid until the job is
+ * done. callback may be NULL. Returns a handle that has to be released with art_job_release, or
+ * NULL if the job could not be allocated.
+ */
+ArtJob *art_scheduler_submit(ArtScheduler *scheduler, const char *file_path,
+                             uint8_t *rgb565_buffer, int32_t priority, art_job_callback callback,
+                             void *user_data);
+
+/**
+ * Changes the priority of a queued job, returns false if the job has already been started.
+ */
+bool art_job_set_priority(ArtJob *job, int32_t priority);
+
+/**
+ * Requests cancellation. Queued jobs are removed and completed with CANCELLED right away, running
+ * jobs stop at their next checkpoint. Jobs that are done are not affected.
+ */
+void art_job_cancel(ArtJob *job);
+
+bool art_job_is_done(ArtJob *job);
+
+/**
+ * Blocks until the job is done and returns its result.
+ */
+IO_ERROR art_job_wait(ArtJob *job);
+
+void art_job_release(ArtJob *job);
+
+#endif // ART_SCHEDULER_H
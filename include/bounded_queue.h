@@ -0,0 +1,36 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Bounded, lock-free multi-producer/multi-consumer queue of pointers used between pipeline stages.
+ *
+ * Every producer calls bounded_queue_producer_done once it will not push anymore. Blocking pops
+ * return false once all producers are done and the queue has been drained, blocking pushes wait
+ * for a free slot, which provides the backpressure between stages.
+ *
+ * The try calls are lock-free. Blocking calls yield a few times and then park on a condition
+ * variable, the other side only takes its lock when a thread is parked. Idle stages sleep until
+ * there is work instead of polling.
+ */
+typedef struct BoundedQueue BoundedQueue;
+
+/**
+ * capacity:    rounded up to the next power of two
+ * producers:   number of producers that will call bounded_queue_producer_done
+ */
+BoundedQueue *bounded_queue_create(size_t capacity, uint32_t producers);
+void bounded_queue_destroy(BoundedQueue *queue);
+
+bool bounded_queue_try_push(BoundedQueue *queue, void *value);
+bool bounded_queue_try_pop(BoundedQueue *queue, void **value);
+
+void bounded_queue_push(BoundedQueue *queue, void *value);
+bool bounded_queue_pop(BoundedQueue *queue, void **value);
+
+void bounded_queue_producer_done(BoundedQueue *queue);
+
+#endif // BOUNDED_QUEUE_H
@@ -9,4 +9,31 @@
 
 bool convert_jpeg_to_rgb888(const uint8_t *image_buffer, uint32_t size, Image *rgb888_image);
 
+/**
+ * Decodes a baseline JPEG with restart markers on up to threads threads. The restart segments are
+ * split into bands of rows that are decoded independently into disjoint rows of the output, the
+ * result is identical to convert_jpeg_to_rgb888. Files without restart markers, with restart
+ * intervals that do not cover whole MCU rows, or with multiple scans are decoded serially.
+ */
+bool convert_jpeg_to_rgb888_parallel(const uint8_t *image_buffer, uint32_t size,
+                                     Image *rgb888_image, uint32_t threads);
+
+bool convert_jpeg_to_rgb888_preview(const uint8_t *image_buffer, uint32_t size,
+                                    rgb888_pass_callback callback, void *user_data);
+
+/**
+ * True if the data is a baseline (SOF0) JPEG with 8 bit grayscale or YCbCr samples, the variant
+ * every embedded decoder supports. Only the marker segments in front of the first scan are read,
+ * orientation is set to the EXIF orientation found in them.
+ */
+bool jpeg_is_baseline(const uint8_t *image_buffer, uint32_t size, Orientation *orientation);
+
+/**
+ * Compresses an RGB888 image into a baseline JPEG of the given quality (1 to 100) with optimised
+ * Huffman tables. On success jpeg is set to a buffer of jpeg_size bytes that the caller frees with
+ * art_free.
+ */
+bool compress_rgb888_to_jpeg(const Image *rgb888_image, int quality, uint8_t **jpeg,
+                             size_t *jpeg_size);
+
 #endif // DECOMPRESS_JPG_H
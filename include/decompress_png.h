@@ -16,5 +16,46 @@ typedef struct {
 
 void read_png_from_memory(png_structp png_ptr, png_bytep data, png_size_t num_bytes);
 bool convert_png_to_rgb888(const uint8_t *image_buffer, uint32_t size, Image *rgb888_image);
+bool convert_png_to_rgb888_preview(const uint8_t *image_buffer, uint32_t size,
+                                   rgb888_pass_callback callback, void *user_data);
+
+/**
+ * Reads the size and interlacing of a PNG from its IHDR chunk, which directly follows the
+ * signature, so the first 33 bytes are enough. Returns false if data does not start with both.
+ */
+bool png_read_ihdr(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height,
+                   bool *interlaced);
+
+/**
+ * Size of the reads that feed convert_png_stream_to_scaled_rgb888.
+ */
+#define PNG_STREAM_CHUNK_SIZE (64 * 1024)
+
+/**
+ * Fills buffer with up to size of the following bytes of the PNG, returns the number of bytes
+ * read and 0 at the end of the data or on errors.
+ */
+typedef size_t (*png_stream_read)(void *handle, uint8_t *buffer, size_t size);
+
+/**
+ * Decodes a PNG with libpng's progressive reader and scales it to the size of rgb888_scaled.
+ *
+ * The PNG is pushed through png_process_data in fixed size reads, so the compressed data is never
+ * held as a whole. Rows of non-interlaced images that are downscaled go straight into a
+ * RowDownscaler and the full resolution image is never allocated either, other images are combined
+ * in full and passed to scale_square_image. The result is identical to convert_png_to_rgb888
+ * followed by scale_square_image.
+ *
+ * prefix:          start of the PNG that the caller already holds, must contain the signature
+ * remaining_size:  number of bytes following the prefix, pulled with read in chunks of
+ *                  PNG_STREAM_CHUNK_SIZE
+ * rgb888_scaled:   preallocated output image, its width and height are the target size
+ * histogram:       optional, the output pixels are added to it like scale_square_image_ex does
+ * linear_light:    downscales in linear light, see row_downscaler_init_ex
+ */
+bool convert_png_stream_to_scaled_rgb888(const uint8_t *prefix, size_t prefix_size,
+                                         uint64_t remaining_size, png_stream_read read,
+                                         void *handle, Image *rgb888_scaled,
+                                         ColorHistogram *histogram, bool linear_light);
 
 #endif // DECOMPRESS_PNG_H
@@ -0,0 +1,58 @@
+#ifndef DHASH_INDEX_H
+#define DHASH_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * In memory index of image_dhash values for Hamming distance queries over large libraries.
+ *
+ * It is a multi-index hash table: the 64 bits are split into max_distance + 1 chunks and every
+ * chunk value has a bucket list of the hashes with that chunk. Two hashes at most max_distance bits
+ * apart agree on at least one chunk, so a query only compares against the hashes sharing a bucket
+ * with it instead of the whole library. Fewer, wider chunks (a small max_distance) keep the buckets
+ * short, a radius of 4 or less keeps queries over millions of hashes well below a millisecond.
+ *
+ * Hashes get consecutive ids starting at 0 in the order they are added.
+ */
+#define DHASH_INDEX_MAX_DISTANCE 15
+
+typedef struct DhashIndex DhashIndex;
+
+[[nodiscard]]
+static inline uint32_t dhash_distance(uint64_t a, uint64_t b) {
+  return (uint32_t)__builtin_popcountll(a ^ b);
+}
+
+/**
+ * Creates an empty index for queries of up to max_distance differing bits. Returns NULL if
+ * max_distance is above DHASH_INDEX_MAX_DISTANCE or the buckets could not be allocated.
+ */
+DhashIndex *dhash_index_create(uint32_t max_distance);
+void dhash_index_destroy(DhashIndex *index);
+
+size_t dhash_index_count(const DhashIndex *index);
+uint64_t dhash_index_hash(const DhashIndex *index, uint32_t id);
+
+/**
+ * Adds a hash, id is set to its id. Returns false if the index could not grow.
+ */
+bool dhash_index_add(DhashIndex *index, uint64_t hash, uint32_t *id);
+
+/**
+ * Collects the ids of all hashes at most max_distance bits away from hash, which has to be within
+ * the max_distance of the index. Up to capacity ids are written, in no particular order. Returns
+ * the number of hashes found, which may be bigger than capacity.
+ */
+size_t dhash_index_query(const DhashIndex *index, uint64_t hash, uint32_t max_distance,
+                         uint32_t *ids, size_t capacity);
+
+/**
+ * Finds the hash closest to hash within max_distance bits, the earliest added one on ties.
+ * Returns false if there is none.
+ */
+bool dhash_index_nearest(const DhashIndex *index, uint64_t hash, uint32_t max_distance,
+                         uint32_t *id);
+
+#endif // DHASH_INDEX_H
@@ -1,13 +1,11 @@
 #ifndef ID3_PARSING_H
 #define ID3_PARSING_H
 
+#include "../include/album_art.h"
 #include "../include/img_processing.h"
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
-#include <stdio.h>
-
-typedef enum { JPEG, PNG, LINK, OTHER } ImageType;
 
 /**
  * Struct containing the data of the ID3 tag header.
@@ -69,14 +67,8 @@ inline uint32_t get_frame_size(const ID3FrameHeader *frame_header, uint8_t major
 
 [[nodiscard]]
 inline bool is_id3_header(const ID3TagHeader *tag_header) {
-  if (tag_header->identifier[0] == 'I' && tag_header->identifier[1] == 'D' &&
-      tag_header->identifier[2] == '3') {
-    return true;
-  }
-
-  printf("ID3 ID not correct: %c%c%c\n", tag_header->identifier[0], tag_header->identifier[1],
-         tag_header->identifier[2]);
-  return false;
+  return tag_header->identifier[0] == 'I' && tag_header->identifier[1] == 'D' &&
+         tag_header->identifier[2] == '3';
 }
 
 [[nodiscard]]
@@ -86,7 +78,90 @@ inline bool is_apic(const ID3FrameHeader *frame_header) {
           frame_header->id[3] == 'C');
 }
 
+/**
+ * Location of the embedded picture inside an APIC frame body.
+ *
+ * type:    image format derived from the MIME type (or the magic bytes if the MIME type is unknown)
+ * data:    pointer to the first byte of the picture data, points into the frame buffer
+ * size:    number of bytes of picture data
+ */
+typedef struct {
+  ImageType type;
+  const uint8_t *data;
+  uint32_t size;
+} ApicImage;
+
+/**
+ * Looks for the biggest APIC frame in a tag body that has been read into memory completely.
+ *
+ * tag_body:        tag data following the tag header
+ * frame_offset:    set to the offset of the APIC frame body (after the frame header) in tag_body
+ * frame_size:      set to the size of the APIC frame body
+ */
+[[nodiscard]]
+bool find_biggest_apic(const uint8_t *tag_body, uint32_t tag_size, uint8_t major_version,
+                       uint32_t *frame_offset, uint32_t *frame_size);
+
+/**
+ * Hash of an APIC frame body, used to recognise the same picture embedded in several files.
+ */
+[[nodiscard]]
+uint64_t hash_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size);
+
+[[nodiscard]]
+bool parse_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size, ApicImage *apic_image);
+
+/**
+ * Decodes the picture of an APIC frame body to a full resolution RGB888 image.
+ * On success the caller owns rgb888_image->buffer.
+ */
+[[nodiscard]]
+IO_ERROR decode_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size, Image *rgb888_image,
+                           const AlbumArtOptions *options);
+
+/**
+ * Scales a decoded image to the target size and packs it into the rgb565 buffer.
+ * The decoded image is left untouched and still has to be freed by the caller.
+ */
+[[nodiscard]]
+IO_ERROR scale_to_rgb565(Image *rgb888_image, uint8_t *rgb565_buffer,
+                         const AlbumArtOptions *options);
+
+/**
+ * Same as scale_to_rgb565 but packs into a TARGET_IMG_WIDTH x TARGET_IMG_HEIGHT IMAGE_RGB565 or
+ * IMAGE_RGBA8888 view, which may be a crop of a larger buffer (see image_view and image_crop).
+ */
+[[nodiscard]]
+IO_ERROR scale_to_view(Image *rgb888_image, Image *view, const AlbumArtOptions *options);
+
+/**
+ * Converts a PNG APIC frame of which only the start has been read. The rest of the picture is
+ * pulled from the reader in fixed size chunks and decoded while it is read, neither the frame nor
+ * the full resolution image is allocated.
+ *
+ * apic_image:      picture found in the start of the frame, has to be a PNG
+ * remaining_size:  number of frame bytes following apic_image, the reader is positioned at them
+ */
+[[nodiscard]]
+IO_ERROR process_apic_png_stream(const ApicImage *apic_image, uint64_t remaining_size,
+                                 const ArtReader *reader, uint8_t *rgb565_buffer,
+                                 const AlbumArtOptions *options);
+
+[[nodiscard]]
+bool get_image_data(const uint8_t *frame_buffer, uint32_t frame_size, uint8_t *rgb565_buffer);
+
+[[nodiscard]]
+IO_ERROR process_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size,
+                            uint8_t *rgb565_buffer, const AlbumArtOptions *options);
+
+[[nodiscard]]
+inline bool is_cancelled(const AlbumArtOptions *options) {
+  return options != NULL && options->is_cancelled != NULL &&
+         options->is_cancelled(options->cancel_data);
+}
+
 [[nodiscard]]
-bool get_image_data(uint8_t *frame_buffer, uint32_t frame_size, uint8_t *rgb565_buffer);
+bool get_image_data_preview(const uint8_t *frame_buffer, uint32_t frame_size,
+                            uint8_t *rgb565_buffer, preview_callback callback, void *user_data);
 
 #endif // ID3_PARSING_H
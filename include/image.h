@@ -1,6 +1,7 @@
 #ifndef MP3_IMAGE_H
 #define MP3_IMAGE_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -9,11 +10,107 @@
 #define RGB565_BUFFER_SIZE (200 * 200 * 2)
 #define RGB888_BUFFER_SIZE (200 * 200 * 3)
 
+// row starts of images from image_allocate are aligned to this many bytes (a cache line)
+#define IMAGE_ROW_ALIGNMENT 64
+
+typedef enum { JPEG, PNG, LINK, OTHER } ImageType;
+
+/**
+ * Memory layout of the pixels of an Image.
+ *
+ * IMAGE_RGB888:          interleaved RGBRGB..., the default of zero initialised images
+ * IMAGE_RGB888_PLANAR:   one plane of height rows per channel, see image_set_planar
+ * IMAGE_RGB565:          packed 16 bit pixels, the packers write these whatever the format of
+ *                        their destination says, it matters for views and crops of them
+ * IMAGE_RGBA8888:        interleaved RGBA with opaque alpha, e.g. tiles of a texture atlas
+ */
+typedef enum { IMAGE_RGB888, IMAGE_RGB888_PLANAR, IMAGE_RGB565, IMAGE_RGBA8888 } PixelFormat;
+
+/**
+ * How the stored rows of a picture have to be turned to show it upright, the values of the EXIF
+ * Orientation tag. Zero initialised images are shown as stored.
+ *
+ * ORIENTATION_ROTATE_90:   stored rotated 90 degrees counter clockwise, shown turned clockwise
+ * ORIENTATION_TRANSPOSE:   mirrored along the top left to bottom right diagonal
+ * ORIENTATION_TRANSVERSE:  mirrored along the top right to bottom left diagonal
+ */
+typedef enum {
+  ORIENTATION_UNTAGGED,
+  ORIENTATION_NORMAL,
+  ORIENTATION_MIRROR_HORIZONTAL,
+  ORIENTATION_ROTATE_180,
+  ORIENTATION_MIRROR_VERTICAL,
+  ORIENTATION_TRANSPOSE,
+  ORIENTATION_ROTATE_90,
+  ORIENTATION_TRANSVERSE,
+  ORIENTATION_ROTATE_270,
+} Orientation;
+
+/**
+ * buffer:        pixel data of length bytes, for planar images the three planes one after another
+ * format:        layout of the pixels in buffer
+ * planes:        start of the red, green and blue plane in buffer, only set for planar images
+ * stride:        bytes from the start of one row to the next (within a plane for planar images),
+ *                0 for tightly packed rows. Views into a larger image (see image_crop) and
+ *                decoder or alignment padded rows have a bigger stride than their row size
+ * orientation:   set by decoders that read it from the file, the scalers write their output
+ *                upright (see scale_square_image)
+ */
 typedef struct {
   uint8_t *buffer;
   size_t length;
   size_t img_width;
   size_t img_height;
+  PixelFormat format;
+  uint8_t *planes[3];
+  size_t stride;
+  Orientation orientation;
 } Image;
 
+/**
+ * Bytes from one row of the image to the next, bytes_per_pixel is 3 for interleaved RGB888, 1 for
+ * the planes of planar images and 2 for RGB565 images.
+ */
+static inline size_t image_stride(const Image *image, size_t bytes_per_pixel) {
+  return image->stride != 0 ? image->stride : image->img_width * bytes_per_pixel;
+}
+
+#define PALETTE_MAX_COLORS 16
+
+/**
+ * A colour of a palette and the number of pixels it stands for.
+ */
+typedef struct {
+  uint8_t r;
+  uint8_t g;
+  uint8_t b;
+  uint32_t pixels;
+} PaletteColor;
+
+/**
+ * Dominant colours of an image, see color_histogram_palette.
+ *
+ * max_colors:  set by the caller, colours wanted. 0 or more than PALETTE_MAX_COLORS uses
+ *              PALETTE_MAX_COLORS
+ * count:       colours found, fewer than max_colors for images with fewer distinct colours
+ * colors:      the colours, most pixels first
+ */
+typedef struct {
+  uint32_t max_colors;
+  uint32_t count;
+  PaletteColor colors[PALETTE_MAX_COLORS];
+} Palette;
+
+/**
+ * Called by the multi-pass decoders every time the image buffer holds a complete (possibly coarse)
+ * picture, final_pass is set for the last one. Returning false stops decoding early.
+ */
+typedef bool (*rgb888_pass_callback)(Image *rgb888_image, bool final_pass, void *user_data);
+
+/**
+ * Called by the row decoders for every RGB888 row of the image in top to bottom order, y is the
+ * index of the row. Returning false stops decoding early.
+ */
+typedef bool (*rgb888_row_callback)(const uint8_t *row, uint32_t y, void *user_data);
+
 #endif // MP3_IMAGE_H
@@ -0,0 +1,85 @@
+#ifndef IMAGE_DECODER_H
+#define IMAGE_DECODER_H
+
+#include "./img_processing.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Decoder backend for one image format. All operations work on a picture held in memory and
+ * produce RGB888, they return false if the data could not be decoded.
+ *
+ * name:            unique name of the backend, e.g. "libpng"
+ * type:            format the backend decodes
+ * probe:           checks the magic bytes, true if the backend can try to decode the data
+ * read_header:     reads the image size without decoding any pixels
+ * decode:          decodes the whole image, on success the caller owns rgb888_image->buffer.
+ *                  threads is a hint for backends that can split a single image
+ * decode_rows:     decodes the image one row at a time into the callback without holding the full
+ *                  image, the callback may stop decoding early
+ * decode_scaled:   decodes the image straight to the size of the preallocated rgb888_scaled, may
+ *                  use cheaper decoder side scaling (e.g. DCT scaling) and differ slightly from
+ *                  decode followed by scale_square_image
+ * scales_in_rows:  optional, true if decode_scaled only holds a band of rows of this data at a
+ *                  time. Progressive JPEGs and interlaced PNGs have to be held in full first.
+ *                  Backends without it count as holding every picture in full
+ */
+typedef struct {
+  const char *name;
+  ImageType type;
+  bool (*probe)(const uint8_t *data, uint32_t size);
+  bool (*read_header)(const uint8_t *data, uint32_t size, uint32_t *width, uint32_t *height);
+  bool (*decode)(const uint8_t *data, uint32_t size, Image *rgb888_image, uint32_t threads);
+  bool (*decode_rows)(const uint8_t *data, uint32_t size, rgb888_row_callback on_row,
+                      void *user_data);
+  bool (*decode_scaled)(const uint8_t *data, uint32_t size, Image *rgb888_scaled);
+  bool (*scales_in_rows)(const uint8_t *data, uint32_t size);
+} ImageDecoder;
+
+extern const ImageDecoder libjpeg_decoder;
+extern const ImageDecoder libpng_decoder;
+
+#ifdef MP3CORE_HAVE_SPNG
+extern const ImageDecoder spng_decoder;
+#endif
+
+/**
+ * The registry holds the built-in backends, optional ones (spng) are compiled in when the library
+ * is found at build time and are preferred over libpng. The registry is not synchronised, register
+ * and prefer backends before the first conversion starts.
+ */
+size_t image_decoder_count(void);
+const ImageDecoder *image_decoder_at(size_t index);
+const ImageDecoder *image_decoder_find(const char *name);
+
+/**
+ * Adds a backend in front of the registered ones, so it is tried first for its format.
+ * Returns false if the registry is full or a backend of the same name is registered.
+ */
+bool image_decoder_register(const ImageDecoder *decoder);
+
+/**
+ * Removes the named backend, the order of the others is kept. Returns false if it is not
+ * registered.
+ */
+bool image_decoder_unregister(const char *name);
+
+/**
+ * Moves the named backend in front of the others. Returns false if it is not registered.
+ */
+bool image_decoder_prefer(const char *name);
+
+/**
+ * First registered backend of the given format that accepts the data, NULL if there is none.
+ */
+const ImageDecoder *image_decoder_for(ImageType type, const uint8_t *data, uint32_t size);
+
+/**
+ * Implements decode_scaled on top of read_header and decode_rows, the result is identical to
+ * decode followed by scale_square_image. Meant for backends without their own scaling.
+ */
+bool image_decoder_scale_rows(const ImageDecoder *decoder, const uint8_t *data, uint32_t size,
+                              Image *rgb888_scaled);
+
+#endif // IMAGE_DECODER_H
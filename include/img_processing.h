@@ -3,10 +3,246 @@
 
 #include "./image.h"
 
-void scale_square_image(Image *src, Image *dst);
+/**
+ * Makes image a planar image of the given size on top of buffer, which must hold 3 * width * height
+ * bytes.
+ */
+void image_set_planar(Image *image, uint8_t *buffer, size_t width, size_t height);
+
+/**
+ * Makes image an interleaved (IMAGE_RGB888 or IMAGE_RGB565) view of the given size on top of
+ * memory the caller owns, e.g. rows a decoder padded or a frame buffer. Rows start stride bytes
+ * apart, buffer must hold stride * height bytes.
+ */
+void image_view(Image *image, uint8_t *buffer, size_t width, size_t height, size_t stride,
+                PixelFormat format);
+
+/**
+ * Allocates an image whose rows (and planes) start on IMAGE_ROW_ALIGNMENT byte boundaries, the
+ * stride is the row size rounded up. The buffer is released with free. Returns false if the
+ * allocation failed.
+ */
+bool image_allocate(Image *image, size_t width, size_t height, PixelFormat format);
+
+/**
+ * Makes view a width x height window of image starting at column x and row y without copying,
+ * the view shares the memory of image and has its stride. Returns false if the window does not
+ * fit into image.
+ */
+bool image_crop(const Image *image, size_t x, size_t y, size_t width, size_t height,
+                Image *view);
+
+/**
+ * Splits interleaved RGB888 pixels into three planes and back, with NEON structure loads on ARM
+ * and SSSE3 shuffles (checked at runtime) on x86.
+ */
+void deinterleave_rgb888(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b,
+                         size_t pixel_count);
+void interleave_rgb888(const uint8_t *r, const uint8_t *g, const uint8_t *b, uint8_t *dst,
+                       size_t pixel_count);
+
+/**
+ * Scales between images of either layout, the layouts of src and dst may differ. All scalers,
+ * copies and RGB565 packers walk the images row by row and honour their stride.
+ *
+ * The orientation of src is applied while dst is written, so dst is upright without a separate
+ * rotation of the source. Orientations that swap rows and columns need a square dst.
+ *
+ * Returns false without writing dst if the aspect ratios of src and dst differ, either image is
+ * not RGB888 of either layout, or a non interleaved image could not get the memory to downscale.
+ */
+bool scale_square_image(Image *src, Image *dst);
+
+/**
+ * True if an image of src_width x src_height scales to dst with the same factor in both
+ * directions, the only scaling scale_square_image does.
+ */
+bool image_scales_square(size_t src_width, size_t src_height, const Image *dst);
+
+#define HISTOGRAM_BITS 4
+#define HISTOGRAM_BINS (1 << (3 * HISTOGRAM_BITS))
+
+/**
+ * Coarse 3D colour histogram with the top HISTOGRAM_BITS of every channel as bin coordinates.
+ *
+ * counts:  pixels per bin
+ * sums:    red, green and blue sums of the pixels of every bin, palette colours are the mean of
+ *          their pixels instead of a bin centre
+ */
+typedef struct {
+  uint32_t counts[HISTOGRAM_BINS];
+  uint64_t sums[HISTOGRAM_BINS][3];
+} ColorHistogram;
+
+/**
+ * Adds the rows [y_start, y_end) of an RGB888 image of either layout to the histogram.
+ */
+void color_histogram_add_rows(ColorHistogram *histogram, const Image *image, size_t y_start,
+                              size_t y_end);
+
+/**
+ * Median cut on the histogram: the box of occupied bins with the most pixels times colour extent
+ * is split along its widest channel until there are palette->max_colors boxes. Boxes are split
+ * where the variance between the halves is biggest instead of at the median, which keeps a
+ * dominant colour in one box. Every box becomes the mean colour of its pixels.
+ */
+void color_histogram_palette(const ColorHistogram *histogram, Palette *palette);
+
+/**
+ * Same as scale_square_image but also adds every pixel of dst to the histogram if it is not NULL.
+ * When downscaling the rows are added as the downscaler writes them, while they are still in
+ * cache, so no extra pass over the source or the destination is made. Copies and upscales of
+ * pictures that are already small add dst once it is written.
+ *
+ * linear_light averages the light of the source pixels instead of their sRGB encoded bytes when
+ * downscaling, see row_downscaler_init_ex. Copies and upscales are the same either way.
+ */
+bool scale_square_image_ex(Image *src, Image *dst, ColorHistogram *histogram, bool linear_light);
+
+/**
+ * Reference area average downscaler, interleaved images only.
+ */
 void downscale_area_average(Image *src, Image *dst);
+
+/**
+ * Same output as downscale_area_average for images of either layout. Rows are summed vertically
+ * per plane and averaged horizontally once per destination row. Returns false if the column sums
+ * could not be allocated.
+ */
+bool downscale_area_average_rows(Image *src, Image *dst);
+
+void upscale_nearest(Image *src, Image *dst);
 void rgb888_to_rgb565_scalar(Image *src, Image *dst);
 
+/**
+ * Packs a planar image into RGB565 with the rounding of rgb888_to_rgb565_scalar.
+ */
+void rgb888_planar_to_rgb565(Image *src, Image *dst);
+
+/**
+ * Packs a planar image into opaque RGBA8888.
+ */
+void rgb888_planar_to_rgba8888(Image *src, Image *dst);
+
+/**
+ * Expands RGB565 pixels to opaque RGBA8888 and copies RGB565 images, e.g. cached thumbnails into
+ * a view of a bigger buffer.
+ */
+void rgb565_to_rgba8888(Image *src, Image *dst);
+void copy_rgb565(Image *src, Image *dst);
+
+#define DHASH_COLUMNS 9
+#define DHASH_ROWS 8
+
+/**
+ * 64 bit difference hash (dHash) of an RGB888 image of either layout. The luma of the image is
+ * area averaged down to DHASH_COLUMNS x DHASH_ROWS cells and every bit tells whether a cell is
+ * darker than its right neighbour, so rescaled or recompressed copies of a picture get hashes that
+ * differ in few bits (see dhash_index.h). Images smaller than the grid hash to 0.
+ */
+uint64_t image_dhash(const Image *image);
+
+/**
+ * Area average downscaler that is fed the source image one row at a time, so the full resolution
+ * image never has to be held in memory. The output is identical to downscale_area_average, dst may
+ * be interleaved or planar.
+ *
+ * Each source row is added to per column sums of its plane (a vertical only loop over contiguous
+ * bytes), the sums are averaged horizontally once the last source row of a destination row is in.
+ *
+ * dst:             preallocated destination image, every row is written once its last source row
+ *                  has been pushed
+ * y_scale:         source rows per destination row
+ * x_bounds:        first and one past last source column of every destination column
+ * column_sums:     sums of the source columns of the destination row being accumulated, one plane
+ *                  of src_width sums per channel
+ * row_planes:      deinterleaved copy of the last interleaved row that was pushed
+ * src_y:           index of the next source row
+ * dst_y:           destination row being accumulated
+ * y_start:         first source row of dst_y
+ * y_end:           one past the last source row of dst_y
+ * histogram:       optional, every destination row is added to it when it is written. NULL after
+ *                  row_downscaler_init
+ * linear_to_srgb:  NULL unless linear light, sRGB byte of every LINEAR_LIGHT_LEVELS average
+ * orientation:     applied to the rows as they are written, ORIENTATION_UNTAGGED after
+ *                  row_downscaler_init. Mirrors only change the addressing of a row, orientations
+ *                  that swap rows and columns collect ORIENTATION_BLOCK_ROWS averaged rows in
+ *                  staging and write them as short runs into every destination row
+ * staging:         ORIENTATION_BLOCK_ROWS averaged rows per channel waiting to be transposed
+ * staged_rows:     rows held in staging
+ */
+typedef struct {
+  Image *dst;
+  size_t src_width;
+  size_t src_height;
+  float y_scale;
+  uint32_t *x_bounds;
+  uint32_t *column_sums;
+  uint8_t *row_planes;
+  uint32_t src_y;
+  uint32_t dst_y;
+  uint32_t y_start;
+  uint32_t y_end;
+  ColorHistogram *histogram;
+  uint8_t *linear_to_srgb;
+  Orientation orientation;
+  uint8_t *staging;
+  uint32_t staged_rows;
+} RowDownscaler;
+
+#define ORIENTATION_BLOCK_ROWS 16
+
+/**
+ * Levels of the linear light values the downscaler sums in linear light mode.
+ */
+#define LINEAR_LIGHT_LEVELS 4096
+
+bool row_downscaler_init(RowDownscaler *scaler, size_t src_width, size_t src_height, Image *dst);
+
+/**
+ * Same as row_downscaler_init, with linear_light the source bytes are decoded from sRGB to 12 bit
+ * linear light through a 256 entry table before they are summed and every average is encoded back
+ * through a LINEAR_LIGHT_LEVELS entry table. Averaging encoded bytes darkens high contrast detail
+ * (white text on black turns darker grey than it looks from a distance), linear light keeps its
+ * brightness. Uniform areas come out unchanged in both modes.
+ */
+bool row_downscaler_init_ex(RowDownscaler *scaler, size_t src_width, size_t src_height, Image *dst,
+                            bool linear_light);
+void row_downscaler_push(RowDownscaler *scaler, const uint8_t *row);
+void row_downscaler_push_planar(RowDownscaler *scaler, const uint8_t *r, const uint8_t *g,
+                                const uint8_t *b);
+bool row_downscaler_finished(const RowDownscaler *scaler);
+void row_downscaler_free(RowDownscaler *scaler);
+
+/**
+ * Scales an image that arrives row by row to the size of dst. Rows go straight into a
+ * RowDownscaler when both sides shrink, otherwise they are collected in a full image that is
+ * passed to scale_square_image. Either way the result equals scale_square_image of the whole image.
+ *
+ * rows:    number of rows pushed so far, rows past the image height are ignored
+ */
+typedef struct {
+  Image *dst;
+  Image full;
+  RowDownscaler downscaler;
+  bool streaming;
+  uint32_t rows;
+} ScaledRowSink;
+
+/**
+ * Returns false if the image does not scale to dst with one factor (see image_scales_square) or
+ * the memory could not be allocated. The sink has to be freed either way.
+ */
+bool scaled_row_sink_init(ScaledRowSink *sink, size_t src_width, size_t src_height, Image *dst);
+void scaled_row_sink_push(ScaledRowSink *sink, const uint8_t *row);
+
+/**
+ * Writes dst if every row of the image has been pushed and frees the sink, returns false if rows
+ * were missing or the collected image could not be scaled.
+ */
+bool scaled_row_sink_finish(ScaledRowSink *sink);
+void scaled_row_sink_free(ScaledRowSink *sink);
+
 #if __has_include(<arm_neon.h>)
 void rgb888_to_rgb565_neon(Image *src, Image *dst);
 void rgb888_to_rgb565_neon_8vals(Image *src, Image *dst);
@@ -0,0 +1,51 @@
+#ifndef INDEXED_COLOR_H
+#define INDEXED_COLOR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * 8 bit indexed output for players with palette displays, half the size of RGB565.
+ *
+ * Layout of an indexed image, all multi byte values little endian:
+ *
+ * palette:   INDEXED_MAX_COLORS RGB565 colours (u16), unused entries are 0
+ * pixels:    one palette index per pixel in raster order
+ */
+#define INDEXED_MAX_COLORS 256
+#define INDEXED_SIZE(pixel_count) (INDEXED_MAX_COLORS * 2 + (size_t)(pixel_count))
+#define INDEXED_BUFFER_SIZE INDEXED_SIZE(200 * 200)
+
+/**
+ * Settings of rgb565_to_indexed, a NULL options uses the defaults for every field.
+ *
+ * max_colors:  palette entries to use, 0 or more than INDEXED_MAX_COLORS uses INDEXED_MAX_COLORS
+ * dither:      diffuse the quantisation error with Floyd-Steinberg, smooth gradients of covers
+ *              band visibly with 256 colours otherwise
+ */
+typedef struct {
+  uint32_t max_colors;
+  bool dither;
+} IndexedOptions;
+
+/**
+ * Quantises width * height RGB565 pixels into an indexed image of INDEXED_SIZE(width * height)
+ * bytes.
+ *
+ * The palette comes from an octree of the distinct colours of the image (counted once in a 64K
+ * entry table, so the tree is built from unique colours instead of pixels), reduced deepest level
+ * first until max_colors leaves are left. Pixels are mapped through a 32x64x32 inverse table that
+ * is filled from the octree leaves for colours of the image and by a nearest colour search for the
+ * colours dithering produces. Returns false if the tables could not be allocated.
+ */
+bool rgb565_to_indexed(const uint8_t *rgb565, size_t width, size_t height,
+                       const IndexedOptions *options, uint8_t *indexed);
+
+/**
+ * Expands pixel_count pixels of an indexed image back to RGB565, e.g. for a preview of what the
+ * player will show.
+ */
+void indexed_to_rgb565(const uint8_t *indexed, size_t pixel_count, uint8_t *rgb565);
+
+#endif // INDEXED_COLOR_H
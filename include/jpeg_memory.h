@@ -0,0 +1,21 @@
+#ifndef JPEG_MEMORY_H
+#define JPEG_MEMORY_H
+
+// NOTE: jpeg-turbo does not inlcude stdio
+// clang-format off
+#include <stdio.h>
+#include <jpeglib.h>
+// clang-format on
+
+/**
+ * Replaces the memory manager of a freshly created libjpeg object with one that allocates from the
+ * art_memory scope of the calling thread, see art_memory.h. Outside of a scope libjpeg keeps its
+ * own manager. Call it right after jpeg_create_decompress or jpeg_create_compress.
+ *
+ * Virtual arrays (the coefficients of progressive files) are always held in memory, libjpeg-turbo
+ * has no backing store either. The few objects jpeg_create_* allocates stay with libjpeg's manager,
+ * which is destroyed together with the replacement.
+ */
+void jpeg_memory_install(j_common_ptr info);
+
+#endif // JPEG_MEMORY_H
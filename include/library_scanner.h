@@ -0,0 +1,59 @@
+#ifndef LIBRARY_SCANNER_H
+#define LIBRARY_SCANNER_H
+
+#include "./album_art.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Result for one MP3 file found by library_scan, only valid during the callback.
+ *
+ * file_path:       path of the file
+ * directory:       path of the directory containing the file
+ * result:          same values get_album_art would return, always OK if art is not converted
+ * rgb565_buffer:   converted album art of RGB565_BUFFER_SIZE bytes, NULL unless result is OK
+ * shared:          the file embeds the same picture as an earlier file of the directory, the
+ *                  earlier conversion was reused
+ */
+typedef struct {
+  const char *file_path;
+  const char *directory;
+  IO_ERROR result;
+  const uint8_t *rgb565_buffer;
+  bool shared;
+} ScanResult;
+
+typedef void (*scan_callback)(const ScanResult *result, void *user_data);
+
+/**
+ * Settings of library_scan, a NULL config only enumerates with the defaults.
+ *
+ * workers:         threads walking the directories, 0 uses the number of online CPUs
+ * convert_art:     read and convert the album art of every file, otherwise only enumerate
+ * on_file:         called once per MP3 file, concurrently from all workers
+ * user_data:       passed to on_file
+ * max_pixels:      pixel budget of every picture, see AlbumArtOptions.max_pixels. 0 disables it
+ */
+typedef struct {
+  uint32_t workers;
+  bool convert_art;
+  scan_callback on_file;
+  void *user_data;
+  uint64_t max_pixels;
+} ScannerConfig;
+
+/**
+ * Walks the root directories recursively with a pool of workers.
+ *
+ * Each worker takes a whole directory at a time: it lists it (with getdents64 on Linux, readdir
+ * elsewhere), queues the subdirectories for the other workers and processes the directory's MP3
+ * files in name order. Tracks of the same album usually embed the same picture, within a directory
+ * each distinct picture is only decoded once. Symbolic links are not followed.
+ *
+ * Returns false if a root could not be opened or the scan ran out of memory, the files that were
+ * found have been reported in either case.
+ */
+bool library_scan(const char *const *roots, size_t root_count, const ScannerConfig *config);
+
+#endif // LIBRARY_SCANNER_H
@@ -0,0 +1,62 @@
+#ifndef LIBRARY_WATCH_H
+#define LIBRARY_WATCH_H
+
+#include "./album_art.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef enum { WATCH_ART_ADDED, WATCH_ART_CHANGED, WATCH_ART_REMOVED } WatchEventType;
+
+/**
+ * Change reported by the watch, only valid during the callback.
+ *
+ * type:            WATCH_ART_ADDED for files that were not in the library before
+ * file_path:       path of the MP3 file
+ * result:          same values get_album_art would return, OK for removed files
+ * rgb565_buffer:   converted album art of RGB565_BUFFER_SIZE bytes, NULL unless result is OK and
+ *                  the file has not been removed
+ */
+typedef struct {
+  WatchEventType type;
+  const char *file_path;
+  IO_ERROR result;
+  const uint8_t *rgb565_buffer;
+} WatchEvent;
+
+typedef void (*watch_callback)(const WatchEvent *event, void *user_data);
+
+/**
+ * Settings of library_watch_start.
+ *
+ * debounce_ms:     a file is converted once no event arrived for it for this long, 0 uses 30
+ * on_change:       called from the watch thread for every added, changed or removed file
+ * user_data:       passed to on_change
+ */
+typedef struct {
+  uint32_t debounce_ms;
+  watch_callback on_change;
+  void *user_data;
+} WatchConfig;
+
+typedef struct LibraryWatch LibraryWatch;
+
+/**
+ * Watches the root directories recursively for MP3 files that are written, moved in or removed.
+ *
+ * Files that exist when the watch starts are treated as already converted (e.g. by library_scan),
+ * they are reported as changed the first time they are written. Bursts of events for the same file
+ * are coalesced with the debounce time, and files whose APIC frame did not change are not
+ * converted or reported again. The watch thread sleeps in poll while nothing happens.
+ *
+ * Returns NULL if the watch could not be set up or inotify is not available on this platform.
+ */
+LibraryWatch *library_watch_start(const char *const *roots, size_t root_count,
+                                  const WatchConfig *config);
+
+/**
+ * Stops the watch thread and frees the watch, no callback runs after this returns.
+ */
+void library_watch_stop(LibraryWatch *watch);
+
+#endif // LIBRARY_WATCH_H
@@ -0,0 +1,18 @@
+#ifndef PATH_UTILS_H
+#define PATH_UTILS_H
+
+#include <stdbool.h>
+
+/**
+ * Returns directory + "/" + name in a newly allocated string, NULL if the allocation failed.
+ */
+[[nodiscard]]
+char *join_path(const char *directory, const char *name);
+
+/**
+ * True for file names ending in .mp3 in any case.
+ */
+[[nodiscard]]
+bool is_mp3_name(const char *name);
+
+#endif // PATH_UTILS_H
@@ -0,0 +1,53 @@
+#ifndef RGB565_CODEC_H
+#define RGB565_CODEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Lossless compression of RGB565 images for the transfer to the player, simple enough for the
+ * device to decode without allocating: the decoder only reads the row above from its own output.
+ *
+ * Stream layout, all multi byte values little endian:
+ *
+ * header:    'R', '5', version (1), flags (0), width (u16), height (u16)
+ * pixels:    in raster order, every pixel is coded as its residual to the pixel above (0 for the
+ *            first row), subtracted per channel modulo the channel range. Residuals are coded
+ *            with byte aligned tokens:
+ *
+ * 00nnnnnn             n + 1 pixels with a zero residual (same as the pixel above)
+ * 01nnnnnn             n + 1 pixels with the residual of the previous pixel
+ * 10rrggbb             one pixel with residuals of -2..1 per channel, stored + 2
+ * 110ggggg rrrrbbbb    one pixel with green -16..15 (stored + 16), red and blue -8..7 (stored + 8)
+ * 111nnnnn             n + 1 raw residuals of two bytes follow
+ */
+#define RGB565_CODEC_HEADER_SIZE 8
+#define RGB565_CODEC_VERSION 1
+
+/**
+ * Encoded size is never above this for an image of pixel_count pixels.
+ */
+#define RGB565_ENCODED_MAX_SIZE(pixel_count)                                                      \
+  (RGB565_CODEC_HEADER_SIZE + 2 * (size_t)(pixel_count) + (size_t)(pixel_count) / 32 + 2)
+
+/**
+ * Encodes width * height RGB565 pixels, residuals and run lengths are computed with NEON or SSE2
+ * where available. Returns the number of bytes written to encoded, 0 if the size does not fit the
+ * header, capacity is too small or the scratch memory could not be allocated.
+ */
+size_t rgb565_encode(const uint8_t *rgb565, size_t width, size_t height, uint8_t *encoded,
+                     size_t capacity);
+
+/**
+ * Reads the image size from the header, returns false if data is not an encoded image.
+ */
+bool rgb565_encoded_size(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height);
+
+/**
+ * Reference decoder for the firmware and the round trip tests. Writes width * height pixels to
+ * rgb565, returns false if capacity is too small or the stream is damaged or has trailing bytes.
+ */
+bool rgb565_decode(const uint8_t *data, size_t size, uint8_t *rgb565, size_t capacity);
+
+#endif // RGB565_CODEC_H
@@ -0,0 +1,54 @@
+#ifndef TAG_READER_H
+#define TAG_READER_H
+
+#include "./album_art.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Reads the ID3 tags of many files at once.
+ *
+ * On Linux the reads of up to queue_depth files are submitted together through io_uring, so a
+ * window of files costs one submission for the tag headers and one for the tag bodies on top of
+ * the open and close of every file. Without io_uring (or if a read is rejected) pread is used.
+ */
+typedef struct TagReader TagReader;
+
+/**
+ * One file read by tag_reader_read.
+ *
+ * file_path:       file to read
+ * result:          OK or the error get_album_art would return for this stage
+ * major_version:   ID3v2 major version of the tag
+ * tag_buffer:      on success the tag body following the tag header, owned by the caller
+ * tag_size:        bytes of tag_buffer that were read, less than the tag size if the file is cut
+ */
+typedef struct {
+  const char *file_path;
+  IO_ERROR result;
+  uint8_t major_version;
+  uint8_t *tag_buffer;
+  uint32_t tag_size;
+} TagRead;
+
+/**
+ * queue_depth:     files read concurrently, 0 uses a default of 64. Every file of a window is open
+ *                  at once, so the depth is capped to a quarter of RLIMIT_NOFILE
+ * use_io_uring:    false always uses pread
+ */
+TagReader *tag_reader_create(uint32_t queue_depth, bool use_io_uring);
+void tag_reader_destroy(TagReader *reader);
+
+[[nodiscard]]
+bool tag_reader_uses_io_uring(const TagReader *reader);
+
+[[nodiscard]]
+uint32_t tag_reader_queue_depth(const TagReader *reader);
+
+/**
+ * Reads the tags of all files, queue_depth files at a time.
+ */
+void tag_reader_read(TagReader *reader, TagRead *reads, size_t count);
+
+#endif // TAG_READER_H
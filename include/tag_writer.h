@@ -0,0 +1,64 @@
+#ifndef TAG_WRITER_H
+#define TAG_WRITER_H
+
+#include "./album_art.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Padding reserved behind the frames when a tag has to grow, enough for a few replacements of a
+ * pre-sized cover before the file has to be copied again.
+ */
+#define TAG_WRITER_DEFAULT_PADDING (64 * 1024)
+
+// ID3v2 picture type of the front cover
+#define APIC_FRONT_COVER 3
+
+/**
+ * Picture written into an APIC frame.
+ *
+ * mime_type:     e.g. "image/jpeg"
+ * picture_type:  ID3v2 picture type, APIC frames of the same type are replaced
+ * description:   optional, NULL writes an empty description
+ * data:          encoded picture of size bytes
+ */
+typedef struct {
+  const char *mime_type;
+  uint8_t picture_type;
+  const char *description;
+  const uint8_t *data;
+  uint32_t size;
+} ApicPicture;
+
+/**
+ * Optional settings of tag_write_apic, NULL uses the defaults.
+ *
+ * padding:     padding behind the frames of a tag that has to grow, 0 uses
+ *              TAG_WRITER_DEFAULT_PADDING
+ * rewritten:   optional, set to true if the file had to be copied, false if only the tag region
+ *              was written (or nothing, because the tag already held the picture)
+ */
+typedef struct {
+  uint32_t padding;
+  bool *rewritten;
+} TagWriteOptions;
+
+/**
+ * Replaces the APIC frames of the picture's type in the ID3v2.3 or ID3v2.4 tag of an MP3 file, or
+ * adds one. Every other frame is kept byte for byte.
+ *
+ * If the new frames fit into the tag including its padding, only the tag region at the start of
+ * the file is written and the rest of the padding is cleared, the audio is not touched. Otherwise
+ * the file is rebuilt next to the original with a tag that reserves padding for later rewrites,
+ * the audio is copied with copy_file_range (which shares extents instead of copying on file
+ * systems that support reflinks) and the copy is renamed over the original. Files without a tag
+ * get a new ID3v2.4 tag the same way.
+ *
+ * Tags with an extended header lose it, tags using unsynchronisation and ID3v2.2 tags are not
+ * written (COULD_NOT_WRITE_TAG).
+ */
+IO_ERROR tag_write_apic(const char *file_path, const ApicPicture *picture,
+                        const TagWriteOptions *options);
+
+#endif // TAG_WRITER_H
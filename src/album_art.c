@@ -1,98 +1,618 @@
 #include "../include/album_art.h"
+#include "../include/art_diag.h"
+#include "../include/art_memory.h"
+#include "../include/decompress_jpg.h"
 #include "../include/id3_parsing.h"
+#include "../include/image_decoder.h"
+#include "../include/indexed_color.h"
+#include "../include/rgb565_codec.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-IO_ERROR get_album_art(const char *file_path, uint8_t *rgb565_buffer) {
-  FILE *f = fopen(file_path, "rb");
+/**
+ * MP3 file held in memory, the APIC frame is used in place instead of being read.
+ */
+typedef struct {
+  const uint8_t *data;
+  size_t size;
+  size_t position;
+} MemoryReader;
 
-  if (f == NULL) {
-    fprintf(stderr, "Could not open file %s!\n", file_path);
-    return COULD_NOT_OPEN_FILE;
+/**
+ * Body of the biggest APIC frame. frame points into the memory source or into owned_buffer, which
+ * has to be freed by the caller.
+ */
+typedef struct {
+  const uint8_t *frame;
+  uint32_t frame_size;
+  uint8_t *owned_buffer;
+} ApicFrame;
+
+static size_t memory_read(void *handle, uint8_t *buffer, size_t size) {
+  MemoryReader *memory = (MemoryReader *)handle;
+  size_t available = memory->size - memory->position;
+  size_t count = size < available ? size : available;
+
+  memcpy(buffer, memory->data + memory->position, count);
+  memory->position += count;
+  return count;
+}
+
+static bool memory_seek(void *handle, uint64_t offset) {
+  MemoryReader *memory = (MemoryReader *)handle;
+
+  if (offset > memory->size) {
+    return false;
   }
 
+  memory->position = offset;
+  return true;
+}
+
+static uint64_t memory_size(void *handle) { return ((MemoryReader *)handle)->size; }
+
+static size_t file_read(void *handle, uint8_t *buffer, size_t size) {
+  return fread(buffer, 1, size, (FILE *)handle);
+}
+
+static bool file_seek(void *handle, uint64_t offset) {
+  return fseeko((FILE *)handle, (off_t)offset, SEEK_SET) == 0;
+}
+
+/**
+ * Start of the APIC frame that is read before the picture type is known, large enough for the MIME
+ * type and description of any real world frame.
+ */
+#define APIC_PREFIX_SIZE 4096
+
+/**
+ * Walks the frame headers of the tag and locates the biggest APIC frame, every source goes through
+ * this walker.
+ *
+ * body_pos:    set to the offset of the frame body (after the frame header) in the source
+ * frame_size:  set to the size of the frame body
+ */
+static IO_ERROR locate_biggest_apic(const ArtReader *reader, uint64_t *body_pos,
+                                    uint32_t *frame_size) {
+
   uint8_t buffer[ID3_TAG_HEADER_SIZE];
 
-  if (fread(buffer, ID3_TAG_HEADER_SIZE, 1, f) == 0) {
-    fprintf(stderr, "Could not read tag header!\n");
-    fclose(f);
+  if (!reader->seek(reader->handle, 0) ||
+      reader->read(reader->handle, buffer, ID3_TAG_HEADER_SIZE) != ID3_TAG_HEADER_SIZE) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_READ_FAILED, "could not read tag header", NULL);
     return COULD_NOT_READ_HEADER;
   }
 
   ID3TagHeader *tag_header = (ID3TagHeader *)buffer;
 
-  if (is_id3_header(tag_header)) {
+  if (!is_id3_header(tag_header)) {
+    ART_DIAG(ART_DIAG_INFO, ART_DIAG_NO_ID3, "no ID3 tag found", NULL);
+    return NO_ID3;
+  }
 
-    size_t biggest_apic_size = 0;
-    size_t biggest_apic_pos = 0;
-    size_t current_pos = 10;
+  uint64_t biggest_apic_size = 0;
+  uint64_t biggest_apic_pos = 0;
+  uint64_t current_pos = ID3_TAG_HEADER_SIZE;
 
-    uint32_t tag_size = convert_syncsafe_size(tag_header->size);
-    uint8_t major_version = tag_header->version[0];
+  uint64_t tag_end = ID3_TAG_HEADER_SIZE + convert_syncsafe_size(tag_header->size);
+  uint8_t major_version = tag_header->version[0];
 
-    // looking for the biggest apic frame
-    while (current_pos < tag_size) {
-      if (fseek(f, current_pos, 0) != 0) {
-        fprintf(stderr, "Could not seek to current pos!\n");
-        fclose(f);
-        break;
-      }
+  if (reader->size != NULL) {
+    uint64_t source_size = reader->size(reader->handle);
+    tag_end = source_size < tag_end ? source_size : tag_end;
+  }
 
-      if (fread(buffer, ID3_FRAME_HEADER_SIZE, 1, f) == 0) {
-        fprintf(stderr, "Could not read frame header!\n");
-        break;
-      }
+  // looking for the biggest apic frame
+  while (current_pos + ID3_FRAME_HEADER_SIZE <= tag_end) {
+    if (!reader->seek(reader->handle, current_pos)) {
+      ART_DIAG(ART_DIAG_WARNING, ART_DIAG_SEEK_FAILED, "could not seek to frame header", NULL);
+      break;
+    }
 
-      ID3FrameHeader *frame_header = (ID3FrameHeader *)buffer;
-      uint32_t frame_size = get_frame_size(frame_header, major_version);
+    if (reader->read(reader->handle, buffer, ID3_FRAME_HEADER_SIZE) != ID3_FRAME_HEADER_SIZE) {
+      ART_DIAG(ART_DIAG_WARNING, ART_DIAG_READ_FAILED, "could not read frame header", NULL);
+      break;
+    }
 
-      if (is_apic(frame_header)) {
-        if (frame_size > biggest_apic_size) {
-          biggest_apic_size = frame_size;
-          biggest_apic_pos = current_pos;
-        }
-      }
+    ID3FrameHeader *frame_header = (ID3FrameHeader *)buffer;
 
-      current_pos += ID3_FRAME_HEADER_SIZE + frame_size;
+    // the rest of the tag is padding
+    if (frame_header->id[0] == 0) {
+      break;
     }
 
-    if (biggest_apic_size > 0) {
-      if (fseek(f, biggest_apic_pos + ID3_FRAME_HEADER_SIZE, 0) != 0) {
-        fprintf(stderr, "Could not seek to APIC frame!\n");
-        fclose(f);
-        return COULD_NOT_SEEK_TO_APIC;
+    uint32_t current_frame_size = get_frame_size(frame_header, major_version);
+
+    if (is_apic(frame_header)) {
+      if (current_frame_size > biggest_apic_size) {
+        biggest_apic_size = current_frame_size;
+        biggest_apic_pos = current_pos;
       }
+    }
 
-      uint8_t *frame_buffer = malloc(biggest_apic_size);
+    current_pos += ID3_FRAME_HEADER_SIZE + current_frame_size;
+  }
 
-      if (frame_buffer == NULL) {
-        fprintf(stderr, "Error: allocation failed for APIC frame\n");
-        fclose(f);
-        return COULD_NOT_ALLOC_APIC;
-      }
+  if (biggest_apic_size == 0) {
+    return NO_APIC;
+  }
 
-      if (fread(frame_buffer, biggest_apic_size, 1, f) == 0) {
-        fprintf(stderr, "Error: failed reading APIC frame body\n");
-        free(frame_buffer);
-        fclose(f);
-        return COULD_NOT_READ_APIC;
-      }
+  *body_pos = biggest_apic_pos + ID3_FRAME_HEADER_SIZE;
+  *frame_size = biggest_apic_size;
+  return OK;
+}
+
+/**
+ * Reads the rest of a frame body of which the first prefix_size bytes are already in apic_buffer,
+ * apic_buffer is grown to the whole frame. On success the frame is owned by apic.
+ */
+static IO_ERROR read_apic_rest(const ArtReader *reader, uint8_t *apic_buffer, uint32_t prefix_size,
+                               uint32_t frame_size, ApicFrame *apic) {
+
+  uint8_t *frame_buffer = apic_buffer;
+
+  if (prefix_size < frame_size) {
+    frame_buffer = art_realloc(apic_buffer, frame_size);
+
+    if (frame_buffer == NULL) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for APIC frame", NULL);
+      art_free(apic_buffer);
+      return COULD_NOT_ALLOC_APIC;
+    }
+  }
+
+  uint32_t rest = frame_size - prefix_size;
+
+  if (reader->read(reader->handle, frame_buffer + prefix_size, rest) != rest) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_READ_FAILED, "failed reading APIC frame body", NULL);
+    art_free(frame_buffer);
+    return COULD_NOT_READ_APIC;
+  }
+
+  apic->frame = frame_buffer;
+  apic->frame_size = frame_size;
+  apic->owned_buffer = frame_buffer;
+  return OK;
+}
+
+/**
+ * Locates the biggest APIC frame and reads its body. Memory sources skip reading, the frame is used
+ * in place.
+ */
+static IO_ERROR read_biggest_apic(const ArtReader *reader, const MemoryReader *memory,
+                                  ApicFrame *apic) {
+
+  uint64_t body_pos;
+  uint32_t frame_size;
+  IO_ERROR error = locate_biggest_apic(reader, &body_pos, &frame_size);
+
+  if (error != OK) {
+    return error;
+  }
+
+  if (memory != NULL) {
+    if (body_pos + frame_size > memory->size) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_TRUNCATED, "APIC frame exceeds the data", NULL);
+      return COULD_NOT_READ_APIC;
+    }
+
+    apic->frame = memory->data + body_pos;
+    apic->frame_size = frame_size;
+    apic->owned_buffer = NULL;
+    return OK;
+  }
+
+  if (!reader->seek(reader->handle, body_pos)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_SEEK_FAILED, "could not seek to APIC frame", NULL);
+    return COULD_NOT_SEEK_TO_APIC;
+  }
+
+  uint8_t *apic_buffer = art_malloc(frame_size);
+
+  if (apic_buffer == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for APIC frame", NULL);
+    return COULD_NOT_ALLOC_APIC;
+  }
+
+  return read_apic_rest(reader, apic_buffer, 0, frame_size, apic);
+}
+
+/**
+ * Converts the APIC frame of a source that has to be read. Only the start of the frame is read up
+ * front, PNG pictures are then decoded while the rest is read in fixed size chunks. Other pictures
+ * are read completely and converted like an in-memory frame.
+ */
+static IO_ERROR convert_read_apic(const ArtReader *reader, uint64_t body_pos, uint32_t frame_size,
+                                  uint8_t *rgb565_buffer, const AlbumArtOptions *options) {
+
+  if (!reader->seek(reader->handle, body_pos)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_SEEK_FAILED, "could not seek to APIC frame", NULL);
+    return COULD_NOT_SEEK_TO_APIC;
+  }
+
+  uint32_t prefix_size = frame_size < APIC_PREFIX_SIZE ? frame_size : APIC_PREFIX_SIZE;
+  uint8_t *apic_buffer = art_malloc(prefix_size);
+
+  if (apic_buffer == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for APIC frame", NULL);
+    return COULD_NOT_ALLOC_APIC;
+  }
+
+  if (reader->read(reader->handle, apic_buffer, prefix_size) != prefix_size) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_READ_FAILED, "failed reading APIC frame body", NULL);
+    art_free(apic_buffer);
+    return COULD_NOT_READ_APIC;
+  }
+
+  ApicImage apic_image;
+
+  // the PNG signature has to be in the prefix, otherwise the description did not fit. Streaming is
+  // built on libpng, another preferred PNG backend gets the whole frame
+  if (prefix_size < frame_size && parse_apic_frame(apic_buffer, prefix_size, &apic_image) &&
+      image_decoder_for(apic_image.type, apic_image.data, apic_image.size) == &libpng_decoder) {
+
+    IO_ERROR error = process_apic_png_stream(&apic_image, frame_size - prefix_size, reader,
+                                             rgb565_buffer, options);
+    art_free(apic_buffer);
+    return error;
+  }
+
+  ApicFrame apic;
+  IO_ERROR error = read_apic_rest(reader, apic_buffer, prefix_size, frame_size, &apic);
+
+  if (error != OK) {
+    return error;
+  }
+
+  if (is_cancelled(options)) {
+    art_free(apic.owned_buffer);
+    return CANCELLED;
+  }
+
+  error = process_apic_frame(apic.frame, apic.frame_size, rgb565_buffer, options);
+  art_free(apic.owned_buffer);
+
+  return error;
+}
+
+/**
+ * Allocation and diagnostics scopes of an entry point, entered only if the options ask for them.
+ */
+typedef struct {
+  ArtMemoryScope memory;
+  ArtDiagScope diag;
+  bool memory_entered;
+  bool diag_entered;
+} CallScope;
+
+static void enter_call_scope(CallScope *scope, const AlbumArtOptions *options) {
+
+  scope->memory_entered =
+      options != NULL && (options->memory != NULL || options->memory_stats != NULL);
+  scope->diag_entered = options != NULL && options->diag != NULL;
+
+  if (scope->memory_entered) {
+    art_memory_scope_enter(&scope->memory,
+                           options->memory != NULL ? options->memory : art_memory_default());
+  }
+
+  if (scope->diag_entered) {
+    art_diag_scope_enter(&scope->diag, options->diag);
+  }
+}
+
+static void leave_call_scope(CallScope *scope, const AlbumArtOptions *options) {
+
+  if (scope->diag_entered) {
+    art_diag_scope_leave(&scope->diag);
+  }
+
+  if (!scope->memory_entered) {
+    return;
+  }
+
+  art_memory_scope_leave(&scope->memory);
+
+  if (options->memory_stats != NULL) {
+    *options->memory_stats = scope->memory.stats;
+  }
+}
+
+static IO_ERROR convert_source(const ArtReader *reader, const MemoryReader *memory,
+                               uint8_t *rgb565_buffer, const AlbumArtOptions *options) {
+
+  if (is_cancelled(options)) {
+    return CANCELLED;
+  }
+
+  if (memory == NULL) {
+    uint64_t body_pos;
+    uint32_t frame_size;
+    IO_ERROR error = locate_biggest_apic(reader, &body_pos, &frame_size);
+
+    if (error != OK) {
+      return error;
+    }
+
+    if (is_cancelled(options)) {
+      return CANCELLED;
+    }
+
+    return convert_read_apic(reader, body_pos, frame_size, rgb565_buffer, options);
+  }
 
-      bool result = get_image_data(frame_buffer, biggest_apic_size, rgb565_buffer);
+  ApicFrame apic;
+  IO_ERROR error = read_biggest_apic(reader, memory, &apic);
 
-      fclose(f);
-      if (result)
-        return OK;
-      else
-        return IMAGE_PROCESSING_ERROR;
-    } else {
-      fclose(f);
-      return NO_APIC;
+  if (error != OK) {
+    return error;
+  }
+
+  if (is_cancelled(options)) {
+    return CANCELLED;
+  }
+
+  return process_apic_frame(apic.frame, apic.frame_size, rgb565_buffer, options);
+}
+
+static IO_ERROR convert_album_art(const ArtReader *reader, const MemoryReader *memory,
+                                  uint8_t *rgb565_buffer, const AlbumArtOptions *options) {
+
+  CallScope scope;
+  enter_call_scope(&scope, options);
+
+  IO_ERROR error = convert_source(reader, memory, rgb565_buffer, options);
+
+  leave_call_scope(&scope, options);
+  return error;
+}
+
+IO_ERROR get_album_art(const char *file_path, uint8_t *rgb565_buffer) {
+  return get_album_art_ex(file_path, rgb565_buffer, NULL);
+}
+
+IO_ERROR get_album_art_ex(const char *file_path, uint8_t *rgb565_buffer,
+                          const AlbumArtOptions *options) {
+
+  FILE *f = fopen(file_path, "rb");
+
+  if (f == NULL) {
+    // convert_album_art enters the scope of the call, this failure comes before it
+    CallScope scope;
+    enter_call_scope(&scope, options);
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open file", file_path);
+    leave_call_scope(&scope, options);
+    return COULD_NOT_OPEN_FILE;
+  }
+
+  ArtReader reader = {.read = &file_read, .seek = &file_seek, .size = NULL, .handle = f};
+  IO_ERROR error = convert_album_art(&reader, NULL, rgb565_buffer, options);
+
+  fclose(f);
+  return error;
+}
+
+IO_ERROR get_album_art_from_memory(const uint8_t *data, size_t size, uint8_t *rgb565_buffer,
+                                   const AlbumArtOptions *options) {
+
+  MemoryReader memory = {.data = data, .size = size, .position = 0};
+  ArtReader reader = {
+      .read = &memory_read, .seek = &memory_seek, .size = &memory_size, .handle = &memory};
+
+  return convert_album_art(&reader, &memory, rgb565_buffer, options);
+}
+
+IO_ERROR get_album_art_from_reader(const ArtReader *reader, uint8_t *rgb565_buffer,
+                                   const AlbumArtOptions *options) {
+  return convert_album_art(reader, NULL, rgb565_buffer, options);
+}
+
+IO_ERROR get_album_art_encoded(const char *file_path, uint8_t *encoded, size_t capacity,
+                               size_t *encoded_size, const AlbumArtOptions *options) {
+
+  CallScope scope;
+  enter_call_scope(&scope, options);
+  uint8_t *rgb565_buffer = art_malloc(RGB565_BUFFER_SIZE);
+
+  if (rgb565_buffer == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for rgb565 buffer", NULL);
+    leave_call_scope(&scope, options);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  IO_ERROR error = get_album_art_ex(file_path, rgb565_buffer, options);
+
+  if (error == OK) {
+    *encoded_size =
+        rgb565_encode(rgb565_buffer, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, encoded, capacity);
+
+    if (*encoded_size == 0) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ENCODE_FAILED, "could not encode album art", NULL);
+      error = IMAGE_PROCESSING_ERROR;
+    }
+  }
+
+  art_free(rgb565_buffer);
+  leave_call_scope(&scope, options);
+  return error;
+}
+
+IO_ERROR get_album_art_indexed(const char *file_path, uint8_t *indexed, bool dither,
+                               const AlbumArtOptions *options) {
+
+  CallScope scope;
+  enter_call_scope(&scope, options);
+  uint8_t *rgb565_buffer = art_malloc(RGB565_BUFFER_SIZE);
+
+  if (rgb565_buffer == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for rgb565 buffer", NULL);
+    leave_call_scope(&scope, options);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  IO_ERROR error = get_album_art_ex(file_path, rgb565_buffer, options);
+
+  if (error == OK) {
+    const IndexedOptions indexed_options = {.max_colors = INDEXED_MAX_COLORS, .dither = dither};
+
+    if (!rgb565_to_indexed(rgb565_buffer, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, &indexed_options,
+                           indexed)) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ENCODE_FAILED, "could not quantise album art", NULL);
+      error = IMAGE_PROCESSING_ERROR;
     }
+  }
+
+  art_free(rgb565_buffer);
+  leave_call_scope(&scope, options);
+  return error;
+}
+
+/**
+ * Passes the picture of the frame through if the player can decode it as is, otherwise sets
+ * owned_buffer to a transcoded JPEG. The picture data is only looked at, never copied.
+ */
+static IO_ERROR compress_apic(const uint8_t *frame, uint32_t frame_size,
+                              const PassthroughOptions *options, AlbumArtJpeg *jpeg) {
+
+  ApicImage apic_image;
+
+  if (!parse_apic_frame(frame, frame_size, &apic_image)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_NO_IMAGE_DATA, "APIC frame does not contain image data",
+             NULL);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  const uint32_t max_size = options != NULL && options->max_size > 0
+                                ? options->max_size
+                                : PASSTHROUGH_DEFAULT_MAX_SIZE;
+  const int quality = options != NULL && options->quality > 0 ? options->quality
+                                                              : PASSTHROUGH_DEFAULT_QUALITY;
+  Orientation orientation;
+
+  if (apic_image.type == JPEG && apic_image.size <= max_size &&
+      jpeg_is_baseline(apic_image.data, apic_image.size, &orientation) &&
+      orientation <= ORIENTATION_NORMAL) {
+    jpeg->data = apic_image.data;
+    jpeg->size = apic_image.size;
+    jpeg->transcoded = false;
+    return OK;
+  }
+
+  const ImageDecoder *decoder =
+      image_decoder_for(apic_image.type, apic_image.data, apic_image.size);
+
+  if (decoder == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_NO_DECODER, "no decoder accepts the picture data", NULL);
+    return IMAGE_PROCESSING_ERROR;
+  }
 
+  Image rgb888_scaled;
+
+  if (!image_allocate(&rgb888_scaled, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, IMAGE_RGB888)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for downscaled image", NULL);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  size_t size = 0;
+  bool result = decoder->decode_scaled(apic_image.data, apic_image.size, &rgb888_scaled) &&
+                compress_rgb888_to_jpeg(&rgb888_scaled, quality, &jpeg->owned_buffer, &size);
+  art_free(rgb888_scaled.buffer);
+
+  if (!result) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ENCODE_FAILED, "could not transcode album art", NULL);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  jpeg->data = jpeg->owned_buffer;
+  jpeg->size = size;
+  jpeg->transcoded = true;
+  return OK;
+}
+
+static IO_ERROR album_art_jpeg(const ArtReader *reader, const MemoryReader *memory,
+                               AlbumArtJpeg *jpeg, const PassthroughOptions *options) {
+
+  *jpeg = (AlbumArtJpeg){.data = NULL, .size = 0, .transcoded = false, .owned_buffer = NULL};
+
+  ApicFrame apic;
+  IO_ERROR error = read_biggest_apic(reader, memory, &apic);
+
+  if (error != OK) {
+    return error;
+  }
+
+  error = compress_apic(apic.frame, apic.frame_size, options, jpeg);
+
+  // a passed through picture stays in the frame that was read
+  if (error == OK && !jpeg->transcoded) {
+    jpeg->owned_buffer = apic.owned_buffer;
   } else {
-    fprintf(stderr, "No ID3 tag found in file: %s\n", file_path);
-    return NO_ID3;
+    art_free(apic.owned_buffer);
   }
+
+  return error;
+}
+
+IO_ERROR get_album_art_jpeg(const char *file_path, AlbumArtJpeg *jpeg,
+                            const PassthroughOptions *options) {
+
+  FILE *f = fopen(file_path, "rb");
+
+  if (f == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open file", file_path);
+    return COULD_NOT_OPEN_FILE;
+  }
+
+  ArtReader reader = {.read = &file_read, .seek = &file_seek, .size = NULL, .handle = f};
+  IO_ERROR error = album_art_jpeg(&reader, NULL, jpeg, options);
+
+  fclose(f);
+  return error;
+}
+
+IO_ERROR get_album_art_jpeg_from_memory(const uint8_t *data, size_t size, AlbumArtJpeg *jpeg,
+                                        const PassthroughOptions *options) {
+
+  MemoryReader memory = {.data = data, .size = size, .position = 0};
+  ArtReader reader = {
+      .read = &memory_read, .seek = &memory_seek, .size = &memory_size, .handle = &memory};
+
+  return album_art_jpeg(&reader, &memory, jpeg, options);
+}
+
+void album_art_jpeg_free(AlbumArtJpeg *jpeg) {
+  art_free(jpeg->owned_buffer);
+  *jpeg = (AlbumArtJpeg){.data = NULL, .size = 0, .transcoded = false, .owned_buffer = NULL};
+}
+
+IO_ERROR get_album_art_preview(const char *file_path, uint8_t *rgb565_buffer,
+                               preview_callback callback, void *user_data) {
+
+  FILE *f = fopen(file_path, "rb");
+
+  if (f == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open file", file_path);
+    return COULD_NOT_OPEN_FILE;
+  }
+
+  ArtReader reader = {.read = &file_read, .seek = &file_seek, .size = NULL, .handle = f};
+  ApicFrame apic;
+
+  IO_ERROR error = read_biggest_apic(&reader, NULL, &apic);
+  fclose(f);
+
+  if (error != OK) {
+    return error;
+  }
+
+  bool result =
+      get_image_data_preview(apic.frame, apic.frame_size, rgb565_buffer, callback, user_data);
+  art_free(apic.owned_buffer);
+
+  if (result)
+    return OK;
+  else
+    return IMAGE_PROCESSING_ERROR;
 }
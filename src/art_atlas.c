@@ -0,0 +1,162 @@
+#include "../include/art_atlas.h"
+#include "../include/art_diag.h"
+#include "../include/img_processing.h"
+#include <stdlib.h>
+#include <string.h>
+
+ArtAtlas *art_atlas_create(uint32_t tile_count, uint32_t columns, PixelFormat format) {
+
+  if ((format != IMAGE_RGB565 && format != IMAGE_RGBA8888) || tile_count == 0 || columns == 0) {
+    return NULL;
+  }
+
+  if (columns > tile_count) {
+    columns = tile_count;
+  }
+
+  const uint32_t rows = (tile_count + columns - 1) / columns;
+
+  ArtAtlas *atlas = calloc(1, sizeof(ArtAtlas));
+
+  if (atlas == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for atlas", NULL);
+    return NULL;
+  }
+
+  atlas->tiles = calloc(tile_count, sizeof(AtlasTile));
+
+  if (atlas->tiles == NULL || !image_allocate(&atlas->image, (size_t)columns * TARGET_IMG_WIDTH,
+                                              (size_t)rows * TARGET_IMG_HEIGHT, format)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for atlas", NULL);
+    free(atlas->tiles);
+    free(atlas);
+    return NULL;
+  }
+
+  memset(atlas->image.buffer, 0, atlas->image.length);
+
+  atlas->columns = columns;
+  atlas->tile_count = tile_count;
+
+  for (uint32_t i = 0; i < tile_count; i++) {
+    atlas->tiles[i] = (AtlasTile){.x = (i % columns) * TARGET_IMG_WIDTH,
+                                  .y = (i / columns) * TARGET_IMG_HEIGHT,
+                                  .result = NO_APIC,
+                                  .dirty = false};
+  }
+
+  return atlas;
+}
+
+void art_atlas_destroy(ArtAtlas *atlas) {
+
+  if (atlas == NULL) {
+    return;
+  }
+
+  free(atlas->image.buffer);
+  free(atlas->tiles);
+  free(atlas);
+}
+
+static void tile_view(ArtAtlas *atlas, uint32_t index, Image *view) {
+  const AtlasTile *tile = &atlas->tiles[index];
+  image_crop(&atlas->image, tile->x, tile->y, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, view);
+}
+
+static void clear_tile(ArtAtlas *atlas, uint32_t index) {
+
+  Image view;
+  tile_view(atlas, index, &view);
+
+  const size_t row_size = atlas->image.format == IMAGE_RGBA8888 ? TARGET_IMG_WIDTH * 4
+                                                                  : TARGET_IMG_WIDTH * 2;
+
+  for (size_t y = 0; y < TARGET_IMG_HEIGHT; y++) {
+    memset(view.buffer + y * view.stride, 0, row_size);
+  }
+}
+
+static void copy_thumbnail(ArtAtlas *atlas, uint32_t index, const uint8_t *rgb565_thumbnail) {
+
+  Image view;
+  Image thumbnail;
+
+  tile_view(atlas, index, &view);
+
+  // the thumbnail is only read
+  image_view(&thumbnail, (uint8_t *)rgb565_thumbnail, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT,
+             TARGET_IMG_WIDTH * 2, IMAGE_RGB565);
+
+  if (atlas->image.format == IMAGE_RGBA8888) {
+    rgb565_to_rgba8888(&thumbnail, &view);
+  } else {
+    copy_rgb565(&thumbnail, &view);
+  }
+}
+
+bool art_atlas_render(ArtAtlas *atlas, const uint32_t *tile_indices, const AtlasSource *sources,
+                      size_t count, const ArtPipelineConfig *config) {
+
+  for (size_t i = 0; i < count; i++) {
+    if (tile_indices != NULL ? tile_indices[i] >= atlas->tile_count : i >= atlas->tile_count) {
+      return false;
+    }
+  }
+
+  ArtBatchItem *items = calloc(count > 0 ? count : 1, sizeof(ArtBatchItem));
+  Image *views = malloc((count > 0 ? count : 1) * sizeof(Image));
+  uint32_t *item_tiles = malloc((count > 0 ? count : 1) * sizeof(uint32_t));
+
+  if (items == NULL || views == NULL || item_tiles == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for atlas batch", NULL);
+    free(items);
+    free(views);
+    free(item_tiles);
+    return false;
+  }
+
+  size_t item_count = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    const uint32_t index = tile_indices != NULL ? tile_indices[i] : (uint32_t)i;
+    atlas->tiles[index].dirty = true;
+
+    if (sources[i].rgb565_thumbnail != NULL) {
+      copy_thumbnail(atlas, index, sources[i].rgb565_thumbnail);
+      atlas->tiles[index].result = OK;
+      continue;
+    }
+
+    // the pipeline packs straight into the tile, no per file buffer is needed
+    tile_view(atlas, index, &views[item_count]);
+    items[item_count] = (ArtBatchItem){.file_path = sources[i].file_path,
+                                       .rgb565_buffer = NULL,
+                                       .result = OK,
+                                       .view = &views[item_count]};
+    item_tiles[item_count] = index;
+    item_count++;
+  }
+
+  bool result = item_count == 0 || art_pipeline_run(items, item_count, config);
+
+  for (size_t i = 0; result && i < item_count; i++) {
+    atlas->tiles[item_tiles[i]].result = items[i].result;
+
+    // no stale cover is left in a tile whose file has none (any more)
+    if (items[i].result != OK) {
+      clear_tile(atlas, item_tiles[i]);
+    }
+  }
+
+  free(items);
+  free(views);
+  free(item_tiles);
+  return result;
+}
+
+void art_atlas_clear_dirty(ArtAtlas *atlas) {
+  for (uint32_t i = 0; i < atlas->tile_count; i++) {
+    atlas->tiles[i].dirty = false;
+  }
+}
@@ -0,0 +1,611 @@
+#include "../include/art_bundle.h"
+#include "../include/art_diag.h"
+#include "../include/dhash_index.h"
+#include "../include/id3_parsing.h"
+#include "../include/rgb565_codec.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char bundle_magic[8] = "MP3ARTB";
+
+#define DEFAULT_BATCH_SIZE 64
+
+static uint64_t align_up(uint64_t offset) {
+  return (offset + ART_BUNDLE_ALIGNMENT - 1) & ~(uint64_t)(ART_BUNDLE_ALIGNMENT - 1);
+}
+
+uint64_t art_bundle_track_id(const char *file_path) {
+  // same FNV-1a as the APIC frames
+  return hash_apic_frame((const uint8_t *)file_path, (uint32_t)strlen(file_path));
+}
+
+/**
+ * Checks a header against the size of its file, the index has to lie within the file.
+ */
+static bool valid_header(const ArtBundleHeader *header, uint64_t file_size) {
+
+  if (memcmp(header->magic, bundle_magic, sizeof(bundle_magic)) != 0 ||
+      header->version != ART_BUNDLE_VERSION || header->entry_size != sizeof(ArtBundleEntry) ||
+      header->index_offset % sizeof(uint64_t) != 0 || header->index_offset > file_size) {
+    return false;
+  }
+
+  return header->entry_count <= (file_size - header->index_offset) / sizeof(ArtBundleEntry);
+}
+
+struct ArtBundle {
+  const uint8_t *map;
+  size_t size;
+  const ArtBundleHeader *header;
+  const ArtBundleEntry *entries;
+};
+
+ArtBundle *art_bundle_open(const char *path) {
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+  if (fd < 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open bundle", path);
+    return NULL;
+  }
+
+  struct stat st;
+
+  if (fstat(fd, &st) != 0 || (uint64_t)st.st_size < sizeof(ArtBundleHeader)) {
+    close(fd);
+    return NULL;
+  }
+
+  void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  ArtBundle *bundle = malloc(sizeof(ArtBundle));
+
+  if (bundle == NULL || !valid_header((const ArtBundleHeader *)map, (uint64_t)st.st_size)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_NOT_A_BUNDLE, "not an art bundle", path);
+    munmap(map, (size_t)st.st_size);
+    free(bundle);
+    return NULL;
+  }
+
+  bundle->map = map;
+  bundle->size = (size_t)st.st_size;
+  bundle->header = (const ArtBundleHeader *)map;
+  bundle->entries = (const ArtBundleEntry *)(bundle->map + bundle->header->index_offset);
+  return bundle;
+}
+
+void art_bundle_close(ArtBundle *bundle) {
+
+  if (bundle == NULL) {
+    return;
+  }
+
+  munmap((void *)bundle->map, bundle->size);
+  free(bundle);
+}
+
+size_t art_bundle_count(const ArtBundle *bundle) { return bundle->header->entry_count; }
+
+const ArtBundleEntry *art_bundle_entry_at(const ArtBundle *bundle, size_t index) {
+  return index < bundle->header->entry_count ? &bundle->entries[index] : NULL;
+}
+
+static int compare_track_id(const void *key, const void *element) {
+  const uint64_t track_id = *(const uint64_t *)key;
+  const uint64_t other = ((const ArtBundleEntry *)element)->track_id;
+  return track_id < other ? -1 : track_id > other;
+}
+
+const ArtBundleEntry *art_bundle_find(const ArtBundle *bundle, uint64_t track_id) {
+  return bsearch(&track_id, bundle->entries, bundle->header->entry_count, sizeof(ArtBundleEntry),
+                 &compare_track_id);
+}
+
+const uint8_t *art_bundle_blob(const ArtBundle *bundle, const ArtBundleEntry *entry) {
+
+  if (entry->blob_offset > bundle->size || entry->blob_size > bundle->size - entry->blob_offset) {
+    return NULL;
+  }
+
+  return bundle->map + entry->blob_offset;
+}
+
+/**
+ * Open addressing table of indices into the writer's entries, keyed by either the track id or
+ * the content hash of the entries. Slots hold the entry index + 1, 0 marks a free slot.
+ */
+typedef struct {
+  uint32_t *slots;
+  size_t capacity;
+  bool by_track;
+} EntryTable;
+
+struct ArtBundleWriter {
+  int fd;
+  ArtBundleEntry *entries;
+  size_t count;
+  size_t capacity;
+  EntryTable tracks;
+  EntryTable blobs;
+  uint64_t data_end;
+  uint64_t next_blob;
+  bool failed;
+};
+
+static inline uint64_t table_key(const EntryTable *table, const ArtBundleEntry *entry) {
+  return table->by_track ? entry->track_id : entry->content_hash;
+}
+
+/**
+ * Slot of the first entry with the key, or the free slot where it would go.
+ */
+static uint32_t *table_slot(const EntryTable *table, const ArtBundleEntry *entries, uint64_t key) {
+
+  const size_t mask = table->capacity - 1;
+  // the keys are FNV hashes, mixing the high bits in is enough
+  size_t slot = (size_t)(key ^ (key >> 32)) & mask;
+
+  while (table->slots[slot] != 0 && table_key(table, &entries[table->slots[slot] - 1]) != key) {
+    slot = (slot + 1) & mask;
+  }
+
+  return &table->slots[slot];
+}
+
+static bool table_resize(EntryTable *table, const ArtBundleEntry *entries, size_t count,
+                         size_t capacity) {
+
+  uint32_t *slots = calloc(capacity, sizeof(uint32_t));
+
+  if (slots == NULL) {
+    return false;
+  }
+
+  free(table->slots);
+  table->slots = slots;
+  table->capacity = capacity;
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t *slot = table_slot(table, entries, table_key(table, &entries[i]));
+
+    // the last entry of a track replaces the earlier ones, the first entry of a blob stays its
+    // representative
+    if (*slot == 0 || table->by_track) {
+      *slot = (uint32_t)i + 1;
+    }
+  }
+
+  return true;
+}
+
+/**
+ * Makes room for one more entry in the entry array and both tables.
+ */
+static bool reserve_entry(ArtBundleWriter *writer) {
+
+  if (writer->count == writer->capacity) {
+    size_t capacity = writer->capacity > 0 ? writer->capacity * 2 : 64;
+    ArtBundleEntry *entries = realloc(writer->entries, capacity * sizeof(ArtBundleEntry));
+
+    if (entries == NULL) {
+      return false;
+    }
+
+    writer->entries = entries;
+    writer->capacity = capacity;
+  }
+
+  // at most half full keeps the probe sequences short
+  if ((writer->count + 1) * 2 > writer->tracks.capacity) {
+    size_t capacity = writer->tracks.capacity > 0 ? writer->tracks.capacity * 2 : 128;
+
+    if (!table_resize(&writer->tracks, writer->entries, writer->count, capacity) ||
+        !table_resize(&writer->blobs, writer->entries, writer->count, capacity)) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool pread_all(int fd, void *buffer, size_t size, uint64_t offset) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t result = pread(fd, (uint8_t *)buffer + done, size - done, (off_t)(offset + done));
+
+    if (result <= 0) {
+      return false;
+    }
+
+    done += (size_t)result;
+  }
+
+  return true;
+}
+
+static bool pwrite_all(int fd, const void *buffer, size_t size, uint64_t offset) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t result =
+        pwrite(fd, (const uint8_t *)buffer + done, size - done, (off_t)(offset + done));
+
+    if (result <= 0) {
+      return false;
+    }
+
+    done += (size_t)result;
+  }
+
+  return true;
+}
+
+static bool load_index(ArtBundleWriter *writer, uint64_t file_size) {
+
+  ArtBundleHeader header;
+
+  if (!pread_all(writer->fd, &header, sizeof(header), 0) || !valid_header(&header, file_size)) {
+    return false;
+  }
+
+  for (uint64_t i = 0; i < header.entry_count; i++) {
+    if (!reserve_entry(writer)) {
+      return false;
+    }
+
+    ArtBundleEntry *entry = &writer->entries[writer->count];
+
+    if (!pread_all(writer->fd, entry, sizeof(ArtBundleEntry),
+                   header.index_offset + i * sizeof(ArtBundleEntry))) {
+      return false;
+    }
+
+    *table_slot(&writer->tracks, writer->entries, entry->track_id) = (uint32_t)writer->count + 1;
+
+    uint32_t *blob = table_slot(&writer->blobs, writer->entries, entry->content_hash);
+    if (*blob == 0) {
+      *blob = (uint32_t)writer->count + 1;
+    }
+
+    writer->count++;
+  }
+
+  const uint64_t index_end = header.index_offset + header.entry_count * sizeof(ArtBundleEntry);
+
+  writer->data_end = header.data_end;
+  writer->next_blob = align_up(header.data_end > index_end ? header.data_end : index_end);
+  return true;
+}
+
+ArtBundleWriter *art_bundle_writer_open(const char *path) {
+
+  ArtBundleWriter *writer = calloc(1, sizeof(ArtBundleWriter));
+
+  if (writer == NULL) {
+    return NULL;
+  }
+
+  writer->tracks.by_track = true;
+  writer->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+  struct stat st;
+
+  if (writer->fd < 0 || fstat(writer->fd, &st) != 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open bundle", path);
+    if (writer->fd >= 0)
+      close(writer->fd);
+    free(writer);
+    return NULL;
+  }
+
+  if (st.st_size == 0) {
+    // blobs start behind the header page
+    writer->data_end = ART_BUNDLE_ALIGNMENT;
+    writer->next_blob = ART_BUNDLE_ALIGNMENT;
+    return writer;
+  }
+
+  if (!load_index(writer, (uint64_t)st.st_size)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_NOT_A_BUNDLE, "not an art bundle", path);
+    close(writer->fd);
+    free(writer->entries);
+    free(writer->tracks.slots);
+    free(writer->blobs.slots);
+    free(writer);
+    return NULL;
+  }
+
+  return writer;
+}
+
+/**
+ * Compares data with a blob of the bundle, guards against content hash collisions.
+ */
+static bool blob_equals(ArtBundleWriter *writer, const ArtBundleEntry *entry, const uint8_t *data,
+                        uint32_t size) {
+
+  uint8_t chunk[ART_BUNDLE_ALIGNMENT];
+
+  if (entry->blob_size != size) {
+    return false;
+  }
+
+  for (uint32_t done = 0; done < size; done += sizeof(chunk)) {
+    uint32_t length = size - done < sizeof(chunk) ? size - done : (uint32_t)sizeof(chunk);
+
+    if (!pread_all(writer->fd, chunk, length, entry->blob_offset + done) ||
+        memcmp(chunk, data + done, length) != 0) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+static bool add_hashed(ArtBundleWriter *writer, uint64_t track_id, const uint8_t *data,
+                       uint32_t size, ArtBundleFormat format, uint64_t content_hash) {
+
+  if (writer->failed || !reserve_entry(writer)) {
+    writer->failed = true;
+    return false;
+  }
+
+  ArtBundleEntry entry = {.track_id = track_id,
+                          .content_hash = content_hash,
+                          .blob_offset = 0,
+                          .blob_size = size,
+                          .format = format};
+
+  uint32_t *blob = table_slot(&writer->blobs, writer->entries, content_hash);
+
+  if (*blob != 0 && writer->entries[*blob - 1].format == (uint32_t)format &&
+      blob_equals(writer, &writer->entries[*blob - 1], data, size)) {
+    entry.blob_offset = writer->entries[*blob - 1].blob_offset;
+  } else {
+    if (!pwrite_all(writer->fd, data, size, writer->next_blob)) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WRITE_FAILED, "could not write bundle blob", NULL);
+      writer->failed = true;
+      return false;
+    }
+
+    entry.blob_offset = writer->next_blob;
+    writer->data_end = writer->next_blob + size;
+    writer->next_blob = align_up(writer->data_end);
+  }
+
+  // earlier art of the track is replaced, its entry is dropped when the index is written and
+  // its blob stays in the file
+  writer->entries[writer->count] = entry;
+  *table_slot(&writer->tracks, writer->entries, track_id) = (uint32_t)writer->count + 1;
+
+  if (*blob == 0) {
+    *blob = (uint32_t)writer->count + 1;
+  }
+
+  writer->count++;
+  return true;
+}
+
+/**
+ * Stores a track with the blob of an earlier entry of the writer.
+ */
+static bool add_shared(ArtBundleWriter *writer, uint64_t track_id, size_t blob_entry) {
+
+  if (writer->failed || !reserve_entry(writer)) {
+    writer->failed = true;
+    return false;
+  }
+
+  ArtBundleEntry entry = writer->entries[blob_entry];
+  entry.track_id = track_id;
+
+  writer->entries[writer->count] = entry;
+  *table_slot(&writer->tracks, writer->entries, track_id) = (uint32_t)writer->count + 1;
+  writer->count++;
+  return true;
+}
+
+bool art_bundle_writer_add(ArtBundleWriter *writer, uint64_t track_id, const uint8_t *data,
+                           uint32_t size, ArtBundleFormat format) {
+  return add_hashed(writer, track_id, data, size, format, hash_apic_frame(data, size));
+}
+
+static int compare_entries(const void *a, const void *b) {
+  return compare_track_id(&((const ArtBundleEntry *)a)->track_id, b);
+}
+
+bool art_bundle_writer_finish(ArtBundleWriter *writer) {
+
+  bool result = !writer->failed;
+
+  if (result) {
+    size_t live = 0;
+
+    for (size_t i = 0; i < writer->count; i++) {
+      if (*table_slot(&writer->tracks, writer->entries, writer->entries[i].track_id) == i + 1) {
+        writer->entries[live++] = writer->entries[i];
+      }
+    }
+
+    writer->count = live;
+
+    // an empty bundle has no entry array, qsort must not get NULL even for no elements
+    if (writer->count > 1) {
+      qsort(writer->entries, writer->count, sizeof(ArtBundleEntry), &compare_entries);
+    }
+
+    ArtBundleHeader header = {.version = ART_BUNDLE_VERSION,
+                              .entry_size = sizeof(ArtBundleEntry),
+                              .entry_count = writer->count,
+                              .index_offset = writer->next_blob,
+                              .data_end = writer->data_end};
+    memcpy(header.magic, bundle_magic, sizeof(bundle_magic));
+
+    // the header goes last, until then the old header still describes a complete bundle
+    result = pwrite_all(writer->fd, writer->entries, writer->count * sizeof(ArtBundleEntry),
+                        header.index_offset) &&
+             ftruncate(writer->fd, (off_t)(header.index_offset +
+                                           writer->count * sizeof(ArtBundleEntry))) == 0 &&
+             fsync(writer->fd) == 0 && pwrite_all(writer->fd, &header, sizeof(header), 0) &&
+             fsync(writer->fd) == 0;
+
+    if (!result) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WRITE_FAILED, "could not write bundle index", NULL);
+    }
+  }
+
+  close(writer->fd);
+  free(writer->entries);
+  free(writer->tracks.slots);
+  free(writer->blobs.slots);
+  free(writer);
+  return result;
+}
+
+/**
+ * One pipeline run of art_bundle_build. The scale workers encode and hash the art of their items
+ * in the completion callback, so the writer only has to write.
+ */
+typedef struct {
+  ArtBatchItem *items;
+  uint8_t *rgb565_buffers;
+  uint8_t *encoded_buffers;
+  uint32_t *sizes;
+  uint64_t *hashes;
+  bool encode;
+} BuildBatch;
+
+#define ENCODED_CAPACITY RGB565_ENCODED_MAX_SIZE(TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT)
+
+static const uint8_t *batch_data(const BuildBatch *batch, size_t i) {
+  return batch->encode ? batch->encoded_buffers + i * ENCODED_CAPACITY
+                       : batch->rgb565_buffers + i * RGB565_BUFFER_SIZE;
+}
+
+static void prepare_item(ArtBatchItem *item, void *user_data) {
+
+  BuildBatch *batch = (BuildBatch *)user_data;
+  const size_t i = (size_t)(item - batch->items);
+
+  if (item->result != OK) {
+    return;
+  }
+
+  batch->sizes[i] = RGB565_BUFFER_SIZE;
+
+  if (batch->encode) {
+    batch->sizes[i] = (uint32_t)rgb565_encode(item->rgb565_buffer, TARGET_IMG_WIDTH,
+                                              TARGET_IMG_HEIGHT,
+                                              batch->encoded_buffers + i * ENCODED_CAPACITY,
+                                              ENCODED_CAPACITY);
+    if (batch->sizes[i] == 0) {
+      item->result = IMAGE_PROCESSING_ERROR;
+      return;
+    }
+  }
+
+  batch->hashes[i] = hash_apic_frame(batch_data(batch, i), batch->sizes[i]);
+}
+
+bool art_bundle_build(const char *bundle_path, const char *const *file_paths, size_t count,
+                      const ArtBundleBuildConfig *config, size_t *added) {
+
+  const ArtBundleBuildConfig default_config = {0};
+
+  if (config == NULL) {
+    config = &default_config;
+  }
+
+  *added = 0;
+
+  const size_t batch_size = config->batch_size > 0 ? config->batch_size : DEFAULT_BATCH_SIZE;
+  ArtBundleWriter *writer = art_bundle_writer_open(bundle_path);
+
+  BuildBatch batch = {
+      .items = calloc(batch_size, sizeof(ArtBatchItem)),
+      .rgb565_buffers = malloc(batch_size * RGB565_BUFFER_SIZE),
+      .encoded_buffers = config->encode ? malloc(batch_size * ENCODED_CAPACITY) : NULL,
+      .sizes = calloc(batch_size, sizeof(uint32_t)),
+      .hashes = calloc(batch_size, sizeof(uint64_t)),
+      .encode = config->encode,
+  };
+
+  bool result = writer != NULL && batch.items != NULL && batch.rgb565_buffers != NULL &&
+                (batch.encoded_buffers != NULL || !config->encode) && batch.sizes != NULL &&
+                batch.hashes != NULL;
+
+  // every entry the build adds gets the next id in the index, id i is entry first_entry + i
+  DhashIndex *similar = NULL;
+  const size_t first_entry = writer != NULL ? writer->count : 0;
+
+  if (result && config->share_similar) {
+    similar = dhash_index_create(config->similar_distance);
+    result = similar != NULL;
+  }
+
+  ArtPipelineConfig pipeline = config->pipeline;
+  pipeline.on_item_done = &prepare_item;
+  pipeline.user_data = &batch;
+
+  for (size_t start = 0; result && start < count; start += batch_size) {
+    const size_t length = count - start < batch_size ? count - start : batch_size;
+
+    for (size_t i = 0; i < length; i++) {
+      uint8_t *rgb565_buffer = batch.rgb565_buffers + i * RGB565_BUFFER_SIZE;
+      batch.items[i] = (ArtBatchItem){
+          .file_path = file_paths[start + i], .rgb565_buffer = rgb565_buffer, .result = OK};
+    }
+
+    result = art_pipeline_run(batch.items, length, &pipeline);
+
+    for (size_t i = 0; result && i < length; i++) {
+      if (batch.items[i].result != OK) {
+        continue;
+      }
+
+      const uint64_t track_id = art_bundle_track_id(batch.items[i].file_path);
+      uint32_t id;
+
+      if (similar != NULL &&
+          dhash_index_nearest(similar, batch.items[i].dhash, config->similar_distance, &id)) {
+        result = add_shared(writer, track_id, first_entry + id);
+      } else {
+        result = add_hashed(writer, track_id, batch_data(&batch, i), batch.sizes[i],
+                            config->encode ? ART_BUNDLE_RGB565_ENCODED : ART_BUNDLE_RGB565,
+                            batch.hashes[i]);
+      }
+
+      if (result && similar != NULL) {
+        result = dhash_index_add(similar, batch.items[i].dhash, &id);
+      }
+
+      *added += result ? 1 : 0;
+    }
+  }
+
+  if (writer != NULL) {
+    // a failed batch leaves the bundle as it was
+    writer->failed |= !result;
+    result = art_bundle_writer_finish(writer);
+  }
+
+  free(batch.items);
+  free(batch.rgb565_buffers);
+  free(batch.encoded_buffers);
+  free(batch.sizes);
+  free(batch.hashes);
+  dhash_index_destroy(similar);
+  return result;
+}
@@ -0,0 +1,121 @@
+#include "../include/art_diag.h"
+#include <stdio.h>
+#include <string.h>
+
+static art_diag_sink sink = NULL;
+static void *sink_data = NULL;
+static ArtDiagLevel sink_level = ART_DIAG_OFF;
+
+static _Thread_local ArtDiagScope *current_scope = NULL;
+
+void art_diag_set_sink(art_diag_sink new_sink, void *user_data, ArtDiagLevel min_level) {
+  sink = new_sink;
+  sink_data = user_data;
+  sink_level = new_sink != NULL ? min_level : ART_DIAG_OFF;
+}
+
+void art_diag_scope_enter(ArtDiagScope *scope, ArtDiagRecord *record) {
+
+  *record = (ArtDiagRecord){.level = ART_DIAG_DEBUG, .code = ART_DIAG_NONE, .message = ""};
+  *scope = (ArtDiagScope){.record = record, .previous = current_scope};
+  current_scope = scope;
+}
+
+void art_diag_scope_leave(ArtDiagScope *scope) {
+
+  current_scope = scope->previous;
+
+  if (current_scope != NULL && current_scope->record != scope->record &&
+      current_scope->record->code == ART_DIAG_NONE) {
+    *current_scope->record = *scope->record;
+  }
+}
+
+void art_diag_report(ArtDiagLevel level, ArtDiagCode code, const char *message,
+                     const char *subject, uint64_t value0, uint64_t value1, const char *function) {
+
+  const bool to_sink = level >= sink_level;
+  const bool to_scope = current_scope != NULL && level >= ART_DIAG_WARNING &&
+                        current_scope->record->code == ART_DIAG_NONE;
+
+  if (!to_sink && !to_scope) {
+    return;
+  }
+
+  ArtDiagRecord record = {.level = level,
+                          .code = code,
+                          .message = message,
+                          .subject = "",
+                          .values = {value0, value1},
+                          .function = function};
+
+  if (subject != NULL) {
+    strncpy(record.subject, subject, ART_DIAG_SUBJECT_SIZE - 1);
+  }
+
+  if (to_scope) {
+    *current_scope->record = record;
+  }
+
+  if (to_sink) {
+    sink(&record, sink_data);
+  }
+}
+
+const char *art_diag_code_name(ArtDiagCode code) {
+
+  static const char *const names[] = {
+      [ART_DIAG_NONE] = "none",
+      [ART_DIAG_OPEN_FAILED] = "open_failed",
+      [ART_DIAG_READ_FAILED] = "read_failed",
+      [ART_DIAG_SEEK_FAILED] = "seek_failed",
+      [ART_DIAG_WRITE_FAILED] = "write_failed",
+      [ART_DIAG_ALLOC_FAILED] = "alloc_failed",
+      [ART_DIAG_NO_ID3] = "no_id3",
+      [ART_DIAG_TRUNCATED] = "truncated",
+      [ART_DIAG_NO_IMAGE_DATA] = "no_image_data",
+      [ART_DIAG_UNSUPPORTED_TYPE] = "unsupported_type",
+      [ART_DIAG_NO_DECODER] = "no_decoder",
+      [ART_DIAG_DECODE_FAILED] = "decode_failed",
+      [ART_DIAG_ENCODE_FAILED] = "encode_failed",
+      [ART_DIAG_TOO_LARGE] = "too_large",
+      [ART_DIAG_UNSUPPORTED_TAG] = "unsupported_tag",
+      [ART_DIAG_NOT_A_BUNDLE] = "not_a_bundle",
+      [ART_DIAG_THREAD_FAILED] = "thread_failed",
+      [ART_DIAG_WATCH_FAILED] = "watch_failed",
+      [ART_DIAG_WATCH_OVERFLOW] = "watch_overflow",
+      [ART_DIAG_IO_FALLBACK] = "io_fallback",
+      [ART_DIAG_NOT_SQUARE] = "not_square",
+  };
+
+  return (size_t)code < sizeof(names) / sizeof(names[0]) ? names[code] : "unknown";
+}
+
+const char *art_diag_level_name(ArtDiagLevel level) {
+
+  static const char *const names[] = {
+      [ART_DIAG_DEBUG] = "debug",
+      [ART_DIAG_INFO] = "info",
+      [ART_DIAG_WARNING] = "warning",
+      [ART_DIAG_ERROR] = "error",
+      [ART_DIAG_OFF] = "off",
+  };
+
+  return (size_t)level < sizeof(names) / sizeof(names[0]) ? names[level] : "unknown";
+}
+
+void art_diag_stderr_sink(const ArtDiagRecord *record, void *user_data) {
+  (void)user_data;
+
+  char values[48] = "";
+
+  if (record->values[0] != 0 || record->values[1] != 0) {
+    snprintf(values, sizeof(values), " [%llu, %llu]", (unsigned long long)record->values[0],
+             (unsigned long long)record->values[1]);
+  }
+
+  // one call per line, so lines of concurrent conversions do not interleave
+  fprintf(stderr, "%s: %s: %s%s%s%s (%s)\n", art_diag_level_name(record->level),
+          art_diag_code_name(record->code), record->message, record->subject[0] != 0 ? ": " : "",
+          record->subject, values, record->function);
+}
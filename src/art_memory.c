@@ -0,0 +1,271 @@
+#include "../include/art_memory.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct ArtMemory {
+  ArtAllocator allocator;
+  _Atomic size_t current_bytes;
+  _Atomic size_t peak_bytes;
+  _Atomic uint64_t allocations;
+};
+
+/**
+ * Stored in front of every block allocated inside a scope, so it can be freed and counted without
+ * a scope knowing about it.
+ *
+ * memory:  context the block came from
+ * size:    bytes requested
+ * offset:  bytes from the start of the allocation to the block, bigger than the header for
+ *          blocks of art_aligned_alloc
+ */
+typedef struct {
+  ArtMemory *memory;
+  size_t size;
+  size_t offset;
+  size_t reserved;
+} BlockHeader;
+
+_Static_assert(sizeof(BlockHeader) % _Alignof(max_align_t) == 0,
+               "blocks behind the header have to keep the allocator's alignment");
+
+static _Thread_local ArtMemoryScope *current_scope = NULL;
+
+static void *libc_malloc(void *user_data, size_t size) {
+  (void)user_data;
+  return malloc(size);
+}
+
+static void *libc_realloc(void *user_data, void *pointer, size_t size) {
+  (void)user_data;
+  return realloc(pointer, size);
+}
+
+static void libc_free(void *user_data, void *pointer) {
+  (void)user_data;
+  free(pointer);
+}
+
+static const ArtAllocator libc_allocator = {
+    .malloc = &libc_malloc, .realloc = &libc_realloc, .free = &libc_free, .user_data = NULL};
+
+// context of calls that want statistics without bringing their own
+static ArtMemory libc_memory = {
+    .allocator = {
+        .malloc = &libc_malloc, .realloc = &libc_realloc, .free = &libc_free, .user_data = NULL}};
+
+ArtMemory *art_memory_create(const ArtAllocator *allocator) {
+
+  if (allocator == NULL) {
+    allocator = &libc_allocator;
+  }
+
+  ArtMemory *memory = allocator->malloc(allocator->user_data, sizeof(ArtMemory));
+
+  if (memory == NULL) {
+    return NULL;
+  }
+
+  memory->allocator = *allocator;
+  atomic_init(&memory->current_bytes, 0);
+  atomic_init(&memory->peak_bytes, 0);
+  atomic_init(&memory->allocations, 0);
+  return memory;
+}
+
+void art_memory_destroy(ArtMemory *memory) {
+  if (memory != NULL) {
+    memory->allocator.free(memory->allocator.user_data, memory);
+  }
+}
+
+ArtMemory *art_memory_default(void) { return &libc_memory; }
+
+void art_memory_stats(const ArtMemory *memory, ArtMemoryStats *stats) {
+  // the fields are read one after another, a concurrent allocation may fall in between
+  stats->current_bytes = atomic_load((_Atomic size_t *)&memory->current_bytes);
+  stats->peak_bytes = atomic_load((_Atomic size_t *)&memory->peak_bytes);
+  stats->allocations = atomic_load((_Atomic uint64_t *)&memory->allocations);
+}
+
+static void add_peak(ArtMemoryStats *stats, size_t current_bytes, size_t peak_bytes) {
+  if (current_bytes + peak_bytes > stats->peak_bytes) {
+    stats->peak_bytes = current_bytes + peak_bytes;
+  }
+}
+
+void art_memory_scope_enter(ArtMemoryScope *scope, ArtMemory *memory) {
+  *scope = (ArtMemoryScope){.memory = memory, .stats = {0}, .previous = current_scope};
+  current_scope = scope;
+}
+
+void art_memory_scope_leave(ArtMemoryScope *scope) {
+
+  current_scope = scope->previous;
+
+  if (current_scope != NULL) {
+    ArtMemoryStats *outer = &current_scope->stats;
+    add_peak(outer, outer->current_bytes, scope->stats.peak_bytes);
+    outer->current_bytes += scope->stats.current_bytes;
+    outer->allocations += scope->stats.allocations;
+  }
+}
+
+ArtMemory *art_memory_current(void) {
+  return current_scope != NULL ? current_scope->memory : NULL;
+}
+
+void art_memory_scope_merge(const ArtMemoryStats *stats) {
+
+  if (current_scope == NULL) {
+    return;
+  }
+
+  ArtMemoryStats *scope_stats = &current_scope->stats;
+  add_peak(scope_stats, scope_stats->current_bytes, stats->peak_bytes);
+  scope_stats->current_bytes += stats->current_bytes;
+  scope_stats->allocations += stats->allocations;
+}
+
+static void count_allocation(ArtMemory *memory, size_t size) {
+
+  size_t current = atomic_fetch_add(&memory->current_bytes, size) + size;
+  size_t peak = atomic_load(&memory->peak_bytes);
+
+  while (current > peak && !atomic_compare_exchange_weak(&memory->peak_bytes, &peak, current)) {
+  }
+
+  atomic_fetch_add(&memory->allocations, 1);
+
+  ArtMemoryStats *stats = &current_scope->stats;
+  stats->current_bytes += size;
+  stats->allocations++;
+  add_peak(stats, stats->current_bytes, 0);
+}
+
+static void count_free(ArtMemory *memory, size_t size) {
+
+  atomic_fetch_sub(&memory->current_bytes, size);
+
+  // blocks of an enclosing scope that are freed in a nested one are not part of its bytes
+  ArtMemoryStats *stats = &current_scope->stats;
+  stats->current_bytes = stats->current_bytes > size ? stats->current_bytes - size : 0;
+}
+
+static BlockHeader *header_of(void *pointer) { return (BlockHeader *)pointer - 1; }
+
+static void *scoped_allocate(size_t alignment, size_t size) {
+
+  ArtMemory *memory = current_scope->memory;
+  const size_t extra = alignment > _Alignof(max_align_t) ? alignment : 0;
+
+  if (size > SIZE_MAX - sizeof(BlockHeader) - extra) {
+    return NULL;
+  }
+
+  uint8_t *allocation =
+      memory->allocator.malloc(memory->allocator.user_data, sizeof(BlockHeader) + extra + size);
+
+  if (allocation == NULL) {
+    return NULL;
+  }
+
+  uintptr_t block = (uintptr_t)(allocation + sizeof(BlockHeader));
+
+  if (extra > 0) {
+    block = (block + alignment - 1) & ~(uintptr_t)(alignment - 1);
+  }
+
+  BlockHeader *header = header_of((void *)block);
+  *header = (BlockHeader){
+      .memory = memory, .size = size, .offset = (size_t)(block - (uintptr_t)allocation)};
+
+  count_allocation(memory, size);
+  return (void *)block;
+}
+
+void *art_malloc(size_t size) {
+  return current_scope != NULL ? scoped_allocate(_Alignof(max_align_t), size) : malloc(size);
+}
+
+void *art_calloc(size_t count, size_t size) {
+
+  if (current_scope == NULL) {
+    return calloc(count, size);
+  }
+
+  if (size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+
+  void *pointer = scoped_allocate(_Alignof(max_align_t), count * size);
+
+  if (pointer != NULL) {
+    memset(pointer, 0, count * size);
+  }
+
+  return pointer;
+}
+
+void *art_aligned_alloc(size_t alignment, size_t size) {
+
+  if (current_scope != NULL) {
+    return scoped_allocate(alignment, size);
+  }
+
+  // before C23 aligned_alloc wants a multiple of the alignment
+  return aligned_alloc(alignment, (size + alignment - 1) & ~(alignment - 1));
+}
+
+void *art_realloc(void *pointer, size_t size) {
+
+  if (current_scope == NULL) {
+    return realloc(pointer, size);
+  }
+
+  if (pointer == NULL) {
+    return art_malloc(size);
+  }
+
+  BlockHeader *header = header_of(pointer);
+  ArtMemory *memory = header->memory;
+  const size_t old_size = header->size;
+
+  // aligned blocks would lose their alignment when moved
+  if (header->offset != sizeof(BlockHeader) || size > SIZE_MAX - sizeof(BlockHeader)) {
+    void *moved = size <= SIZE_MAX - sizeof(BlockHeader) ? art_malloc(size) : NULL;
+
+    if (moved != NULL) {
+      memcpy(moved, pointer, old_size < size ? old_size : size);
+      art_free(pointer);
+    }
+
+    return moved;
+  }
+
+  BlockHeader *resized =
+      memory->allocator.realloc(memory->allocator.user_data, header, sizeof(BlockHeader) + size);
+
+  if (resized == NULL) {
+    return NULL;
+  }
+
+  resized->size = size;
+  count_free(memory, old_size);
+  count_allocation(memory, size);
+  return resized + 1;
+}
+
+void art_free(void *pointer) {
+
+  if (current_scope == NULL || pointer == NULL) {
+    free(pointer);
+    return;
+  }
+
+  BlockHeader *header = header_of(pointer);
+  ArtMemory *memory = header->memory;
+
+  count_free(memory, header->size);
+  memory->allocator.free(memory->allocator.user_data, (uint8_t *)pointer - header->offset);
+}
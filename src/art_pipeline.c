@@ -0,0 +1,208 @@
+#include "../include/art_pipeline.h"
+#include "../include/art_diag.h"
+#include "../include/bounded_queue.h"
+#include "../include/id3_parsing.h"
+#include "../include/tag_reader.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct {
+  ArtBatchItem *item;
+
+  // whole tag body, the APIC frame body is a slice of it
+  uint8_t *tag_buffer;
+  uint32_t frame_offset;
+  uint32_t frame_size;
+
+  Image rgb888_image;
+} PipelineWork;
+
+typedef struct {
+  BoundedQueue *decode_queue;
+  BoundedQueue *scale_queue;
+  const ArtPipelineConfig *config;
+} Pipeline;
+
+static void complete_item(const ArtPipelineConfig *config, ArtBatchItem *item, IO_ERROR result) {
+  item->result = result;
+
+  if (config->on_item_done != NULL) {
+    config->on_item_done(item, config->user_data);
+  }
+}
+
+/**
+ * Reads the tags of a window of items at once and hands every item with an APIC frame to the
+ * decoders, the other items are completed right away.
+ */
+static void read_window(Pipeline *pipeline, TagReader *reader, TagRead *reads, PipelineWork *work,
+                        size_t count) {
+
+  for (size_t i = 0; i < count; i++) {
+    reads[i].file_path = work[i].item->file_path;
+  }
+
+  tag_reader_read(reader, reads, count);
+
+  for (size_t i = 0; i < count; i++) {
+    if (reads[i].result != OK) {
+      complete_item(pipeline->config, work[i].item, reads[i].result);
+      continue;
+    }
+
+    // a truncated tag is walked as far as it goes
+    if (!find_biggest_apic(reads[i].tag_buffer, reads[i].tag_size, reads[i].major_version,
+                           &work[i].frame_offset, &work[i].frame_size)) {
+      free(reads[i].tag_buffer);
+      complete_item(pipeline->config, work[i].item, NO_APIC);
+      continue;
+    }
+
+    work[i].tag_buffer = reads[i].tag_buffer;
+    bounded_queue_push(pipeline->decode_queue, &work[i]);
+  }
+}
+
+static void *decode_worker(void *arg) {
+  Pipeline *pipeline = (Pipeline *)arg;
+  void *value;
+
+  while (bounded_queue_pop(pipeline->decode_queue, &value)) {
+    PipelineWork *work = (PipelineWork *)value;
+    const AlbumArtOptions options = {.max_pixels = pipeline->config->max_pixels};
+
+    IO_ERROR error = decode_apic_frame(work->tag_buffer + work->frame_offset, work->frame_size,
+                                       &work->rgb888_image, &options);
+    free(work->tag_buffer);
+    work->tag_buffer = NULL;
+
+    if (error != OK) {
+      complete_item(pipeline->config, work->item, error);
+      continue;
+    }
+
+    bounded_queue_push(pipeline->scale_queue, work);
+  }
+
+  bounded_queue_producer_done(pipeline->scale_queue);
+  return NULL;
+}
+
+static void *scale_worker(void *arg) {
+  Pipeline *pipeline = (Pipeline *)arg;
+  void *value;
+
+  while (bounded_queue_pop(pipeline->scale_queue, &value)) {
+    PipelineWork *work = (PipelineWork *)value;
+    const AlbumArtOptions options = {.art_dhash = &work->item->dhash};
+
+    IO_ERROR error =
+        work->item->view != NULL
+            ? scale_to_view(&work->rgb888_image, work->item->view, &options)
+            : scale_to_rgb565(&work->rgb888_image, work->item->rgb565_buffer, &options);
+    free(work->rgb888_image.buffer);
+    work->rgb888_image.buffer = NULL;
+
+    complete_item(pipeline->config, work->item, error);
+  }
+
+  return NULL;
+}
+
+bool art_pipeline_run(ArtBatchItem *items, size_t count, const ArtPipelineConfig *config) {
+
+  const ArtPipelineConfig default_config = {0};
+
+  if (config == NULL) {
+    config = &default_config;
+  }
+
+  uint32_t decode_workers = config->decode_workers;
+
+  if (decode_workers == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    decode_workers = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+
+  uint32_t scale_workers = config->scale_workers > 0 ? config->scale_workers : 1;
+  uint32_t queue_depth = config->queue_depth > 0 ? config->queue_depth : 2 * decode_workers;
+
+  Pipeline pipeline = {
+      .decode_queue = bounded_queue_create(queue_depth, 1),
+      .scale_queue = bounded_queue_create(queue_depth, decode_workers),
+      .config = config,
+  };
+
+  TagReader *reader = tag_reader_create(config->io_queue_depth, !config->disable_io_uring);
+  uint32_t io_window = reader != NULL ? tag_reader_queue_depth(reader) : 1;
+
+  PipelineWork *work = calloc(count > 0 ? count : 1, sizeof(PipelineWork));
+  TagRead *reads = malloc(io_window * sizeof(TagRead));
+  pthread_t *threads = malloc((decode_workers + scale_workers) * sizeof(pthread_t));
+
+  if (pipeline.decode_queue == NULL || pipeline.scale_queue == NULL || reader == NULL ||
+      work == NULL || reads == NULL || threads == NULL) {
+    if (pipeline.decode_queue != NULL)
+      bounded_queue_destroy(pipeline.decode_queue);
+    if (pipeline.scale_queue != NULL)
+      bounded_queue_destroy(pipeline.scale_queue);
+    if (reader != NULL)
+      tag_reader_destroy(reader);
+    free(work);
+    free(reads);
+    free(threads);
+    return false;
+  }
+
+  uint32_t started = 0;
+
+  for (uint32_t i = 0; i < decode_workers; i++) {
+    if (pthread_create(&threads[started], NULL, &decode_worker, &pipeline) != 0) {
+      // the scale workers must not wait for a decoder that never runs
+      bounded_queue_producer_done(pipeline.scale_queue);
+      continue;
+    }
+    started++;
+  }
+
+  uint32_t started_decode_workers = started;
+
+  for (uint32_t i = 0; i < scale_workers; i++) {
+    if (pthread_create(&threads[started], NULL, &scale_worker, &pipeline) == 0) {
+      started++;
+    }
+  }
+
+  // fewer workers than requested only slow the batch down, a missing stage would block it
+  bool setup_failed = started_decode_workers == 0 || started == started_decode_workers;
+
+  // the I/O stage runs on the calling thread and blocks whenever the decoders fall behind
+  if (!setup_failed) {
+    for (size_t i = 0; i < count; i++) {
+      work[i].item = &items[i];
+    }
+
+    for (size_t start = 0; start < count; start += io_window) {
+      size_t window = count - start < io_window ? count - start : io_window;
+      read_window(&pipeline, reader, reads, work + start, window);
+    }
+  } else {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_THREAD_FAILED, "could not start pipeline workers", NULL);
+  }
+
+  bounded_queue_producer_done(pipeline.decode_queue);
+
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  bounded_queue_destroy(pipeline.decode_queue);
+  bounded_queue_destroy(pipeline.scale_queue);
+  tag_reader_destroy(reader);
+  free(work);
+  free(reads);
+  free(threads);
+
+  return !setup_failed;
+}
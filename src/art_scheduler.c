@@ -0,0 +1,396 @@
+#include "../include/art_scheduler.h"
+#include "../include/art_diag.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define INITIAL_QUEUE_CAPACITY 64
+
+typedef enum { JOB_QUEUED, JOB_RUNNING, JOB_DONE } JobState;
+
+struct ArtJob {
+  ArtScheduler *scheduler;
+  char *file_path;
+  uint8_t *rgb565_buffer;
+  art_job_callback callback;
+  void *user_data;
+
+  // guarded by the scheduler mutex
+  int32_t priority;
+  uint64_t sequence;
+  size_t heap_index;
+
+  _Atomic JobState state;
+  atomic_bool cancelled;
+  atomic_int references;
+  IO_ERROR result;
+
+  // only used to sleep in art_job_wait
+  pthread_mutex_t mutex;
+  pthread_cond_t done;
+};
+
+struct ArtScheduler {
+  pthread_mutex_t mutex;
+  pthread_cond_t work_available;
+
+  // binary max-heap ordered by priority, then submission order
+  ArtJob **queue;
+  size_t queue_size;
+  size_t queue_capacity;
+  uint64_t next_sequence;
+
+  atomic_bool stopping;
+
+  pthread_t *workers;
+  uint32_t worker_count;
+};
+
+static bool runs_before(const ArtJob *a, const ArtJob *b) {
+  if (a->priority != b->priority) {
+    return a->priority > b->priority;
+  }
+  return a->sequence < b->sequence;
+}
+
+static void queue_swap(ArtScheduler *scheduler, size_t i, size_t j) {
+  ArtJob *tmp = scheduler->queue[i];
+  scheduler->queue[i] = scheduler->queue[j];
+  scheduler->queue[j] = tmp;
+
+  scheduler->queue[i]->heap_index = i;
+  scheduler->queue[j]->heap_index = j;
+}
+
+static void sift_up(ArtScheduler *scheduler, size_t index) {
+  while (index > 0) {
+    size_t parent = (index - 1) / 2;
+
+    if (!runs_before(scheduler->queue[index], scheduler->queue[parent])) {
+      break;
+    }
+
+    queue_swap(scheduler, index, parent);
+    index = parent;
+  }
+}
+
+static void sift_down(ArtScheduler *scheduler, size_t index) {
+  while (true) {
+    size_t first = index;
+    size_t left = 2 * index + 1;
+    size_t right = left + 1;
+
+    if (left < scheduler->queue_size &&
+        runs_before(scheduler->queue[left], scheduler->queue[first]))
+      first = left;
+    if (right < scheduler->queue_size &&
+        runs_before(scheduler->queue[right], scheduler->queue[first]))
+      first = right;
+
+    if (first == index) {
+      break;
+    }
+
+    queue_swap(scheduler, index, first);
+    index = first;
+  }
+}
+
+static bool queue_push(ArtScheduler *scheduler, ArtJob *job) {
+  if (scheduler->queue_size == scheduler->queue_capacity) {
+    size_t capacity = scheduler->queue_capacity * 2;
+    ArtJob **queue = realloc(scheduler->queue, capacity * sizeof(ArtJob *));
+
+    if (queue == NULL) {
+      return false;
+    }
+
+    scheduler->queue = queue;
+    scheduler->queue_capacity = capacity;
+  }
+
+  job->heap_index = scheduler->queue_size;
+  scheduler->queue[scheduler->queue_size++] = job;
+  sift_up(scheduler, job->heap_index);
+  return true;
+}
+
+static void queue_remove(ArtScheduler *scheduler, size_t index) {
+  scheduler->queue_size--;
+
+  if (index != scheduler->queue_size) {
+    queue_swap(scheduler, index, scheduler->queue_size);
+    sift_up(scheduler, index);
+    sift_down(scheduler, index);
+  }
+}
+
+static ArtJob *queue_pop(ArtScheduler *scheduler) {
+  ArtJob *job = scheduler->queue[0];
+  queue_remove(scheduler, 0);
+  return job;
+}
+
+static bool job_is_cancelled(void *cancel_data) {
+  ArtJob *job = (ArtJob *)cancel_data;
+
+  return atomic_load_explicit(&job->cancelled, memory_order_relaxed) ||
+         atomic_load_explicit(&job->scheduler->stopping, memory_order_relaxed);
+}
+
+/**
+ * Reports the result and drops the reference held by the scheduler.
+ * The job must have been taken out of the queue already.
+ */
+static void complete_job(ArtJob *job, IO_ERROR result) {
+  job->result = result;
+
+  if (job->callback != NULL) {
+    job->callback(job, result, job->rgb565_buffer, job->user_data);
+  }
+
+  pthread_mutex_lock(&job->mutex);
+  atomic_store(&job->state, JOB_DONE);
+  pthread_cond_broadcast(&job->done);
+  pthread_mutex_unlock(&job->mutex);
+
+  art_job_release(job);
+}
+
+static void *worker_main(void *arg) {
+  ArtScheduler *scheduler = (ArtScheduler *)arg;
+
+  pthread_mutex_lock(&scheduler->mutex);
+
+  while (true) {
+    while (scheduler->queue_size == 0 && !atomic_load(&scheduler->stopping)) {
+      pthread_cond_wait(&scheduler->work_available, &scheduler->mutex);
+    }
+
+    if (scheduler->queue_size == 0) {
+      break;
+    }
+
+    ArtJob *job = queue_pop(scheduler);
+    atomic_store(&job->state, JOB_RUNNING);
+    pthread_mutex_unlock(&scheduler->mutex);
+
+    AlbumArtOptions options = {.is_cancelled = &job_is_cancelled, .cancel_data = job};
+    complete_job(job, get_album_art_ex(job->file_path, job->rgb565_buffer, &options));
+
+    pthread_mutex_lock(&scheduler->mutex);
+  }
+
+  pthread_mutex_unlock(&scheduler->mutex);
+  return NULL;
+}
+
+ArtScheduler *art_scheduler_create(uint32_t worker_count) {
+
+  if (worker_count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+
+  ArtScheduler *scheduler = calloc(1, sizeof(ArtScheduler));
+
+  if (scheduler == NULL) {
+    return NULL;
+  }
+
+  scheduler->queue = malloc(INITIAL_QUEUE_CAPACITY * sizeof(ArtJob *));
+  scheduler->queue_capacity = INITIAL_QUEUE_CAPACITY;
+  scheduler->workers = malloc(worker_count * sizeof(pthread_t));
+
+  if (scheduler->queue == NULL || scheduler->workers == NULL) {
+    free(scheduler->queue);
+    free(scheduler->workers);
+    free(scheduler);
+    return NULL;
+  }
+
+  pthread_mutex_init(&scheduler->mutex, NULL);
+  pthread_cond_init(&scheduler->work_available, NULL);
+  atomic_init(&scheduler->stopping, false);
+
+  for (uint32_t i = 0; i < worker_count; i++) {
+    if (pthread_create(&scheduler->workers[i], NULL, &worker_main, scheduler) != 0) {
+      ART_DIAG_VALUES(ART_DIAG_WARNING, ART_DIAG_THREAD_FAILED, "could not start scheduler worker",
+                      NULL, i, 0);
+      break;
+    }
+    scheduler->worker_count++;
+  }
+
+  if (scheduler->worker_count == 0) {
+    art_scheduler_destroy(scheduler);
+    return NULL;
+  }
+
+  return scheduler;
+}
+
+void art_scheduler_destroy(ArtScheduler *scheduler) {
+
+  pthread_mutex_lock(&scheduler->mutex);
+
+  atomic_store(&scheduler->stopping, true);
+
+  ArtJob **pending = scheduler->queue;
+  size_t pending_count = scheduler->queue_size;
+
+  scheduler->queue = NULL;
+  scheduler->queue_size = 0;
+  scheduler->queue_capacity = 0;
+
+  for (size_t i = 0; i < pending_count; i++) {
+    atomic_store(&pending[i]->state, JOB_RUNNING);
+  }
+
+  pthread_cond_broadcast(&scheduler->work_available);
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  for (size_t i = 0; i < pending_count; i++) {
+    complete_job(pending[i], CANCELLED);
+  }
+  free(pending);
+
+  for (uint32_t i = 0; i < scheduler->worker_count; i++) {
+    pthread_join(scheduler->workers[i], NULL);
+  }
+
+  pthread_cond_destroy(&scheduler->work_available);
+  pthread_mutex_destroy(&scheduler->mutex);
+  free(scheduler->workers);
+  free(scheduler);
+}
+
+ArtJob *art_scheduler_submit(ArtScheduler *scheduler, const char *file_path,
+                             uint8_t *rgb565_buffer, int32_t priority, art_job_callback callback,
+                             void *user_data) {
+
+  ArtJob *job = calloc(1, sizeof(ArtJob));
+
+  if (job == NULL) {
+    return NULL;
+  }
+
+  job->file_path = strdup(file_path);
+
+  if (job->file_path == NULL) {
+    free(job);
+    return NULL;
+  }
+
+  job->scheduler = scheduler;
+  job->rgb565_buffer = rgb565_buffer;
+  job->callback = callback;
+  job->user_data = user_data;
+  job->priority = priority;
+  job->result = OK;
+
+  atomic_init(&job->state, JOB_QUEUED);
+  atomic_init(&job->cancelled, false);
+  // one reference for the caller, one for the scheduler until the job is done
+  atomic_init(&job->references, 2);
+
+  pthread_mutex_init(&job->mutex, NULL);
+  pthread_cond_init(&job->done, NULL);
+
+  pthread_mutex_lock(&scheduler->mutex);
+
+  job->sequence = scheduler->next_sequence++;
+
+  if (atomic_load(&scheduler->stopping) || !queue_push(scheduler, job)) {
+    pthread_mutex_unlock(&scheduler->mutex);
+    pthread_cond_destroy(&job->done);
+    pthread_mutex_destroy(&job->mutex);
+    free(job->file_path);
+    free(job);
+    return NULL;
+  }
+
+  pthread_cond_signal(&scheduler->work_available);
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  return job;
+}
+
+bool art_job_set_priority(ArtJob *job, int32_t priority) {
+
+  if (atomic_load(&job->state) != JOB_QUEUED) {
+    return false;
+  }
+
+  ArtScheduler *scheduler = job->scheduler;
+  bool queued = false;
+
+  pthread_mutex_lock(&scheduler->mutex);
+
+  if (atomic_load(&job->state) == JOB_QUEUED) {
+    job->priority = priority;
+    sift_up(scheduler, job->heap_index);
+    sift_down(scheduler, job->heap_index);
+    queued = true;
+  }
+
+  pthread_mutex_unlock(&scheduler->mutex);
+  return queued;
+}
+
+void art_job_cancel(ArtJob *job) {
+
+  atomic_store(&job->cancelled, true);
+
+  if (atomic_load(&job->state) != JOB_QUEUED) {
+    return;
+  }
+
+  ArtScheduler *scheduler = job->scheduler;
+  bool removed = false;
+
+  pthread_mutex_lock(&scheduler->mutex);
+
+  if (atomic_load(&job->state) == JOB_QUEUED) {
+    queue_remove(scheduler, job->heap_index);
+    atomic_store(&job->state, JOB_RUNNING);
+    removed = true;
+  }
+
+  pthread_mutex_unlock(&scheduler->mutex);
+
+  if (removed) {
+    complete_job(job, CANCELLED);
+  }
+}
+
+bool art_job_is_done(ArtJob *job) { return atomic_load(&job->state) == JOB_DONE; }
+
+IO_ERROR art_job_wait(ArtJob *job) {
+
+  if (atomic_load(&job->state) != JOB_DONE) {
+    pthread_mutex_lock(&job->mutex);
+
+    while (atomic_load(&job->state) != JOB_DONE) {
+      pthread_cond_wait(&job->done, &job->mutex);
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+  }
+
+  return job->result;
+}
+
+void art_job_release(ArtJob *job) {
+
+  if (atomic_fetch_sub(&job->references, 1) == 1) {
+    pthread_cond_destroy(&job->done);
+    pthread_mutex_destroy(&job->mutex);
+    free(job->file_path);
+    free(job);
+  }
+}
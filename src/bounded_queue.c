@@ -0,0 +1,248 @@
+#include "../include/bounded_queue.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define CACHE_LINE_SIZE 64
+
+// number of failed attempts that yield the CPU before the waiting thread parks on the condition
+#define YIELD_ATTEMPTS 64
+
+/**
+ * Every cell carries a sequence number that tells producers and consumers whether the cell is
+ * free for the current lap of the ring (see D. Vyukov's bounded MPMC queue).
+ */
+typedef struct {
+  atomic_size_t sequence;
+  void *value;
+} QueueCell;
+
+struct BoundedQueue {
+  QueueCell *cells;
+  size_t mask;
+
+  // producers and consumers update different cache lines
+  alignas(CACHE_LINE_SIZE) atomic_size_t enqueue_pos;
+  alignas(CACHE_LINE_SIZE) atomic_size_t dequeue_pos;
+  alignas(CACHE_LINE_SIZE) atomic_uint producers;
+
+  // threads parked in a blocking pop or push, the other side only takes the lock to wake them if
+  // there are any
+  alignas(CACHE_LINE_SIZE) atomic_uint pop_waiters;
+  atomic_uint push_waiters;
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+};
+
+BoundedQueue *bounded_queue_create(size_t capacity, uint32_t producers) {
+
+  size_t size = 2;
+  while (size < capacity) {
+    size *= 2;
+  }
+
+  BoundedQueue *queue = aligned_alloc(CACHE_LINE_SIZE, sizeof(BoundedQueue));
+
+  if (queue == NULL) {
+    return NULL;
+  }
+
+  queue->cells = malloc(size * sizeof(QueueCell));
+
+  if (queue->cells == NULL) {
+    free(queue);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    atomic_init(&queue->cells[i].sequence, i);
+    queue->cells[i].value = NULL;
+  }
+
+  queue->mask = size - 1;
+  atomic_init(&queue->enqueue_pos, 0);
+  atomic_init(&queue->dequeue_pos, 0);
+  atomic_init(&queue->producers, producers);
+  atomic_init(&queue->pop_waiters, 0);
+  atomic_init(&queue->push_waiters, 0);
+  pthread_mutex_init(&queue->lock, NULL);
+  pthread_cond_init(&queue->not_empty, NULL);
+  pthread_cond_init(&queue->not_full, NULL);
+
+  return queue;
+}
+
+void bounded_queue_destroy(BoundedQueue *queue) {
+  pthread_cond_destroy(&queue->not_full);
+  pthread_cond_destroy(&queue->not_empty);
+  pthread_mutex_destroy(&queue->lock);
+  free(queue->cells);
+  free(queue);
+}
+
+/**
+ * Wakes the threads parked on the condition if there are any. The fence orders the change the
+ * caller made to the queue before the look at the waiters, a waiter registers itself before it
+ * looks at the queue again, so one of the two always sees the other.
+ */
+static void wake(BoundedQueue *queue, atomic_uint *waiters, pthread_cond_t *condition) {
+
+  atomic_thread_fence(memory_order_seq_cst);
+
+  if (atomic_load_explicit(waiters, memory_order_relaxed) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  pthread_cond_broadcast(condition);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+static bool try_push(BoundedQueue *queue, void *value) {
+
+  size_t pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+  QueueCell *cell;
+
+  while (true) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->enqueue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // the consumers have not freed this cell yet, the queue is full
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->enqueue_pos, memory_order_relaxed);
+    }
+  }
+
+  cell->value = value;
+  atomic_store_explicit(&cell->sequence, pos + 1, memory_order_release);
+  return true;
+}
+
+static bool try_pop(BoundedQueue *queue, void **value) {
+
+  size_t pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+  QueueCell *cell;
+
+  while (true) {
+    cell = &queue->cells[pos & queue->mask];
+    size_t sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+    intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+
+    if (diff == 0) {
+      if (atomic_compare_exchange_weak_explicit(&queue->dequeue_pos, &pos, pos + 1,
+                                                memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (diff < 0) {
+      // nothing has been published in this cell yet, the queue is empty
+      return false;
+    } else {
+      pos = atomic_load_explicit(&queue->dequeue_pos, memory_order_relaxed);
+    }
+  }
+
+  *value = cell->value;
+  atomic_store_explicit(&cell->sequence, pos + queue->mask + 1, memory_order_release);
+  return true;
+}
+
+bool bounded_queue_try_push(BoundedQueue *queue, void *value) {
+
+  if (!try_push(queue, value)) {
+    return false;
+  }
+
+  wake(queue, &queue->pop_waiters, &queue->not_empty);
+  return true;
+}
+
+bool bounded_queue_try_pop(BoundedQueue *queue, void **value) {
+
+  if (!try_pop(queue, value)) {
+    return false;
+  }
+
+  wake(queue, &queue->push_waiters, &queue->not_full);
+  return true;
+}
+
+void bounded_queue_push(BoundedQueue *queue, void *value) {
+
+  for (uint32_t attempts = 0; attempts < YIELD_ATTEMPTS; attempts++) {
+    if (bounded_queue_try_push(queue, value)) {
+      return;
+    }
+    sched_yield();
+  }
+
+  // the queue stays full, park until a pop frees a cell
+  pthread_mutex_lock(&queue->lock);
+  atomic_fetch_add_explicit(&queue->push_waiters, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  while (!try_push(queue, value)) {
+    pthread_cond_wait(&queue->not_full, &queue->lock);
+  }
+
+  atomic_fetch_sub_explicit(&queue->push_waiters, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&queue->lock);
+
+  wake(queue, &queue->pop_waiters, &queue->not_empty);
+}
+
+bool bounded_queue_pop(BoundedQueue *queue, void **value) {
+
+  for (uint32_t attempts = 0; attempts < YIELD_ATTEMPTS; attempts++) {
+    if (bounded_queue_try_pop(queue, value)) {
+      return true;
+    }
+    if (atomic_load_explicit(&queue->producers, memory_order_acquire) == 0) {
+      // all pushes happened before the last producer_done, one more try drains them
+      return bounded_queue_try_pop(queue, value);
+    }
+    sched_yield();
+  }
+
+  // the queue stays empty, park until a push or the last producer_done
+  pthread_mutex_lock(&queue->lock);
+  atomic_fetch_add_explicit(&queue->pop_waiters, 1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+
+  bool result;
+
+  while (!(result = try_pop(queue, value))) {
+    if (atomic_load_explicit(&queue->producers, memory_order_acquire) == 0) {
+      result = try_pop(queue, value);
+      break;
+    }
+    pthread_cond_wait(&queue->not_empty, &queue->lock);
+  }
+
+  atomic_fetch_sub_explicit(&queue->pop_waiters, 1, memory_order_relaxed);
+  pthread_mutex_unlock(&queue->lock);
+
+  if (result) {
+    wake(queue, &queue->push_waiters, &queue->not_full);
+  }
+
+  return result;
+}
+
+void bounded_queue_producer_done(BoundedQueue *queue) {
+  atomic_fetch_sub_explicit(&queue->producers, 1, memory_order_release);
+
+  // parked pops have to see that no more values come
+  wake(queue, &queue->pop_waiters, &queue->not_empty);
+}
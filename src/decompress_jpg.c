@@ -1,51 +1,1116 @@
 
 #include "../include/decompress_jpg.h"
+#include "../include/art_diag.h"
+#include "../include/art_memory.h"
+#include "../include/image_decoder.h"
+#include "../include/jpeg_memory.h"
 
 // NOTE: jpeg-turbo does not inlcude stdio
 // clang-format off
 #include <stdio.h>
 #include <jpeglib.h>
+#include <jerror.h>
 // clang-format on
 
 #include <assert.h>
+#include <pthread.h>
+#include <setjmp.h>
 #include <stddef.h>
-#include <stdlib.h>
+#include <string.h>
+
+// denominator of the DCT scaling used for the coarse preview of baseline JPEGs
+#define JPEG_PREVIEW_SCALE_DENOM 8
+
+// first size of the output buffer of compress_rgb888_to_jpeg, it doubles from there
+#define JPEG_DESTINATION_INITIAL_SIZE (16 * 1024)
+
+// EXIF Orientation tag in the first IFD of the TIFF structure of an APP1 segment
+#define EXIF_ORIENTATION_TAG 0x0112
+#define EXIF_TYPE_SHORT 3
+
+static void report_jpeg_message(j_common_ptr info) {
+
+  char message[JMSG_LENGTH_MAX];
+  info->err->format_message(info, message);
+  ART_DIAG(ART_DIAG_DEBUG, ART_DIAG_DECODE_FAILED, "libjpeg message", message);
+}
+
+/**
+ * Error manager of every libjpeg object. Errors jump back to the setjmp of the function that
+ * created the object instead of exiting the process, which is what libjpeg's default does.
+ */
+typedef struct {
+  struct jpeg_error_mgr pub;
+  jmp_buf jump;
+} JpegError;
+
+static void report_jpeg_error(j_common_ptr info) {
+
+  char message[JMSG_LENGTH_MAX];
+  info->err->format_message(info, message);
+
+  ArtDiagCode code = info->err->msg_code == JERR_OUT_OF_MEMORY ? ART_DIAG_ALLOC_FAILED
+                     : info->is_decompressor                   ? ART_DIAG_DECODE_FAILED
+                                                               : ART_DIAG_ENCODE_FAILED;
+  ART_DIAG(ART_DIAG_ERROR, code, "libjpeg error", message);
+
+  longjmp(((JpegError *)info->err)->jump, 1);
+}
+
+/**
+ * jpeg_std_error with errors returning through err->jump, and the warnings and traces of libjpeg
+ * reported to art_diag instead of stderr. Set the jump before creating the object.
+ */
+static struct jpeg_error_mgr *diag_std_error(JpegError *err) {
+  jpeg_std_error(&err->pub);
+  err->pub.error_exit = &report_jpeg_error;
+  err->pub.output_message = &report_jpeg_message;
+  return &err->pub;
+}
+
+/**
+ * Row buffer that lives in the image pool of the decompressor, so it is freed with the object also
+ * when an error jumps out of the decode.
+ */
+static JSAMPROW alloc_row(struct jpeg_decompress_struct *info) {
+  return (JSAMPROW)info->mem->alloc_large((j_common_ptr)info, JPOOL_IMAGE,
+                                           (size_t)info->output_width * 3);
+}
+
+static uint32_t read_tiff16(const uint8_t *data, bool little_endian) {
+  return little_endian ? ((uint32_t)data[1] << 8) | data[0] : ((uint32_t)data[0] << 8) | data[1];
+}
+
+static uint32_t read_tiff32(const uint8_t *data, bool little_endian) {
+  return little_endian ? read_tiff16(data + 2, true) << 16 | read_tiff16(data, true)
+                       : read_tiff16(data, false) << 16 | read_tiff16(data + 2, false);
+}
+
+/**
+ * Orientation tag of the payload of an APP1 segment ("Exif\0\0" followed by a TIFF header),
+ * ORIENTATION_UNTAGGED if the segment holds none or is malformed. Only the first IFD is read,
+ * which is where cameras put the tag.
+ */
+static Orientation exif_orientation(const uint8_t *segment, uint32_t length) {
+
+  if (length < 14 || memcmp(segment, "Exif\0\0", 6) != 0) {
+    return ORIENTATION_UNTAGGED;
+  }
+
+  const uint8_t *tiff = segment + 6;
+  const uint32_t size = length - 6;
+  const bool little_endian = tiff[0] == 'I' && tiff[1] == 'I';
+
+  if ((!little_endian && (tiff[0] != 'M' || tiff[1] != 'M')) ||
+      read_tiff16(tiff + 2, little_endian) != 42) {
+    return ORIENTATION_UNTAGGED;
+  }
+
+  const uint32_t ifd = read_tiff32(tiff + 4, little_endian);
+
+  if (ifd < 8 || ifd > size - 2) {
+    return ORIENTATION_UNTAGGED;
+  }
+
+  const uint32_t entry_count = read_tiff16(tiff + ifd, little_endian);
+
+  for (uint32_t i = 0; i < entry_count && ifd + 2 + (i + 1) * 12 <= size; i++) {
+    const uint8_t *entry = tiff + ifd + 2 + i * 12;
+
+    if (read_tiff16(entry, little_endian) != EXIF_ORIENTATION_TAG) {
+      continue;
+    }
+
+    // a single SHORT sits in the first two bytes of the value field
+    const uint32_t value = read_tiff16(entry + 8, little_endian);
+
+    if (read_tiff16(entry + 2, little_endian) != EXIF_TYPE_SHORT || value < ORIENTATION_NORMAL ||
+        value > ORIENTATION_ROTATE_270) {
+      return ORIENTATION_UNTAGGED;
+    }
+
+    return (Orientation)value;
+  }
+
+  return ORIENTATION_UNTAGGED;
+}
+
+/**
+ * Makes jpeg_read_header keep the APP1 segments for saved_orientation.
+ */
+static void save_exif_markers(struct jpeg_decompress_struct *info) {
+  jpeg_save_markers(info, JPEG_APP0 + 1, 0xFFFF);
+}
+
+static Orientation saved_orientation(struct jpeg_decompress_struct *info) {
+
+  for (jpeg_saved_marker_ptr marker = info->marker_list; marker != NULL; marker = marker->next) {
+    if (marker->marker == JPEG_APP0 + 1) {
+      Orientation orientation = exif_orientation(marker->data, marker->data_length);
+
+      if (orientation != ORIENTATION_UNTAGGED) {
+        return orientation;
+      }
+    }
+  }
+
+  return ORIENTATION_UNTAGGED;
+}
+
+static bool allocate_output_image(struct jpeg_decompress_struct *info, Image *rgb888_image) {
+
+  assert(info->output_components == 3);
+
+  rgb888_image->img_width = info->output_width;
+  rgb888_image->img_height = info->output_height;
+  rgb888_image->format = IMAGE_RGB888;
+  rgb888_image->length = (size_t)rgb888_image->img_width * rgb888_image->img_height * 3;
+  rgb888_image->orientation = saved_orientation(info);
+  rgb888_image->buffer = art_malloc(rgb888_image->length);
+
+  return rgb888_image->buffer != NULL;
+}
+
+static void read_rgb888_scanlines(struct jpeg_decompress_struct *info, Image *rgb888_image) {
+
+  JSAMPROW row_pointer;
+  size_t row_stride = (size_t)info->output_width * 3;
+
+  while (info->output_scanline < info->output_height) {
+    row_pointer = rgb888_image->buffer + (info->output_scanline * row_stride);
+    jpeg_read_scanlines(info, &row_pointer, 1);
+  }
+}
 
 bool convert_jpeg_to_rgb888(const uint8_t *image_buffer, uint32_t size, Image *rgb888_image) {
 
   struct jpeg_decompress_struct info;
-  struct jpeg_error_mgr err;
+  JpegError err;
+
+  info.err = diag_std_error(&err);
+  rgb888_image->buffer = NULL;
 
-  info.err = jpeg_std_error(&err);
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&info);
+    art_free(rgb888_image->buffer);
+    rgb888_image->buffer = NULL;
+    return false;
+  }
 
   jpeg_create_decompress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
 
   jpeg_mem_src(&info, image_buffer, size);
+  save_exif_markers(&info);
   jpeg_read_header(&info, true);
 
   info.out_color_space = JCS_EXT_RGB;
 
   jpeg_start_decompress(&info);
 
-  assert(info.output_components == 3);
+  if (!allocate_output_image(&info, rgb888_image)) {
+    jpeg_destroy_decompress(&info);
+    return false;
+  }
 
-  rgb888_image->img_width = info.output_width;
-  rgb888_image->img_height = info.output_height;
-  rgb888_image->length = rgb888_image->img_width * rgb888_image->img_height * 3;
+  read_rgb888_scanlines(&info, rgb888_image);
 
-  uint8_t *rgb888_buffer = malloc(rgb888_image->length);
+  jpeg_finish_decompress(&info);
+  jpeg_destroy_decompress(&info);
+  return true;
+}
 
-  rgb888_image->buffer = rgb888_buffer;
+/**
+ * Buffered-image mode: the DC scans are absorbed and emitted as the coarse pass, the final pass
+ * refines the same buffer once all scans are in. The coefficients are only entropy decoded once.
+ */
+static bool decode_progressive_passes(struct jpeg_decompress_struct *info, Image *rgb888_image,
+                                      rgb888_pass_callback callback, void *user_data) {
 
-  JSAMPROW row_pointer;
-  int row_stride = info.output_width * 3;
+  info->buffered_image = true;
+  jpeg_start_decompress(info);
+
+  if (!allocate_output_image(info, rgb888_image)) {
+    return false;
+  }
+
+  // absorb scans until the first AC scan shows up, the header of that scan has been read already
+  int status;
+  do {
+    status = jpeg_consume_input(info);
+  } while (status != JPEG_SUSPENDED && status != JPEG_REACHED_EOI &&
+           !(status == JPEG_REACHED_SOS && info->Ss != 0));
+
+  int coarse_scan = info->input_scan_number;
+  if (status == JPEG_REACHED_SOS && coarse_scan > 1) {
+    coarse_scan--;
+  }
+
+  jpeg_start_output(info, coarse_scan);
+  read_rgb888_scanlines(info, rgb888_image);
+  jpeg_finish_output(info);
+
+  if (!callback(rgb888_image, false, user_data)) {
+    jpeg_abort_decompress(info);
+    return true;
+  }
+
+  while (!jpeg_input_complete(info)) {
+    status = jpeg_consume_input(info);
+
+    if (status == JPEG_SUSPENDED || status == JPEG_REACHED_EOI) {
+      break;
+    }
+  }
+
+  jpeg_start_output(info, info->input_scan_number);
+  read_rgb888_scanlines(info, rgb888_image);
+  jpeg_finish_output(info);
+  jpeg_finish_decompress(info);
+
+  callback(rgb888_image, true, user_data);
+  return true;
+}
+
+/**
+ * Baseline JPEGs are decoded twice: first with 1/8 DCT scaling (which skips most of the IDCT work)
+ * and then at full resolution. coarse_image is held by the caller, which frees it if decoding
+ * fails.
+ */
+static bool decode_scaled_then_full(struct jpeg_decompress_struct *info,
+                                    const uint8_t *image_buffer, uint32_t size,
+                                    Image *coarse_image, Image *rgb888_image,
+                                    rgb888_pass_callback callback, void *user_data) {
+
+  info->scale_num = 1;
+  info->scale_denom = JPEG_PREVIEW_SCALE_DENOM;
+  jpeg_start_decompress(info);
+
+  if (!allocate_output_image(info, coarse_image)) {
+    return false;
+  }
+
+  read_rgb888_scanlines(info, coarse_image);
+  jpeg_finish_decompress(info);
+
+  bool keep_going = callback(coarse_image, false, user_data);
+  art_free(coarse_image->buffer);
+  coarse_image->buffer = NULL;
+
+  if (!keep_going) {
+    return true;
+  }
+
+  // the decompressor is back in its initial state and can be reused for the full decode
+  jpeg_mem_src(info, image_buffer, size);
+  jpeg_read_header(info, true);
+
+  info->out_color_space = JCS_EXT_RGB;
+
+  jpeg_start_decompress(info);
+
+  if (!allocate_output_image(info, rgb888_image)) {
+    return false;
+  }
+
+  read_rgb888_scanlines(info, rgb888_image);
+  jpeg_finish_decompress(info);
+
+  callback(rgb888_image, true, user_data);
+  return true;
+}
+
+bool convert_jpeg_to_rgb888_preview(const uint8_t *image_buffer, uint32_t size,
+                                    rgb888_pass_callback callback, void *user_data) {
+
+  struct jpeg_decompress_struct info;
+  JpegError err;
+
+  Image coarse_storage = {.img_width = 0, .img_height = 0, .buffer = NULL, .length = 0};
+  Image rgb888_storage = {.img_width = 0, .img_height = 0, .buffer = NULL, .length = 0};
+
+  // modified after setjmp, must not live in registers
+  Image *volatile coarse_image = &coarse_storage;
+  Image *volatile rgb888_image = &rgb888_storage;
+
+  info.err = diag_std_error(&err);
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&info);
+    art_free(coarse_image->buffer);
+    art_free(rgb888_image->buffer);
+    return false;
+  }
+
+  jpeg_create_decompress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
+
+  jpeg_mem_src(&info, image_buffer, size);
+  save_exif_markers(&info);
+  jpeg_read_header(&info, true);
+
+  info.out_color_space = JCS_EXT_RGB;
+
+  bool result;
+
+  if (jpeg_has_multiple_scans(&info)) {
+    result = decode_progressive_passes(&info, rgb888_image, callback, user_data);
+  } else {
+    result = decode_scaled_then_full(&info, image_buffer, size, coarse_image, rgb888_image,
+                                     callback, user_data);
+  }
+
+  art_free(rgb888_image->buffer);
+  jpeg_destroy_decompress(&info);
+  return result;
+}
+
+/**
+ * Marker layout of a single-scan baseline JPEG with restart markers.
+ *
+ * header_size:         bytes up to and including the SOS segment
+ * sof_height_offset:   offset of the image height in the SOF segment
+ * segment_starts:      offset of the entropy coded data of every restart segment
+ * segment_ends:        offset one past the entropy coded data of every restart segment
+ * rows_per_segment:    output rows covered by one full restart segment
+ * orientation:         EXIF orientation found in an APP1 segment of the header
+ */
+typedef struct {
+  const uint8_t *data;
+  uint32_t header_size;
+  uint32_t sof_height_offset;
+  uint32_t width;
+  uint32_t height;
+
+  uint32_t *segment_starts;
+  uint32_t *segment_ends;
+  uint32_t segment_count;
+  uint32_t rows_per_segment;
+  Orientation orientation;
+} RestartLayout;
+
+/**
+ * One band of output rows, decoded from its own restart segments.
+ *
+ * jpeg/jpeg_size:  synthetic JPEG holding the band's segments plus one neighbouring segment above
+ *                  and below, so upsampling at the band edges sees the same context as a serial
+ *                  decode
+ * skip_rows:       rows of the synthetic JPEG above the band
+ */
+typedef struct {
+  uint8_t *jpeg;
+  uint32_t jpeg_size;
+  uint32_t skip_rows;
+  uint32_t first_row;
+  uint32_t row_count;
+  Image *rgb888_image;
+  bool result;
+  ArtMemory *memory;
+  ArtMemoryStats memory_stats;
+} JpegBand;
+
+static uint32_t read_be16(const uint8_t *data) { return ((uint32_t)data[0] << 8) | data[1]; }
+
+static bool append_segment(RestartLayout *layout, uint32_t *capacity, uint32_t start,
+                           uint32_t end) {
+
+  if (layout->segment_count == *capacity) {
+    uint32_t new_capacity = *capacity > 0 ? *capacity * 2 : 64;
+    uint32_t *starts = art_realloc(layout->segment_starts, new_capacity * sizeof(uint32_t));
+
+    if (starts == NULL) {
+      return false;
+    }
+    layout->segment_starts = starts;
+
+    uint32_t *ends = art_realloc(layout->segment_ends, new_capacity * sizeof(uint32_t));
+
+    if (ends == NULL) {
+      return false;
+    }
+    layout->segment_ends = ends;
+    *capacity = new_capacity;
+  }
+
+  layout->segment_starts[layout->segment_count] = start;
+  layout->segment_ends[layout->segment_count] = end;
+  layout->segment_count++;
+  return true;
+}
+
+/**
+ * Parses the markers up to the scan and splits the entropy coded data at the RST markers.
+ * Only files where every restart interval covers whole MCU rows can be split into row bands.
+ */
+static bool parse_restart_layout(const uint8_t *data, uint32_t size, RestartLayout *layout) {
+
+  *layout = (RestartLayout){.data = data};
+
+  if (size < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+    return false;
+  }
+
+  uint32_t pos = 2;
+  uint32_t restart_interval = 0;
+  uint32_t components = 0;
+  uint32_t max_h = 1;
+  uint32_t max_v = 1;
+  bool have_sof = false;
+
+  while (layout->header_size == 0) {
+    // skip fill bytes
+    while (pos < size && data[pos] == 0xFF && pos + 1 < size && data[pos + 1] == 0xFF) {
+      pos++;
+    }
+
+    if (pos + 4 > size || data[pos] != 0xFF) {
+      return false;
+    }
+
+    uint8_t marker = data[pos + 1];
+    uint32_t length = read_be16(data + pos + 2);
+
+    if (length < 2 || pos + 2 + length > size) {
+      return false;
+    }
+
+    const uint8_t *segment = data + pos + 4;
+
+    if (marker == 0xC0 || marker == 0xC1) {
+      if (length < 8) {
+        return false;
+      }
+
+      layout->sof_height_offset = pos + 5;
+      layout->height = read_be16(segment + 1);
+      layout->width = read_be16(segment + 3);
+      components = segment[5];
+
+      if (length < 8 + 3 * components) {
+        return false;
+      }
+
+      for (uint32_t i = 0; i < components; i++) {
+        uint32_t h = segment[7 + 3 * i] >> 4;
+        uint32_t v = segment[7 + 3 * i] & 0x0F;
+        max_h = h > max_h ? h : max_h;
+        max_v = v > max_v ? v : max_v;
+      }
+
+      have_sof = true;
+    } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 &&
+               marker != 0xCC) {
+      // progressive, lossless and arithmetic coded files are decoded serially
+      return false;
+    } else if (marker == 0xE1 && layout->orientation == ORIENTATION_UNTAGGED) {
+      layout->orientation = exif_orientation(segment, length - 2);
+    } else if (marker == 0xDD) {
+      if (length < 4) {
+        return false;
+      }
+      restart_interval = read_be16(segment);
+    } else if (marker == 0xDA) {
+      // the scan has to contain every component, otherwise there are more scans to come
+      if (!have_sof || segment[0] != components) {
+        return false;
+      }
+      layout->header_size = pos + 2 + length;
+    }
+
+    pos += 2 + length;
+  }
+
+  if (restart_interval == 0 || layout->height == 0 || layout->width == 0) {
+    return false;
+  }
+
+  // a single component scan is not interleaved and has 8x8 MCUs
+  uint32_t mcu_width = components == 1 ? 8 : 8 * max_h;
+  uint32_t mcu_height = components == 1 ? 8 : 8 * max_v;
+  uint32_t mcus_per_row = (layout->width + mcu_width - 1) / mcu_width;
+  uint32_t mcu_rows = (layout->height + mcu_height - 1) / mcu_height;
+
+  if (restart_interval % mcus_per_row != 0) {
+    return false;
+  }
+
+  layout->rows_per_segment = restart_interval / mcus_per_row * mcu_height;
+
+  uint32_t capacity = 0;
+  uint32_t segment_start = layout->header_size;
+  pos = layout->header_size;
+
+  while (pos + 1 < size) {
+    if (data[pos] != 0xFF || data[pos + 1] == 0x00 || data[pos + 1] == 0xFF) {
+      pos++;
+      continue;
+    }
+
+    uint8_t marker = data[pos + 1];
+
+    if (marker < 0xD0 || marker > 0xD7) {
+      break;
+    }
+
+    if (!append_segment(layout, &capacity, segment_start, pos)) {
+      return false;
+    }
+
+    pos += 2;
+    segment_start = pos;
+  }
+
+  if (!append_segment(layout, &capacity, segment_start, pos)) {
+    return false;
+  }
+
+  uint32_t mcu_rows_per_segment = restart_interval / mcus_per_row;
+  return layout->segment_count == (mcu_rows + mcu_rows_per_segment - 1) / mcu_rows_per_segment;
+}
+
+static void free_restart_layout(RestartLayout *layout) {
+  art_free(layout->segment_starts);
+  art_free(layout->segment_ends);
+}
+
+/**
+ * Builds a JPEG of the segments [first, last) with the height patched to the rows they cover and
+ * the RST markers renumbered from RST0.
+ */
+static uint8_t *build_band_jpeg(const RestartLayout *layout, uint32_t first, uint32_t last,
+                                uint32_t *jpeg_size) {
+
+  size_t size = layout->header_size + 2;
+
+  for (uint32_t i = first; i < last; i++) {
+    size += layout->segment_ends[i] - layout->segment_starts[i] + 2;
+  }
+
+  uint8_t *jpeg = art_malloc(size);
+
+  if (jpeg == NULL) {
+    return NULL;
+  }
+
+  uint32_t first_row = first * layout->rows_per_segment;
+  uint32_t rows = (last - first) * layout->rows_per_segment;
+
+  if (first_row + rows > layout->height) {
+    rows = layout->height - first_row;
+  }
+
+  memcpy(jpeg, layout->data, layout->header_size);
+  jpeg[layout->sof_height_offset] = rows >> 8;
+  jpeg[layout->sof_height_offset + 1] = rows & 0xFF;
+
+  size_t pos = layout->header_size;
+
+  for (uint32_t i = first; i < last; i++) {
+    if (i > first) {
+      jpeg[pos++] = 0xFF;
+      jpeg[pos++] = 0xD0 + ((i - first - 1) & 7);
+    }
+
+    uint32_t length = layout->segment_ends[i] - layout->segment_starts[i];
+    memcpy(jpeg + pos, layout->data + layout->segment_starts[i], length);
+    pos += length;
+  }
+
+  jpeg[pos++] = 0xFF;
+  jpeg[pos++] = 0xD9;
+
+  *jpeg_size = pos;
+  return jpeg;
+}
 
-  for (int y = 0; y < info.output_height; y++) {
-    row_pointer = rgb888_buffer + (y * row_stride);
+/**
+ * Leaves band->result false if the band could not be decoded, an error of libjpeg only ends the
+ * thread's own decode.
+ */
+static void decode_band_rows(JpegBand *band) {
+
+  struct jpeg_decompress_struct info;
+  JpegError err;
+
+  info.err = diag_std_error(&err);
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&info);
+    return;
+  }
+
+  jpeg_create_decompress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
+
+  jpeg_mem_src(&info, band->jpeg, band->jpeg_size);
+  jpeg_read_header(&info, true);
+
+  info.out_color_space = JCS_EXT_RGB;
+
+  jpeg_start_decompress(&info);
+
+  size_t row_stride = (size_t)band->rgb888_image->img_width * 3;
+  JSAMPROW skipped_row = alloc_row(&info);
+
+  uint32_t end_row = band->skip_rows + band->row_count;
+
+  while (info.output_scanline < end_row) {
+    uint32_t row = info.output_scanline;
+    JSAMPROW row_pointer =
+        row < band->skip_rows
+            ? skipped_row
+            : band->rgb888_image->buffer + (band->first_row + row - band->skip_rows) * row_stride;
     jpeg_read_scanlines(&info, &row_pointer, 1);
   }
 
-  jpeg_finish_decompress(&info);
+  // the rows of the segment below only provided context
+  jpeg_abort_decompress(&info);
   jpeg_destroy_decompress(&info);
+
+  band->result = true;
+}
+
+/**
+ * Decodes the band in an allocation scope of the caller's context. On the calling thread the scope
+ * nests in the caller's, band threads hand their statistics back through memory_stats.
+ */
+static void *decode_band(void *arg) {
+
+  JpegBand *band = (JpegBand *)arg;
+  ArtMemoryScope scope;
+
+  if (band->memory != NULL) {
+    art_memory_scope_enter(&scope, band->memory);
+  }
+
+  decode_band_rows(band);
+
+  if (band->memory != NULL) {
+    art_memory_scope_leave(&scope);
+    band->memory_stats = scope.stats;
+  }
+
+  return NULL;
+}
+
+bool convert_jpeg_to_rgb888_parallel(const uint8_t *image_buffer, uint32_t size,
+                                     Image *rgb888_image, uint32_t threads) {
+
+  RestartLayout layout;
+
+  if (threads < 2 || !parse_restart_layout(image_buffer, size, &layout) ||
+      layout.segment_count < 2) {
+    if (threads >= 2) {
+      free_restart_layout(&layout);
+    }
+    return convert_jpeg_to_rgb888(image_buffer, size, rgb888_image);
+  }
+
+  uint32_t band_count = threads < layout.segment_count ? threads : layout.segment_count;
+
+  rgb888_image->img_width = layout.width;
+  rgb888_image->img_height = layout.height;
+  rgb888_image->format = IMAGE_RGB888;
+  rgb888_image->orientation = layout.orientation;
+  rgb888_image->length = (size_t)rgb888_image->img_width * rgb888_image->img_height * 3;
+  rgb888_image->buffer = art_malloc(rgb888_image->length);
+
+  JpegBand *bands = art_calloc(band_count, sizeof(JpegBand));
+  pthread_t *band_threads = art_calloc(band_count, sizeof(pthread_t));
+  bool *started = art_calloc(band_count, sizeof(bool));
+  bool result = rgb888_image->buffer != NULL && bands != NULL && band_threads != NULL &&
+                started != NULL;
+
+  for (uint32_t i = 0; result && i < band_count; i++) {
+    uint32_t first = layout.segment_count * i / band_count;
+    uint32_t last = layout.segment_count * (i + 1) / band_count;
+    uint32_t context_first = first > 0 ? first - 1 : 0;
+    uint32_t context_last = last < layout.segment_count ? last + 1 : last;
+
+    JpegBand *band = &bands[i];
+    band->jpeg = build_band_jpeg(&layout, context_first, context_last, &band->jpeg_size);
+    band->skip_rows = (first - context_first) * layout.rows_per_segment;
+    band->first_row = first * layout.rows_per_segment;
+    band->row_count = last * layout.rows_per_segment - band->first_row;
+    band->rgb888_image = rgb888_image;
+    band->memory = art_memory_current();
+
+    if (band->first_row + band->row_count > layout.height) {
+      band->row_count = layout.height - band->first_row;
+    }
+
+    if (band->jpeg == NULL) {
+      result = false;
+      break;
+    }
+
+    // the last band is decoded on the calling thread
+    if (i + 1 < band_count) {
+      started[i] = pthread_create(&band_threads[i], NULL, &decode_band, band) == 0;
+      if (!started[i]) {
+        decode_band(band);
+      }
+    } else {
+      decode_band(band);
+    }
+  }
+
+  // the band threads ran at the same time, their peaks add up
+  ArtMemoryStats thread_stats = {0};
+
+  for (uint32_t i = 0; bands != NULL && started != NULL && i < band_count; i++) {
+    if (started[i]) {
+      pthread_join(band_threads[i], NULL);
+      thread_stats.peak_bytes += bands[i].memory_stats.peak_bytes;
+      thread_stats.allocations += bands[i].memory_stats.allocations;
+    }
+    result = result && bands[i].result;
+    art_free(bands[i].jpeg);
+  }
+
+  art_memory_scope_merge(&thread_stats);
+
+  if (bands != NULL && started == NULL) {
+    result = false;
+  }
+
+  art_free(bands);
+  art_free(band_threads);
+  art_free(started);
+  free_restart_layout(&layout);
+
+  if (!result) {
+    art_free(rgb888_image->buffer);
+    rgb888_image->buffer = NULL;
+    rgb888_image->length = 0;
+  }
+
+  return result;
+}
+
+bool jpeg_is_baseline(const uint8_t *image_buffer, uint32_t size, Orientation *orientation) {
+
+  *orientation = ORIENTATION_UNTAGGED;
+
+  if (size < 4 || image_buffer[0] != 0xFF || image_buffer[1] != 0xD8) {
+    return false;
+  }
+
+  uint32_t pos = 2;
+  bool baseline = false;
+
+  while (true) {
+    // skip fill bytes
+    while (pos + 1 < size && image_buffer[pos] == 0xFF && image_buffer[pos + 1] == 0xFF) {
+      pos++;
+    }
+
+    if (pos + 4 > size || image_buffer[pos] != 0xFF) {
+      return false;
+    }
+
+    uint8_t marker = image_buffer[pos + 1];
+    uint32_t length = read_be16(image_buffer + pos + 2);
+
+    if (length < 2 || pos + 2 + length > size) {
+      return false;
+    }
+
+    const uint8_t *segment = image_buffer + pos + 4;
+
+    if (marker == 0xC0) {
+      // 8 bit precision, grayscale or YCbCr
+      baseline = length >= 8 && segment[0] == 8 && (segment[5] == 1 || segment[5] == 3);
+    } else if (marker >= 0xC1 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 &&
+               marker != 0xCC) {
+      // extended, progressive, lossless and arithmetic coded files
+      return false;
+    } else if (marker == 0xE1 && *orientation == ORIENTATION_UNTAGGED) {
+      *orientation = exif_orientation(segment, length - 2);
+    } else if (marker == 0xDA) {
+      return baseline;
+    }
+
+    pos += 2 + length;
+  }
+}
+
+/**
+ * Destination collecting the compressed data in a buffer of art_malloc that doubles when it is
+ * full. jpeg_mem_dest would allocate it with malloc, outside of the allocator of the call.
+ */
+typedef struct {
+  struct jpeg_destination_mgr pub;
+  uint8_t *buffer;
+  size_t capacity;
+} JpegDestination;
+
+static void init_destination(j_compress_ptr info) {
+
+  JpegDestination *destination = (JpegDestination *)info->dest;
+  destination->buffer = art_malloc(JPEG_DESTINATION_INITIAL_SIZE);
+
+  if (destination->buffer == NULL) {
+    ERREXIT1(info, JERR_OUT_OF_MEMORY, 0);
+  }
+
+  destination->capacity = JPEG_DESTINATION_INITIAL_SIZE;
+  destination->pub.next_output_byte = destination->buffer;
+  destination->pub.free_in_buffer = destination->capacity;
+}
+
+static boolean grow_destination(j_compress_ptr info) {
+
+  JpegDestination *destination = (JpegDestination *)info->dest;
+  uint8_t *buffer = art_realloc(destination->buffer, destination->capacity * 2);
+
+  // the old buffer stays with the destination and is freed by the caller
+  if (buffer == NULL) {
+    ERREXIT1(info, JERR_OUT_OF_MEMORY, 1);
+  }
+
+  destination->pub.next_output_byte = buffer + destination->capacity;
+  destination->pub.free_in_buffer = destination->capacity;
+  destination->buffer = buffer;
+  destination->capacity *= 2;
   return true;
 }
+
+static void term_destination(j_compress_ptr info) { (void)info; }
+
+bool compress_rgb888_to_jpeg(const Image *rgb888_image, int quality, uint8_t **jpeg,
+                             size_t *jpeg_size) {
+
+  struct jpeg_compress_struct info;
+  JpegError err;
+
+  JpegDestination storage = {.pub = {.init_destination = &init_destination,
+                                     .empty_output_buffer = &grow_destination,
+                                     .term_destination = &term_destination},
+                             .buffer = NULL,
+                             .capacity = 0};
+
+  // modified after setjmp, must not live in registers
+  JpegDestination *volatile destination = &storage;
+
+  info.err = diag_std_error(&err);
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_compress(&info);
+    art_free(destination->buffer);
+    return false;
+  }
+
+  jpeg_create_compress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
+
+  info.dest = &destination->pub;
+
+  info.image_width = rgb888_image->img_width;
+  info.image_height = rgb888_image->img_height;
+  info.input_components = 3;
+  info.in_color_space = JCS_RGB;
+
+  // jpeg_set_defaults writes a sequential huffman coded (baseline) file
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, quality, true);
+  info.optimize_coding = true;
+
+  jpeg_start_compress(&info, true);
+
+  const size_t stride = image_stride(rgb888_image, 3);
+
+  while (info.next_scanline < info.image_height) {
+    JSAMPROW row = rgb888_image->buffer + info.next_scanline * stride;
+    jpeg_write_scanlines(&info, &row, 1);
+  }
+
+  jpeg_finish_compress(&info);
+  jpeg_destroy_compress(&info);
+
+  *jpeg = destination->buffer;
+  *jpeg_size = destination->capacity - destination->pub.free_in_buffer;
+  return true;
+}
+
+static bool libjpeg_probe(const uint8_t *data, uint32_t size) {
+  return size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+}
+
+static bool libjpeg_read_header(const uint8_t *data, uint32_t size, uint32_t *width,
+                                uint32_t *height) {
+
+  struct jpeg_decompress_struct info;
+  JpegError err;
+
+  info.err = diag_std_error(&err);
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&info);
+    return false;
+  }
+
+  jpeg_create_decompress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
+
+  jpeg_mem_src(&info, data, size);
+  jpeg_read_header(&info, true);
+
+  *width = info.image_width;
+  *height = info.image_height;
+
+  jpeg_destroy_decompress(&info);
+  return true;
+}
+
+/**
+ * Single scan JPEGs are decoded an MCU row at a time, the coefficients of progressive and other
+ * multi scan files are buffered for the whole image. Unreadable headers count as buffered.
+ */
+static bool libjpeg_scales_in_rows(const uint8_t *data, uint32_t size) {
+
+  struct jpeg_decompress_struct info;
+  JpegError err;
+
+  info.err = diag_std_error(&err);
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&info);
+    return false;
+  }
+
+  jpeg_create_decompress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
+
+  jpeg_mem_src(&info, data, size);
+  jpeg_read_header(&info, true);
+
+  bool in_rows = !jpeg_has_multiple_scans(&info);
+
+  jpeg_destroy_decompress(&info);
+  return in_rows;
+}
+
+static bool libjpeg_decode(const uint8_t *data, uint32_t size, Image *rgb888_image,
+                           uint32_t threads) {
+  return convert_jpeg_to_rgb888_parallel(data, size, rgb888_image, threads);
+}
+
+static bool libjpeg_decode_rows(const uint8_t *data, uint32_t size, rgb888_row_callback on_row,
+                                void *user_data) {
+
+  struct jpeg_decompress_struct info;
+  JpegError err;
+
+  info.err = diag_std_error(&err);
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&info);
+    return false;
+  }
+
+  jpeg_create_decompress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
+
+  jpeg_mem_src(&info, data, size);
+  jpeg_read_header(&info, true);
+
+  info.out_color_space = JCS_EXT_RGB;
+
+  jpeg_start_decompress(&info);
+
+  JSAMPROW row = alloc_row(&info);
+
+  while (info.output_scanline < info.output_height) {
+    uint32_t y = info.output_scanline;
+    jpeg_read_scanlines(&info, &row, 1);
+
+    if (!on_row(row, y, user_data)) {
+      break;
+    }
+  }
+
+  if (info.output_scanline < info.output_height) {
+    jpeg_abort_decompress(&info);
+  } else {
+    jpeg_finish_decompress(&info);
+  }
+
+  jpeg_destroy_decompress(&info);
+  return true;
+}
+
+/**
+ * Lets the IDCT produce the smallest multiple of 1/8 of the image that still covers the target, so
+ * large covers skip most of the IDCT and color conversion work. The rows are then area averaged
+ * down to the target size.
+ */
+static bool libjpeg_decode_scaled(const uint8_t *data, uint32_t size, Image *rgb888_scaled) {
+
+  struct jpeg_decompress_struct info;
+  JpegError err;
+
+  // freeing a sink that was never initialised is a no-op
+  ScaledRowSink sink = {.full = {.buffer = NULL}};
+
+  info.err = diag_std_error(&err);
+
+  if (setjmp(err.jump)) {
+    jpeg_destroy_decompress(&info);
+    scaled_row_sink_free(&sink);
+    return false;
+  }
+
+  jpeg_create_decompress(&info);
+  jpeg_memory_install((j_common_ptr)&info);
+
+  jpeg_mem_src(&info, data, size);
+  save_exif_markers(&info);
+  jpeg_read_header(&info, true);
+
+  info.out_color_space = JCS_EXT_RGB;
+  info.scale_denom = 8;
+
+  for (info.scale_num = 1; info.scale_num < 8; info.scale_num++) {
+    jpeg_calc_output_dimensions(&info);
+
+    if (info.output_width >= rgb888_scaled->img_width &&
+        info.output_height >= rgb888_scaled->img_height) {
+      break;
+    }
+  }
+
+  jpeg_start_decompress(&info);
+
+  if (!scaled_row_sink_init(&sink, info.output_width, info.output_height, rgb888_scaled)) {
+    jpeg_destroy_decompress(&info);
+    scaled_row_sink_free(&sink);
+    return false;
+  }
+
+  sink.full.orientation = saved_orientation(&info);
+  sink.downscaler.orientation = sink.full.orientation;
+
+  JSAMPROW row = alloc_row(&info);
+
+  while (info.output_scanline < info.output_height) {
+    jpeg_read_scanlines(&info, &row, 1);
+    scaled_row_sink_push(&sink, row);
+  }
+
+  jpeg_finish_decompress(&info);
+  jpeg_destroy_decompress(&info);
+
+  return scaled_row_sink_finish(&sink);
+}
+
+const ImageDecoder libjpeg_decoder = {
+    .name = "libjpeg-turbo",
+    .type = JPEG,
+    .probe = &libjpeg_probe,
+    .read_header = &libjpeg_read_header,
+    .decode = &libjpeg_decode,
+    .decode_rows = &libjpeg_decode_rows,
+    .decode_scaled = &libjpeg_decode_scaled,
+    .scales_in_rows = &libjpeg_scales_in_rows,
+};
@@ -1,10 +1,12 @@
 
 #include "../include/decompress_png.h"
+#include "../include/art_diag.h"
+#include "../include/art_memory.h"
+#include "../include/image_decoder.h"
 #include "png.h"
 #include <assert.h>
 #include <setjmp.h>
 #include <stddef.h>
-#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -18,6 +20,75 @@ void read_png_from_memory(png_structp png_ptr, png_bytep data, png_size_t num_by
   input_data->offset += num_bytes;
 }
 
+static png_voidp allocate_png_memory(png_structp png_ptr, png_alloc_size_t size) {
+  (void)png_ptr;
+  return art_malloc(size);
+}
+
+static void free_png_memory(png_structp png_ptr, png_voidp pointer) {
+  (void)png_ptr;
+  art_free(pointer);
+}
+
+static void report_png_error(png_structp png_ptr, png_const_charp message) {
+  ART_DIAG(ART_DIAG_ERROR, ART_DIAG_DECODE_FAILED, "libpng error", message);
+  png_longjmp(png_ptr, 1);
+}
+
+static void report_png_warning(png_structp png_ptr, png_const_charp message) {
+  (void)png_ptr;
+  ART_DIAG(ART_DIAG_DEBUG, ART_DIAG_DECODE_FAILED, "libpng warning", message);
+}
+
+/**
+ * png_create_read_struct with libpng's allocations going through art_malloc, see art_memory.h, and
+ * its messages reported to art_diag instead of stderr.
+ */
+static png_structp create_read_struct(void) {
+  return png_create_read_struct_2(PNG_LIBPNG_VER_STRING, NULL, &report_png_error,
+                                  &report_png_warning, NULL, &allocate_png_memory,
+                                  &free_png_memory);
+}
+
+/**
+ * Bytes of an RGB888 image of the size in the header, false if they do not fit in a size_t.
+ */
+static bool rgb888_length(png_uint_32 width, png_uint_32 height, size_t *length) {
+
+  if (height != 0 && width > SIZE_MAX / 3 / height) {
+    return false;
+  }
+
+  *length = 3 * (size_t)width * height;
+  return true;
+}
+
+static void set_rgb888_transforms(png_structp png_ptr, png_infop info_ptr) {
+
+  png_byte color_type = png_get_color_type(png_ptr, info_ptr);
+  png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+
+  if (bit_depth < 8) {
+    png_set_expand(png_ptr);
+  }
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_palette_to_rgb(png_ptr);
+  }
+
+  if (color_type & PNG_COLOR_MASK_ALPHA) {
+    png_set_strip_alpha(png_ptr);
+  }
+
+  if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+    png_set_gray_to_rgb(png_ptr);
+  }
+
+  if (bit_depth == 16) {
+    png_set_scale_16(png_ptr);
+  }
+}
+
 bool convert_png_to_rgb888(const uint8_t *image_buffer, uint32_t size, Image *rgb888_image) {
 
   png_byte image_header[8];
@@ -26,7 +97,7 @@ bool convert_png_to_rgb888(const uint8_t *image_buffer, uint32_t size, Image *rg
   // check for png signature
   if (png_sig_cmp((png_const_bytep)image_header, 0, 8) == 0) {
 
-    png_structp png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+    png_structp png_ptr = create_read_struct();
     if (!png_ptr) {
 
       // TODO
@@ -47,9 +118,15 @@ bool convert_png_to_rgb888(const uint8_t *image_buffer, uint32_t size, Image *rg
       return false;
     }
 
+    // modified after setjmp, must not live in registers
+    uint8_t *volatile rgb888_buffer = NULL;
+    png_bytep *volatile row_pointers = NULL;
+
     if (setjmp(png_jmpbuf(png_ptr))) {
+      art_free(row_pointers);
+      art_free(rgb888_buffer);
+      rgb888_image->buffer = NULL;
       png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
-      // TODO
       return false;
     }
 
@@ -60,51 +137,444 @@ bool convert_png_to_rgb888(const uint8_t *image_buffer, uint32_t size, Image *rg
     png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
     png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
 
-    rgb888_image->length = 3 * width * height;
+    if (!rgb888_length(width, height, &rgb888_image->length)) {
+      png_error(png_ptr, "image too large");
+    }
+
     rgb888_image->img_width = width;
     rgb888_image->img_height = height;
+    rgb888_image->format = IMAGE_RGB888;
+
+    set_rgb888_transforms(png_ptr, info_ptr);
+    png_set_interlace_handling(png_ptr);
+    png_read_update_info(png_ptr, info_ptr);
 
-    png_byte color_type = png_get_color_type(png_ptr, info_ptr);
-    png_byte bit_depth = png_get_bit_depth(png_ptr, info_ptr);
+    rgb888_buffer = art_malloc(rgb888_image->length);
+    row_pointers = art_malloc(height * sizeof(png_bytep));
 
-    if (bit_depth < 8) {
-      png_set_expand(png_ptr);
+    if (rgb888_buffer == NULL || row_pointers == NULL) {
+      png_error(png_ptr, "could not allocate output image");
     }
 
-    if (color_type == PNG_COLOR_TYPE_PALETTE) {
-      png_set_palette_to_rgb(png_ptr);
+    for (png_uint_32 y = 0; y < height; y++) {
+      row_pointers[y] = rgb888_buffer + (size_t)y * width * 3;
     }
 
-    if (color_type & PNG_COLOR_MASK_ALPHA) {
-      png_set_strip_alpha(png_ptr);
+    png_read_image(png_ptr, row_pointers);
+    rgb888_image->buffer = rgb888_buffer;
+    art_free(row_pointers);
+    png_destroy_read_struct(&png_ptr, &info_ptr, &end_info);
+
+    return true;
+
+  } else {
+    // TODO does not contain png signature!
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_DECODE_FAILED, "PNG signature missing", NULL);
+    return false;
+  }
+}
+
+bool convert_png_to_rgb888_preview(const uint8_t *image_buffer, uint32_t size,
+                                   rgb888_pass_callback callback, void *user_data) {
+
+  if (size < 8 || png_sig_cmp((png_const_bytep)image_buffer, 0, 8) != 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_DECODE_FAILED, "PNG signature missing", NULL);
+    return false;
+  }
+
+  png_structp png_ptr = create_read_struct();
+  if (!png_ptr) {
+    return false;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+    return false;
+  }
+
+  // modified after setjmp, must not live in registers
+  uint8_t *volatile rgb888_buffer = NULL;
+  png_bytep *volatile row_pointers = NULL;
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    art_free(row_pointers);
+    art_free(rgb888_buffer);
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    return false;
+  }
+
+  png_data data = {image_buffer, size, 0};
+  png_set_read_fn(png_ptr, &data, &read_png_from_memory);
+  png_read_info(png_ptr, info_ptr);
+
+  png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+  png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+
+  set_rgb888_transforms(png_ptr, info_ptr);
+  int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  Image rgb888_image = {.img_width = width, .img_height = height, .length = 0, .buffer = NULL};
+
+  if (!rgb888_length(width, height, &rgb888_image.length)) {
+    png_error(png_ptr, "image too large");
+  }
+
+  rgb888_buffer = art_malloc(rgb888_image.length);
+  row_pointers = art_malloc(height * sizeof(png_bytep));
+
+  if (rgb888_buffer == NULL || row_pointers == NULL) {
+    png_error(png_ptr, "could not allocate output image");
+  }
+
+  rgb888_image.buffer = rgb888_buffer;
+
+  for (png_uint_32 y = 0; y < height; y++) {
+    row_pointers[y] = rgb888_buffer + (size_t)y * width * 3;
+  }
+
+  bool keep_going = true;
+
+  if (passes > 1) {
+    // passing the rows as display rows makes libpng replicate every pixel of the first Adam7 pass
+    // over its whole 8x8 block, which gives a complete blocky picture after 1/64 of the data
+    png_read_rows(png_ptr, NULL, row_pointers, height);
+    keep_going = callback(&rgb888_image, false, user_data);
+
+    for (int pass = 1; keep_going && pass < passes; pass++) {
+      png_read_rows(png_ptr, NULL, row_pointers, height);
     }
+  } else {
+    png_read_image(png_ptr, row_pointers);
+  }
+
+  if (keep_going) {
+    callback(&rgb888_image, true, user_data);
+  }
+
+  art_free(row_pointers);
+  art_free(rgb888_buffer);
+  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+  return true;
+}
+
+/**
+ * State of a push-mode decode, shared by the libpng progressive callbacks.
+ *
+ * streaming:   rows go straight into the downscaler, otherwise they are combined into full
+ */
+typedef struct {
+  Image *rgb888_scaled;
+  Image full;
+  RowDownscaler downscaler;
+  ColorHistogram *histogram;
+  bool linear_light;
+  bool streaming;
+  bool done;
+} PngStream;
+
+static void png_stream_info(png_structp png_ptr, png_infop info_ptr) {
+
+  PngStream *stream = (PngStream *)png_get_progressive_ptr(png_ptr);
+
+  png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+  png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
 
-    if (color_type == PNG_COLOR_TYPE_GRAY || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
-      png_set_gray_to_rgb(png_ptr);
+  if (!image_scales_square(width, height, stream->rgb888_scaled)) {
+    ART_DIAG_VALUES(ART_DIAG_ERROR, ART_DIAG_NOT_SQUARE, "picture is not square", NULL, width,
+                    height);
+    png_error(png_ptr, "picture is not square");
+  }
+
+  set_rgb888_transforms(png_ptr, info_ptr);
+  int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  const float x_scale = ((float)width) / stream->rgb888_scaled->img_width;
+  const float y_scale = ((float)height) / stream->rgb888_scaled->img_height;
+
+  stream->full.img_width = width;
+  stream->full.img_height = height;
+  stream->full.length = 3 * (size_t)width * height;
+
+  // interlaced rows arrive once per Adam7 pass and have to be combined in a full image, as do
+  // images that are copied or upscaled by scale_square_image
+  stream->streaming = passes == 1 && x_scale > 1.0f && y_scale > 1.0f;
+
+  if (stream->streaming) {
+    if (!row_downscaler_init_ex(&stream->downscaler, width, height, stream->rgb888_scaled,
+                                stream->linear_light)) {
+      stream->streaming = false;
+      png_error(png_ptr, "could not allocate downscaler");
     }
+    stream->downscaler.histogram = stream->histogram;
+    return;
+  }
+
+  // zeroed so rows missing from a truncated interlaced image stay defined
+  stream->full.buffer = art_calloc(stream->full.length, 1);
+
+  if (stream->full.buffer == NULL) {
+    png_error(png_ptr, "could not allocate output image");
+  }
+}
+
+static void png_stream_row(png_structp png_ptr, png_bytep new_row, png_uint_32 row_num, int pass) {
 
-    if (bit_depth == 16) {
-      png_set_scale_16(png_ptr);
+  PngStream *stream = (PngStream *)png_get_progressive_ptr(png_ptr);
+
+  // interlaced passes report rows that have no new pixels in this pass as NULL
+  if (new_row == NULL || row_num >= stream->full.img_height) {
+    return;
+  }
+
+  if (stream->streaming) {
+    row_downscaler_push(&stream->downscaler, new_row);
+  } else {
+    png_progressive_combine_row(png_ptr, stream->full.buffer + row_num * stream->full.img_width * 3,
+                                new_row);
+  }
+}
+
+static void png_stream_end(png_structp png_ptr, png_infop info_ptr) {
+  PngStream *stream = (PngStream *)png_get_progressive_ptr(png_ptr);
+  stream->done = true;
+}
+
+bool convert_png_stream_to_scaled_rgb888(const uint8_t *prefix, size_t prefix_size,
+                                         uint64_t remaining_size, png_stream_read read,
+                                         void *handle, Image *rgb888_scaled,
+                                         ColorHistogram *histogram, bool linear_light) {
+
+  if (prefix_size < 8 || png_sig_cmp((png_const_bytep)prefix, 0, 8) != 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_DECODE_FAILED, "PNG signature missing", NULL);
+    return false;
+  }
+
+  png_structp png_ptr = create_read_struct();
+  if (!png_ptr) {
+    return false;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+    return false;
+  }
+
+  PngStream stream = {.rgb888_scaled = rgb888_scaled,
+                      .full = {.buffer = NULL, .length = 0, .img_width = 0, .img_height = 0},
+                      .downscaler = {.x_bounds = NULL, .column_sums = NULL, .row_planes = NULL},
+                      .histogram = histogram,
+                      .linear_light = linear_light,
+                      .streaming = false,
+                      .done = false};
+
+  // modified after setjmp, must not live in registers
+  uint8_t *volatile chunk = NULL;
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    art_free(chunk);
+    art_free(stream.full.buffer);
+    row_downscaler_free(&stream.downscaler);
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    return false;
+  }
+
+  png_set_progressive_read_fn(png_ptr, &stream, &png_stream_info, &png_stream_row,
+                              &png_stream_end);
+
+  // libpng keeps its own copy of partial chunks, the prefix is consumed in place
+  png_process_data(png_ptr, info_ptr, (png_bytep)prefix, prefix_size);
+
+  if (remaining_size > 0 && !stream.done) {
+    chunk = art_malloc(PNG_STREAM_CHUNK_SIZE);
+
+    if (chunk == NULL) {
+      png_error(png_ptr, "could not allocate read buffer");
     }
-    png_read_update_info(png_ptr, info_ptr);
+  }
 
-    uint8_t *rgb888_buffer = malloc(rgb888_image->length);
-    rgb888_image->buffer = rgb888_buffer;
+  // reading the next chunk and inflating the previous one alternate, only one chunk is ever held
+  while (remaining_size > 0 && !stream.done) {
+    size_t wanted = remaining_size < PNG_STREAM_CHUNK_SIZE ? remaining_size : PNG_STREAM_CHUNK_SIZE;
+    size_t count = read(handle, chunk, wanted);
+
+    if (count == 0) {
+      png_error(png_ptr, "unexpected end of data");
+    }
+
+    png_process_data(png_ptr, info_ptr, chunk, count);
+    remaining_size -= count;
+  }
+
+  bool complete = stream.done && (!stream.streaming || row_downscaler_finished(&stream.downscaler));
+
+  if (complete && !stream.streaming) {
+    complete = scale_square_image_ex(&stream.full, rgb888_scaled, histogram, linear_light);
+  }
+
+  art_free(chunk);
+  art_free(stream.full.buffer);
+  row_downscaler_free(&stream.downscaler);
+  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+
+  return complete;
+}
+
+static bool libpng_probe(const uint8_t *data, uint32_t size) {
+  return size >= 8 && png_sig_cmp((png_const_bytep)data, 0, 8) == 0;
+}
+
+static bool libpng_read_header(const uint8_t *data, uint32_t size, uint32_t *width,
+                               uint32_t *height) {
+
+  png_structp png_ptr = create_read_struct();
+  if (!png_ptr) {
+    return false;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+    return false;
+  }
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    return false;
+  }
+
+  png_data input = {data, size, 0};
+  png_set_read_fn(png_ptr, &input, &read_png_from_memory);
+  png_read_info(png_ptr, info_ptr);
+
+  *width = png_get_image_width(png_ptr, info_ptr);
+  *height = png_get_image_height(png_ptr, info_ptr);
+
+  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+  return true;
+}
+
+bool png_read_ihdr(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height,
+                   bool *interlaced) {
+
+  // signature, chunk length and type, then width, height, bit depth, colour type, compression,
+  // filter and interlace method
+  if (size < 8 + 8 + 13 || png_sig_cmp((png_const_bytep)data, 0, 8) != 0 ||
+      memcmp(data + 12, "IHDR", 4) != 0) {
+    return false;
+  }
+
+  *width = png_get_uint_32(data + 16);
+  *height = png_get_uint_32(data + 20);
+  *interlaced = data[28] != PNG_INTERLACE_NONE;
+  return true;
+}
+
+static bool libpng_scales_in_rows(const uint8_t *data, uint32_t size) {
+  uint32_t width, height;
+  bool interlaced;
+  return png_read_ihdr(data, size, &width, &height, &interlaced) && !interlaced;
+}
+
+static bool libpng_decode(const uint8_t *data, uint32_t size, Image *rgb888_image,
+                          uint32_t threads) {
+  return convert_png_to_rgb888(data, size, rgb888_image);
+}
+
+static bool libpng_decode_rows(const uint8_t *data, uint32_t size, rgb888_row_callback on_row,
+                               void *user_data) {
+
+  png_structp png_ptr = create_read_struct();
+  if (!png_ptr) {
+    return false;
+  }
+
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+  if (!info_ptr) {
+    png_destroy_read_struct(&png_ptr, (png_infopp)NULL, (png_infopp)NULL);
+    return false;
+  }
+
+  // modified after setjmp, must not live in registers
+  uint8_t *volatile rows = NULL;
+  png_bytep *volatile row_pointers = NULL;
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    art_free(row_pointers);
+    art_free(rows);
+    png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+    return false;
+  }
+
+  png_data input = {data, size, 0};
+  png_set_read_fn(png_ptr, &input, &read_png_from_memory);
+  png_read_info(png_ptr, info_ptr);
 
-    png_bytep *row_pointers = malloc(height * sizeof(png_bytep));
+  png_uint_32 width = png_get_image_width(png_ptr, info_ptr);
+  png_uint_32 height = png_get_image_height(png_ptr, info_ptr);
+  size_t row_size = 3 * (size_t)width;
 
-    for (int y = 0; y < height; y++) {
-      row_pointers[y] = rgb888_buffer + (y * width * 3);
+  set_rgb888_transforms(png_ptr, info_ptr);
+  int passes = png_set_interlace_handling(png_ptr);
+  png_read_update_info(png_ptr, info_ptr);
+
+  if (passes > 1) {
+    // every Adam7 pass touches every row, the image has to be combined in full first
+    rows = art_malloc(row_size * height);
+    row_pointers = art_malloc(height * sizeof(png_bytep));
+
+    if (rows == NULL || row_pointers == NULL) {
+      png_error(png_ptr, "could not allocate output image");
     }
 
-    png_read_image(png_ptr, row_pointers);
-    free(row_pointers);
+    for (png_uint_32 y = 0; y < height; y++) {
+      row_pointers[y] = rows + y * row_size;
+    }
 
-    return true;
+    png_read_image(png_ptr, row_pointers);
 
+    for (png_uint_32 y = 0; y < height; y++) {
+      if (!on_row(row_pointers[y], y, user_data)) {
+        break;
+      }
+    }
   } else {
-    // TODO does not contain png signature!
-    printf("Could not find PNG signature depsite MIME type 'image/png'!\n");
-    return false;
+    rows = art_malloc(row_size);
+
+    if (rows == NULL) {
+      png_error(png_ptr, "could not allocate row");
+    }
+
+    for (png_uint_32 y = 0; y < height; y++) {
+      png_read_row(png_ptr, rows, NULL);
+
+      if (!on_row(rows, y, user_data)) {
+        break;
+      }
+    }
   }
+
+  art_free(row_pointers);
+  art_free(rows);
+  png_destroy_read_struct(&png_ptr, &info_ptr, (png_infopp)NULL);
+  return true;
 }
+
+static bool libpng_decode_scaled(const uint8_t *data, uint32_t size, Image *rgb888_scaled) {
+  return convert_png_stream_to_scaled_rgb888(data, size, 0, NULL, NULL, rgb888_scaled, NULL,
+                                             false);
+}
+
+const ImageDecoder libpng_decoder = {
+    .name = "libpng",
+    .type = PNG,
+    .probe = &libpng_probe,
+    .read_header = &libpng_read_header,
+    .decode = &libpng_decode,
+    .decode_rows = &libpng_decode_rows,
+    .decode_scaled = &libpng_decode_scaled,
+    .scales_in_rows = &libpng_scales_in_rows,
+};
@@ -0,0 +1,175 @@
+#include "../include/art_memory.h"
+#include "../include/image_decoder.h"
+
+#ifdef MP3CORE_HAVE_SPNG
+
+#include <spng.h>
+#include <stdlib.h>
+#include <string.h>
+
+static spng_ctx *open_spng(const uint8_t *data, uint32_t size, struct spng_ihdr *ihdr) {
+
+  // spng copies the allocator
+  struct spng_alloc alloc = {.malloc_fn = &art_malloc,
+                             .realloc_fn = &art_realloc,
+                             .calloc_fn = &art_calloc,
+                             .free_fn = &art_free};
+  spng_ctx *ctx = spng_ctx_new2(&alloc, 0);
+
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  if (spng_set_png_buffer(ctx, data, size) != 0 || spng_get_ihdr(ctx, ihdr) != 0) {
+    spng_ctx_free(ctx);
+    return NULL;
+  }
+
+  return ctx;
+}
+
+static bool spng_probe(const uint8_t *data, uint32_t size) {
+  static const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+  return size >= 8 && memcmp(data, signature, 8) == 0;
+}
+
+static bool spng_read_header(const uint8_t *data, uint32_t size, uint32_t *width,
+                             uint32_t *height) {
+
+  struct spng_ihdr ihdr;
+  spng_ctx *ctx = open_spng(data, size, &ihdr);
+
+  if (ctx == NULL) {
+    return false;
+  }
+
+  *width = ihdr.width;
+  *height = ihdr.height;
+
+  spng_ctx_free(ctx);
+  return true;
+}
+
+static bool spng_decode(const uint8_t *data, uint32_t size, Image *rgb888_image,
+                        uint32_t threads) {
+
+  struct spng_ihdr ihdr;
+  spng_ctx *ctx = open_spng(data, size, &ihdr);
+  size_t length;
+
+  if (ctx == NULL) {
+    return false;
+  }
+
+  if (spng_decoded_image_size(ctx, SPNG_FMT_RGB8, &length) != 0) {
+    spng_ctx_free(ctx);
+    return false;
+  }
+
+  uint8_t *buffer = art_malloc(length);
+
+  if (buffer == NULL || spng_decode_image(ctx, buffer, length, SPNG_FMT_RGB8, 0) != 0) {
+    art_free(buffer);
+    spng_ctx_free(ctx);
+    return false;
+  }
+
+  rgb888_image->buffer = buffer;
+  rgb888_image->length = length;
+  rgb888_image->img_width = ihdr.width;
+  rgb888_image->img_height = ihdr.height;
+  rgb888_image->format = IMAGE_RGB888;
+
+  spng_ctx_free(ctx);
+  return true;
+}
+
+static bool spng_decode_rows(const uint8_t *data, uint32_t size, rgb888_row_callback on_row,
+                             void *user_data) {
+
+  // interlaced rows arrive once per Adam7 pass, decode those in full and hand out the rows
+  struct spng_ihdr ihdr;
+  spng_ctx *ctx = open_spng(data, size, &ihdr);
+
+  if (ctx == NULL) {
+    return false;
+  }
+
+  if (ihdr.interlace_method != SPNG_INTERLACE_NONE) {
+    spng_ctx_free(ctx);
+
+    Image image;
+
+    if (!spng_decode(data, size, &image, 0)) {
+      return false;
+    }
+
+    for (uint32_t y = 0; y < image.img_height; y++) {
+      if (!on_row(image.buffer + y * image.img_width * 3, y, user_data)) {
+        break;
+      }
+    }
+
+    art_free(image.buffer);
+    return true;
+  }
+
+  size_t row_size = (size_t)ihdr.width * 3;
+  uint8_t *row = art_malloc(row_size);
+
+  if (row == NULL || spng_decode_image(ctx, NULL, 0, SPNG_FMT_RGB8, SPNG_DECODE_PROGRESSIVE) != 0) {
+    art_free(row);
+    spng_ctx_free(ctx);
+    return false;
+  }
+
+  bool result = true;
+
+  for (uint32_t y = 0; y < ihdr.height; y++) {
+    int error = spng_decode_row(ctx, row, row_size);
+
+    // the last row reports the end of the image
+    if (error != 0 && error != SPNG_EOI) {
+      result = false;
+      break;
+    }
+
+    if (!on_row(row, y, user_data)) {
+      break;
+    }
+  }
+
+  art_free(row);
+  spng_ctx_free(ctx);
+  return result;
+}
+
+static bool spng_scales_in_rows(const uint8_t *data, uint32_t size) {
+
+  struct spng_ihdr ihdr;
+  spng_ctx *ctx = open_spng(data, size, &ihdr);
+
+  if (ctx == NULL) {
+    return false;
+  }
+
+  spng_ctx_free(ctx);
+  return ihdr.interlace_method == SPNG_INTERLACE_NONE;
+}
+
+static bool spng_decode_scaled(const uint8_t *data, uint32_t size, Image *rgb888_scaled) {
+  return image_decoder_scale_rows(&spng_decoder, data, size, rgb888_scaled);
+}
+
+const ImageDecoder spng_decoder = {
+    .name = "spng",
+    .type = PNG,
+    .probe = &spng_probe,
+    .read_header = &spng_read_header,
+    .decode = &spng_decode,
+    .decode_rows = &spng_decode_rows,
+    .decode_scaled = &spng_decode_scaled,
+    .scales_in_rows = &spng_scales_in_rows,
+};
+
+#endif // MP3CORE_HAVE_SPNG
@@ -0,0 +1,233 @@
+#include "../include/dhash_index.h"
+#include <stdlib.h>
+
+// buckets per chunk, chunks of up to 16 bits index them directly
+#define BUCKET_BITS 16
+#define BUCKET_COUNT ((size_t)1 << BUCKET_BITS)
+
+/**
+ * chunks:    number of chunks the hashes are split into, max_distance + 1
+ * shifts:    first bit of every chunk
+ * masks:     bits of every chunk after shifting
+ * fold:      the chunks are wider than BUCKET_BITS and hashed to their bucket
+ * hashes:    the added hashes, indexed by id
+ * heads:     first id + 1 of every bucket of every chunk, 0 marks an empty bucket
+ * next:      next id + 1 in the same bucket, chunks entries per id
+ */
+struct DhashIndex {
+  uint32_t chunks;
+  uint32_t shifts[DHASH_INDEX_MAX_DISTANCE + 1];
+  uint64_t masks[DHASH_INDEX_MAX_DISTANCE + 1];
+  bool fold;
+  uint64_t *hashes;
+  uint32_t *heads;
+  uint32_t *next;
+  size_t count;
+  size_t capacity;
+};
+
+static inline uint64_t chunk_of(const DhashIndex *index, uint64_t hash, uint32_t chunk) {
+  return (hash >> index->shifts[chunk]) & index->masks[chunk];
+}
+
+static inline size_t bucket_of(const DhashIndex *index, uint64_t hash, uint32_t chunk) {
+
+  const uint64_t value = chunk_of(index, hash, chunk);
+
+  // wider chunks are folded with a multiplicative hash, bucket collisions are filtered by
+  // comparing the chunks
+  if (index->fold) {
+    return chunk * BUCKET_COUNT + (size_t)((value * 0x9E3779B97F4A7C15ull) >> (64 - BUCKET_BITS));
+  }
+
+  return chunk * BUCKET_COUNT + (size_t)value;
+}
+
+DhashIndex *dhash_index_create(uint32_t max_distance) {
+
+  if (max_distance > DHASH_INDEX_MAX_DISTANCE) {
+    return NULL;
+  }
+
+  DhashIndex *index = calloc(1, sizeof(DhashIndex));
+
+  if (index == NULL) {
+    return NULL;
+  }
+
+  index->chunks = max_distance + 1;
+  // chunks differ in width by at most a bit, with 4 or more they all fit a bucket index
+  index->fold = index->chunks < 64 / BUCKET_BITS;
+
+  for (uint32_t chunk = 0; chunk < index->chunks; chunk++) {
+    const uint32_t start = chunk * 64 / index->chunks;
+    const uint32_t bits = (chunk + 1) * 64 / index->chunks - start;
+
+    index->shifts[chunk] = start;
+    index->masks[chunk] = bits == 64 ? UINT64_MAX : ((uint64_t)1 << bits) - 1;
+  }
+
+  index->heads = calloc(index->chunks * BUCKET_COUNT, sizeof(uint32_t));
+
+  if (index->heads == NULL) {
+    free(index);
+    return NULL;
+  }
+
+  return index;
+}
+
+void dhash_index_destroy(DhashIndex *index) {
+
+  if (index == NULL) {
+    return;
+  }
+
+  free(index->hashes);
+  free(index->heads);
+  free(index->next);
+  free(index);
+}
+
+size_t dhash_index_count(const DhashIndex *index) { return index->count; }
+
+uint64_t dhash_index_hash(const DhashIndex *index, uint32_t id) { return index->hashes[id]; }
+
+bool dhash_index_add(DhashIndex *index, uint64_t hash, uint32_t *id) {
+
+  if (index->count == UINT32_MAX - 1) {
+    return false;
+  }
+
+  if (index->count == index->capacity) {
+    size_t capacity = index->capacity > 0 ? index->capacity * 2 : 256;
+    uint64_t *hashes = realloc(index->hashes, capacity * sizeof(uint64_t));
+
+    if (hashes == NULL) {
+      return false;
+    }
+
+    index->hashes = hashes;
+
+    uint32_t *next = realloc(index->next, capacity * index->chunks * sizeof(uint32_t));
+
+    if (next == NULL) {
+      return false;
+    }
+
+    index->next = next;
+    index->capacity = capacity;
+  }
+
+  const uint32_t new_id = (uint32_t)index->count;
+
+  index->hashes[new_id] = hash;
+
+  for (uint32_t chunk = 0; chunk < index->chunks; chunk++) {
+    uint32_t *head = &index->heads[bucket_of(index, hash, chunk)];
+    index->next[(size_t)new_id * index->chunks + chunk] = *head;
+    *head = new_id + 1;
+  }
+
+  index->count++;
+  *id = new_id;
+  return true;
+}
+
+typedef void (*match_visitor)(uint32_t id, uint32_t distance, void *user_data);
+
+/**
+ * Calls visit once for every hash within max_distance. A hash sharing several chunks with the
+ * query is in several of the walked buckets, it is only visited from the first chunk it shares.
+ */
+static void visit_matches(const DhashIndex *index, uint64_t hash, uint32_t max_distance,
+                          match_visitor visit, void *user_data) {
+
+  for (uint32_t chunk = 0; chunk < index->chunks; chunk++) {
+    const uint64_t value = chunk_of(index, hash, chunk);
+    uint32_t link = index->heads[bucket_of(index, hash, chunk)];
+
+    while (link != 0) {
+      const uint32_t id = link - 1;
+      const uint64_t candidate = index->hashes[id];
+      link = index->next[(size_t)id * index->chunks + chunk];
+
+      const uint32_t distance = dhash_distance(candidate, hash);
+
+      if (distance > max_distance || chunk_of(index, candidate, chunk) != value) {
+        continue;
+      }
+
+      bool seen = false;
+      for (uint32_t earlier = 0; earlier < chunk && !seen; earlier++) {
+        seen = chunk_of(index, candidate, earlier) == chunk_of(index, hash, earlier);
+      }
+
+      if (!seen) {
+        visit(id, distance, user_data);
+      }
+    }
+  }
+}
+
+typedef struct {
+  uint32_t *ids;
+  size_t capacity;
+  size_t found;
+} QueryResult;
+
+static void collect_match(uint32_t id, uint32_t distance, void *user_data) {
+
+  (void)distance;
+  QueryResult *result = (QueryResult *)user_data;
+
+  if (result->found < result->capacity) {
+    result->ids[result->found] = id;
+  }
+
+  result->found++;
+}
+
+size_t dhash_index_query(const DhashIndex *index, uint64_t hash, uint32_t max_distance,
+                         uint32_t *ids, size_t capacity) {
+
+  QueryResult result = {.ids = ids, .capacity = capacity, .found = 0};
+
+  if (max_distance < index->chunks) {
+    visit_matches(index, hash, max_distance, &collect_match, &result);
+  }
+
+  return result.found;
+}
+
+typedef struct {
+  uint32_t id;
+  uint32_t distance;
+  bool found;
+} NearestMatch;
+
+static void keep_nearest(uint32_t id, uint32_t distance, void *user_data) {
+
+  NearestMatch *nearest = (NearestMatch *)user_data;
+
+  if (!nearest->found || distance < nearest->distance ||
+      (distance == nearest->distance && id < nearest->id)) {
+    *nearest = (NearestMatch){.id = id, .distance = distance, .found = true};
+  }
+}
+
+bool dhash_index_nearest(const DhashIndex *index, uint64_t hash, uint32_t max_distance,
+                         uint32_t *id) {
+
+  NearestMatch nearest = {.found = false};
+
+  if (max_distance < index->chunks) {
+    visit_matches(index, hash, max_distance, &keep_nearest, &nearest);
+  }
+
+  if (nearest.found) {
+    *id = nearest.id;
+  }
+
+  return nearest.found;
+}
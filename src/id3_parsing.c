@@ -1,52 +1,120 @@
 #include "../include/id3_parsing.h"
+#include "../include/art_diag.h"
+#include "../include/art_memory.h"
 #include "../include/decompress_jpg.h"
 #include "../include/decompress_png.h"
-#include <regex.h>
-#include <stdio.h>
+#include "../include/image_decoder.h"
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
-bool get_image_data(uint8_t *frame_buffer, uint32_t frame_size, uint8_t *rgb565_buffer) {
-  uint8_t text_encoding = frame_buffer[0];
-  uint32_t offset = 1;
+// external definitions of the inline helpers for calls the compiler decides not to inline
+extern inline uint32_t convert_syncsafe_size(const uint8_t *size);
+extern inline uint32_t convert_be32_size(const uint8_t *size);
+extern inline uint32_t get_frame_size(const ID3FrameHeader *frame_header, uint8_t major_version);
+extern inline bool is_id3_header(const ID3TagHeader *tag_header);
+extern inline bool is_apic(const ID3FrameHeader *frame_header);
+extern inline bool is_cancelled(const AlbumArtOptions *options);
 
-  ImageType image_type = OTHER;
-  const char *mime_type = (const char *)(&frame_buffer[offset]);
+static bool mime_subtype_equals(const char *mime_type, size_t length, const char *subtype) {
 
-  regex_t regex_jpg;
-  int regr_jpg = regcomp(&regex_jpg, "(image\/)?((jpe?g)|(JPE?G))", 0);
+  // "image/" is optional, ID3v2.2 style "JPG"/"PNG" is used by some taggers
+  if (length > 6 && strncasecmp(mime_type, "image/", 6) == 0) {
+    mime_type += 6;
+    length -= 6;
+  }
 
-  regex_t regex_png;
-  int regr_png = regcomp(&regex_jpg, "(image\/)?((png)|(PNG))", 0);
+  return length == strlen(subtype) && strncasecmp(mime_type, subtype, length) == 0;
+}
 
-  if (regr_jpg) {
-    fprintf(stderr, "Could not compile JPEG regex\n");
-    return false;
+static ImageType get_image_type(const char *mime_type, size_t mime_length, const uint8_t *data,
+                                uint32_t size) {
+
+  if (mime_subtype_equals(mime_type, mime_length, "jpeg") ||
+      mime_subtype_equals(mime_type, mime_length, "jpg")) {
+    return JPEG;
+  } else if (mime_subtype_equals(mime_type, mime_length, "png")) {
+    return PNG;
+  } else if (mime_length == 3 && strncmp(mime_type, "-->", 3) == 0) {
+    return LINK;
   }
 
-  if (regr_png) {
-    fprintf(stderr, "Could not compile PNG regex\n");
-    return false;
+  // the MIME type is free text, fall back to the magic bytes
+  if (size >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF) {
+    return JPEG;
+  } else if (size >= 4 && data[0] == 0x89 && data[1] == 'P' && data[2] == 'N' && data[3] == 'G') {
+    return PNG;
   }
 
-  regr_jpg = regexec(&regex_jpg, mime_type, 0, NULL, 0);
-  regr_png = regexec(&regex_png, mime_type, 0, NULL, 0);
+  return OTHER;
+}
+
+bool find_biggest_apic(const uint8_t *tag_body, uint32_t tag_size, uint8_t major_version,
+                       uint32_t *frame_offset, uint32_t *frame_size) {
+
+  uint32_t biggest_apic_size = 0;
+  uint32_t biggest_apic_offset = 0;
+  uint32_t offset = 0;
 
-  if (!regr_jpg)
-    image_type = JPEG;
-  else if (!regr_png)
-    image_type = PNG;
-  else if (strcmp(mime_type, "-->") == 0)
-    image_type = LINK;
+  while (offset + ID3_FRAME_HEADER_SIZE <= tag_size) {
+    const ID3FrameHeader *frame_header = (const ID3FrameHeader *)(tag_body + offset);
+
+    // the rest of the tag is padding
+    if (frame_header->id[0] == 0) {
+      break;
+    }
+
+    uint32_t current_frame_size = get_frame_size(frame_header, major_version);
+    uint32_t body_offset = offset + ID3_FRAME_HEADER_SIZE;
+
+    if (current_frame_size > tag_size - body_offset) {
+      break;
+    }
+
+    if (is_apic(frame_header) && current_frame_size > biggest_apic_size) {
+      biggest_apic_size = current_frame_size;
+      biggest_apic_offset = body_offset;
+    }
+
+    offset = body_offset + current_frame_size;
+  }
+
+  *frame_offset = biggest_apic_offset;
+  *frame_size = biggest_apic_size;
+  return biggest_apic_size > 0;
+}
 
-  regfree(&regex_jpg);
-  regfree(&regex_png);
+uint64_t hash_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size) {
+
+  // FNV-1a
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (uint32_t i = 0; i < frame_size; i++) {
+    hash ^= frame_buffer[i];
+    hash *= 0x100000001b3ULL;
+  }
+
+  return hash;
+}
+
+bool parse_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size, ApicImage *apic_image) {
+
+  if (frame_size < 2) {
+    return false;
+  }
+
+  uint8_t text_encoding = frame_buffer[0];
+  uint32_t offset = 1;
+
+  const char *mime_type = (const char *)(&frame_buffer[offset]);
 
   // skip mime type
   while (offset < frame_size && frame_buffer[offset] != 0) {
     offset++;
   }
 
+  size_t mime_length = (const char *)(&frame_buffer[offset]) - mime_type;
+
   // include null terminator
   offset++;
 
@@ -76,61 +144,390 @@ bool get_image_data(uint8_t *frame_buffer, uint32_t frame_size, uint8_t *rgb565_
     }
   }
 
-  uint32_t image_data_size = frame_size - offset;
-  uint8_t *image_buffer = frame_buffer + offset;
+  if (offset >= frame_size) {
+    return false;
+  }
+
+  apic_image->data = frame_buffer + offset;
+  apic_image->size = frame_size - offset;
+  apic_image->type = get_image_type(mime_type, mime_length, apic_image->data, apic_image->size);
 
-  Image rgb888_image = {.img_width = 0, .img_height = 0, .buffer = NULL, .length = 0};
+  return true;
+}
+
+static void pack_rgb565(Image *rgb888_downscaled, Image *rgb565_image) {
 
-  if (image_type == LINK) {
-    printf("image data is a link, fetching data...\n");
-    printf("To be implemented!\n");
+  if (rgb565_image->format == IMAGE_RGBA8888) {
+    rgb888_planar_to_rgba8888(rgb888_downscaled, rgb565_image);
+    return;
+  }
+
+  if (rgb888_downscaled->format == IMAGE_RGB888_PLANAR) {
+    rgb888_planar_to_rgb565(rgb888_downscaled, rgb565_image);
+    return;
+  }
+
+#if __has_include(<arm_neon.h>)
+  rgb888_to_rgb565_neon(rgb888_downscaled, rgb565_image);
+#else
+  rgb888_to_rgb565_scalar(rgb888_downscaled, rgb565_image);
+#endif
+}
+
+static void rgb565_target_view(Image *rgb565_image, uint8_t *rgb565_buffer) {
+  image_view(rgb565_image, rgb565_buffer, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT,
+             TARGET_IMG_WIDTH * 2, IMAGE_RGB565);
+}
+
+/**
+ * Allocates the planar target the scalers write to, so scaling and packing work on contiguous
+ * bytes per channel with every row starting on a cache line.
+ */
+static bool allocate_downscaled(Image *rgb888_downscaled) {
+
+  if (!image_allocate(rgb888_downscaled, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT,
+                      IMAGE_RGB888_PLANAR)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for downscaled image", NULL);
     return false;
+  }
 
-  } else if (image_type == JPEG) {
+  return true;
+}
 
-    if (!convert_jpeg_to_rgb888(image_buffer, image_data_size, &rgb888_image)) {
-      // TODO error handling
-      return false;
+static void store_dhash(const Image *rgb888_downscaled, const AlbumArtOptions *options) {
+  if (options != NULL && options->art_dhash != NULL) {
+    *options->art_dhash = image_dhash(rgb888_downscaled);
+  }
+}
+
+/**
+ * Histogram for the palette the options ask for, NULL if they ask for none. Sets failed if it
+ * could not be allocated.
+ */
+static ColorHistogram *palette_histogram(const AlbumArtOptions *options, bool *failed) {
+
+  if (options == NULL || options->palette == NULL) {
+    return NULL;
+  }
+
+  ColorHistogram *histogram = art_calloc(1, sizeof(ColorHistogram));
+  *failed = histogram == NULL;
+  return histogram;
+}
+
+static bool linear_light(const AlbumArtOptions *options) {
+  return options != NULL && options->linear_light;
+}
+
+static void store_palette(const ColorHistogram *histogram, const AlbumArtOptions *options) {
+  if (histogram != NULL) {
+    color_histogram_palette(histogram, options->palette);
+  }
+}
+
+IO_ERROR scale_to_view(Image *rgb888_image, Image *view, const AlbumArtOptions *options) {
+
+  if (!image_scales_square(rgb888_image->img_width, rgb888_image->img_height, view)) {
+    ART_DIAG_VALUES(ART_DIAG_ERROR, ART_DIAG_NOT_SQUARE, "picture is not square", NULL,
+                    rgb888_image->img_width, rgb888_image->img_height);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  Image rgb888_downscaled;
+  bool failed = false;
+  ColorHistogram *histogram = palette_histogram(options, &failed);
+
+  if (failed || !allocate_downscaled(&rgb888_downscaled)) {
+    art_free(histogram);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  if (!scale_square_image_ex(rgb888_image, &rgb888_downscaled, histogram,
+                             linear_light(options))) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "could not scale picture", NULL);
+    art_free(rgb888_downscaled.buffer);
+    art_free(histogram);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  if (is_cancelled(options)) {
+    art_free(rgb888_downscaled.buffer);
+    art_free(histogram);
+    return CANCELLED;
+  }
+
+  pack_rgb565(&rgb888_downscaled, view);
+  store_dhash(&rgb888_downscaled, options);
+  store_palette(histogram, options);
+
+  art_free(rgb888_downscaled.buffer);
+  art_free(histogram);
+  return OK;
+}
+
+IO_ERROR scale_to_rgb565(Image *rgb888_image, uint8_t *rgb565_buffer,
+                         const AlbumArtOptions *options) {
+
+  Image rgb565_image;
+  rgb565_target_view(&rgb565_image, rgb565_buffer);
+
+  return scale_to_view(rgb888_image, &rgb565_image, options);
+}
+
+// rows the row-wise decoders hold at most: a few MCU rows of libjpeg or the row of libpng, plus
+// the downscaler's band, with a margin
+#define PIXEL_BUDGET_BAND_ROWS 32
+
+/**
+ * Checks a picture against the pixel budget of the options. Returns OK and sets scaled if it has to
+ * be decoded straight to the target size, IMAGE_TOO_LARGE if it can not be decoded within budget.
+ *
+ * in_rows:   the decoder can scale the picture holding only a band of rows
+ */
+static IO_ERROR check_pixel_budget(uint32_t width, uint32_t height, bool in_rows,
+                                   const AlbumArtOptions *options, bool *scaled) {
+
+  *scaled = false;
+
+  if (options == NULL || options->max_pixels == 0) {
+    return OK;
+  }
+
+  const uint64_t target_pixels = (uint64_t)TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT;
+  const uint64_t budget = options->max_pixels > target_pixels ? options->max_pixels : target_pixels;
+
+  if ((uint64_t)width * height <= budget) {
+    return OK;
+  }
+
+  if (!in_rows || (uint64_t)width * PIXEL_BUDGET_BAND_ROWS > budget) {
+    ART_DIAG_VALUES(ART_DIAG_ERROR, ART_DIAG_TOO_LARGE, "picture exceeds the pixel budget", NULL,
+                    width, height);
+    return IMAGE_TOO_LARGE;
+  }
+
+  *scaled = true;
+  return OK;
+}
+
+static IO_ERROR check_decoder_budget(const ImageDecoder *decoder, const ApicImage *apic_image,
+                                     const AlbumArtOptions *options, bool *scaled) {
+
+  uint32_t width;
+  uint32_t height;
+  *scaled = false;
+
+  // pictures without a readable header fail in the decoder
+  if (options == NULL || options->max_pixels == 0 ||
+      !decoder->read_header(apic_image->data, apic_image->size, &width, &height)) {
+    return OK;
+  }
+
+  // asking the decoder can mean parsing the headers again, only done for pictures above budget
+  const bool in_rows = (uint64_t)width * height > options->max_pixels &&
+                       decoder->scales_in_rows != NULL &&
+                       decoder->scales_in_rows(apic_image->data, apic_image->size);
+
+  return check_pixel_budget(width, height, in_rows, options, scaled);
+}
+
+static IO_ERROR decode_apic_image(const ApicImage *apic_image, const uint8_t *frame_buffer,
+                                  Image *rgb888_image, const AlbumArtOptions *options) {
+
+  if (apic_image->type == LINK) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_UNSUPPORTED_TYPE, "linked pictures are not supported", NULL);
+    return IMAGE_PROCESSING_ERROR;
+
+  } else if (apic_image->type == JPEG || apic_image->type == PNG) {
+
+    const ImageDecoder *decoder =
+        image_decoder_for(apic_image->type, apic_image->data, apic_image->size);
+
+    if (decoder == NULL) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_NO_DECODER, "no decoder accepts the picture data",
+               (const char *)&frame_buffer[1]);
+      return IMAGE_PROCESSING_ERROR;
+    }
+
+    bool scaled;
+    IO_ERROR error = check_decoder_budget(decoder, apic_image, options, &scaled);
+
+    if (error != OK) {
+      return error;
     }
 
-  } else if (image_type == PNG) {
-    if (!convert_png_to_rgb888(image_buffer, image_data_size, &rgb888_image)) {
+    // the scalers copy a picture of the target size, so the rest of the conversion is unchanged
+    if (scaled) {
+      if (!image_allocate(rgb888_image, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, IMAGE_RGB888) ||
+          !decoder->decode_scaled(apic_image->data, apic_image->size, rgb888_image)) {
+        return IMAGE_PROCESSING_ERROR;
+      }
+
+      return OK;
+    }
+
+    uint32_t threads = options != NULL ? options->jpeg_decode_threads : 0;
+
+    if (!decoder->decode(apic_image->data, apic_image->size, rgb888_image, threads)) {
       // TODO error handling
-      return false;
+      return IMAGE_PROCESSING_ERROR;
     }
 
   } else {
-    printf("MIME Type: '%s' is not supported!\n", mime_type);
-    return false;
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_UNSUPPORTED_TYPE, "MIME type is not supported",
+             (const char *)&frame_buffer[1]);
+    return IMAGE_PROCESSING_ERROR;
   }
 
-  if (rgb888_image.length != 0) {
+  return rgb888_image->length != 0 ? OK : IMAGE_PROCESSING_ERROR;
+}
 
-    Image rgb888_downscaled = {.img_height = TARGET_IMG_HEIGHT,
-                               .img_width = TARGET_IMG_WIDTH,
-                               .length = RGB888_BUFFER_SIZE};
-    uint8_t *downscaled_buffer = malloc(rgb888_downscaled.length);
-    rgb888_downscaled.buffer = downscaled_buffer;
+IO_ERROR decode_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size, Image *rgb888_image,
+                           const AlbumArtOptions *options) {
 
-    scale_square_image(&rgb888_image, &rgb888_downscaled);
+  ApicImage apic_image;
 
-    free(rgb888_image.buffer);
+  if (!parse_apic_frame(frame_buffer, frame_size, &apic_image)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_NO_IMAGE_DATA, "APIC frame does not contain image data",
+             NULL);
+    return IMAGE_PROCESSING_ERROR;
+  }
 
-    Image rgb565_image = {
-        .img_height = TARGET_IMG_HEIGHT,
-        .img_width = TARGET_IMG_WIDTH,
-        .length = RGB565_BUFFER_SIZE,
-        .buffer = rgb565_buffer,
-    };
+  IO_ERROR error = decode_apic_image(&apic_image, frame_buffer, rgb888_image, options);
 
-#if __has_include(<arm_neon.h>)
-    rgb888_to_rgb565_neon(&rgb888_downscaled, &rgb565_image);
-#else
-    rgb888_to_rgb565_scalar(&rgb888_downscaled, &rgb565_image);
-#endif
+  if (error != OK) {
+    art_free(rgb888_image->buffer);
+    rgb888_image->buffer = NULL;
+  }
+
+  return error;
+}
 
+IO_ERROR process_apic_frame(const uint8_t *frame_buffer, uint32_t frame_size,
+                            uint8_t *rgb565_buffer, const AlbumArtOptions *options) {
+
+  Image rgb888_image = {.img_width = 0, .img_height = 0, .buffer = NULL, .length = 0};
+
+  IO_ERROR error = decode_apic_frame(frame_buffer, frame_size, &rgb888_image, options);
+
+  if (error != OK) {
+    return error;
+  }
+
+  if (is_cancelled(options)) {
+    art_free(rgb888_image.buffer);
+    return CANCELLED;
+  }
+
+  IO_ERROR result = scale_to_rgb565(&rgb888_image, rgb565_buffer, options);
+  art_free(rgb888_image.buffer);
+  return result;
+}
+
+IO_ERROR process_apic_png_stream(const ApicImage *apic_image, uint64_t remaining_size,
+                                 const ArtReader *reader, uint8_t *rgb565_buffer,
+                                 const AlbumArtOptions *options) {
+
+  Image rgb888_downscaled;
+  Image rgb565_image;
+  uint32_t width;
+  uint32_t height;
+  bool interlaced;
+  bool scaled;
+
+  // the stream always scales a band of rows at a time, unless the picture is interlaced
+  if (png_read_ihdr(apic_image->data, apic_image->size, &width, &height, &interlaced) &&
+      check_pixel_budget(width, height, !interlaced, options, &scaled) != OK) {
+    return IMAGE_TOO_LARGE;
+  }
+
+  bool failed = false;
+  ColorHistogram *histogram = palette_histogram(options, &failed);
+
+  if (failed || !allocate_downscaled(&rgb888_downscaled)) {
+    art_free(histogram);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  if (!convert_png_stream_to_scaled_rgb888(apic_image->data, apic_image->size, remaining_size,
+                                           reader->read, reader->handle, &rgb888_downscaled,
+                                           histogram, linear_light(options))) {
+    art_free(rgb888_downscaled.buffer);
+    art_free(histogram);
+    return IMAGE_PROCESSING_ERROR;
+  }
+
+  if (is_cancelled(options)) {
+    art_free(rgb888_downscaled.buffer);
+    art_free(histogram);
+    return CANCELLED;
+  }
+
+  rgb565_target_view(&rgb565_image, rgb565_buffer);
+  pack_rgb565(&rgb888_downscaled, &rgb565_image);
+  store_dhash(&rgb888_downscaled, options);
+  store_palette(histogram, options);
+
+  art_free(rgb888_downscaled.buffer);
+  art_free(histogram);
+  return OK;
+}
+
+bool get_image_data(const uint8_t *frame_buffer, uint32_t frame_size, uint8_t *rgb565_buffer) {
+  return process_apic_frame(frame_buffer, frame_size, rgb565_buffer, NULL) == OK;
+}
+
+typedef struct {
+  uint8_t *rgb565_buffer;
+  preview_callback callback;
+  void *user_data;
+  bool failed;
+} PreviewState;
+
+static bool preview_pass(Image *rgb888_image, bool final_pass, void *user_data) {
+
+  PreviewState *state = (PreviewState *)user_data;
+
+  if (scale_to_rgb565(rgb888_image, state->rgb565_buffer, NULL) != OK) {
+    state->failed = true;
+    return false;
+  }
+
+  if (state->callback == NULL) {
     return true;
   }
 
-  return false;
+  return state->callback(final_pass ? PREVIEW_FINAL : PREVIEW_COARSE, state->rgb565_buffer,
+                         state->user_data);
+}
+
+bool get_image_data_preview(const uint8_t *frame_buffer, uint32_t frame_size,
+                            uint8_t *rgb565_buffer, preview_callback callback, void *user_data) {
+
+  ApicImage apic_image;
+
+  if (!parse_apic_frame(frame_buffer, frame_size, &apic_image)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_NO_IMAGE_DATA, "APIC frame does not contain image data",
+             NULL);
+    return false;
+  }
+
+  PreviewState state = {.rgb565_buffer = rgb565_buffer,
+                        .callback = callback,
+                        .user_data = user_data,
+                        .failed = false};
+  bool result;
+
+  if (apic_image.type == JPEG) {
+    result =
+        convert_jpeg_to_rgb888_preview(apic_image.data, apic_image.size, &preview_pass, &state);
+  } else if (apic_image.type == PNG) {
+    result = convert_png_to_rgb888_preview(apic_image.data, apic_image.size, &preview_pass, &state);
+  } else {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_UNSUPPORTED_TYPE, "MIME type is not supported",
+             (const char *)&frame_buffer[1]);
+    return false;
+  }
+
+  return result && !state.failed;
 }
@@ -0,0 +1,119 @@
+#include "../include/image_decoder.h"
+#include <string.h>
+
+#define MAX_IMAGE_DECODERS 16
+
+// earlier entries are preferred for their format
+static const ImageDecoder *decoders[MAX_IMAGE_DECODERS] = {
+#ifdef MP3CORE_HAVE_SPNG
+    &spng_decoder,
+#endif
+    &libpng_decoder,
+    &libjpeg_decoder,
+};
+
+static size_t decoder_count =
+#ifdef MP3CORE_HAVE_SPNG
+    3;
+#else
+    2;
+#endif
+
+size_t image_decoder_count(void) { return decoder_count; }
+
+const ImageDecoder *image_decoder_at(size_t index) {
+  return index < decoder_count ? decoders[index] : NULL;
+}
+
+static size_t find_index(const char *name) {
+
+  for (size_t i = 0; i < decoder_count; i++) {
+    if (strcmp(decoders[i]->name, name) == 0) {
+      return i;
+    }
+  }
+
+  return decoder_count;
+}
+
+const ImageDecoder *image_decoder_find(const char *name) {
+  return image_decoder_at(find_index(name));
+}
+
+static void move_to_front(const ImageDecoder *decoder, size_t index) {
+  memmove(&decoders[1], &decoders[0], index * sizeof(decoders[0]));
+  decoders[0] = decoder;
+}
+
+bool image_decoder_register(const ImageDecoder *decoder) {
+
+  if (decoder_count == MAX_IMAGE_DECODERS || find_index(decoder->name) != decoder_count) {
+    return false;
+  }
+
+  move_to_front(decoder, decoder_count);
+  decoder_count++;
+  return true;
+}
+
+bool image_decoder_unregister(const char *name) {
+
+  size_t index = find_index(name);
+
+  if (index == decoder_count) {
+    return false;
+  }
+
+  decoder_count--;
+  memmove(&decoders[index], &decoders[index + 1], (decoder_count - index) * sizeof(decoders[0]));
+  decoders[decoder_count] = NULL;
+  return true;
+}
+
+bool image_decoder_prefer(const char *name) {
+
+  size_t index = find_index(name);
+
+  if (index == decoder_count) {
+    return false;
+  }
+
+  move_to_front(decoders[index], index);
+  return true;
+}
+
+const ImageDecoder *image_decoder_for(ImageType type, const uint8_t *data, uint32_t size) {
+
+  for (size_t i = 0; i < decoder_count; i++) {
+    if (decoders[i]->type == type && decoders[i]->probe(data, size)) {
+      return decoders[i];
+    }
+  }
+
+  return NULL;
+}
+
+static bool push_row(const uint8_t *row, uint32_t y, void *user_data) {
+  scaled_row_sink_push((ScaledRowSink *)user_data, row);
+  return true;
+}
+
+bool image_decoder_scale_rows(const ImageDecoder *decoder, const uint8_t *data, uint32_t size,
+                              Image *rgb888_scaled) {
+
+  uint32_t width;
+  uint32_t height;
+  ScaledRowSink sink;
+
+  if (!decoder->read_header(data, size, &width, &height) ||
+      !scaled_row_sink_init(&sink, width, height, rgb888_scaled)) {
+    return false;
+  }
+
+  if (!decoder->decode_rows(data, size, &push_row, &sink)) {
+    scaled_row_sink_free(&sink);
+    return false;
+  }
+
+  return scaled_row_sink_finish(&sink);
+}
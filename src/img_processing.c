@@ -1,28 +1,649 @@
 #include "../include/img_processing.h"
+#include "../include/art_memory.h"
 #include <assert.h>
+#include <stdlib.h>
 #include <string.h>
 
 #if __has_include(<arm_neon.h>)
 #include "arm_neon.h"
 #endif
 
-void scale_square_image(Image *src, Image *dst) {
+// the library is built for the baseline ISA, SSSE3 shuffles and AVX2 gathers are enabled per
+// function and picked at runtime
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && __has_include(<immintrin.h>)
+#include <immintrin.h>
+#define HAVE_SSSE3_KERNELS 1
+#endif
 
-  const float x_scale = ((float)(src->img_width)) / dst->img_width;
-  const float y_scale = ((float)(src->img_height)) / dst->img_height;
+void image_set_planar(Image *image, uint8_t *buffer, size_t width, size_t height) {
+
+  const size_t plane_size = width * height;
+
+  image->buffer = buffer;
+  image->length = plane_size * 3;
+  image->img_width = width;
+  image->img_height = height;
+  image->format = IMAGE_RGB888_PLANAR;
+  image->planes[0] = buffer;
+  image->planes[1] = buffer + plane_size;
+  image->planes[2] = buffer + plane_size * 2;
+  image->stride = 0;
+}
+
+static inline size_t bytes_per_pixel(PixelFormat format) {
+  switch (format) {
+  case IMAGE_RGB888_PLANAR:
+    return 1;
+  case IMAGE_RGB565:
+    return 2;
+  case IMAGE_RGBA8888:
+    return 4;
+  default:
+    return 3;
+  }
+}
+
+static inline size_t row_stride(const Image *image) {
+  return image_stride(image, bytes_per_pixel(image->format));
+}
+
+void image_view(Image *image, uint8_t *buffer, size_t width, size_t height, size_t stride,
+                PixelFormat format) {
+
+  assert(format != IMAGE_RGB888_PLANAR);
+
+  *image = (Image){.buffer = buffer,
+                   .length = stride * height,
+                   .img_width = width,
+                   .img_height = height,
+                   .format = format,
+                   .stride = stride};
+}
+
+bool image_allocate(Image *image, size_t width, size_t height, PixelFormat format) {
+
+  const size_t row_size = width * bytes_per_pixel(format);
+  const size_t stride = (row_size + IMAGE_ROW_ALIGNMENT - 1) & ~(size_t)(IMAGE_ROW_ALIGNMENT - 1);
+  const size_t plane_size = stride * height;
+  const size_t length = format == IMAGE_RGB888_PLANAR ? plane_size * 3 : plane_size;
+
+  uint8_t *buffer = length > 0 ? art_aligned_alloc(IMAGE_ROW_ALIGNMENT, length) : NULL;
+
+  if (buffer == NULL) {
+    return false;
+  }
+
+  *image = (Image){.buffer = buffer,
+                   .length = length,
+                   .img_width = width,
+                   .img_height = height,
+                   .format = format,
+                   .stride = stride};
+
+  if (format == IMAGE_RGB888_PLANAR) {
+    image->planes[0] = buffer;
+    image->planes[1] = buffer + plane_size;
+    image->planes[2] = buffer + plane_size * 2;
+  }
+
+  return true;
+}
+
+bool image_crop(const Image *image, size_t x, size_t y, size_t width, size_t height,
+                Image *view) {
+
+  if (x + width > image->img_width || y + height > image->img_height) {
+    return false;
+  }
+
+  const size_t stride = row_stride(image);
+  const size_t offset = y * stride + x * bytes_per_pixel(image->format);
+
+  *view = *image;
+  view->img_width = width;
+  view->img_height = height;
+  view->stride = stride;
+
+  if (image->format == IMAGE_RGB888_PLANAR) {
+    for (int32_t c = 0; c < 3; c++) {
+      view->planes[c] = image->planes[c] + offset;
+    }
+  }
+
+  // the view reaches up to the end of the parent buffer, which covers its last row
+  view->buffer = image->buffer + offset;
+  view->length = image->length - offset;
+  return true;
+}
+
+#ifdef HAVE_SSSE3_KERNELS
+
+__attribute__((target("ssse3"))) static size_t deinterleave_ssse3(const uint8_t *src, uint8_t *r,
+                                                                   uint8_t *g, uint8_t *b,
+                                                                   size_t pixel_count) {
+  // lanes taken from each of the three source vectors, -1 clears the lane
+  const __m128i r0 = _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13);
+  const __m128i g0 = _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i g1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14);
+  const __m128i b0 = _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1);
+  const __m128i b1 = _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1);
+  const __m128i b2 = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15);
+
+  size_t i = 0;
+
+  for (; i + 16 <= pixel_count; i += 16) {
+    const __m128i v0 = _mm_loadu_si128((const __m128i *)(src + i * 3));
+    const __m128i v1 = _mm_loadu_si128((const __m128i *)(src + i * 3 + 16));
+    const __m128i v2 = _mm_loadu_si128((const __m128i *)(src + i * 3 + 32));
+
+    __m128i v_r = _mm_or_si128(_mm_shuffle_epi8(v0, r0), _mm_shuffle_epi8(v1, r1));
+    __m128i v_g = _mm_or_si128(_mm_shuffle_epi8(v0, g0), _mm_shuffle_epi8(v1, g1));
+    __m128i v_b = _mm_or_si128(_mm_shuffle_epi8(v0, b0), _mm_shuffle_epi8(v1, b1));
+
+    _mm_storeu_si128((__m128i *)(r + i), _mm_or_si128(v_r, _mm_shuffle_epi8(v2, r2)));
+    _mm_storeu_si128((__m128i *)(g + i), _mm_or_si128(v_g, _mm_shuffle_epi8(v2, g2)));
+    _mm_storeu_si128((__m128i *)(b + i), _mm_or_si128(v_b, _mm_shuffle_epi8(v2, b2)));
+  }
+
+  return i;
+}
+
+__attribute__((target("ssse3"))) static size_t interleave_ssse3(const uint8_t *r, const uint8_t *g,
+                                                                 const uint8_t *b, uint8_t *dst,
+                                                                 size_t pixel_count) {
+  // lanes of each destination vector taken from the r, g and b vectors
+  const __m128i r0 = _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5);
+  const __m128i g0 = _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1);
+  const __m128i b0 = _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1);
+  const __m128i r1 = _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1);
+  const __m128i g1 = _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10);
+  const __m128i b1 = _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1);
+  const __m128i r2 = _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1);
+  const __m128i g2 = _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1);
+  const __m128i b2 = _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15);
+
+  size_t i = 0;
+
+  for (; i + 16 <= pixel_count; i += 16) {
+    const __m128i v_r = _mm_loadu_si128((const __m128i *)(r + i));
+    const __m128i v_g = _mm_loadu_si128((const __m128i *)(g + i));
+    const __m128i v_b = _mm_loadu_si128((const __m128i *)(b + i));
+
+    __m128i v0 = _mm_or_si128(_mm_shuffle_epi8(v_r, r0), _mm_shuffle_epi8(v_g, g0));
+    __m128i v1 = _mm_or_si128(_mm_shuffle_epi8(v_r, r1), _mm_shuffle_epi8(v_g, g1));
+    __m128i v2 = _mm_or_si128(_mm_shuffle_epi8(v_r, r2), _mm_shuffle_epi8(v_g, g2));
+
+    _mm_storeu_si128((__m128i *)(dst + i * 3), _mm_or_si128(v0, _mm_shuffle_epi8(v_b, b0)));
+    _mm_storeu_si128((__m128i *)(dst + i * 3 + 16), _mm_or_si128(v1, _mm_shuffle_epi8(v_b, b1)));
+    _mm_storeu_si128((__m128i *)(dst + i * 3 + 32), _mm_or_si128(v2, _mm_shuffle_epi8(v_b, b2)));
+  }
+
+  return i;
+}
+
+static bool has_ssse3(void) {
+  static int supported = -1;
+
+  if (supported < 0) {
+    supported = __builtin_cpu_supports("ssse3") ? 1 : 0;
+  }
+
+  return supported == 1;
+}
+
+#endif // HAVE_SSSE3_KERNELS
+
+void deinterleave_rgb888(const uint8_t *src, uint8_t *r, uint8_t *g, uint8_t *b,
+                         size_t pixel_count) {
+
+  size_t i = 0;
+
+#if __has_include(<arm_neon.h>)
+  for (; i + 16 <= pixel_count; i += 16) {
+    uint8x16x3_t v_rgb888 = vld3q_u8(src + i * 3);
+    vst1q_u8(r + i, v_rgb888.val[0]);
+    vst1q_u8(g + i, v_rgb888.val[1]);
+    vst1q_u8(b + i, v_rgb888.val[2]);
+  }
+#elif defined(HAVE_SSSE3_KERNELS)
+  if (has_ssse3()) {
+    i = deinterleave_ssse3(src, r, g, b, pixel_count);
+  }
+#endif
+
+  // tail and targets without shuffles
+  for (; i < pixel_count; i++) {
+    r[i] = src[i * 3 + 0];
+    g[i] = src[i * 3 + 1];
+    b[i] = src[i * 3 + 2];
+  }
+}
 
-  assert(x_scale == y_scale);
+void interleave_rgb888(const uint8_t *r, const uint8_t *g, const uint8_t *b, uint8_t *dst,
+                       size_t pixel_count) {
 
-  const float scale = x_scale;
+  size_t i = 0;
+
+#if __has_include(<arm_neon.h>)
+  for (; i + 16 <= pixel_count; i += 16) {
+    uint8x16x3_t v_rgb888 = {{vld1q_u8(r + i), vld1q_u8(g + i), vld1q_u8(b + i)}};
+    vst3q_u8(dst + i * 3, v_rgb888);
+  }
+#elif defined(HAVE_SSSE3_KERNELS)
+  if (has_ssse3()) {
+    i = interleave_ssse3(r, g, b, dst, pixel_count);
+  }
+#endif
+
+  for (; i < pixel_count; i++) {
+    dst[i * 3 + 0] = r[i];
+    dst[i * 3 + 1] = g[i];
+    dst[i * 3 + 2] = b[i];
+  }
+}
+
+// pixels whose bins are computed at once, small enough to keep the bin indices in registers or L1
+#define HISTOGRAM_CHUNK 64
+
+static inline uint16_t histogram_bin(uint8_t r, uint8_t g, uint8_t b) {
+  return (uint16_t)(((r >> (8 - HISTOGRAM_BITS)) << (2 * HISTOGRAM_BITS)) |
+                    ((g >> (8 - HISTOGRAM_BITS)) << HISTOGRAM_BITS) | (b >> (8 - HISTOGRAM_BITS)));
+}
+
+#if defined(HAVE_SSSE3_KERNELS)
+
+__attribute__((target("ssse3"))) static inline __m128i histogram_bins_sse(__m128i r, __m128i g,
+                                                                          __m128i b) {
+  const __m128i high_r = _mm_slli_epi16(_mm_srli_epi16(r, 8 - HISTOGRAM_BITS), 2 * HISTOGRAM_BITS);
+  const __m128i high_g = _mm_slli_epi16(_mm_srli_epi16(g, 8 - HISTOGRAM_BITS), HISTOGRAM_BITS);
+  return _mm_or_si128(_mm_or_si128(high_r, high_g), _mm_srli_epi16(b, 8 - HISTOGRAM_BITS));
+}
+
+__attribute__((target("ssse3"))) static size_t histogram_bins_ssse3(const uint8_t *r,
+                                                                     const uint8_t *g,
+                                                                     const uint8_t *b,
+                                                                     uint16_t *bins, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  size_t i = 0;
+
+  // bytes are widened to 16 bit lanes first, there are no byte shifts
+  for (; i + 16 <= count; i += 16) {
+    const __m128i v_r = _mm_loadu_si128((const __m128i *)(r + i));
+    const __m128i v_g = _mm_loadu_si128((const __m128i *)(g + i));
+    const __m128i v_b = _mm_loadu_si128((const __m128i *)(b + i));
+
+    _mm_storeu_si128((__m128i *)(bins + i),
+                     histogram_bins_sse(_mm_unpacklo_epi8(v_r, zero), _mm_unpacklo_epi8(v_g, zero),
+                                        _mm_unpacklo_epi8(v_b, zero)));
+    _mm_storeu_si128((__m128i *)(bins + i + 8),
+                     histogram_bins_sse(_mm_unpackhi_epi8(v_r, zero), _mm_unpackhi_epi8(v_g, zero),
+                                        _mm_unpackhi_epi8(v_b, zero)));
+  }
+
+  return i;
+}
+
+#endif // HAVE_SSSE3_KERNELS
+
+static void histogram_bins(const uint8_t *r, const uint8_t *g, const uint8_t *b, uint16_t *bins,
+                           size_t count) {
+
+  size_t i = 0;
+
+#if __has_include(<arm_neon.h>)
+  for (; i + 16 <= count; i += 16) {
+    const uint8x16_t v_r = vshrq_n_u8(vld1q_u8(r + i), 8 - HISTOGRAM_BITS);
+    const uint8x16_t v_g = vshrq_n_u8(vld1q_u8(g + i), 8 - HISTOGRAM_BITS);
+    const uint8x16_t v_b = vshrq_n_u8(vld1q_u8(b + i), 8 - HISTOGRAM_BITS);
+
+    uint16x8_t low = vorrq_u16(vshlq_n_u16(vmovl_u8(vget_low_u8(v_r)), 2 * HISTOGRAM_BITS),
+                               vshlq_n_u16(vmovl_u8(vget_low_u8(v_g)), HISTOGRAM_BITS));
+    uint16x8_t high = vorrq_u16(vshlq_n_u16(vmovl_u8(vget_high_u8(v_r)), 2 * HISTOGRAM_BITS),
+                                vshlq_n_u16(vmovl_u8(vget_high_u8(v_g)), HISTOGRAM_BITS));
+
+    vst1q_u16(bins + i, vorrq_u16(low, vmovl_u8(vget_low_u8(v_b))));
+    vst1q_u16(bins + i + 8, vorrq_u16(high, vmovl_u8(vget_high_u8(v_b))));
+  }
+#elif defined(HAVE_SSSE3_KERNELS)
+  if (has_ssse3()) {
+    i = histogram_bins_ssse3(r, g, b, bins, count);
+  }
+#endif
+
+  for (; i < count; i++) {
+    bins[i] = histogram_bin(r[i], g[i], b[i]);
+  }
+}
+
+static void histogram_add_planar(ColorHistogram *histogram, const uint8_t *restrict r,
+                                 const uint8_t *restrict g, const uint8_t *restrict b,
+                                 size_t width) {
+
+  uint16_t bins[HISTOGRAM_CHUNK];
+
+  for (size_t x = 0; x < width; x += HISTOGRAM_CHUNK) {
+    const size_t count = width - x < HISTOGRAM_CHUNK ? width - x : HISTOGRAM_CHUNK;
+
+    // the bin indices of a chunk are computed with vector shifts, only the scatter is scalar
+    histogram_bins(r + x, g + x, b + x, bins, count);
+
+    for (size_t i = 0; i < count; i++) {
+      histogram->counts[bins[i]]++;
+      histogram->sums[bins[i]][0] += r[x + i];
+      histogram->sums[bins[i]][1] += g[x + i];
+      histogram->sums[bins[i]][2] += b[x + i];
+    }
+  }
+}
+
+static void histogram_add_interleaved(ColorHistogram *histogram, const uint8_t *rgb,
+                                      size_t width) {
+
+  uint8_t planes[3][HISTOGRAM_CHUNK];
+
+  // chunks are split into planes with the shuffles of deinterleave_rgb888 and binned like planar
+  // rows
+  for (size_t x = 0; x < width; x += HISTOGRAM_CHUNK) {
+    const size_t count = width - x < HISTOGRAM_CHUNK ? width - x : HISTOGRAM_CHUNK;
+
+    deinterleave_rgb888(rgb + x * 3, planes[0], planes[1], planes[2], count);
+    histogram_add_planar(histogram, planes[0], planes[1], planes[2], count);
+  }
+}
+
+void color_histogram_add_rows(ColorHistogram *histogram, const Image *image, size_t y_start,
+                              size_t y_end) {
+
+  const size_t stride = row_stride(image);
+
+  for (size_t y = y_start; y < y_end; y++) {
+    if (image->format == IMAGE_RGB888_PLANAR) {
+      histogram_add_planar(histogram, image->planes[0] + y * stride,
+                           image->planes[1] + y * stride, image->planes[2] + y * stride,
+                           image->img_width);
+    } else {
+      histogram_add_interleaved(histogram, image->buffer + y * stride, image->img_width);
+    }
+  }
+}
+
+/**
+ * Occupied histogram bin and the mean colour of its pixels, what median cut sorts and splits.
+ */
+typedef struct {
+  uint8_t rgb[3];
+  uint16_t bin;
+} HistogramColor;
+
+/**
+ * Range [start, end) of the occupied bins, pixels is the number of pixels in them, axis the
+ * channel with the biggest extent.
+ */
+typedef struct {
+  size_t start;
+  size_t end;
+  uint64_t pixels;
+  int32_t axis;
+  uint32_t extent;
+} ColorBox;
+
+static void color_box_measure(ColorBox *box, const HistogramColor *colors,
+                              const ColorHistogram *histogram) {
+
+  uint8_t low[3] = {255, 255, 255};
+  uint8_t high[3] = {0, 0, 0};
+
+  box->pixels = 0;
+
+  for (size_t i = box->start; i < box->end; i++) {
+    box->pixels += histogram->counts[colors[i].bin];
+
+    for (int32_t c = 0; c < 3; c++) {
+      low[c] = colors[i].rgb[c] < low[c] ? colors[i].rgb[c] : low[c];
+      high[c] = colors[i].rgb[c] > high[c] ? colors[i].rgb[c] : high[c];
+    }
+  }
+
+  box->axis = 0;
+  box->extent = 0;
+
+  for (int32_t c = 0; c < 3; c++) {
+    if ((uint32_t)(high[c] - low[c]) > box->extent) {
+      box->axis = c;
+      box->extent = high[c] - low[c];
+    }
+  }
+}
+
+static int compare_red(const void *a, const void *b) {
+  return ((const HistogramColor *)a)->rgb[0] - ((const HistogramColor *)b)->rgb[0];
+}
+
+static int compare_green(const void *a, const void *b) {
+  return ((const HistogramColor *)a)->rgb[1] - ((const HistogramColor *)b)->rgb[1];
+}
+
+static int compare_blue(const void *a, const void *b) {
+  return ((const HistogramColor *)a)->rgb[2] - ((const HistogramColor *)b)->rgb[2];
+}
+
+static int compare_palette_pixels(const void *a, const void *b) {
+  const uint32_t pixels_a = ((const PaletteColor *)a)->pixels;
+  const uint32_t pixels_b = ((const PaletteColor *)b)->pixels;
+  return pixels_a < pixels_b ? 1 : pixels_a > pixels_b ? -1 : 0;
+}
+
+void color_histogram_palette(const ColorHistogram *histogram, Palette *palette) {
+
+  int (*const comparators[3])(const void *, const void *) = {&compare_red, &compare_green,
+                                                               &compare_blue};
+
+  const uint32_t max_colors = palette->max_colors > 0 && palette->max_colors < PALETTE_MAX_COLORS
+                                  ? palette->max_colors
+                                  : PALETTE_MAX_COLORS;
+
+  HistogramColor colors[HISTOGRAM_BINS];
+  size_t color_count = 0;
+
+  for (uint32_t bin = 0; bin < HISTOGRAM_BINS; bin++) {
+    const uint32_t count = histogram->counts[bin];
+
+    if (count > 0) {
+      colors[color_count].bin = (uint16_t)bin;
+      for (int32_t c = 0; c < 3; c++) {
+        colors[color_count].rgb[c] = (uint8_t)(histogram->sums[bin][c] / count);
+      }
+      color_count++;
+    }
+  }
+
+  ColorBox boxes[PALETTE_MAX_COLORS];
+  uint32_t box_count = 0;
+
+  if (color_count > 0) {
+    boxes[0] = (ColorBox){.start = 0, .end = color_count};
+    color_box_measure(&boxes[0], colors, histogram);
+    box_count = 1;
+  }
+
+  while (box_count < max_colors) {
+    // many pixels spread over a wide range of colours are split first
+    ColorBox *widest = NULL;
+
+    for (uint32_t i = 0; i < box_count; i++) {
+      if (boxes[i].end - boxes[i].start > 1 &&
+          (widest == NULL ||
+           boxes[i].pixels * boxes[i].extent > widest->pixels * widest->extent)) {
+        widest = &boxes[i];
+      }
+    }
+
+    if (widest == NULL) {
+      break;
+    }
+
+    qsort(colors + widest->start, widest->end - widest->start, sizeof(HistogramColor),
+          comparators[widest->axis]);
+
+    // the split with the biggest between-class variance along the axis (Otsu), a plain median
+    // would cut a dominant colour in two when its pixels spread over neighbouring bins
+    const int32_t axis = widest->axis;
+    uint64_t axis_sum = 0;
+
+    for (size_t i = widest->start; i < widest->end; i++) {
+      axis_sum += histogram->sums[colors[i].bin][axis];
+    }
+
+    size_t split = widest->start + 1;
+    double best = -1.0;
+    uint64_t left_pixels = 0;
+    uint64_t left_sum = 0;
+
+    for (size_t i = widest->start + 1; i < widest->end; i++) {
+      left_pixels += histogram->counts[colors[i - 1].bin];
+      left_sum += histogram->sums[colors[i - 1].bin][axis];
+
+      const uint64_t right_pixels = widest->pixels - left_pixels;
+      const double difference = (double)left_sum / left_pixels -
+                                (double)(axis_sum - left_sum) / right_pixels;
+      const double variance = (double)left_pixels * right_pixels * difference * difference;
+
+      if (variance > best) {
+        best = variance;
+        split = i;
+      }
+    }
+
+    boxes[box_count] = (ColorBox){.start = split, .end = widest->end};
+    widest->end = split;
+    color_box_measure(widest, colors, histogram);
+    color_box_measure(&boxes[box_count], colors, histogram);
+    box_count++;
+  }
+
+  for (uint32_t i = 0; i < box_count; i++) {
+    uint64_t sums[3] = {0, 0, 0};
+
+    for (size_t j = boxes[i].start; j < boxes[i].end; j++) {
+      for (int32_t c = 0; c < 3; c++) {
+        sums[c] += histogram->sums[colors[j].bin][c];
+      }
+    }
+
+    palette->colors[i] = (PaletteColor){.r = (uint8_t)(sums[0] / boxes[i].pixels),
+                                        .g = (uint8_t)(sums[1] / boxes[i].pixels),
+                                        .b = (uint8_t)(sums[2] / boxes[i].pixels),
+                                        .pixels = (uint32_t)boxes[i].pixels};
+  }
+
+  palette->count = box_count;
+  qsort(palette->colors, box_count, sizeof(PaletteColor), &compare_palette_pixels);
+}
+
+/**
+ * Copies an image of the same size row by row, converting between the interleaved and planar
+ * layouts.
+ */
+static void copy_image(Image *src, Image *dst) {
+
+  const size_t width = src->img_width;
+  const size_t src_stride = row_stride(src);
+  const size_t dst_stride = row_stride(dst);
+
+  for (size_t y = 0; y < src->img_height; y++) {
+    const size_t src_offset = y * src_stride;
+    const size_t dst_offset = y * dst_stride;
+
+    if (src->format == IMAGE_RGB888 && dst->format == IMAGE_RGB888) {
+      memcpy(dst->buffer + dst_offset, src->buffer + src_offset, width * 3);
+    } else if (src->format == IMAGE_RGB888) {
+      deinterleave_rgb888(src->buffer + src_offset, dst->planes[0] + dst_offset,
+                          dst->planes[1] + dst_offset, dst->planes[2] + dst_offset, width);
+    } else if (dst->format == IMAGE_RGB888) {
+      interleave_rgb888(src->planes[0] + src_offset, src->planes[1] + src_offset,
+                        src->planes[2] + src_offset, dst->buffer + dst_offset, width);
+    } else {
+      for (int32_t c = 0; c < 3; c++) {
+        memcpy(dst->planes[c] + dst_offset, src->planes[c] + src_offset, width);
+      }
+    }
+  }
+}
+
+static bool downscale_rows(Image *src, Image *dst, ColorHistogram *histogram, bool linear_light) {
+
+  RowDownscaler scaler;
+
+  if (!row_downscaler_init_ex(&scaler, src->img_width, src->img_height, dst, linear_light)) {
+    return false;
+  }
+
+  scaler.histogram = histogram;
+  scaler.orientation = src->orientation;
+
+  for (size_t y = 0; y < src->img_height && !row_downscaler_finished(&scaler); y++) {
+    const size_t offset = y * row_stride(src);
+
+    if (src->format == IMAGE_RGB888_PLANAR) {
+      row_downscaler_push_planar(&scaler, src->planes[0] + offset, src->planes[1] + offset,
+                                 src->planes[2] + offset);
+    } else {
+      row_downscaler_push(&scaler, src->buffer + offset);
+    }
+  }
+
+  row_downscaler_free(&scaler);
+  return true;
+}
+
+bool image_scales_square(size_t src_width, size_t src_height, const Image *dst) {
+  return src_width > 0 && src_height > 0 && dst->img_width > 0 && dst->img_height > 0 &&
+         (uint64_t)src_width * dst->img_height == (uint64_t)src_height * dst->img_width;
+}
+
+static bool is_rgb888(const Image *image) {
+  return image->format == IMAGE_RGB888 || image->format == IMAGE_RGB888_PLANAR;
+}
+
+bool scale_square_image_ex(Image *src, Image *dst, ColorHistogram *histogram, bool linear_light) {
+
+  if (!image_scales_square(src->img_width, src->img_height, dst) || !is_rgb888(src) ||
+      !is_rgb888(dst)) {
+    return false;
+  }
+
+  if (src->img_width > dst->img_width) {
+    // the row based version only fails to allocate its column sums, the reference version
+    // needs no memory but only handles interleaved images
+    if (downscale_rows(src, dst, histogram, linear_light)) {
+      return true;
+    }
+
+    if (src->format != IMAGE_RGB888 || dst->format != IMAGE_RGB888) {
+      return false;
+    }
 
-  if (scale == 1.0f) {
-    memcpy(dst->buffer, src->buffer, dst->length);
-  } else if (scale > 1.0f) {
     downscale_area_average(src, dst);
+  } else if (src->img_width == dst->img_width && src->orientation <= ORIENTATION_NORMAL) {
+    copy_image(src, dst);
   } else {
-    // upscaling not implemented
-    assert(0);
+    // only used for coarse previews and turned pictures that are already small, quality does not
+    // matter
+    upscale_nearest(src, dst);
+  }
+
+  if (histogram != NULL) {
+    color_histogram_add_rows(histogram, dst, 0, dst->img_height);
   }
+
+  return true;
+}
+
+bool scale_square_image(Image *src, Image *dst) {
+  return scale_square_image_ex(src, dst, NULL, false);
 }
 
 void downscale_area_average(Image *src, Image *dst) {
@@ -34,6 +655,9 @@ void downscale_area_average(Image *src, Image *dst) {
   assert(x_scale > 1.0f);
   assert(y_scale > 1.0f);
 
+  const size_t src_stride = image_stride(src, 3);
+  const size_t dst_stride = image_stride(dst, 3);
+
   // for (size_t idx = 0; idx < dst_height * dst_width; idx++) {
 
   for (uint32_t y = 0; y < dst->img_height; y++) {
@@ -60,13 +684,13 @@ void downscale_area_average(Image *src, Image *dst) {
 
         for (int32_t sy = src_y_start; sy < src_y_end; sy++) {
           for (int32_t sx = src_x_start; sx < src_x_end; sx++) {
-            size_t src_idx = (sy * src->img_width + sx) * 3 + c;
+            size_t src_idx = sy * src_stride + sx * 3 + c;
             assert(src_idx < src->length);
             sum += src->buffer[src_idx];
           }
         }
 
-        size_t dst_idx = (y * dst->img_width + x) * 3 + c;
+        size_t dst_idx = y * dst_stride + x * 3 + c;
         assert(dst_idx < dst->length);
         dst->buffer[dst_idx] = (uint8_t)(sum / pixel_count);
       }
@@ -74,33 +698,812 @@ void downscale_area_average(Image *src, Image *dst) {
   }
 }
 
+static inline bool orientation_transposes(Orientation orientation) {
+  return orientation >= ORIENTATION_TRANSPOSE;
+}
+
+/**
+ * Moves pixel (x, y) of a width x height image to where the orientation puts it. Orientations that
+ * transpose need a square image.
+ */
+static void oriented_position(Orientation orientation, size_t width, size_t height, size_t *x,
+                              size_t *y) {
+
+  const size_t sx = *x;
+  const size_t sy = *y;
+
+  switch (orientation) {
+  case ORIENTATION_MIRROR_HORIZONTAL:
+    *x = width - 1 - sx;
+    break;
+  case ORIENTATION_ROTATE_180:
+    *x = width - 1 - sx;
+    *y = height - 1 - sy;
+    break;
+  case ORIENTATION_MIRROR_VERTICAL:
+    *y = height - 1 - sy;
+    break;
+  case ORIENTATION_TRANSPOSE:
+    *x = sy;
+    *y = sx;
+    break;
+  case ORIENTATION_ROTATE_90:
+    *x = height - 1 - sy;
+    *y = sx;
+    break;
+  case ORIENTATION_TRANSVERSE:
+    *x = height - 1 - sy;
+    *y = width - 1 - sx;
+    break;
+  case ORIENTATION_ROTATE_270:
+    *x = sy;
+    *y = width - 1 - sx;
+    break;
+  default:
+    break;
+  }
+}
+
+static inline uint8_t *channel_at(Image *image, size_t x, size_t y, int32_t c) {
+  return image->format == IMAGE_RGB888_PLANAR ? image->planes[c] + y * row_stride(image) + x
+                                              : image->buffer + y * row_stride(image) + x * 3 + c;
+}
+
+void upscale_nearest(Image *src, Image *dst) {
+
+  // upscaling only
+  assert(src->img_width <= dst->img_width);
+  assert(src->img_height <= dst->img_height);
+
+  for (uint32_t y = 0; y < dst->img_height; y++) {
+    const uint32_t src_y = (uint32_t)((size_t)y * src->img_height / dst->img_height);
+
+    for (uint32_t x = 0; x < dst->img_width; x++) {
+      const uint32_t src_x = (uint32_t)((size_t)x * src->img_width / dst->img_width);
+
+      size_t dst_x = x;
+      size_t dst_y = y;
+      oriented_position(src->orientation, dst->img_width, dst->img_height, &dst_x, &dst_y);
+
+      for (int32_t c = 0; c < 3; c++) {
+        *channel_at(dst, dst_x, dst_y, c) = *channel_at(src, src_x, src_y, c);
+      }
+    }
+  }
+}
+
+/**
+ * 12 bit linear light of every sRGB byte, round(255 * decode(s / 255) * 4095 / 255). The entry past
+ * the end pads the 32 bit gathers of the AVX2 kernel, which read two entries at once.
+ */
+static const uint16_t SRGB_TO_LINEAR[257] = {
+    0, 1, 2, 4, 5, 6, 7, 9, 10, 11, 12, 14, 15, 16, 18, 20,
+    21, 23, 25, 27, 29, 31, 33, 35, 37, 40, 42, 45, 48, 50, 53, 56,
+    59, 62, 66, 69, 72, 76, 79, 83, 87, 91, 95, 99, 103, 107, 112, 116,
+    121, 126, 131, 136, 141, 146, 151, 156, 162, 168, 173, 179, 185, 191, 197, 204,
+    210, 216, 223, 230, 237, 244, 251, 258, 265, 273, 280, 288, 296, 304, 312, 320,
+    329, 337, 346, 354, 363, 372, 381, 390, 400, 409, 419, 428, 438, 448, 458, 469,
+    479, 490, 500, 511, 522, 533, 544, 555, 567, 578, 590, 602, 614, 626, 639, 651,
+    664, 676, 689, 702, 715, 728, 742, 755, 769, 783, 797, 811, 825, 840, 854, 869,
+    884, 899, 914, 929, 945, 960, 976, 992, 1008, 1024, 1041, 1057, 1074, 1091, 1108, 1125,
+    1142, 1159, 1177, 1195, 1213, 1231, 1249, 1267, 1286, 1304, 1323, 1342, 1361, 1381, 1400, 1420,
+    1440, 1459, 1480, 1500, 1520, 1541, 1562, 1582, 1603, 1625, 1646, 1668, 1689, 1711, 1733, 1755,
+    1778, 1800, 1823, 1846, 1869, 1892, 1916, 1939, 1963, 1987, 2011, 2035, 2059, 2084, 2109, 2133,
+    2159, 2184, 2209, 2235, 2260, 2286, 2312, 2339, 2365, 2392, 2419, 2446, 2473, 2500, 2527, 2555,
+    2583, 2611, 2639, 2668, 2696, 2725, 2754, 2783, 2812, 2841, 2871, 2901, 2931, 2961, 2991, 3022,
+    3052, 3083, 3114, 3146, 3177, 3209, 3240, 3272, 3304, 3337, 3369, 3402, 3435, 3468, 3501, 3535,
+    3568, 3602, 3636, 3670, 3705, 3739, 3774, 3809, 3844, 3879, 3915, 3950, 3986, 4022, 4059, 4095,
+    0,
+};
+
+#if __has_include(<arm_neon.h>)
+
+/**
+ * Looks up 16 bytes at a time with vqtbl4q/vqtbx4q, four 64 entry lookups per byte of the table
+ * entries. Indices outside the 64 entries of a lookup keep the lanes of the previous one.
+ */
+static size_t add_linear_neon(uint32_t *sums, const uint8_t *plane, size_t width) {
+
+  uint8x16x4_t low[4];
+  uint8x16x4_t high[4];
+
+  for (int32_t t = 0; t < 4; t++) {
+    for (int32_t v = 0; v < 4; v++) {
+      uint8x16x2_t entries = vld2q_u8((const uint8_t *)(SRGB_TO_LINEAR + t * 64 + v * 16));
+      low[t].val[v] = entries.val[0];
+      high[t].val[v] = entries.val[1];
+    }
+  }
+
+  size_t x = 0;
+
+  for (; x + 16 <= width; x += 16) {
+    const uint8x16_t index = vld1q_u8(plane + x);
+    uint8x16_t lo = vqtbl4q_u8(low[0], index);
+    uint8x16_t hi = vqtbl4q_u8(high[0], index);
+
+    for (int32_t t = 1; t < 4; t++) {
+      const uint8x16_t shifted = vsubq_u8(index, vdupq_n_u8((uint8_t)(t * 64)));
+      lo = vqtbx4q_u8(lo, low[t], shifted);
+      hi = vqtbx4q_u8(hi, high[t], shifted);
+    }
+
+    const uint16x8_t linear_low = vreinterpretq_u16_u8(vzip1q_u8(lo, hi));
+    const uint16x8_t linear_high = vreinterpretq_u16_u8(vzip2q_u8(lo, hi));
+
+    vst1q_u32(sums + x, vaddw_u16(vld1q_u32(sums + x), vget_low_u16(linear_low)));
+    vst1q_u32(sums + x + 4, vaddw_high_u16(vld1q_u32(sums + x + 4), linear_low));
+    vst1q_u32(sums + x + 8, vaddw_u16(vld1q_u32(sums + x + 8), vget_low_u16(linear_high)));
+    vst1q_u32(sums + x + 12, vaddw_high_u16(vld1q_u32(sums + x + 12), linear_high));
+  }
+
+  return x;
+}
+
+#elif defined(HAVE_SSSE3_KERNELS)
+
+__attribute__((target("avx2"))) static size_t add_linear_avx2(uint32_t *sums, const uint8_t *plane,
+                                                               size_t width) {
+  const __m256i mask = _mm256_set1_epi32(0xFFFF);
+  size_t x = 0;
+
+  // two independent gathers per iteration keep more loads in flight
+  for (; x + 16 <= width; x += 16) {
+    const __m128i bytes = _mm_loadu_si128((const __m128i *)(plane + x));
+    const __m256i index_low = _mm256_cvtepu8_epi32(bytes);
+    const __m256i index_high = _mm256_cvtepu8_epi32(_mm_srli_si128(bytes, 8));
+    const __m256i linear_low = _mm256_and_si256(
+        _mm256_i32gather_epi32((const int *)SRGB_TO_LINEAR, index_low, 2), mask);
+    const __m256i linear_high = _mm256_and_si256(
+        _mm256_i32gather_epi32((const int *)SRGB_TO_LINEAR, index_high, 2), mask);
+    const __m256i sum_low = _mm256_loadu_si256((const __m256i *)(sums + x));
+    const __m256i sum_high = _mm256_loadu_si256((const __m256i *)(sums + x + 8));
+    _mm256_storeu_si256((__m256i *)(sums + x), _mm256_add_epi32(sum_low, linear_low));
+    _mm256_storeu_si256((__m256i *)(sums + x + 8), _mm256_add_epi32(sum_high, linear_high));
+  }
+
+  return x;
+}
+
+static bool has_avx2(void) {
+  static int supported = -1;
+
+  if (supported < 0) {
+    supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+  }
+
+  return supported == 1;
+}
+
+#endif
+
+/**
+ * Adds the linear light of a row of one plane to its column sums.
+ */
+static void add_linear_row(uint32_t *restrict sums, const uint8_t *restrict plane, size_t width) {
+
+  size_t x = 0;
+
+#if __has_include(<arm_neon.h>)
+  x = add_linear_neon(sums, plane, width);
+#elif defined(HAVE_SSSE3_KERNELS)
+  if (has_avx2()) {
+    x = add_linear_avx2(sums, plane, width);
+  }
+#endif
+
+  for (; x < width; x++) {
+    sums[x] += SRGB_TO_LINEAR[plane[x]];
+  }
+}
+
+/**
+ * Fills the LINEAR_LIGHT_LEVELS entries of table with the sRGB byte whose linear light is nearest,
+ * so the average of a uniform area maps back to its own byte.
+ */
+static void fill_linear_to_srgb(uint8_t *table) {
+
+  uint32_t srgb = 0;
+
+  for (uint32_t level = 0; level < LINEAR_LIGHT_LEVELS; level++) {
+    while (srgb < 255 && level * 2 >= (uint32_t)SRGB_TO_LINEAR[srgb] + SRGB_TO_LINEAR[srgb + 1]) {
+      srgb++;
+    }
+    table[level] = (uint8_t)srgb;
+  }
+}
+
+static void row_downscaler_start_row(RowDownscaler *scaler) {
+
+  const uint32_t y = scaler->dst_y;
+
+  // same bounds as downscale_area_average, so both produce identical pixels
+  scaler->y_start = (uint32_t)(y * scaler->y_scale);
+  scaler->y_end = (uint32_t)((y + 1) * scaler->y_scale) < scaler->src_height
+                      ? (uint32_t)((y + 1) * scaler->y_scale)
+                      : scaler->src_height;
+
+  memset(scaler->column_sums, 0, scaler->src_width * 3 * sizeof(uint32_t));
+}
+
+bool row_downscaler_init(RowDownscaler *scaler, size_t src_width, size_t src_height, Image *dst) {
+  return row_downscaler_init_ex(scaler, src_width, src_height, dst, false);
+}
+
+bool row_downscaler_init_ex(RowDownscaler *scaler, size_t src_width, size_t src_height, Image *dst,
+                            bool linear_light) {
+
+  const float x_scale = ((float)src_width) / dst->img_width;
+
+  scaler->dst = dst;
+  scaler->src_width = src_width;
+  scaler->src_height = src_height;
+  scaler->y_scale = ((float)src_height) / dst->img_height;
+  scaler->dst_y = 0;
+  scaler->src_y = 0;
+  scaler->histogram = NULL;
+  scaler->orientation = ORIENTATION_UNTAGGED;
+  scaler->staged_rows = 0;
+
+  // downscaling only
+  assert(x_scale > 1.0f);
+  assert(scaler->y_scale > 1.0f);
+
+  scaler->x_bounds = art_malloc(dst->img_width * 2 * sizeof(uint32_t));
+  scaler->column_sums = art_malloc(src_width * 3 * sizeof(uint32_t));
+  scaler->row_planes = art_malloc(src_width * 3);
+  scaler->linear_to_srgb = linear_light ? art_malloc(LINEAR_LIGHT_LEVELS) : NULL;
+  scaler->staging = art_malloc(ORIENTATION_BLOCK_ROWS * dst->img_width * 3);
+
+  if (scaler->x_bounds == NULL || scaler->column_sums == NULL || scaler->row_planes == NULL ||
+      (linear_light && scaler->linear_to_srgb == NULL) || scaler->staging == NULL) {
+    row_downscaler_free(scaler);
+    return false;
+  }
+
+  if (linear_light) {
+    fill_linear_to_srgb(scaler->linear_to_srgb);
+  }
+
+  for (uint32_t x = 0; x < dst->img_width; x++) {
+    scaler->x_bounds[x * 2] = (uint32_t)(x * x_scale);
+    scaler->x_bounds[x * 2 + 1] =
+        (uint32_t)((x + 1) * x_scale) < src_width ? (uint32_t)((x + 1) * x_scale) : src_width;
+  }
+
+  row_downscaler_start_row(scaler);
+  return true;
+}
+
+/**
+ * Writes the staged rows into the destination columns they are turned into. Every destination row
+ * gets one run of staged_rows pixels, instead of a single pixel per averaged row.
+ */
+static void row_downscaler_flush_staging(RowDownscaler *scaler) {
+
+  Image *dst = scaler->dst;
+  const size_t width = dst->img_width;
+  const size_t stride = row_stride(dst);
+  const size_t pixel_size = dst->format == IMAGE_RGB888_PLANAR ? 1 : 3;
+  const uint32_t first_row = scaler->dst_y + 1 - scaler->staged_rows;
+
+  // the staged rows go to consecutive columns, right to left for the clockwise turns, and the
+  // staged columns to consecutive rows, bottom to top for the counter clockwise turns
+  const ptrdiff_t step = scaler->orientation == ORIENTATION_ROTATE_90 ||
+                                 scaler->orientation == ORIENTATION_TRANSVERSE
+                             ? -(ptrdiff_t)pixel_size
+                             : (ptrdiff_t)pixel_size;
+  const ptrdiff_t row_step = scaler->orientation == ORIENTATION_ROTATE_270 ||
+                                     scaler->orientation == ORIENTATION_TRANSVERSE
+                                 ? -(ptrdiff_t)stride
+                                 : (ptrdiff_t)stride;
+
+  size_t column = 0;
+  size_t row = first_row;
+  oriented_position(scaler->orientation, width, dst->img_height, &column, &row);
+
+  for (int32_t c = 0; c < 3; c++) {
+    const uint8_t *staged = scaler->staging + (size_t)c * ORIENTATION_BLOCK_ROWS * width;
+    uint8_t *out = dst->format == IMAGE_RGB888_PLANAR ? dst->planes[c] + row * stride + column
+                                                      : dst->buffer + row * stride + column * 3 + c;
+
+    for (size_t x = 0; x < width; x++, out += row_step) {
+      for (uint32_t r = 0; r < scaler->staged_rows; r++) {
+        out[(ptrdiff_t)r * step] = staged[r * width + x];
+      }
+    }
+  }
+
+  scaler->staged_rows = 0;
+}
+
+/**
+ * Averages the column sums of the finished destination row horizontally and stores the pixels in
+ * the layout of the destination image, at the position the orientation gives them.
+ */
+static void row_downscaler_emit_row(RowDownscaler *scaler) {
+
+  Image *dst = scaler->dst;
+  const uint32_t row_count = scaler->y_end - scaler->y_start;
+  const Orientation orientation = scaler->orientation;
+  const bool transposes = orientation_transposes(orientation);
+  const bool mirrored =
+      orientation == ORIENTATION_MIRROR_HORIZONTAL || orientation == ORIENTATION_ROTATE_180;
+
+  size_t first_column = 0;
+  size_t row = scaler->dst_y;
+
+  if (!transposes) {
+    oriented_position(orientation, dst->img_width, dst->img_height, &first_column, &row);
+  }
+
+  assert(!transposes || dst->img_width == dst->img_height);
+
+  const size_t row_offset = row * row_stride(dst);
+
+  for (int32_t c = 0; c < 3; c++) {
+    const uint32_t *sums = scaler->column_sums + c * scaler->src_width;
+
+    uint8_t *out;
+    ptrdiff_t step = 1;
+
+    if (transposes) {
+      out = scaler->staging + ((size_t)c * ORIENTATION_BLOCK_ROWS + scaler->staged_rows) *
+                                  dst->img_width;
+    } else if (dst->format == IMAGE_RGB888_PLANAR) {
+      out = dst->planes[c] + row_offset + first_column;
+    } else {
+      out = dst->buffer + row_offset + first_column * 3 + c;
+      step = 3;
+    }
+
+    if (mirrored) {
+      step = -step;
+    }
+
+    for (uint32_t x = 0; x < dst->img_width; x++) {
+      const uint32_t x_start = scaler->x_bounds[x * 2];
+      const uint32_t x_end = scaler->x_bounds[x * 2 + 1];
+      const uint32_t pixel_count = (x_end - x_start) * row_count;
+
+      uint32_t sum = 0;
+      for (uint32_t sx = x_start; sx < x_end; sx++) {
+        sum += sums[sx];
+      }
+
+      out[(ptrdiff_t)x * step] = scaler->linear_to_srgb != NULL
+                                     ? scaler->linear_to_srgb[(sum + pixel_count / 2) / pixel_count]
+                                     : (uint8_t)(sum / pixel_count);
+    }
+  }
+
+  const bool last_row = scaler->dst_y + 1 == dst->img_height;
+
+  if (transposes) {
+    scaler->staged_rows++;
+
+    if (scaler->staged_rows == ORIENTATION_BLOCK_ROWS || last_row) {
+      row_downscaler_flush_staging(scaler);
+    }
+
+    // turned rows are only complete once the last column is in
+    if (scaler->histogram != NULL && last_row) {
+      color_histogram_add_rows(scaler->histogram, dst, 0, dst->img_height);
+    }
+  } else if (scaler->histogram != NULL) {
+    color_histogram_add_rows(scaler->histogram, dst, row, row + 1);
+  }
+
+  scaler->dst_y++;
+
+  if (scaler->dst_y < dst->img_height) {
+    row_downscaler_start_row(scaler);
+  }
+}
+
+void row_downscaler_push_planar(RowDownscaler *scaler, const uint8_t *r, const uint8_t *g,
+                                const uint8_t *b) {
+
+  const uint32_t sy = scaler->src_y++;
+
+  // rows past the last destination row are not covered by any output pixel
+  if (scaler->dst_y >= scaler->dst->img_height || sy < scaler->y_start) {
+    return;
+  }
+
+  const uint8_t *planes[3] = {r, g, b};
+
+  if (scaler->linear_to_srgb != NULL) {
+    for (int32_t c = 0; c < 3; c++) {
+      add_linear_row(scaler->column_sums + c * scaler->src_width, planes[c], scaler->src_width);
+    }
+  } else {
+    // vertical only: contiguous bytes are widened and added, which compilers vectorise on any
+    // target
+    for (int32_t c = 0; c < 3; c++) {
+      uint32_t *restrict sums = scaler->column_sums + c * scaler->src_width;
+      const uint8_t *restrict plane = planes[c];
+
+      for (size_t x = 0; x < scaler->src_width; x++) {
+        sums[x] += plane[x];
+      }
+    }
+  }
+
+  if (sy + 1 == scaler->y_end) {
+    row_downscaler_emit_row(scaler);
+  }
+}
+
+void row_downscaler_push(RowDownscaler *scaler, const uint8_t *row) {
+
+  const size_t width = scaler->src_width;
+
+  deinterleave_rgb888(row, scaler->row_planes, scaler->row_planes + width,
+                      scaler->row_planes + 2 * width, width);
+  row_downscaler_push_planar(scaler, scaler->row_planes, scaler->row_planes + width,
+                             scaler->row_planes + 2 * width);
+}
+
+bool row_downscaler_finished(const RowDownscaler *scaler) {
+  return scaler->dst_y == scaler->dst->img_height;
+}
+
+void row_downscaler_free(RowDownscaler *scaler) {
+  art_free(scaler->x_bounds);
+  art_free(scaler->column_sums);
+  art_free(scaler->row_planes);
+  art_free(scaler->linear_to_srgb);
+  art_free(scaler->staging);
+  scaler->x_bounds = NULL;
+  scaler->column_sums = NULL;
+  scaler->row_planes = NULL;
+  scaler->linear_to_srgb = NULL;
+  scaler->staging = NULL;
+}
+
+bool downscale_area_average_rows(Image *src, Image *dst) {
+  return downscale_rows(src, dst, NULL, false);
+}
+
+bool scaled_row_sink_init(ScaledRowSink *sink, size_t src_width, size_t src_height, Image *dst) {
+
+  const float x_scale = ((float)src_width) / dst->img_width;
+  const float y_scale = ((float)src_height) / dst->img_height;
+
+  sink->dst = dst;
+  sink->full = (Image){
+      .buffer = NULL, .length = 3 * src_width * src_height, .img_width = src_width,
+      .img_height = src_height};
+  sink->downscaler = (RowDownscaler){.x_bounds = NULL, .column_sums = NULL, .row_planes = NULL};
+  sink->streaming = x_scale > 1.0f && y_scale > 1.0f;
+  sink->rows = 0;
+
+  if (!image_scales_square(src_width, src_height, dst)) {
+    return false;
+  }
+
+  if (sink->streaming) {
+    return row_downscaler_init(&sink->downscaler, src_width, src_height, dst);
+  }
+
+  sink->full.buffer = art_malloc(sink->full.length);
+  return sink->full.buffer != NULL;
+}
+
+void scaled_row_sink_push(ScaledRowSink *sink, const uint8_t *row) {
+
+  if (sink->rows >= sink->full.img_height) {
+    return;
+  }
+
+  if (sink->streaming) {
+    row_downscaler_push(&sink->downscaler, row);
+  } else {
+    memcpy(sink->full.buffer + sink->rows * sink->full.img_width * 3, row,
+           sink->full.img_width * 3);
+  }
+
+  sink->rows++;
+}
+
+bool scaled_row_sink_finish(ScaledRowSink *sink) {
+
+  bool complete = sink->rows == sink->full.img_height;
+
+  if (complete && !sink->streaming) {
+    complete = scale_square_image(&sink->full, sink->dst);
+  }
+
+  scaled_row_sink_free(sink);
+  return complete;
+}
+
+void scaled_row_sink_free(ScaledRowSink *sink) {
+  art_free(sink->full.buffer);
+  sink->full.buffer = NULL;
+  row_downscaler_free(&sink->downscaler);
+}
+
+static inline uint16_t pack_rgb565_pixel(uint8_t r, uint8_t g, uint8_t b) {
+
+  // Add half the lost precision before truncating
+  uint16_t r5 = (r + 4) >> 3; // +4 is half of 8 (2^3)
+  uint16_t g6 = (g + 2) >> 2; // +2 is half of 4 (2^2)
+  uint16_t b5 = (b + 4) >> 3; // +4 is half of 8 (2^3)
+
+  // Clamp to prevent overflow
+  if (r5 > 31)
+    r5 = 31;
+  if (g6 > 63)
+    g6 = 63;
+  if (b5 > 31)
+    b5 = 31;
+
+  return (uint16_t)((r5 << 11) | (g6 << 5) | b5);
+}
+
 void rgb888_to_rgb565_scalar(Image *src, Image *dst) {
 
-  for (int i = 0; i < src->img_width * src->img_height; i++) {
-    uint8_t r = src->buffer[i * 3 + 0];
-    uint8_t g = src->buffer[i * 3 + 1];
-    uint8_t b = src->buffer[i * 3 + 2];
+  const size_t src_stride = image_stride(src, 3);
+  const size_t dst_stride = image_stride(dst, 2);
+
+  for (size_t y = 0; y < src->img_height; y++) {
+    const uint8_t *src_row = src->buffer + y * src_stride;
+    uint16_t *dst_row = (uint16_t *)(dst->buffer + y * dst_stride);
+
+    for (size_t x = 0; x < src->img_width; x++) {
+      dst_row[x] = pack_rgb565_pixel(src_row[x * 3 + 0], src_row[x * 3 + 1], src_row[x * 3 + 2]);
+    }
+  }
+}
+
+void rgb888_planar_to_rgb565(Image *src, Image *dst) {
+
+  assert(src->format == IMAGE_RGB888_PLANAR);
 
-    // Add half the lost precision before truncating
-    uint16_t r5 = (r + 4) >> 3; // +4 is half of 8 (2^3)
-    uint16_t g6 = (g + 2) >> 2; // +2 is half of 4 (2^2)
-    uint16_t b5 = (b + 4) >> 3; // +4 is half of 8 (2^3)
+  const size_t src_stride = image_stride(src, 1);
+  const size_t dst_stride = image_stride(dst, 2);
 
-    // Clamp to prevent overflow
-    if (r5 > 31)
-      r5 = 31;
-    if (g6 > 63)
-      g6 = 63;
-    if (b5 > 31)
-      b5 = 31;
+  for (size_t y = 0; y < src->img_height; y++) {
+    const uint8_t *restrict r = src->planes[0] + y * src_stride;
+    const uint8_t *restrict g = src->planes[1] + y * src_stride;
+    const uint8_t *restrict b = src->planes[2] + y * src_stride;
+    uint16_t *restrict rgb565 = (uint16_t *)(dst->buffer + y * dst_stride);
 
-    uint16_t value = (uint16_t)((r5 << 11) | (g6 << 5) | b5);
+    // same rounding as rgb888_to_rgb565_scalar, three contiguous loads per pixel vectorise
+    // without structure loads
+    for (size_t x = 0; x < src->img_width; x++) {
+      uint16_t r5 = (uint16_t)((r[x] + 4) >> 3);
+      uint16_t g6 = (uint16_t)((g[x] + 2) >> 2);
+      uint16_t b5 = (uint16_t)((b[x] + 4) >> 3);
 
-    ((uint16_t *)dst->buffer)[i] = value;
+      r5 = r5 > 31 ? 31 : r5;
+      g6 = g6 > 63 ? 63 : g6;
+      b5 = b5 > 31 ? 31 : b5;
+
+      rgb565[x] = (uint16_t)((r5 << 11) | (g6 << 5) | b5);
+    }
   }
 }
 
+void rgb888_planar_to_rgba8888(Image *src, Image *dst) {
+
+  assert(src->format == IMAGE_RGB888_PLANAR);
+
+  const size_t src_stride = image_stride(src, 1);
+  const size_t dst_stride = image_stride(dst, 4);
+
+  for (size_t y = 0; y < src->img_height; y++) {
+    const uint8_t *restrict r = src->planes[0] + y * src_stride;
+    const uint8_t *restrict g = src->planes[1] + y * src_stride;
+    const uint8_t *restrict b = src->planes[2] + y * src_stride;
+    uint8_t *restrict rgba = dst->buffer + y * dst_stride;
+
+    for (size_t x = 0; x < src->img_width; x++) {
+      rgba[x * 4 + 0] = r[x];
+      rgba[x * 4 + 1] = g[x];
+      rgba[x * 4 + 2] = b[x];
+      rgba[x * 4 + 3] = 255;
+    }
+  }
+}
+
+void rgb565_to_rgba8888(Image *src, Image *dst) {
+
+  const size_t src_stride = image_stride(src, 2);
+  const size_t dst_stride = image_stride(dst, 4);
+
+  for (size_t y = 0; y < src->img_height; y++) {
+    const uint16_t *rgb565 = (const uint16_t *)(src->buffer + y * src_stride);
+    uint8_t *rgba = dst->buffer + y * dst_stride;
+
+    // the top bits are repeated in the low ones, so 31 and 63 become 255
+    for (size_t x = 0; x < src->img_width; x++) {
+      const uint8_t r5 = rgb565[x] >> 11;
+      const uint8_t g6 = (rgb565[x] >> 5) & 0x3F;
+      const uint8_t b5 = rgb565[x] & 0x1F;
+
+      rgba[x * 4 + 0] = (uint8_t)((r5 << 3) | (r5 >> 2));
+      rgba[x * 4 + 1] = (uint8_t)((g6 << 2) | (g6 >> 4));
+      rgba[x * 4 + 2] = (uint8_t)((b5 << 3) | (b5 >> 2));
+      rgba[x * 4 + 3] = 255;
+    }
+  }
+}
+
+void copy_rgb565(Image *src, Image *dst) {
+
+  const size_t src_stride = image_stride(src, 2);
+  const size_t dst_stride = image_stride(dst, 2);
+
+  for (size_t y = 0; y < src->img_height; y++) {
+    memcpy(dst->buffer + y * dst_stride, src->buffer + y * src_stride, src->img_width * 2);
+  }
+}
+
+// BT.601 luma weights in 1/256, they add up to 256
+#define LUMA_R 77
+#define LUMA_G 150
+#define LUMA_B 29
+
+#if defined(HAVE_SSSE3_KERNELS)
+
+/**
+ * Byte sums of the three planes over 16 pixels at a time, returns the first column not summed.
+ * _mm_sad_epu8 against zero adds 8 bytes into a 64 bit lane, so the sums can not overflow.
+ */
+__attribute__((target("ssse3"))) static size_t plane_sums_ssse3(const uint8_t *r, const uint8_t *g,
+                                                                 const uint8_t *b, size_t x_start,
+                                                                 size_t x_end, uint64_t sums[3]) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i v_sums[3] = {zero, zero, zero};
+  size_t x = x_start;
+
+  for (; x + 16 <= x_end; x += 16) {
+    const __m128i v_r = _mm_loadu_si128((const __m128i *)(r + x));
+    const __m128i v_g = _mm_loadu_si128((const __m128i *)(g + x));
+    const __m128i v_b = _mm_loadu_si128((const __m128i *)(b + x));
+
+    v_sums[0] = _mm_add_epi64(v_sums[0], _mm_sad_epu8(v_r, zero));
+    v_sums[1] = _mm_add_epi64(v_sums[1], _mm_sad_epu8(v_g, zero));
+    v_sums[2] = _mm_add_epi64(v_sums[2], _mm_sad_epu8(v_b, zero));
+  }
+
+  for (int32_t c = 0; c < 3; c++) {
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, v_sums[c]);
+    sums[c] += lanes[0] + lanes[1];
+  }
+
+  return x;
+}
+
+#endif // HAVE_SSSE3_KERNELS
+
+/**
+ * Weighted luma sum of the columns [x_start, x_end) of a row. The weights are applied to the byte
+ * sums of the planes, which the vector kernels add 16 pixels at a time.
+ */
+static uint32_t planar_luma_sum(const uint8_t *restrict r, const uint8_t *restrict g,
+                                const uint8_t *restrict b, size_t x_start, size_t x_end) {
+
+  uint64_t sums[3] = {0, 0, 0};
+  size_t x = x_start;
+
 #if __has_include(<arm_neon.h>)
+  uint32x4_t v_r = vdupq_n_u32(0);
+  uint32x4_t v_g = vdupq_n_u32(0);
+  uint32x4_t v_b = vdupq_n_u32(0);
+
+  for (; x + 16 <= x_end; x += 16) {
+    v_r = vpadalq_u16(v_r, vpaddlq_u8(vld1q_u8(r + x)));
+    v_g = vpadalq_u16(v_g, vpaddlq_u8(vld1q_u8(g + x)));
+    v_b = vpadalq_u16(v_b, vpaddlq_u8(vld1q_u8(b + x)));
+  }
+
+  uint32_t lanes[3][4];
+  vst1q_u32(lanes[0], v_r);
+  vst1q_u32(lanes[1], v_g);
+  vst1q_u32(lanes[2], v_b);
+
+  for (int32_t c = 0; c < 3; c++) {
+    sums[c] = (uint64_t)lanes[c][0] + lanes[c][1] + lanes[c][2] + lanes[c][3];
+  }
+#elif defined(HAVE_SSSE3_KERNELS)
+  if (has_ssse3()) {
+    x = plane_sums_ssse3(r, g, b, x_start, x_end, sums);
+  }
+#endif
+
+  for (; x < x_end; x++) {
+    sums[0] += r[x];
+    sums[1] += g[x];
+    sums[2] += b[x];
+  }
+
+  return (uint32_t)(LUMA_R * sums[0] + LUMA_G * sums[1] + LUMA_B * sums[2]);
+}
+
+// pixels of an interleaved row split into planes at once for planar_luma_sum
+#define DHASH_CHUNK 64
+
+static uint32_t interleaved_luma_sum(const uint8_t *restrict rgb, size_t x_start, size_t x_end) {
+
+  uint8_t planes[3][DHASH_CHUNK];
+  uint32_t sum = 0;
+
+  for (size_t x = x_start; x < x_end; x += DHASH_CHUNK) {
+    const size_t count = x_end - x < DHASH_CHUNK ? x_end - x : DHASH_CHUNK;
+
+    deinterleave_rgb888(rgb + x * 3, planes[0], planes[1], planes[2], count);
+    sum += planar_luma_sum(planes[0], planes[1], planes[2], 0, count);
+  }
+
+  return sum;
+}
+
+uint64_t image_dhash(const Image *image) {
+
+  const size_t width = image->img_width;
+  const size_t height = image->img_height;
+
+  if (width < DHASH_COLUMNS || height < DHASH_ROWS) {
+    return 0;
+  }
+
+  const bool planar = image->format == IMAGE_RGB888_PLANAR;
+  const size_t stride = image_stride(image, planar ? 1 : 3);
+
+  size_t x_bounds[DHASH_COLUMNS + 1];
+  for (size_t c = 0; c <= DHASH_COLUMNS; c++) {
+    x_bounds[c] = c * width / DHASH_COLUMNS;
+  }
+
+  uint64_t hash = 0;
+
+  for (size_t row = 0; row < DHASH_ROWS; row++) {
+    const size_t y_start = row * height / DHASH_ROWS;
+    const size_t y_end = (row + 1) * height / DHASH_ROWS;
+    uint64_t sums[DHASH_COLUMNS] = {0};
+
+    for (size_t y = y_start; y < y_end; y++) {
+      for (size_t c = 0; c < DHASH_COLUMNS; c++) {
+        sums[c] += planar ? planar_luma_sum(image->planes[0] + y * stride,
+                                            image->planes[1] + y * stride,
+                                            image->planes[2] + y * stride, x_bounds[c],
+                                            x_bounds[c + 1])
+                          : interleaved_luma_sum(image->buffer + y * stride, x_bounds[c],
+                                                 x_bounds[c + 1]);
+      }
+    }
+
+    // the cells of a row differ in width by at most a column, compare their averages
+    uint64_t averages[DHASH_COLUMNS];
+    for (size_t c = 0; c < DHASH_COLUMNS; c++) {
+      averages[c] = sums[c] / ((x_bounds[c + 1] - x_bounds[c]) * (y_end - y_start));
+    }
+
+    for (size_t c = 0; c + 1 < DHASH_COLUMNS; c++) {
+      if (averages[c] < averages[c + 1]) {
+        hash |= (uint64_t)1 << (row * (DHASH_COLUMNS - 1) + c);
+      }
+    }
+  }
+
+  return hash;
+}
+
+#if __has_include(<arm_neon.h>)
+
+/**
+ * Packs the pixels of a row that are left over after the vector loop.
+ */
+static void pack_rgb565_tail(const uint8_t *src_row, uint16_t *dst_row, size_t x, size_t width) {
+  for (; x < width; x++) {
+    dst_row[x] = pack_rgb565_pixel(src_row[x * 3 + 0], src_row[x * 3 + 1], src_row[x * 3 + 2]);
+  }
+}
 
 void rgb888_to_rgb565_neon(Image *src, Image *dst) {
 
@@ -108,64 +1511,69 @@ void rgb888_to_rgb565_neon(Image *src, Image *dst) {
   const uint8x16_t v_2 = vdupq_n_u8(2);
   const uint8x16_t v_255 = vdupq_n_u8(255);
 
-  // expecting 200x200 image
-  assert(src->img_width == TARGET_IMG_WIDTH);
-  assert(src->img_height == TARGET_IMG_HEIGHT);
-  assert(dst->img_width == TARGET_IMG_WIDTH);
-  assert(dst->img_height == TARGET_IMG_HEIGHT);
+  assert(src->img_width == dst->img_width);
+  assert(src->img_height == dst->img_height);
+
+  const size_t src_stride = image_stride(src, 3);
+  const size_t dst_stride = image_stride(dst, 2);
 
   uint8x16x3_t v_rgb888;
   uint16x8_t v_rgb565_high;
   uint16x8_t v_rgb565_low;
 
-  for (int i = 0; i < src->img_width * src->img_height; i += 16) {
+  for (size_t y = 0; y < src->img_height; y++) {
+    const uint8_t *src_row = src->buffer + y * src_stride;
+    uint16_t *dst_row = (uint16_t *)(dst->buffer + y * dst_stride);
+    size_t x = 0;
 
-    v_rgb888 = vld3q_u8(src->buffer + (i * 3));
+    for (; x + 16 <= src->img_width; x += 16) {
 
-    uint8x16_t v_r = v_rgb888.val[0];
-    uint8x16_t v_g = v_rgb888.val[1];
-    uint8x16_t v_b = v_rgb888.val[2];
+      v_rgb888 = vld3q_u8(src_row + (x * 3));
 
-    v_r = vaddq_u8(v_r, v_4);
-    v_g = vaddq_u8(v_g, v_2);
-    v_b = vaddq_u8(v_b, v_4);
+      uint8x16_t v_r = v_rgb888.val[0];
+      uint8x16_t v_g = v_rgb888.val[1];
+      uint8x16_t v_b = v_rgb888.val[2];
 
-    // handle overflow
-    uint8x16_t r_mask = vcgtq_u8(v_rgb888.val[0], v_r);
-    uint8x16_t g_mask = vcgtq_u8(v_rgb888.val[1], v_g);
-    uint8x16_t b_mask = vcgtq_u8(v_rgb888.val[2], v_b);
+      v_r = vaddq_u8(v_r, v_4);
+      v_g = vaddq_u8(v_g, v_2);
+      v_b = vaddq_u8(v_b, v_4);
 
-    v_r = vbslq_u8(r_mask, v_255, v_r);
-    v_g = vbslq_u8(g_mask, v_255, v_g);
-    v_b = vbslq_u8(b_mask, v_255, v_b);
+      // handle overflow
+      uint8x16_t r_mask = vcgtq_u8(v_rgb888.val[0], v_r);
+      uint8x16_t g_mask = vcgtq_u8(v_rgb888.val[1], v_g);
+      uint8x16_t b_mask = vcgtq_u8(v_rgb888.val[2], v_b);
 
-    v_r = vshrq_n_u8(v_r, 3);
-    v_g = vshrq_n_u8(v_g, 2);
-    v_b = vshrq_n_u8(v_b, 3);
+      v_r = vbslq_u8(r_mask, v_255, v_r);
+      v_g = vbslq_u8(g_mask, v_255, v_g);
+      v_b = vbslq_u8(b_mask, v_255, v_b);
 
-    uint16x8_t v_r8_high = vmovl_high_u8(v_r);
-    uint16x8_t v_r8_low = vmovl_u8(vget_low_u8(v_r));
+      v_r = vshrq_n_u8(v_r, 3);
+      v_g = vshrq_n_u8(v_g, 2);
+      v_b = vshrq_n_u8(v_b, 3);
 
-    uint16x8_t v_g8_high = vmovl_high_u8(v_g);
-    uint16x8_t v_g8_low = vmovl_u8(vget_low_u8(v_g));
+      uint16x8_t v_r8_high = vmovl_high_u8(v_r);
+      uint16x8_t v_r8_low = vmovl_u8(vget_low_u8(v_r));
 
-    uint16x8_t v_b8_high = vmovl_high_u8(v_b);
-    uint16x8_t v_b8_low = vmovl_u8(vget_low_u8(v_b));
+      uint16x8_t v_g8_high = vmovl_high_u8(v_g);
+      uint16x8_t v_g8_low = vmovl_u8(vget_low_u8(v_g));
 
-    v_r8_high = vshlq_n_u16(v_r8_high, 11);
-    v_g8_high = vshlq_n_u16(v_g8_high, 5);
+      v_r8_high = vshlq_n_u16(v_r8_high, 11);
+      v_g8_high = vshlq_n_u16(v_g8_high, 5);
 
-    v_r8_low = vshlq_n_u16(v_r8_low, 11);
-    v_g8_low = vshlq_n_u16(v_g8_low, 5);
+      v_r8_low = vshlq_n_u16(v_r8_low, 11);
+      v_g8_low = vshlq_n_u16(v_g8_low, 5);
 
-    v_rgb565_high = vorrq_u16(v_r8_high, v_g8_high);
-    v_rgb565_high = vorrq_u16(v_rgb565_high, vmovl_high_u8(v_b));
+      v_rgb565_high = vorrq_u16(v_r8_high, v_g8_high);
+      v_rgb565_high = vorrq_u16(v_rgb565_high, vmovl_high_u8(v_b));
 
-    v_rgb565_low = vorrq_u16(v_r8_low, v_g8_low);
-    v_rgb565_low = vorrq_u16(v_rgb565_low, vmovl_u8(vget_low_u8(v_b)));
+      v_rgb565_low = vorrq_u16(v_r8_low, v_g8_low);
+      v_rgb565_low = vorrq_u16(v_rgb565_low, vmovl_u8(vget_low_u8(v_b)));
 
-    vst1q_u16((uint16_t *)dst->buffer + i, v_rgb565_low);
-    vst1q_u16((uint16_t *)dst->buffer + i + 8, v_rgb565_high);
+      vst1q_u16(dst_row + x, v_rgb565_low);
+      vst1q_u16(dst_row + x + 8, v_rgb565_high);
+    }
+
+    pack_rgb565_tail(src_row, dst_row, x, src->img_width);
   }
 }
 
@@ -176,42 +1584,50 @@ void rgb888_to_rgb565_neon_8vals(Image *src, Image *dst) {
   const uint16x8_t v_31 = vdupq_n_u16(31);
   const uint16x8_t v_63 = vdupq_n_u16(63);
 
-  // expecting 200x200 image
-  assert(src->img_width == TARGET_IMG_WIDTH);
-  assert(src->img_height == TARGET_IMG_HEIGHT);
-  assert(dst->img_width == TARGET_IMG_WIDTH);
-  assert(dst->img_height == TARGET_IMG_HEIGHT);
+  assert(src->img_width == dst->img_width);
+  assert(src->img_height == dst->img_height);
+
+  const size_t src_stride = image_stride(src, 3);
+  const size_t dst_stride = image_stride(dst, 2);
 
   uint8x8x3_t v_rgb888;
   uint16x8_t v_rgb565;
 
-  for (int i = 0; i < src->img_width * src->img_height; i += 8) {
+  for (size_t y = 0; y < src->img_height; y++) {
+    const uint8_t *src_row = src->buffer + y * src_stride;
+    uint16_t *dst_row = (uint16_t *)(dst->buffer + y * dst_stride);
+    size_t x = 0;
 
-    v_rgb888 = vld3_u8(src->buffer + (i * 3));
+    for (; x + 8 <= src->img_width; x += 8) {
 
-    uint16x8_t v_r = vmovl_u8(v_rgb888.val[0]);
-    uint16x8_t v_g = vmovl_u8(v_rgb888.val[1]);
-    uint16x8_t v_b = vmovl_u8(v_rgb888.val[2]);
+      v_rgb888 = vld3_u8(src_row + (x * 3));
 
-    v_r = vaddq_u16(v_r, v_4);
-    v_g = vaddq_u16(v_g, v_2);
-    v_b = vaddq_u16(v_b, v_4);
+      uint16x8_t v_r = vmovl_u8(v_rgb888.val[0]);
+      uint16x8_t v_g = vmovl_u8(v_rgb888.val[1]);
+      uint16x8_t v_b = vmovl_u8(v_rgb888.val[2]);
 
-    v_r = vshrq_n_u16(v_r, 3);
-    v_g = vshrq_n_u16(v_g, 2);
-    v_b = vshrq_n_u16(v_b, 3);
+      v_r = vaddq_u16(v_r, v_4);
+      v_g = vaddq_u16(v_g, v_2);
+      v_b = vaddq_u16(v_b, v_4);
 
-    v_r = vminq_u16(v_r, v_31);
-    v_g = vminq_u16(v_g, v_63);
-    v_b = vminq_u16(v_b, v_31);
+      v_r = vshrq_n_u16(v_r, 3);
+      v_g = vshrq_n_u16(v_g, 2);
+      v_b = vshrq_n_u16(v_b, 3);
 
-    v_r = vshlq_n_u16(v_r, 11);
-    v_g = vshlq_n_u16(v_g, 5);
+      v_r = vminq_u16(v_r, v_31);
+      v_g = vminq_u16(v_g, v_63);
+      v_b = vminq_u16(v_b, v_31);
 
-    v_rgb565 = vorrq_u16(v_r, v_g);
-    v_rgb565 = vorrq_u16(v_rgb565, v_b);
+      v_r = vshlq_n_u16(v_r, 11);
+      v_g = vshlq_n_u16(v_g, 5);
 
-    vst1q_u16((uint16_t *)dst->buffer + i, v_rgb565);
+      v_rgb565 = vorrq_u16(v_r, v_g);
+      v_rgb565 = vorrq_u16(v_rgb565, v_b);
+
+      vst1q_u16(dst_row + x, v_rgb565);
+    }
+
+    pack_rgb565_tail(src_row, dst_row, x, src->img_width);
   }
 }
 
@@ -222,67 +1638,75 @@ void rgb888_to_rgb565_neon_16_vals(Image *src, Image *dst) {
   const uint16x8_t v_31 = vdupq_n_u16(31);
   const uint16x8_t v_63 = vdupq_n_u16(63);
 
-  // expecting 200x200 image
-  assert(src->img_width == TARGET_IMG_WIDTH);
-  assert(src->img_height == TARGET_IMG_HEIGHT);
-  assert(dst->img_width == TARGET_IMG_WIDTH);
-  assert(dst->img_height == TARGET_IMG_HEIGHT);
+  assert(src->img_width == dst->img_width);
+  assert(src->img_height == dst->img_height);
+
+  const size_t src_stride = image_stride(src, 3);
+  const size_t dst_stride = image_stride(dst, 2);
 
   uint8x16x3_t v_rgb888;
   uint16x8_t v_rgb565_high;
   uint16x8_t v_rgb565_low;
 
-  for (int i = 0; i < src->img_width * src->img_height; i += 16) {
+  for (size_t y = 0; y < src->img_height; y++) {
+    const uint8_t *src_row = src->buffer + y * src_stride;
+    uint16_t *dst_row = (uint16_t *)(dst->buffer + y * dst_stride);
+    size_t x = 0;
 
-    v_rgb888 = vld3q_u8(src->buffer + (i * 3));
+    for (; x + 16 <= src->img_width; x += 16) {
 
-    uint16x8_t v_r8_high = vmovl_high_u8(v_rgb888.val[0]);
-    uint16x8_t v_r8_low = vmovl_u8(vget_low_u8(v_rgb888.val[0]));
+      v_rgb888 = vld3q_u8(src_row + (x * 3));
 
-    uint16x8_t v_g8_high = vmovl_high_u8(v_rgb888.val[1]);
-    uint16x8_t v_g8_low = vmovl_u8(vget_low_u8(v_rgb888.val[1]));
+      uint16x8_t v_r8_high = vmovl_high_u8(v_rgb888.val[0]);
+      uint16x8_t v_r8_low = vmovl_u8(vget_low_u8(v_rgb888.val[0]));
 
-    uint16x8_t v_b8_high = vmovl_high_u8(v_rgb888.val[2]);
-    uint16x8_t v_b8_low = vmovl_u8(vget_low_u8(v_rgb888.val[2]));
+      uint16x8_t v_g8_high = vmovl_high_u8(v_rgb888.val[1]);
+      uint16x8_t v_g8_low = vmovl_u8(vget_low_u8(v_rgb888.val[1]));
 
-    v_r8_high = vaddq_u16(v_r8_high, v_4);
-    v_g8_high = vaddq_u16(v_g8_high, v_2);
-    v_b8_high = vaddq_u16(v_b8_high, v_4);
+      uint16x8_t v_b8_high = vmovl_high_u8(v_rgb888.val[2]);
+      uint16x8_t v_b8_low = vmovl_u8(vget_low_u8(v_rgb888.val[2]));
 
-    v_r8_low = vaddq_u16(v_r8_low, v_4);
-    v_g8_low = vaddq_u16(v_g8_low, v_2);
-    v_b8_low = vaddq_u16(v_b8_low, v_4);
+      v_r8_high = vaddq_u16(v_r8_high, v_4);
+      v_g8_high = vaddq_u16(v_g8_high, v_2);
+      v_b8_high = vaddq_u16(v_b8_high, v_4);
 
-    v_r8_high = vshrq_n_u16(v_r8_high, 3);
-    v_g8_high = vshrq_n_u16(v_g8_high, 2);
-    v_b8_high = vshrq_n_u16(v_b8_high, 3);
+      v_r8_low = vaddq_u16(v_r8_low, v_4);
+      v_g8_low = vaddq_u16(v_g8_low, v_2);
+      v_b8_low = vaddq_u16(v_b8_low, v_4);
 
-    v_r8_low = vshrq_n_u16(v_r8_low, 3);
-    v_g8_low = vshrq_n_u16(v_g8_low, 2);
-    v_b8_low = vshrq_n_u16(v_b8_low, 3);
+      v_r8_high = vshrq_n_u16(v_r8_high, 3);
+      v_g8_high = vshrq_n_u16(v_g8_high, 2);
+      v_b8_high = vshrq_n_u16(v_b8_high, 3);
 
-    v_r8_high = vminq_u16(v_r8_high, v_31);
-    v_g8_high = vminq_u16(v_g8_high, v_63);
-    v_b8_high = vminq_u16(v_b8_high, v_31);
+      v_r8_low = vshrq_n_u16(v_r8_low, 3);
+      v_g8_low = vshrq_n_u16(v_g8_low, 2);
+      v_b8_low = vshrq_n_u16(v_b8_low, 3);
 
-    v_r8_low = vminq_u16(v_r8_low, v_31);
-    v_g8_low = vminq_u16(v_g8_low, v_63);
-    v_b8_low = vminq_u16(v_b8_low, v_31);
+      v_r8_high = vminq_u16(v_r8_high, v_31);
+      v_g8_high = vminq_u16(v_g8_high, v_63);
+      v_b8_high = vminq_u16(v_b8_high, v_31);
 
-    v_r8_high = vshlq_n_u16(v_r8_high, 11);
-    v_g8_high = vshlq_n_u16(v_g8_high, 5);
+      v_r8_low = vminq_u16(v_r8_low, v_31);
+      v_g8_low = vminq_u16(v_g8_low, v_63);
+      v_b8_low = vminq_u16(v_b8_low, v_31);
 
-    v_r8_low = vshlq_n_u16(v_r8_low, 11);
-    v_g8_low = vshlq_n_u16(v_g8_low, 5);
+      v_r8_high = vshlq_n_u16(v_r8_high, 11);
+      v_g8_high = vshlq_n_u16(v_g8_high, 5);
 
-    v_rgb565_high = vorrq_u16(v_r8_high, v_g8_high);
-    v_rgb565_high = vorrq_u16(v_rgb565_high, v_b8_high);
+      v_r8_low = vshlq_n_u16(v_r8_low, 11);
+      v_g8_low = vshlq_n_u16(v_g8_low, 5);
 
-    v_rgb565_low = vorrq_u16(v_r8_low, v_g8_low);
-    v_rgb565_low = vorrq_u16(v_rgb565_low, v_b8_low);
+      v_rgb565_high = vorrq_u16(v_r8_high, v_g8_high);
+      v_rgb565_high = vorrq_u16(v_rgb565_high, v_b8_high);
+
+      v_rgb565_low = vorrq_u16(v_r8_low, v_g8_low);
+      v_rgb565_low = vorrq_u16(v_rgb565_low, v_b8_low);
+
+      vst1q_u16(dst_row + x + 8, v_rgb565_high);
+      vst1q_u16(dst_row + x, v_rgb565_low);
+    }
 
-    vst1q_u16((uint16_t *)dst->buffer + i + 8, v_rgb565_high);
-    vst1q_u16((uint16_t *)dst->buffer + i, v_rgb565_low);
+    pack_rgb565_tail(src_row, dst_row, x, src->img_width);
   }
 }
 #endif
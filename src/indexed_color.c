@@ -0,0 +1,403 @@
+#include "../include/indexed_color.h"
+#include "../include/art_memory.h"
+#include <stdlib.h>
+#include <string.h>
+
+// levels below the root, 6 bits per channel tell every RGB565 colour apart
+#define OCTREE_DEPTH 6
+#define RGB565_COLORS 65536
+
+/**
+ * children:  node index + 1 of every octant, 0 if the octant is empty
+ * sums:      red, green and blue sums of the pixels of a leaf
+ * pixels:    pixels in the subtree
+ */
+typedef struct {
+  uint32_t children[8];
+  uint64_t sums[3];
+  uint32_t pixels;
+  uint8_t level;
+  bool leaf;
+  uint8_t index;
+} OctreeNode;
+
+typedef struct {
+  OctreeNode *nodes;
+  size_t count;
+  size_t capacity;
+  uint32_t leaves;
+} Octree;
+
+/**
+ * Working memory of one conversion.
+ *
+ * counts:    pixels of every RGB565 colour
+ * lut:       inverse table, palette index of every RGB565 colour that has been looked up
+ * filled:    bit per lut entry that holds an index
+ * palette:   red, green and blue of every palette colour expanded to 8 bits, one array per channel
+ *            so the nearest colour search is a vector loop over the palette
+ */
+typedef struct {
+  uint32_t counts[RGB565_COLORS];
+  uint8_t lut[RGB565_COLORS];
+  uint64_t filled[RGB565_COLORS / 64];
+  int32_t palette[3][INDEXED_MAX_COLORS];
+  uint32_t palette_size;
+} Quantizer;
+
+static inline void expand_rgb565(uint16_t pixel, uint8_t rgb[3]) {
+  const uint8_t r5 = (uint8_t)(pixel >> 11);
+  const uint8_t g6 = (uint8_t)((pixel >> 5) & 0x3F);
+  const uint8_t b5 = (uint8_t)(pixel & 0x1F);
+
+  rgb[0] = (uint8_t)((r5 << 3) | (r5 >> 2));
+  rgb[1] = (uint8_t)((g6 << 2) | (g6 >> 4));
+  rgb[2] = (uint8_t)((b5 << 3) | (b5 >> 2));
+}
+
+/**
+ * Closest RGB565 colour of an 8 bit colour, the inverse of expand_rgb565.
+ */
+static inline uint16_t round_to_rgb565(int32_t r, int32_t g, int32_t b) {
+  r = r < 0 ? 0 : r > 255 ? 255 : r;
+  g = g < 0 ? 0 : g > 255 ? 255 : g;
+  b = b < 0 ? 0 : b > 255 ? 255 : b;
+  return (uint16_t)(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 |
+                    (b * 31 + 127) / 255);
+}
+
+static inline uint32_t octant(const uint8_t rgb[3], uint8_t level) {
+  const uint8_t bit = (uint8_t)(7 - level);
+  return (uint32_t)(((rgb[0] >> bit) & 1) << 2 | ((rgb[1] >> bit) & 1) << 1 |
+                    ((rgb[2] >> bit) & 1));
+}
+
+static bool octree_add_node(Octree *tree, uint8_t level, uint32_t *index) {
+
+  if (tree->count == tree->capacity) {
+    size_t capacity = tree->capacity > 0 ? tree->capacity * 2 : 1024;
+    OctreeNode *nodes = art_realloc(tree->nodes, capacity * sizeof(OctreeNode));
+
+    if (nodes == NULL) {
+      return false;
+    }
+
+    tree->nodes = nodes;
+    tree->capacity = capacity;
+  }
+
+  tree->nodes[tree->count] = (OctreeNode){.level = level, .leaf = level == OCTREE_DEPTH};
+  tree->leaves += level == OCTREE_DEPTH ? 1 : 0;
+  *index = (uint32_t)tree->count++;
+  return true;
+}
+
+static bool octree_insert(Octree *tree, const uint8_t rgb[3], uint32_t pixels) {
+
+  uint32_t node = 0;
+
+  for (uint8_t level = 0; !tree->nodes[node].leaf; level++) {
+    tree->nodes[node].pixels += pixels;
+
+    const uint32_t child = octant(rgb, level);
+
+    if (tree->nodes[node].children[child] == 0) {
+      uint32_t added;
+
+      if (!octree_add_node(tree, (uint8_t)(level + 1), &added)) {
+        return false;
+      }
+
+      tree->nodes[node].children[child] = added + 1;
+    }
+
+    node = tree->nodes[node].children[child] - 1;
+  }
+
+  tree->nodes[node].pixels += pixels;
+  for (int32_t c = 0; c < 3; c++) {
+    tree->nodes[node].sums[c] += (uint64_t)rgb[c] * pixels;
+  }
+
+  return true;
+}
+
+/**
+ * Merges the leaves below node into it, the children of node have to be leaves.
+ */
+static void octree_reduce(Octree *tree, OctreeNode *node) {
+
+  uint32_t merged = 0;
+
+  for (uint32_t i = 0; i < 8; i++) {
+    if (node->children[i] != 0) {
+      const OctreeNode *child = &tree->nodes[node->children[i] - 1];
+
+      for (int32_t c = 0; c < 3; c++) {
+        node->sums[c] += child->sums[c];
+      }
+      node->children[i] = 0;
+      merged++;
+    }
+  }
+
+  node->leaf = true;
+  tree->leaves = tree->leaves + 1 - merged;
+}
+
+static int compare_node_pixels(const void *a, const void *b) {
+  const uint32_t pixels_a = (*(OctreeNode *const *)a)->pixels;
+  const uint32_t pixels_b = (*(OctreeNode *const *)b)->pixels;
+  return pixels_a < pixels_b ? -1 : pixels_a > pixels_b ? 1 : 0;
+}
+
+/**
+ * Reduces the deepest level first and within a level the nodes with the fewest pixels first,
+ * rare colours are merged before common ones.
+ */
+static bool octree_reduce_to(Octree *tree, uint32_t max_colors) {
+
+  OctreeNode **level_nodes = art_malloc(tree->count * sizeof(OctreeNode *));
+
+  if (level_nodes == NULL) {
+    return false;
+  }
+
+  for (int32_t level = OCTREE_DEPTH - 1; level >= 0 && tree->leaves > max_colors; level--) {
+    size_t count = 0;
+
+    for (size_t i = 0; i < tree->count; i++) {
+      if (tree->nodes[i].level == level && !tree->nodes[i].leaf) {
+        level_nodes[count++] = &tree->nodes[i];
+      }
+    }
+
+    qsort(level_nodes, count, sizeof(OctreeNode *), &compare_node_pixels);
+
+    for (size_t i = 0; i < count && tree->leaves > max_colors; i++) {
+      octree_reduce(tree, level_nodes[i]);
+    }
+  }
+
+  art_free(level_nodes);
+  return true;
+}
+
+/**
+ * Numbers the leaves below node and writes their mean colours to the palette.
+ */
+static void octree_collect(Octree *tree, uint32_t node, Quantizer *quantizer, uint8_t *indexed) {
+
+  OctreeNode *current = &tree->nodes[node];
+
+  if (current->leaf) {
+    const uint32_t index = quantizer->palette_size++;
+    uint16_t color = 0;
+
+    current->index = (uint8_t)index;
+
+    if (current->pixels > 0) {
+      for (int32_t c = 0; c < 3; c++) {
+        quantizer->palette[c][index] = (int32_t)(current->sums[c] / current->pixels);
+      }
+      color = round_to_rgb565(quantizer->palette[0][index], quantizer->palette[1][index],
+                              quantizer->palette[2][index]);
+    }
+
+    // the player gets the RGB565 colour, dithering works with what it will show
+    uint8_t shown[3];
+    expand_rgb565(color, shown);
+    for (int32_t c = 0; c < 3; c++) {
+      quantizer->palette[c][index] = shown[c];
+    }
+
+    indexed[index * 2] = (uint8_t)color;
+    indexed[index * 2 + 1] = (uint8_t)(color >> 8);
+    return;
+  }
+
+  for (uint32_t i = 0; i < 8; i++) {
+    if (current->children[i] != 0) {
+      octree_collect(tree, current->children[i] - 1, quantizer, indexed);
+      current = &tree->nodes[node];
+    }
+  }
+}
+
+static uint8_t octree_lookup(const Octree *tree, const uint8_t rgb[3]) {
+
+  uint32_t node = 0;
+
+  while (!tree->nodes[node].leaf) {
+    node = tree->nodes[node].children[octant(rgb, tree->nodes[node].level)] - 1;
+  }
+
+  return tree->nodes[node].index;
+}
+
+/**
+ * Palette index closest to the colour, the distances to all palette colours are computed in one
+ * vector loop and the minimum is picked afterwards.
+ */
+static uint8_t nearest_color(const Quantizer *quantizer, int32_t r, int32_t g, int32_t b) {
+
+  int32_t distances[INDEXED_MAX_COLORS];
+  const uint32_t size = quantizer->palette_size;
+
+  for (uint32_t i = 0; i < size; i++) {
+    const int32_t dr = quantizer->palette[0][i] - r;
+    const int32_t dg = quantizer->palette[1][i] - g;
+    const int32_t db = quantizer->palette[2][i] - b;
+    distances[i] = dr * dr + dg * dg + db * db;
+  }
+
+  uint32_t best = 0;
+  for (uint32_t i = 1; i < size; i++) {
+    best = distances[i] < distances[best] ? i : best;
+  }
+
+  return (uint8_t)best;
+}
+
+static inline uint8_t lut_lookup(Quantizer *quantizer, uint16_t color) {
+
+  if ((quantizer->filled[color / 64] >> (color % 64) & 1) == 0) {
+    uint8_t rgb[3];
+    expand_rgb565(color, rgb);
+    quantizer->lut[color] = nearest_color(quantizer, rgb[0], rgb[1], rgb[2]);
+    quantizer->filled[color / 64] |= (uint64_t)1 << (color % 64);
+  }
+
+  return quantizer->lut[color];
+}
+
+/**
+ * Floyd-Steinberg error diffusion in 8 bit RGB. The error of a pixel goes 7/16 to the right,
+ * 3/16, 5/16 and 1/16 to the row below, errors holds the pending error of two rows.
+ */
+static bool dither_pixels(const uint16_t *pixels, size_t width, size_t height,
+                          Quantizer *quantizer, uint8_t *out) {
+
+  // one guard pixel on either side of a row spares the edge checks
+  const size_t row_size = (width + 2) * 3;
+  int32_t *errors = art_calloc(row_size * 2, sizeof(int32_t));
+
+  if (errors == NULL) {
+    return false;
+  }
+
+  for (size_t y = 0; y < height; y++) {
+    int32_t *current = errors + (y % 2) * row_size;
+    int32_t *next = errors + ((y + 1) % 2) * row_size;
+    memset(next, 0, row_size * sizeof(int32_t));
+
+    for (size_t x = 0; x < width; x++) {
+      uint8_t rgb[3];
+      int32_t wanted[3];
+      expand_rgb565(pixels[y * width + x], rgb);
+
+      for (int32_t c = 0; c < 3; c++) {
+        wanted[c] = rgb[c] + current[(x + 1) * 3 + c] / 16;
+        wanted[c] = wanted[c] < 0 ? 0 : wanted[c] > 255 ? 255 : wanted[c];
+      }
+
+      const uint8_t index =
+          lut_lookup(quantizer, round_to_rgb565(wanted[0], wanted[1], wanted[2]));
+      out[y * width + x] = index;
+
+      for (int32_t c = 0; c < 3; c++) {
+        const int32_t error = wanted[c] - quantizer->palette[c][index];
+        current[(x + 2) * 3 + c] += error * 7;
+        next[x * 3 + c] += error * 3;
+        next[(x + 1) * 3 + c] += error * 5;
+        next[(x + 2) * 3 + c] += error;
+      }
+    }
+  }
+
+  art_free(errors);
+  return true;
+}
+
+bool rgb565_to_indexed(const uint8_t *rgb565, size_t width, size_t height,
+                       const IndexedOptions *options, uint8_t *indexed) {
+
+  const IndexedOptions default_options = {0};
+
+  if (options == NULL) {
+    options = &default_options;
+  }
+
+  const uint32_t max_colors = options->max_colors > 0 && options->max_colors < INDEXED_MAX_COLORS
+                                  ? options->max_colors
+                                  : INDEXED_MAX_COLORS;
+  const uint16_t *pixels = (const uint16_t *)rgb565;
+  const size_t pixel_count = width * height;
+
+  Quantizer *quantizer = art_calloc(1, sizeof(Quantizer));
+  Octree tree = {0};
+  uint32_t root;
+  bool result = quantizer != NULL && octree_add_node(&tree, 0, &root);
+
+  if (result) {
+    for (size_t i = 0; i < pixel_count; i++) {
+      quantizer->counts[pixels[i]]++;
+    }
+
+    // the tree is built from the distinct colours, a cover has far fewer than pixels
+    for (uint32_t color = 0; result && color < RGB565_COLORS; color++) {
+      if (quantizer->counts[color] != 0) {
+        uint8_t rgb[3];
+        expand_rgb565((uint16_t)color, rgb);
+        result = octree_insert(&tree, rgb, quantizer->counts[color]);
+      }
+    }
+  }
+
+  result = result && octree_reduce_to(&tree, max_colors);
+
+  if (result) {
+    memset(indexed, 0, INDEXED_MAX_COLORS * 2);
+    octree_collect(&tree, root, quantizer, indexed);
+
+    // every colour of the image ends in a leaf, its inverse table entry needs no search
+    for (uint32_t color = 0; color < RGB565_COLORS; color++) {
+      if (quantizer->counts[color] != 0) {
+        uint8_t rgb[3];
+        expand_rgb565((uint16_t)color, rgb);
+        quantizer->lut[color] = octree_lookup(&tree, rgb);
+        quantizer->filled[color / 64] |= (uint64_t)1 << (color % 64);
+      }
+    }
+
+    uint8_t *out = indexed + INDEXED_MAX_COLORS * 2;
+
+    if (options->dither) {
+      result = dither_pixels(pixels, width, height, quantizer, out);
+    } else {
+      for (size_t i = 0; i < pixel_count; i++) {
+        out[i] = quantizer->lut[pixels[i]];
+      }
+    }
+  }
+
+  art_free(tree.nodes);
+  art_free(quantizer);
+  return result;
+}
+
+void indexed_to_rgb565(const uint8_t *indexed, size_t pixel_count, uint8_t *rgb565) {
+
+  uint16_t palette[INDEXED_MAX_COLORS];
+  uint16_t *pixels = (uint16_t *)rgb565;
+
+  for (uint32_t i = 0; i < INDEXED_MAX_COLORS; i++) {
+    palette[i] = (uint16_t)(indexed[i * 2] | indexed[i * 2 + 1] << 8);
+  }
+
+  const uint8_t *indices = indexed + INDEXED_MAX_COLORS * 2;
+
+  for (size_t i = 0; i < pixel_count; i++) {
+    pixels[i] = palette[indices[i]];
+  }
+}
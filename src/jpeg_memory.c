@@ -0,0 +1,280 @@
+#include "../include/jpeg_memory.h"
+#include "../include/art_memory.h"
+#include <jerror.h>
+#include <stdint.h>
+#include <string.h>
+
+// row and block alignment the SIMD code of libjpeg-turbo relies on
+#define JPEG_MEMORY_ALIGNMENT 32
+
+// libjpeg-turbo's SIMD routines may write up to twice the alignment past the end of a sample row
+#define JPEG_ROW_ALIGNMENT (2 * JPEG_MEMORY_ALIGNMENT)
+
+/**
+ * Link in front of every allocation of a pool, padded so the object behind it stays aligned.
+ */
+typedef union PoolBlock {
+  union PoolBlock *next;
+  uint8_t padding[JPEG_MEMORY_ALIGNMENT];
+} PoolBlock;
+
+struct jvirt_sarray_control {
+  JSAMPARRAY mem_buffer;
+  JDIMENSION rows_in_array;
+  JDIMENSION samplesperrow;
+  JDIMENSION maxaccess;
+  boolean pre_zero;
+  struct jvirt_sarray_control *next;
+};
+
+struct jvirt_barray_control {
+  JBLOCKARRAY mem_buffer;
+  JDIMENSION rows_in_array;
+  JDIMENSION blocksperrow;
+  JDIMENSION maxaccess;
+  boolean pre_zero;
+  struct jvirt_barray_control *next;
+};
+
+/**
+ * library:         manager set up by jpeg_create_*, it still owns what was allocated before the
+ *                  replacement
+ * pools:           allocations of every pool, newest first
+ * virt_sarrays:    requested virtual arrays, they live in JPOOL_IMAGE
+ */
+typedef struct {
+  struct jpeg_memory_mgr pub;
+  struct jpeg_memory_mgr *library;
+  PoolBlock *pools[JPOOL_NUMPOOLS];
+  jvirt_sarray_ptr virt_sarrays;
+  jvirt_barray_ptr virt_barrays;
+} ArtJpegMemory;
+
+static size_t round_up(size_t value, size_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+static size_t sample_size(j_common_ptr info) {
+
+  int precision = info->is_decompressor ? ((j_decompress_ptr)info)->data_precision
+                                        : ((j_compress_ptr)info)->data_precision;
+
+  // 12 and 16 bit samples of libjpeg-turbo 3 are shorts
+  return precision > 8 ? 2 : 1;
+}
+
+static void *alloc_pool(j_common_ptr info, int pool_id, size_t size) {
+
+  ArtJpegMemory *memory = (ArtJpegMemory *)info->mem;
+
+  if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+    ERREXIT1(info, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  PoolBlock *block = size <= SIZE_MAX - sizeof(PoolBlock)
+                         ? art_aligned_alloc(JPEG_MEMORY_ALIGNMENT, sizeof(PoolBlock) + size)
+                         : NULL;
+
+  if (block == NULL) {
+    ERREXIT1(info, JERR_OUT_OF_MEMORY, 0);
+  }
+
+  block->next = memory->pools[pool_id];
+  memory->pools[pool_id] = block;
+  return block + 1;
+}
+
+/**
+ * Row pointers followed by the rows, in one allocation.
+ */
+static void **alloc_rows(j_common_ptr info, int pool_id, size_t row_size, JDIMENSION row_count) {
+
+  const size_t pointers_size = round_up((size_t)row_count * sizeof(void *), JPEG_MEMORY_ALIGNMENT);
+
+  if (row_count > 0 && row_size > (SIZE_MAX - pointers_size) / row_count) {
+    ERREXIT1(info, JERR_OUT_OF_MEMORY, 1);
+  }
+
+  void **rows = alloc_pool(info, pool_id, pointers_size + row_size * row_count);
+  uint8_t *row = (uint8_t *)rows + pointers_size;
+
+  for (JDIMENSION i = 0; i < row_count; i++, row += row_size) {
+    rows[i] = row;
+  }
+
+  return rows;
+}
+
+static JSAMPARRAY alloc_sarray(j_common_ptr info, int pool_id, JDIMENSION samplesperrow,
+                               JDIMENSION numrows) {
+  const size_t row_size = round_up((size_t)samplesperrow * sample_size(info), JPEG_ROW_ALIGNMENT);
+  return (JSAMPARRAY)alloc_rows(info, pool_id, row_size, numrows);
+}
+
+static JBLOCKARRAY alloc_barray(j_common_ptr info, int pool_id, JDIMENSION blocksperrow,
+                                JDIMENSION numrows) {
+  return (JBLOCKARRAY)alloc_rows(info, pool_id, (size_t)blocksperrow * sizeof(JBLOCK), numrows);
+}
+
+static jvirt_sarray_ptr request_virt_sarray(j_common_ptr info, int pool_id, boolean pre_zero,
+                                            JDIMENSION samplesperrow, JDIMENSION numrows,
+                                            JDIMENSION maxaccess) {
+
+  ArtJpegMemory *memory = (ArtJpegMemory *)info->mem;
+
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(info, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  jvirt_sarray_ptr array = alloc_pool(info, pool_id, sizeof(struct jvirt_sarray_control));
+  *array = (struct jvirt_sarray_control){.mem_buffer = NULL,
+                                         .rows_in_array = numrows,
+                                         .samplesperrow = samplesperrow,
+                                         .maxaccess = maxaccess,
+                                         .pre_zero = pre_zero,
+                                         .next = memory->virt_sarrays};
+  memory->virt_sarrays = array;
+  return array;
+}
+
+static jvirt_barray_ptr request_virt_barray(j_common_ptr info, int pool_id, boolean pre_zero,
+                                            JDIMENSION blocksperrow, JDIMENSION numrows,
+                                            JDIMENSION maxaccess) {
+
+  ArtJpegMemory *memory = (ArtJpegMemory *)info->mem;
+
+  if (pool_id != JPOOL_IMAGE) {
+    ERREXIT1(info, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  jvirt_barray_ptr array = alloc_pool(info, pool_id, sizeof(struct jvirt_barray_control));
+  *array = (struct jvirt_barray_control){.mem_buffer = NULL,
+                                         .rows_in_array = numrows,
+                                         .blocksperrow = blocksperrow,
+                                         .maxaccess = maxaccess,
+                                         .pre_zero = pre_zero,
+                                         .next = memory->virt_barrays};
+  memory->virt_barrays = array;
+  return array;
+}
+
+static void realize_virt_arrays(j_common_ptr info) {
+
+  ArtJpegMemory *memory = (ArtJpegMemory *)info->mem;
+
+  for (jvirt_sarray_ptr array = memory->virt_sarrays; array != NULL; array = array->next) {
+    if (array->mem_buffer == NULL) {
+      array->mem_buffer =
+          alloc_sarray(info, JPOOL_IMAGE, array->samplesperrow, array->rows_in_array);
+
+      for (JDIMENSION row = 0; array->pre_zero && row < array->rows_in_array; row++) {
+        memset(array->mem_buffer[row], 0, (size_t)array->samplesperrow * sample_size(info));
+      }
+    }
+  }
+
+  for (jvirt_barray_ptr array = memory->virt_barrays; array != NULL; array = array->next) {
+    if (array->mem_buffer == NULL) {
+      array->mem_buffer =
+          alloc_barray(info, JPOOL_IMAGE, array->blocksperrow, array->rows_in_array);
+
+      for (JDIMENSION row = 0; array->pre_zero && row < array->rows_in_array; row++) {
+        memset(array->mem_buffer[row], 0, (size_t)array->blocksperrow * sizeof(JBLOCK));
+      }
+    }
+  }
+}
+
+static JSAMPARRAY access_virt_sarray(j_common_ptr info, jvirt_sarray_ptr array,
+                                     JDIMENSION start_row, JDIMENSION num_rows, boolean writable) {
+  (void)writable;
+
+  if (array->mem_buffer == NULL || num_rows > array->maxaccess ||
+      start_row + num_rows > array->rows_in_array) {
+    ERREXIT(info, JERR_BAD_VIRTUAL_ACCESS);
+  }
+
+  return array->mem_buffer + start_row;
+}
+
+static JBLOCKARRAY access_virt_barray(j_common_ptr info, jvirt_barray_ptr array,
+                                      JDIMENSION start_row, JDIMENSION num_rows, boolean writable) {
+  (void)writable;
+
+  if (array->mem_buffer == NULL || num_rows > array->maxaccess ||
+      start_row + num_rows > array->rows_in_array) {
+    ERREXIT(info, JERR_BAD_VIRTUAL_ACCESS);
+  }
+
+  return array->mem_buffer + start_row;
+}
+
+static void free_pool(j_common_ptr info, int pool_id) {
+
+  ArtJpegMemory *memory = (ArtJpegMemory *)info->mem;
+
+  if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+    ERREXIT1(info, JERR_BAD_POOL_ID, pool_id);
+  }
+
+  if (pool_id == JPOOL_IMAGE) {
+    memory->virt_sarrays = NULL;
+    memory->virt_barrays = NULL;
+  }
+
+  PoolBlock *block = memory->pools[pool_id];
+
+  while (block != NULL) {
+    PoolBlock *next = block->next;
+    art_free(block);
+    block = next;
+  }
+
+  memory->pools[pool_id] = NULL;
+}
+
+static void self_destruct(j_common_ptr info) {
+
+  ArtJpegMemory *memory = (ArtJpegMemory *)info->mem;
+
+  for (int pool_id = JPOOL_NUMPOOLS - 1; pool_id >= JPOOL_PERMANENT; pool_id--) {
+    free_pool(info, pool_id);
+  }
+
+  info->mem = memory->library;
+  art_free(memory);
+  info->mem->self_destruct(info);
+}
+
+void jpeg_memory_install(j_common_ptr info) {
+
+  if (art_memory_current() == NULL) {
+    return;
+  }
+
+  ArtJpegMemory *memory = art_calloc(1, sizeof(ArtJpegMemory));
+
+  // libjpeg's manager keeps working, its allocations are just not counted
+  if (memory == NULL) {
+    return;
+  }
+
+  memory->library = info->mem;
+  memory->pub = (struct jpeg_memory_mgr){
+      .alloc_small = &alloc_pool,
+      .alloc_large = &alloc_pool,
+      .alloc_sarray = &alloc_sarray,
+      .alloc_barray = &alloc_barray,
+      .request_virt_sarray = &request_virt_sarray,
+      .request_virt_barray = &request_virt_barray,
+      .realize_virt_arrays = &realize_virt_arrays,
+      .access_virt_sarray = &access_virt_sarray,
+      .access_virt_barray = &access_virt_barray,
+      .free_pool = &free_pool,
+      .self_destruct = &self_destruct,
+      .max_memory_to_use = info->mem->max_memory_to_use,
+      .max_alloc_chunk = info->mem->max_alloc_chunk,
+  };
+
+  info->mem = &memory->pub;
+}
@@ -0,0 +1,512 @@
+#include "../include/library_scanner.h"
+#include "../include/art_diag.h"
+#include "../include/id3_parsing.h"
+#include "../include/path_utils.h"
+#include "../include/tag_reader.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/syscall.h>
+#define HAVE_GETDENTS64 1
+#else
+#define HAVE_GETDENTS64 0
+#endif
+
+#define DENTS_BUFFER_SIZE (32 * 1024)
+#define SCAN_READ_DEPTH 16
+
+typedef struct {
+  char **paths;
+  size_t count;
+  size_t capacity;
+} PathList;
+
+typedef struct {
+  // directories waiting to be listed, processed depth-first to keep the list short
+  PathList directories;
+
+  // directories queued or being processed, the scan is done once this drops to 0
+  size_t pending;
+
+  pthread_mutex_t mutex;
+  pthread_cond_t changed;
+
+  const ScannerConfig *config;
+  atomic_bool failed;
+} Scanner;
+
+/**
+ * A distinct picture of the directory being processed. The tag buffer is kept to tell pictures
+ * with the same hash apart.
+ */
+typedef struct {
+  uint64_t hash;
+  const uint8_t *frame;
+  uint32_t frame_size;
+  uint8_t *tag_buffer;
+  IO_ERROR result;
+  uint8_t *rgb565_buffer;
+} DirectoryCover;
+
+typedef struct {
+  Scanner *scanner;
+  TagReader *reader;
+  TagRead reads[SCAN_READ_DEPTH];
+
+  DirectoryCover *covers;
+  size_t cover_count;
+  size_t cover_capacity;
+
+#if HAVE_GETDENTS64
+  uint8_t *dents_buffer;
+#endif
+} ScanWorker;
+
+#if HAVE_GETDENTS64
+struct linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+#endif
+
+static bool path_list_append(PathList *list, char *path) {
+
+  if (list->count == list->capacity) {
+    size_t capacity = list->capacity > 0 ? list->capacity * 2 : 16;
+    char **paths = realloc(list->paths, capacity * sizeof(char *));
+
+    if (paths == NULL) {
+      return false;
+    }
+
+    list->paths = paths;
+    list->capacity = capacity;
+  }
+
+  list->paths[list->count++] = path;
+  return true;
+}
+
+static void path_list_free(PathList *list) {
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->paths[i]);
+  }
+  free(list->paths);
+  *list = (PathList){0};
+}
+
+static int compare_paths(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void queue_directory(Scanner *scanner, char *path) {
+
+  pthread_mutex_lock(&scanner->mutex);
+
+  if (path_list_append(&scanner->directories, path)) {
+    scanner->pending++;
+    pthread_cond_signal(&scanner->changed);
+  } else {
+    atomic_store(&scanner->failed, true);
+    free(path);
+  }
+
+  pthread_mutex_unlock(&scanner->mutex);
+}
+
+/**
+ * Sorts one directory entry, d_type is only trusted if the file system filled it in.
+ */
+static void add_entry(Scanner *scanner, int directory_fd, const char *directory, const char *name,
+                      unsigned char d_type, PathList *files) {
+
+  if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+    return;
+  }
+
+  // files that are not MP3s are skipped without a stat
+  if (d_type == DT_REG && !is_mp3_name(name)) {
+    return;
+  }
+
+  if (d_type == DT_UNKNOWN) {
+    struct stat info;
+
+    if (fstatat(directory_fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+      return;
+    }
+
+    d_type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_LNK;
+  }
+
+  if (d_type != DT_DIR && !(d_type == DT_REG && is_mp3_name(name))) {
+    return;
+  }
+
+  char *path = join_path(directory, name);
+
+  if (path == NULL) {
+    atomic_store(&scanner->failed, true);
+    return;
+  }
+
+  if (d_type == DT_DIR) {
+    queue_directory(scanner, path);
+  } else if (!path_list_append(files, path)) {
+    atomic_store(&scanner->failed, true);
+    free(path);
+  }
+}
+
+static bool list_directory(ScanWorker *worker, const char *directory, PathList *files) {
+
+  int fd = openat(AT_FDCWD, directory, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+  if (fd < 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open directory", directory);
+    return false;
+  }
+
+#if HAVE_GETDENTS64
+  while (true) {
+    long bytes = syscall(SYS_getdents64, fd, worker->dents_buffer, DENTS_BUFFER_SIZE);
+
+    if (bytes <= 0) {
+      break;
+    }
+
+    for (long offset = 0; offset < bytes;) {
+      struct linux_dirent64 *entry = (struct linux_dirent64 *)(worker->dents_buffer + offset);
+      add_entry(worker->scanner, fd, directory, entry->d_name, entry->d_type, files);
+      offset += entry->d_reclen;
+    }
+  }
+
+  close(fd);
+#else
+  DIR *dir = fdopendir(fd);
+
+  if (dir == NULL) {
+    close(fd);
+    return false;
+  }
+
+  struct dirent *entry;
+
+  while ((entry = readdir(dir)) != NULL) {
+    add_entry(worker->scanner, dirfd(dir), directory, entry->d_name, entry->d_type, files);
+  }
+
+  closedir(dir);
+#endif
+
+  return true;
+}
+
+static DirectoryCover *find_cover(ScanWorker *worker, uint64_t hash, const uint8_t *frame,
+                                  uint32_t frame_size) {
+
+  for (size_t i = 0; i < worker->cover_count; i++) {
+    DirectoryCover *cover = &worker->covers[i];
+
+    if (cover->hash == hash && cover->frame_size == frame_size &&
+        memcmp(cover->frame, frame, frame_size) == 0) {
+      return cover;
+    }
+  }
+
+  return NULL;
+}
+
+/**
+ * Decodes a picture that has not been seen in the directory yet and takes over its tag buffer.
+ */
+static DirectoryCover *add_cover(ScanWorker *worker, uint64_t hash, uint8_t *tag_buffer,
+                                 uint32_t frame_offset, uint32_t frame_size) {
+
+  if (worker->cover_count == worker->cover_capacity) {
+    size_t capacity = worker->cover_capacity > 0 ? worker->cover_capacity * 2 : 4;
+    DirectoryCover *covers = realloc(worker->covers, capacity * sizeof(DirectoryCover));
+
+    if (covers == NULL) {
+      return NULL;
+    }
+
+    worker->covers = covers;
+    worker->cover_capacity = capacity;
+  }
+
+  uint8_t *rgb565_buffer = malloc(RGB565_BUFFER_SIZE);
+
+  if (rgb565_buffer == NULL) {
+    return NULL;
+  }
+
+  DirectoryCover *cover = &worker->covers[worker->cover_count++];
+  cover->hash = hash;
+  cover->frame = tag_buffer + frame_offset;
+  cover->frame_size = frame_size;
+  cover->tag_buffer = tag_buffer;
+  cover->rgb565_buffer = rgb565_buffer;
+  const AlbumArtOptions options = {.max_pixels = worker->scanner->config->max_pixels};
+  cover->result = process_apic_frame(cover->frame, frame_size, rgb565_buffer, &options);
+
+  return cover;
+}
+
+static void clear_covers(ScanWorker *worker) {
+  for (size_t i = 0; i < worker->cover_count; i++) {
+    free(worker->covers[i].tag_buffer);
+    free(worker->covers[i].rgb565_buffer);
+  }
+  worker->cover_count = 0;
+}
+
+static void convert_file(ScanWorker *worker, TagRead *read, ScanResult *result) {
+
+  if (read->result != OK) {
+    result->result = read->result;
+    return;
+  }
+
+  uint32_t frame_offset;
+  uint32_t frame_size;
+
+  if (!find_biggest_apic(read->tag_buffer, read->tag_size, read->major_version, &frame_offset,
+                         &frame_size)) {
+    free(read->tag_buffer);
+    result->result = NO_APIC;
+    return;
+  }
+
+  const uint8_t *frame = read->tag_buffer + frame_offset;
+  uint64_t hash = hash_apic_frame(frame, frame_size);
+  DirectoryCover *cover = find_cover(worker, hash, frame, frame_size);
+
+  if (cover != NULL) {
+    free(read->tag_buffer);
+    result->shared = true;
+  } else {
+    cover = add_cover(worker, hash, read->tag_buffer, frame_offset, frame_size);
+
+    if (cover == NULL) {
+      free(read->tag_buffer);
+      atomic_store(&worker->scanner->failed, true);
+      result->result = COULD_NOT_ALLOC_APIC;
+      return;
+    }
+  }
+
+  result->result = cover->result;
+  result->rgb565_buffer = cover->result == OK ? cover->rgb565_buffer : NULL;
+}
+
+static void process_files(ScanWorker *worker, const char *directory, PathList *files) {
+
+  const ScannerConfig *config = worker->scanner->config;
+
+  // directories without MP3s have no path array, qsort must not get NULL even for no elements
+  if (files->count > 1) {
+    qsort(files->paths, files->count, sizeof(char *), &compare_paths);
+  }
+
+  for (size_t start = 0; start < files->count; start += SCAN_READ_DEPTH) {
+    size_t window = files->count - start < SCAN_READ_DEPTH ? files->count - start : SCAN_READ_DEPTH;
+
+    if (config->convert_art) {
+      for (size_t i = 0; i < window; i++) {
+        worker->reads[i].file_path = files->paths[start + i];
+      }
+      tag_reader_read(worker->reader, worker->reads, window);
+    }
+
+    for (size_t i = 0; i < window; i++) {
+      ScanResult result = {
+          .file_path = files->paths[start + i],
+          .directory = directory,
+          .result = OK,
+          .rgb565_buffer = NULL,
+          .shared = false,
+      };
+
+      if (config->convert_art) {
+        convert_file(worker, &worker->reads[i], &result);
+      }
+
+      if (config->on_file != NULL) {
+        config->on_file(&result, config->user_data);
+      }
+    }
+  }
+
+  clear_covers(worker);
+}
+
+static void *scan_worker(void *arg) {
+
+  ScanWorker *worker = (ScanWorker *)arg;
+  Scanner *scanner = worker->scanner;
+
+  while (true) {
+    pthread_mutex_lock(&scanner->mutex);
+
+    while (scanner->directories.count == 0 && scanner->pending > 0) {
+      pthread_cond_wait(&scanner->changed, &scanner->mutex);
+    }
+
+    if (scanner->directories.count == 0) {
+      pthread_mutex_unlock(&scanner->mutex);
+      break;
+    }
+
+    char *directory = scanner->directories.paths[--scanner->directories.count];
+    pthread_mutex_unlock(&scanner->mutex);
+
+    PathList files = {0};
+
+    if (list_directory(worker, directory, &files)) {
+      process_files(worker, directory, &files);
+    }
+
+    path_list_free(&files);
+    free(directory);
+
+    pthread_mutex_lock(&scanner->mutex);
+    if (--scanner->pending == 0) {
+      pthread_cond_broadcast(&scanner->changed);
+    }
+    pthread_mutex_unlock(&scanner->mutex);
+  }
+
+  return NULL;
+}
+
+static bool init_worker(ScanWorker *worker, Scanner *scanner) {
+
+  *worker = (ScanWorker){.scanner = scanner};
+
+  if (scanner->config->convert_art) {
+    worker->reader = tag_reader_create(SCAN_READ_DEPTH, true);
+
+    if (worker->reader == NULL) {
+      return false;
+    }
+  }
+
+#if HAVE_GETDENTS64
+  worker->dents_buffer = malloc(DENTS_BUFFER_SIZE);
+
+  if (worker->dents_buffer == NULL) {
+    if (worker->reader != NULL)
+      tag_reader_destroy(worker->reader);
+    return false;
+  }
+#endif
+
+  return true;
+}
+
+static void destroy_worker(ScanWorker *worker) {
+  if (worker->reader != NULL)
+    tag_reader_destroy(worker->reader);
+  free(worker->covers);
+#if HAVE_GETDENTS64
+  free(worker->dents_buffer);
+#endif
+}
+
+bool library_scan(const char *const *roots, size_t root_count, const ScannerConfig *config) {
+
+  const ScannerConfig default_config = {0};
+
+  if (config == NULL) {
+    config = &default_config;
+  }
+
+  uint32_t worker_count = config->workers;
+
+  if (worker_count == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    worker_count = cpus > 0 ? (uint32_t)cpus : 1;
+  }
+
+  Scanner scanner = {.pending = 0, .config = config};
+  atomic_init(&scanner.failed, false);
+  pthread_mutex_init(&scanner.mutex, NULL);
+  pthread_cond_init(&scanner.changed, NULL);
+
+  for (size_t i = 0; i < root_count; i++) {
+    struct stat info;
+
+    if (stat(roots[i], &info) != 0 || !S_ISDIR(info.st_mode)) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open directory", roots[i]);
+      atomic_store(&scanner.failed, true);
+      continue;
+    }
+
+    char *root = strdup(roots[i]);
+
+    if (root == NULL) {
+      atomic_store(&scanner.failed, true);
+      continue;
+    }
+
+    queue_directory(&scanner, root);
+  }
+
+  ScanWorker *workers = calloc(worker_count, sizeof(ScanWorker));
+  pthread_t *threads = calloc(worker_count, sizeof(pthread_t));
+  uint32_t started = 0;
+
+  if (workers != NULL && threads != NULL) {
+    for (uint32_t i = 0; i < worker_count; i++) {
+      if (!init_worker(&workers[started], &scanner)) {
+        break;
+      }
+
+      if (pthread_create(&threads[started], NULL, &scan_worker, &workers[started]) != 0) {
+        destroy_worker(&workers[started]);
+        break;
+      }
+
+      started++;
+    }
+  }
+
+  if (started == 0) {
+    // the scan still has to happen, do it on the calling thread
+    ScanWorker worker;
+
+    if (init_worker(&worker, &scanner)) {
+      scan_worker(&worker);
+      destroy_worker(&worker);
+    } else {
+      atomic_store(&scanner.failed, true);
+    }
+  }
+
+  for (uint32_t i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    destroy_worker(&workers[i]);
+  }
+
+  // only left over if the scan could not run at all
+  path_list_free(&scanner.directories);
+
+  pthread_mutex_destroy(&scanner.mutex);
+  pthread_cond_destroy(&scanner.changed);
+  free(workers);
+  free(threads);
+
+  return !atomic_load(&scanner.failed);
+}
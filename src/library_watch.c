@@ -0,0 +1,730 @@
+#if defined(__linux__)
+// pipe2
+#define _GNU_SOURCE
+#endif
+
+#include "../include/library_watch.h"
+#include "../include/art_diag.h"
+
+#if defined(__linux__)
+
+#include "../include/id3_parsing.h"
+#include "../include/path_utils.h"
+#include "../include/tag_reader.h"
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_DEBOUNCE_MS 30
+#define WATCH_READ_DEPTH 16
+#define EVENT_BUFFER_SIZE (64 * 1024)
+
+#define WATCH_MASK                                                                                 \
+  (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ONLYDIR |            \
+   IN_DONT_FOLLOW)
+
+/**
+ * MP3 file known to be in the library.
+ *
+ * art_hash:    hash of the APIC frame of the last conversion, 0 if it had no usable art
+ * hash_known:  false for files that existed before the watch started and were not converted yet
+ */
+typedef struct {
+  char *path;
+  uint64_t art_hash;
+  bool hash_known;
+} KnownFile;
+
+/**
+ * File with events that are waiting for the debounce time to pass.
+ */
+typedef struct {
+  char *path;
+  uint64_t deadline_ms;
+} PendingFile;
+
+struct LibraryWatch {
+  int inotify_fd;
+  int stop_pipe[2];
+  pthread_t thread;
+
+  char **roots;
+  size_t root_count;
+
+  // directory paths indexed by watch descriptor
+  char **watch_paths;
+  size_t watch_capacity;
+
+  // sorted by path
+  KnownFile *known;
+  size_t known_count;
+  size_t known_capacity;
+
+  // sorted by path
+  PendingFile *pending;
+  size_t pending_count;
+  size_t pending_capacity;
+
+  TagReader *reader;
+  TagRead reads[WATCH_READ_DEPTH];
+  uint8_t *rgb565_buffer;
+
+  uint32_t debounce_ms;
+  watch_callback on_change;
+  void *user_data;
+};
+
+static uint64_t now_ms(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static bool grow(void **array, size_t *capacity, size_t count, size_t element_size) {
+
+  if (count < *capacity) {
+    return true;
+  }
+
+  size_t new_capacity = *capacity > 0 ? *capacity * 2 : 16;
+  void *new_array = realloc(*array, new_capacity * element_size);
+
+  if (new_array == NULL) {
+    return false;
+  }
+
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+/**
+ * Returns the index of the path in an array sorted by path, or the index it would be inserted at.
+ * The elements are KnownFile or PendingFile, both start with their path.
+ */
+static size_t path_search(const void *array, size_t count, size_t element_size, const char *path,
+                          bool *found) {
+
+  size_t low = 0;
+  size_t high = count;
+
+  while (low < high) {
+    size_t middle = low + (high - low) / 2;
+    int order = strcmp(*(char *const *)((const uint8_t *)array + middle * element_size), path);
+
+    if (order == 0) {
+      *found = true;
+      return middle;
+    } else if (order < 0) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+
+  *found = false;
+  return low;
+}
+
+static size_t known_search(const LibraryWatch *watch, const char *path, bool *found) {
+  return path_search(watch->known, watch->known_count, sizeof(KnownFile), path, found);
+}
+
+static KnownFile *known_insert(LibraryWatch *watch, const char *path) {
+
+  bool found;
+  size_t index = known_search(watch, path, &found);
+
+  if (found) {
+    return &watch->known[index];
+  }
+
+  char *copy = strdup(path);
+
+  if (copy == NULL || !grow((void **)&watch->known, &watch->known_capacity, watch->known_count,
+                            sizeof(KnownFile))) {
+    free(copy);
+    return NULL;
+  }
+
+  memmove(&watch->known[index + 1], &watch->known[index],
+          (watch->known_count - index) * sizeof(KnownFile));
+  watch->known[index] = (KnownFile){.path = copy, .art_hash = 0, .hash_known = false};
+  watch->known_count++;
+
+  return &watch->known[index];
+}
+
+static void known_remove(LibraryWatch *watch, size_t index) {
+  free(watch->known[index].path);
+  memmove(&watch->known[index], &watch->known[index + 1],
+          (watch->known_count - index - 1) * sizeof(KnownFile));
+  watch->known_count--;
+}
+
+/**
+ * Queues a file for conversion, events for a file that is already queued only push its deadline.
+ */
+static void schedule(LibraryWatch *watch, const char *path) {
+
+  uint64_t deadline = now_ms() + watch->debounce_ms;
+
+  bool found;
+  size_t index =
+      path_search(watch->pending, watch->pending_count, sizeof(PendingFile), path, &found);
+
+  if (found) {
+    watch->pending[index].deadline_ms = deadline;
+    return;
+  }
+
+  char *copy = strdup(path);
+
+  if (copy == NULL || !grow((void **)&watch->pending, &watch->pending_capacity,
+                            watch->pending_count, sizeof(PendingFile))) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for watch event", NULL);
+    free(copy);
+    return;
+  }
+
+  memmove(&watch->pending[index + 1], &watch->pending[index],
+          (watch->pending_count - index) * sizeof(PendingFile));
+  watch->pending[index] = (PendingFile){.path = copy, .deadline_ms = deadline};
+  watch->pending_count++;
+}
+
+/**
+ * Queues every known file with one deadline. Both arrays are sorted by path, so they are merged
+ * in one pass instead of searching the pending files once per known file.
+ */
+static void schedule_all_known(LibraryWatch *watch) {
+
+  uint64_t deadline = now_ms() + watch->debounce_ms;
+  size_t capacity = watch->known_count + watch->pending_count;
+  PendingFile *merged = malloc((capacity > 0 ? capacity : 1) * sizeof(PendingFile));
+
+  if (merged == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for watch event", NULL);
+    return;
+  }
+
+  size_t count = 0;
+  size_t k = 0;
+  size_t p = 0;
+
+  while (k < watch->known_count || p < watch->pending_count) {
+    int order = k == watch->known_count    ? 1
+                : p == watch->pending_count ? -1
+                                            : strcmp(watch->known[k].path, watch->pending[p].path);
+
+    if (order >= 0) {
+      // already pending, also when it is no longer known
+      merged[count++] = (PendingFile){.path = watch->pending[p++].path, .deadline_ms = deadline};
+      k += order == 0;
+      continue;
+    }
+
+    char *copy = strdup(watch->known[k++].path);
+
+    if (copy == NULL) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for watch event", NULL);
+      continue;
+    }
+
+    merged[count++] = (PendingFile){.path = copy, .deadline_ms = deadline};
+  }
+
+  free(watch->pending);
+  watch->pending = merged;
+  watch->pending_count = count;
+  watch->pending_capacity = capacity > 0 ? capacity : 1;
+}
+
+/**
+ * Queues every known file below the directory, used when a directory is deleted or moved away.
+ */
+static void schedule_known_below(LibraryWatch *watch, const char *directory) {
+
+  size_t length = strlen(directory);
+
+  for (size_t i = 0; i < watch->known_count; i++) {
+    const char *path = watch->known[i].path;
+
+    if (strncmp(path, directory, length) == 0 && path[length] == '/') {
+      schedule(watch, path);
+    }
+  }
+}
+
+static void remove_watches_below(LibraryWatch *watch, const char *directory) {
+
+  size_t length = strlen(directory);
+
+  for (size_t wd = 0; wd < watch->watch_capacity; wd++) {
+    const char *path = watch->watch_paths[wd];
+
+    if (path != NULL && strncmp(path, directory, length) == 0 &&
+        (path[length] == 0 || path[length] == '/')) {
+      // the IN_IGNORED event that follows frees the path
+      inotify_rm_watch(watch->inotify_fd, (int)wd);
+    }
+  }
+}
+
+static bool set_watch_path(LibraryWatch *watch, int wd, const char *directory) {
+
+  while ((size_t)wd >= watch->watch_capacity) {
+    size_t old_capacity = watch->watch_capacity;
+
+    if (!grow((void **)&watch->watch_paths, &watch->watch_capacity, old_capacity,
+              sizeof(char *))) {
+      return false;
+    }
+
+    memset(&watch->watch_paths[old_capacity], 0,
+           (watch->watch_capacity - old_capacity) * sizeof(char *));
+  }
+
+  char *copy = strdup(directory);
+
+  if (copy == NULL) {
+    return false;
+  }
+
+  free(watch->watch_paths[wd]);
+  watch->watch_paths[wd] = copy;
+  return true;
+}
+
+/**
+ * Watches a directory and everything below it. Files found are either recorded as known (initial
+ * setup) or queued as new (a directory that was created or moved into the library).
+ */
+static bool add_tree(LibraryWatch *watch, const char *directory, bool schedule_files) {
+
+  int wd = inotify_add_watch(watch->inotify_fd, directory, WATCH_MASK);
+
+  if (wd < 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WATCH_FAILED, "could not watch directory", directory);
+    return false;
+  }
+
+  if (!set_watch_path(watch, wd, directory)) {
+    return false;
+  }
+
+  DIR *dir = opendir(directory);
+
+  if (dir == NULL) {
+    return true;
+  }
+
+  bool result = true;
+  struct dirent *entry;
+
+  while ((entry = readdir(dir)) != NULL) {
+    const char *name = entry->d_name;
+
+    if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0))) {
+      continue;
+    }
+
+    unsigned char d_type = entry->d_type;
+
+    if (d_type == DT_UNKNOWN) {
+      struct stat info;
+
+      if (fstatat(dirfd(dir), name, &info, AT_SYMLINK_NOFOLLOW) != 0) {
+        continue;
+      }
+
+      d_type = S_ISDIR(info.st_mode) ? DT_DIR : S_ISREG(info.st_mode) ? DT_REG : DT_LNK;
+    }
+
+    if (d_type != DT_DIR && !(d_type == DT_REG && is_mp3_name(name))) {
+      continue;
+    }
+
+    char *path = join_path(directory, name);
+
+    if (path == NULL) {
+      result = false;
+      break;
+    }
+
+    if (d_type == DT_DIR) {
+      result = add_tree(watch, path, schedule_files) && result;
+    } else if (schedule_files) {
+      schedule(watch, path);
+    } else if (known_insert(watch, path) == NULL) {
+      result = false;
+    }
+
+    free(path);
+  }
+
+  closedir(dir);
+  return result;
+}
+
+static void handle_event(LibraryWatch *watch, const struct inotify_event *event) {
+
+  if (event->mask & IN_Q_OVERFLOW) {
+    // events were lost, look at every file again
+    ART_DIAG(ART_DIAG_WARNING, ART_DIAG_WATCH_OVERFLOW,
+             "inotify queue overflow, rescanning the library", NULL);
+
+    schedule_all_known(watch);
+
+    // only files that appeared while events were lost are inserted, the others are found
+    for (size_t i = 0; i < watch->root_count; i++) {
+      add_tree(watch, watch->roots[i], true);
+    }
+    return;
+  }
+
+  if (event->wd < 0 || (size_t)event->wd >= watch->watch_capacity ||
+      watch->watch_paths[event->wd] == NULL) {
+    return;
+  }
+
+  if (event->mask & IN_IGNORED) {
+    free(watch->watch_paths[event->wd]);
+    watch->watch_paths[event->wd] = NULL;
+    return;
+  }
+
+  if (event->len == 0) {
+    return;
+  }
+
+  char *path = join_path(watch->watch_paths[event->wd], event->name);
+
+  if (path == NULL) {
+    return;
+  }
+
+  if (event->mask & IN_ISDIR) {
+    if (event->mask & (IN_CREATE | IN_MOVED_TO)) {
+      add_tree(watch, path, true);
+    } else if (event->mask & (IN_DELETE | IN_MOVED_FROM)) {
+      remove_watches_below(watch, path);
+      schedule_known_below(watch, path);
+    }
+  } else if (is_mp3_name(event->name) && !(event->mask & IN_CREATE)) {
+    // a created file is converted once it has been written and closed
+    schedule(watch, path);
+  }
+
+  free(path);
+}
+
+static void report(LibraryWatch *watch, WatchEventType type, const char *path, IO_ERROR result) {
+
+  if (watch->on_change == NULL) {
+    return;
+  }
+
+  WatchEvent event = {
+      .type = type,
+      .file_path = path,
+      .result = result,
+      .rgb565_buffer = type != WATCH_ART_REMOVED && result == OK ? watch->rgb565_buffer : NULL,
+  };
+
+  watch->on_change(&event, watch->user_data);
+}
+
+static void update_file(LibraryWatch *watch, TagRead *read) {
+
+  bool known_before;
+  size_t index = known_search(watch, read->file_path, &known_before);
+  KnownFile *known = known_before ? &watch->known[index] : NULL;
+
+  IO_ERROR result = read->result;
+  const uint8_t *frame = NULL;
+  uint32_t frame_offset = 0;
+  uint32_t frame_size = 0;
+  uint64_t hash = 0;
+
+  if (result == OK) {
+    if (find_biggest_apic(read->tag_buffer, read->tag_size, read->major_version, &frame_offset,
+                          &frame_size)) {
+      frame = read->tag_buffer + frame_offset;
+
+      // 0 is reserved for files without usable art
+      hash = hash_apic_frame(frame, frame_size) | 1;
+    } else {
+      result = NO_APIC;
+    }
+  }
+
+  // rewrites that did not touch the picture (e.g. a retag of the title) are not reported
+  if (known != NULL && known->hash_known && known->art_hash == hash) {
+    free(read->tag_buffer);
+    return;
+  }
+
+  if (frame != NULL) {
+    result = process_apic_frame(frame, frame_size, watch->rgb565_buffer, NULL);
+  }
+
+  free(read->tag_buffer);
+
+  if (known == NULL) {
+    known = known_insert(watch, read->file_path);
+  }
+
+  if (known != NULL) {
+    known->art_hash = result == OK ? hash : 0;
+    known->hash_known = true;
+  }
+
+  report(watch, known_before ? WATCH_ART_CHANGED : WATCH_ART_ADDED, read->file_path, result);
+}
+
+static void convert_files(LibraryWatch *watch, char **paths, size_t count) {
+
+  for (size_t start = 0; start < count; start += WATCH_READ_DEPTH) {
+    size_t window = count - start < WATCH_READ_DEPTH ? count - start : WATCH_READ_DEPTH;
+
+    for (size_t i = 0; i < window; i++) {
+      watch->reads[i].file_path = paths[start + i];
+    }
+
+    tag_reader_read(watch->reader, watch->reads, window);
+
+    for (size_t i = 0; i < window; i++) {
+      update_file(watch, &watch->reads[i]);
+    }
+  }
+}
+
+/**
+ * Converts or removes every pending file whose debounce time has passed.
+ */
+static void process_due(LibraryWatch *watch) {
+
+  uint64_t now = now_ms();
+  char *due[WATCH_READ_DEPTH];
+  size_t due_count = 0;
+
+  // the files that are not due are moved up in place, which keeps them sorted
+  size_t kept = 0;
+
+  for (size_t i = 0; i < watch->pending_count; i++) {
+    if (watch->pending[i].deadline_ms > now) {
+      watch->pending[kept++] = watch->pending[i];
+      continue;
+    }
+
+    char *path = watch->pending[i].path;
+
+    struct stat info;
+
+    if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+      bool found;
+      size_t index = known_search(watch, path, &found);
+
+      if (found) {
+        known_remove(watch, index);
+        report(watch, WATCH_ART_REMOVED, path, OK);
+      }
+
+      free(path);
+      continue;
+    }
+
+    due[due_count++] = path;
+
+    if (due_count == WATCH_READ_DEPTH) {
+      convert_files(watch, due, due_count);
+      for (size_t j = 0; j < due_count; j++) {
+        free(due[j]);
+      }
+      due_count = 0;
+    }
+  }
+
+  watch->pending_count = kept;
+  convert_files(watch, due, due_count);
+
+  for (size_t i = 0; i < due_count; i++) {
+    free(due[i]);
+  }
+}
+
+static int poll_timeout(const LibraryWatch *watch) {
+
+  if (watch->pending_count == 0) {
+    // nothing to do until the next event
+    return -1;
+  }
+
+  uint64_t now = now_ms();
+  uint64_t next = UINT64_MAX;
+
+  for (size_t i = 0; i < watch->pending_count; i++) {
+    if (watch->pending[i].deadline_ms < next) {
+      next = watch->pending[i].deadline_ms;
+    }
+  }
+
+  return next > now ? (int)(next - now) : 0;
+}
+
+static void *watch_thread(void *arg) {
+
+  LibraryWatch *watch = (LibraryWatch *)arg;
+  uint8_t *events = malloc(EVENT_BUFFER_SIZE);
+
+  if (events == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for inotify events", NULL);
+    return NULL;
+  }
+
+  while (true) {
+    struct pollfd fds[2] = {
+        {.fd = watch->inotify_fd, .events = POLLIN},
+        {.fd = watch->stop_pipe[0], .events = POLLIN},
+    };
+
+    if (poll(fds, 2, poll_timeout(watch)) < 0 && errno != EINTR) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WATCH_FAILED, "could not poll inotify events", NULL);
+      break;
+    }
+
+    if (fds[1].revents & POLLIN) {
+      break;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      ssize_t length = read(watch->inotify_fd, events, EVENT_BUFFER_SIZE);
+
+      for (ssize_t offset = 0; offset < length;) {
+        const struct inotify_event *event = (const struct inotify_event *)(events + offset);
+        handle_event(watch, event);
+        offset += sizeof(struct inotify_event) + event->len;
+      }
+    }
+
+    process_due(watch);
+  }
+
+  free(events);
+  return NULL;
+}
+
+static void free_watch(LibraryWatch *watch) {
+
+  for (size_t i = 0; i < watch->root_count; i++) {
+    free(watch->roots[i]);
+  }
+  for (size_t i = 0; i < watch->watch_capacity; i++) {
+    free(watch->watch_paths[i]);
+  }
+  for (size_t i = 0; i < watch->known_count; i++) {
+    free(watch->known[i].path);
+  }
+  for (size_t i = 0; i < watch->pending_count; i++) {
+    free(watch->pending[i].path);
+  }
+
+  if (watch->reader != NULL)
+    tag_reader_destroy(watch->reader);
+  if (watch->inotify_fd >= 0)
+    close(watch->inotify_fd);
+  if (watch->stop_pipe[0] >= 0)
+    close(watch->stop_pipe[0]);
+  if (watch->stop_pipe[1] >= 0)
+    close(watch->stop_pipe[1]);
+
+  free(watch->roots);
+  free(watch->watch_paths);
+  free(watch->known);
+  free(watch->pending);
+  free(watch->rgb565_buffer);
+  free(watch);
+}
+
+LibraryWatch *library_watch_start(const char *const *roots, size_t root_count,
+                                  const WatchConfig *config) {
+
+  LibraryWatch *watch = calloc(1, sizeof(LibraryWatch));
+
+  if (watch == NULL) {
+    return NULL;
+  }
+
+  watch->stop_pipe[0] = -1;
+  watch->stop_pipe[1] = -1;
+  watch->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  watch->debounce_ms =
+      config != NULL && config->debounce_ms > 0 ? config->debounce_ms : DEFAULT_DEBOUNCE_MS;
+  watch->on_change = config != NULL ? config->on_change : NULL;
+  watch->user_data = config != NULL ? config->user_data : NULL;
+  watch->reader = tag_reader_create(WATCH_READ_DEPTH, true);
+  watch->rgb565_buffer = malloc(RGB565_BUFFER_SIZE);
+  watch->roots = calloc(root_count > 0 ? root_count : 1, sizeof(char *));
+
+  if (watch->inotify_fd < 0 || pipe2(watch->stop_pipe, O_CLOEXEC) != 0 || watch->reader == NULL ||
+      watch->rgb565_buffer == NULL || watch->roots == NULL) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WATCH_FAILED, "could not set up library watch", NULL);
+    free_watch(watch);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < root_count; i++) {
+    watch->roots[i] = strdup(roots[i]);
+    watch->root_count++;
+
+    if (watch->roots[i] == NULL || !add_tree(watch, roots[i], false)) {
+      free_watch(watch);
+      return NULL;
+    }
+  }
+
+  if (pthread_create(&watch->thread, NULL, &watch_thread, watch) != 0) {
+    free_watch(watch);
+    return NULL;
+  }
+
+  return watch;
+}
+
+void library_watch_stop(LibraryWatch *watch) {
+
+  if (watch == NULL) {
+    return;
+  }
+
+  const uint8_t stop = 1;
+
+  while (write(watch->stop_pipe[1], &stop, 1) < 0 && errno == EINTR) {
+  }
+
+  pthread_join(watch->thread, NULL);
+  free_watch(watch);
+}
+
+#else
+
+LibraryWatch *library_watch_start(const char *const *roots, size_t root_count,
+                                  const WatchConfig *config) {
+  (void)roots;
+  (void)root_count;
+  (void)config;
+  return NULL;
+}
+
+void library_watch_stop(LibraryWatch *watch) { (void)watch; }
+
+#endif
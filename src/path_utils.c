@@ -0,0 +1,30 @@
+#include "../include/path_utils.h"
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+char *join_path(const char *directory, const char *name) {
+
+  size_t directory_length = strlen(directory);
+  size_t name_length = strlen(name);
+  bool separator = directory_length > 0 && directory[directory_length - 1] != '/';
+
+  char *path = malloc(directory_length + separator + name_length + 1);
+
+  if (path == NULL) {
+    return NULL;
+  }
+
+  memcpy(path, directory, directory_length);
+  if (separator) {
+    path[directory_length] = '/';
+  }
+  memcpy(path + directory_length + separator, name, name_length + 1);
+
+  return path;
+}
+
+bool is_mp3_name(const char *name) {
+  size_t length = strlen(name);
+  return length > 4 && strcasecmp(name + length - 4, ".mp3") == 0;
+}
@@ -0,0 +1,304 @@
+#include "../include/rgb565_codec.h"
+#include "../include/art_memory.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if __has_include(<arm_neon.h>)
+#include "arm_neon.h"
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#define TOKEN_ZERO_RUN 0x00
+#define TOKEN_REPEAT_RUN 0x40
+#define TOKEN_SMALL 0x80
+#define TOKEN_MEDIUM 0xC0
+#define TOKEN_LITERAL 0xE0
+
+#define MAX_RUN 64
+#define MAX_LITERAL 32
+
+// top bit of every channel, keeps borrows and carries inside their channel
+#define CHANNEL_HIGH_BITS 0x8410
+
+/**
+ * Per channel subtraction and addition modulo the channel range on packed pixels.
+ */
+static inline uint16_t residual_of(uint16_t pixel, uint16_t above) {
+  return (uint16_t)(((pixel | CHANNEL_HIGH_BITS) - (above & ~CHANNEL_HIGH_BITS)) ^
+                    ((pixel ^ ~above) & CHANNEL_HIGH_BITS));
+}
+
+static inline uint16_t pixel_of(uint16_t residual, uint16_t above) {
+  return (uint16_t)(((residual & ~CHANNEL_HIGH_BITS) + (above & ~CHANNEL_HIGH_BITS)) ^
+                    ((residual ^ above) & CHANNEL_HIGH_BITS));
+}
+
+static void row_residuals(const uint16_t *row, const uint16_t *above, uint16_t *residuals,
+                          size_t width) {
+
+  size_t x = 0;
+
+#if __has_include(<arm_neon.h>)
+  const uint16x8_t high = vdupq_n_u16(CHANNEL_HIGH_BITS);
+
+  for (; x + 8 <= width; x += 8) {
+    uint16x8_t v_pixel = vld1q_u16(row + x);
+    uint16x8_t v_above = vld1q_u16(above + x);
+
+    uint16x8_t v_diff = vsubq_u16(vorrq_u16(v_pixel, high), vbicq_u16(v_above, high));
+    uint16x8_t v_sign = vandq_u16(vmvnq_u16(veorq_u16(v_pixel, v_above)), high);
+    vst1q_u16(residuals + x, veorq_u16(v_diff, v_sign));
+  }
+#elif defined(__SSE2__)
+  const __m128i high = _mm_set1_epi16((short)CHANNEL_HIGH_BITS);
+  const __m128i ones = _mm_set1_epi16(-1);
+
+  for (; x + 8 <= width; x += 8) {
+    __m128i v_pixel = _mm_loadu_si128((const __m128i *)(row + x));
+    __m128i v_above = _mm_loadu_si128((const __m128i *)(above + x));
+
+    __m128i v_diff = _mm_sub_epi16(_mm_or_si128(v_pixel, high), _mm_andnot_si128(high, v_above));
+    __m128i v_sign = _mm_and_si128(_mm_xor_si128(_mm_xor_si128(v_pixel, v_above), ones), high);
+    _mm_storeu_si128((__m128i *)(residuals + x), _mm_xor_si128(v_diff, v_sign));
+  }
+#endif
+
+  for (; x < width; x++) {
+    residuals[x] = residual_of(row[x], above[x]);
+  }
+}
+
+/**
+ * Number of residuals from index i on (at most max) that equal value.
+ */
+static size_t run_length(const uint16_t *residuals, size_t i, size_t max, uint16_t value) {
+
+  size_t j = i;
+  const size_t end = i + max;
+
+#if __has_include(<arm_neon.h>)
+  const uint16x8_t v_value = vdupq_n_u16(value);
+
+  for (; j + 8 <= end; j += 8) {
+    // one nibble per lane, all ones where the lane matches
+    uint64_t mask = vget_lane_u64(
+        vreinterpret_u64_u8(vshrn_n_u16(vceqq_u16(vld1q_u16(residuals + j), v_value), 4)), 0);
+
+    if (mask != UINT64_MAX) {
+      return j - i + (size_t)__builtin_ctzll(~mask) / 4;
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i v_value = _mm_set1_epi16((short)value);
+
+  for (; j + 8 <= end; j += 8) {
+    __m128i v_equal = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *)(residuals + j)), v_value);
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(v_equal);
+
+    if (mask != 0xFFFF) {
+      return j - i + (size_t)__builtin_ctz(~mask) / 2;
+    }
+  }
+#endif
+
+  for (; j < end && residuals[j] == value; j++) {
+  }
+
+  return j - i;
+}
+
+static inline int32_t signed_field(uint16_t residual, int32_t shift, int32_t bits) {
+  int32_t value = (residual >> shift) & ((1 << bits) - 1);
+  return value >= (1 << (bits - 1)) ? value - (1 << bits) : value;
+}
+
+static inline bool small_residual(int32_t r, int32_t g, int32_t b) {
+  return r >= -2 && r <= 1 && g >= -2 && g <= 1 && b >= -2 && b <= 1;
+}
+
+static inline bool medium_residual(int32_t r, int32_t g, int32_t b) {
+  return r >= -8 && r <= 7 && g >= -16 && g <= 15 && b >= -8 && b <= 7;
+}
+
+/**
+ * Residuals that take a single byte (runs and small differences) end a literal, medium ones are
+ * taken into it at the same two bytes. That bounds the output by RGB565_ENCODED_MAX_SIZE.
+ */
+static bool ends_literal(uint16_t residual, uint16_t last) {
+  return residual == 0 || residual == last ||
+         small_residual(signed_field(residual, 11, 5), signed_field(residual, 5, 6),
+                        signed_field(residual, 0, 5));
+}
+
+static size_t encode_residuals(const uint16_t *residuals, size_t count, uint8_t *out) {
+
+  size_t pos = 0;
+  uint16_t last = 0;
+
+  for (size_t i = 0; i < count;) {
+    const uint16_t residual = residuals[i];
+    const size_t remaining = count - i < MAX_RUN ? count - i : MAX_RUN;
+
+    if (residual == 0 || residual == last) {
+      size_t run = run_length(residuals, i, remaining, residual);
+      out[pos++] = (uint8_t)((residual == 0 ? TOKEN_ZERO_RUN : TOKEN_REPEAT_RUN) | (run - 1));
+      last = residual;
+      i += run;
+      continue;
+    }
+
+    const int32_t r = signed_field(residual, 11, 5);
+    const int32_t g = signed_field(residual, 5, 6);
+    const int32_t b = signed_field(residual, 0, 5);
+
+    if (small_residual(r, g, b)) {
+      out[pos++] = (uint8_t)(TOKEN_SMALL | ((r + 2) << 4) | ((g + 2) << 2) | (b + 2));
+    } else if (medium_residual(r, g, b)) {
+      out[pos++] = (uint8_t)(TOKEN_MEDIUM | (g + 16));
+      out[pos++] = (uint8_t)(((r + 8) << 4) | (b + 8));
+    } else {
+      size_t tag_pos = pos++;
+      size_t length = 0;
+
+      do {
+        last = residuals[i + length];
+        out[pos++] = (uint8_t)(last & 0xFF);
+        out[pos++] = (uint8_t)(last >> 8);
+        length++;
+      } while (length < MAX_LITERAL && i + length < count &&
+               !ends_literal(residuals[i + length], last));
+
+      out[tag_pos] = (uint8_t)(TOKEN_LITERAL | (length - 1));
+      i += length;
+      continue;
+    }
+
+    last = residual;
+    i++;
+  }
+
+  return pos;
+}
+
+size_t rgb565_encode(const uint8_t *rgb565, size_t width, size_t height, uint8_t *encoded,
+                     size_t capacity) {
+
+  const size_t pixel_count = width * height;
+
+  if (width == 0 || height == 0 || width > UINT16_MAX || height > UINT16_MAX ||
+      capacity < RGB565_ENCODED_MAX_SIZE(pixel_count)) {
+    return 0;
+  }
+
+  uint16_t *residuals = art_malloc(pixel_count * sizeof(uint16_t));
+  uint16_t *zero_row = art_calloc(width, sizeof(uint16_t));
+
+  if (residuals == NULL || zero_row == NULL) {
+    art_free(residuals);
+    art_free(zero_row);
+    return 0;
+  }
+
+  const uint16_t *pixels = (const uint16_t *)rgb565;
+
+  for (size_t y = 0; y < height; y++) {
+    const uint16_t *above = y > 0 ? pixels + (y - 1) * width : zero_row;
+    row_residuals(pixels + y * width, above, residuals + y * width, width);
+  }
+
+  encoded[0] = 'R';
+  encoded[1] = '5';
+  encoded[2] = RGB565_CODEC_VERSION;
+  encoded[3] = 0;
+  encoded[4] = (uint8_t)(width & 0xFF);
+  encoded[5] = (uint8_t)(width >> 8);
+  encoded[6] = (uint8_t)(height & 0xFF);
+  encoded[7] = (uint8_t)(height >> 8);
+
+  size_t size =
+      RGB565_CODEC_HEADER_SIZE + encode_residuals(residuals, pixel_count, encoded + 8);
+
+  art_free(residuals);
+  art_free(zero_row);
+  return size;
+}
+
+bool rgb565_encoded_size(const uint8_t *data, size_t size, uint32_t *width, uint32_t *height) {
+
+  if (size < RGB565_CODEC_HEADER_SIZE || data[0] != 'R' || data[1] != '5' ||
+      data[2] != RGB565_CODEC_VERSION || data[3] != 0) {
+    return false;
+  }
+
+  *width = (uint32_t)data[4] | ((uint32_t)data[5] << 8);
+  *height = (uint32_t)data[6] | ((uint32_t)data[7] << 8);
+  return *width > 0 && *height > 0;
+}
+
+bool rgb565_decode(const uint8_t *data, size_t size, uint8_t *rgb565, size_t capacity) {
+
+  uint32_t width;
+  uint32_t height;
+
+  if (!rgb565_encoded_size(data, size, &width, &height) ||
+      (size_t)width * height * 2 > capacity) {
+    return false;
+  }
+
+  uint16_t *pixels = (uint16_t *)rgb565;
+  const size_t pixel_count = (size_t)width * height;
+  size_t pos = RGB565_CODEC_HEADER_SIZE;
+  size_t i = 0;
+  uint16_t last = 0;
+
+  while (i < pixel_count) {
+    if (pos == size) {
+      return false;
+    }
+
+    const uint8_t tag = data[pos++];
+    size_t count = 1;
+    uint16_t residual;
+
+    if (tag < TOKEN_SMALL) {
+      count = (tag & 0x3F) + 1u;
+      residual = tag < TOKEN_REPEAT_RUN ? 0 : last;
+    } else if (tag < TOKEN_MEDIUM) {
+      residual = (uint16_t)(((((tag >> 4) & 3) - 2) & 0x1F) << 11 |
+                            ((((tag >> 2) & 3) - 2) & 0x3F) << 5 | (((tag & 3) - 2) & 0x1F));
+    } else if (tag < TOKEN_LITERAL) {
+      if (pos == size) {
+        return false;
+      }
+
+      const uint8_t rb = data[pos++];
+      residual = (uint16_t)(((((rb >> 4) - 8) & 0x1F) << 11) | ((((tag & 0x1F) - 16) & 0x3F) << 5) |
+                            (((rb & 0x0F) - 8) & 0x1F));
+    } else {
+      count = (tag & 0x1F) + 1u;
+
+      if (size - pos < count * 2 || pixel_count - i < count) {
+        return false;
+      }
+
+      for (size_t k = 0; k < count; k++, i++) {
+        last = (uint16_t)(data[pos] | (data[pos + 1] << 8));
+        pos += 2;
+        pixels[i] = pixel_of(last, i >= width ? pixels[i - width] : 0);
+      }
+      continue;
+    }
+
+    if (pixel_count - i < count) {
+      return false;
+    }
+
+    for (size_t k = 0; k < count; k++, i++) {
+      pixels[i] = pixel_of(residual, i >= width ? pixels[i - width] : 0);
+    }
+    last = residual;
+  }
+
+  return pos == size;
+}
@@ -0,0 +1,485 @@
+#include "../include/tag_reader.h"
+#include "../include/art_diag.h"
+#include "../include/id3_parsing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#define HAVE_IO_URING 1
+#include <linux/io_uring.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#else
+#define HAVE_IO_URING 0
+#endif
+
+#define DEFAULT_QUEUE_DEPTH 64
+#define MAX_QUEUE_DEPTH 4096
+
+// every file of a window is open until the window is read, a reader takes at most this fraction
+// of the descriptor limit and leaves the rest to the host and other readers
+#define FD_LIMIT_SHARE 4
+
+/**
+ * A single read of a window.
+ *
+ * read_index:  index of the TagRead in the window the read belongs to
+ * result:      bytes read, or a negative value if the read has not been done or failed
+ */
+typedef struct {
+  size_t read_index;
+  int fd;
+  uint8_t *buffer;
+  uint32_t length;
+  off_t offset;
+  int64_t result;
+} ReadOp;
+
+#if HAVE_IO_URING
+/**
+ * Submission and completion rings shared with the kernel, set up without liburing.
+ */
+typedef struct {
+  int fd;
+
+  void *sq_ring;
+  size_t sq_ring_size;
+  void *cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe *sqes;
+  size_t sqes_size;
+
+  _Atomic unsigned *sq_tail;
+  unsigned sq_mask;
+  unsigned *sq_array;
+  unsigned sq_entries;
+
+  _Atomic unsigned *cq_head;
+  _Atomic unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+} Ring;
+#endif
+
+struct TagReader {
+  uint32_t queue_depth;
+  bool use_io_uring;
+
+  uint8_t (*headers)[ID3_TAG_HEADER_SIZE];
+  int *fds;
+  ReadOp *ops;
+
+#if HAVE_IO_URING
+  Ring ring;
+#endif
+};
+
+#if HAVE_IO_URING
+static void ring_teardown(Ring *ring) {
+  if (ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring != MAP_FAILED && ring->cq_ring != ring->sq_ring)
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring != MAP_FAILED)
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  close(ring->fd);
+}
+
+static bool ring_setup(Ring *ring, uint32_t entries) {
+
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+
+  if (ring->fd < 0) {
+    // not compiled into the kernel or blocked by a seccomp filter
+    return false;
+  }
+
+  ring->sq_ring = MAP_FAILED;
+  ring->cq_ring = MAP_FAILED;
+  ring->sqes = MAP_FAILED;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+
+  if (single_mmap) {
+    if (ring->cq_ring_size > ring->sq_ring_size)
+      ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+
+  if (ring->sq_ring == MAP_FAILED) {
+    ring_teardown(ring);
+    return false;
+  }
+
+  ring->cq_ring = single_mmap ? ring->sq_ring
+                              : mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                    ring->fd, IORING_OFF_SQES);
+
+  if (ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+    ring_teardown(ring);
+    return false;
+  }
+
+  uint8_t *sq = ring->sq_ring;
+  uint8_t *cq = ring->cq_ring;
+
+  ring->sq_tail = (_Atomic unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+
+  ring->cq_head = (_Atomic unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (_Atomic unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+
+  return true;
+}
+
+/**
+ * Moves the completions in the completion queue to their ops, returns how many there were.
+ */
+static size_t ring_reap(Ring *ring, ReadOp *ops) {
+
+  unsigned head = atomic_load_explicit(ring->cq_head, memory_order_relaxed);
+  unsigned cq_tail = atomic_load_explicit(ring->cq_tail, memory_order_acquire);
+  size_t reaped = 0;
+
+  while (head != cq_tail) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+    ops[cqe->user_data].result = cqe->res;
+    head++;
+    reaped++;
+  }
+
+  atomic_store_explicit(ring->cq_head, head, memory_order_release);
+  return reaped;
+}
+
+static bool is_transient_enter_error(int error) {
+  // EBUSY: the completion queue overflowed and has to be reaped before more can be submitted
+  return error == EINTR || error == EAGAIN || error == EBUSY;
+}
+
+/**
+ * Waits until every submitted read has completed, so the kernel no longer writes to their buffers.
+ * If io_uring_enter stops working the completion queue is polled, the kernel posts completions
+ * without it.
+ */
+static void ring_drain(Ring *ring, ReadOp *ops, size_t submitted, size_t completed) {
+
+  while (completed < submitted) {
+    int result = (int)syscall(__NR_io_uring_enter, ring->fd, 0, (unsigned)(submitted - completed),
+                              IORING_ENTER_GETEVENTS, NULL, 0);
+
+    if (result < 0 && !is_transient_enter_error(errno)) {
+      const struct timespec delay = {.tv_sec = 0, .tv_nsec = 1000000};
+      nanosleep(&delay, NULL);
+    }
+
+    completed += ring_reap(ring, ops);
+  }
+}
+
+/**
+ * Submits all reads with one io_uring_enter and waits for their completions.
+ * count must not exceed the number of submission queue entries.
+ *
+ * Returns false if io_uring_enter failed. The reads that were submitted have completed by then,
+ * the others were never handed to the kernel and are left for finish_read.
+ */
+static bool ring_run(Ring *ring, ReadOp *ops, size_t count) {
+
+  unsigned tail = atomic_load_explicit(ring->sq_tail, memory_order_relaxed);
+
+  for (size_t i = 0; i < count; i++) {
+    unsigned index = tail & ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = ops[i].fd;
+    sqe->addr = (uint64_t)(uintptr_t)ops[i].buffer;
+    sqe->len = ops[i].length;
+    sqe->off = (uint64_t)ops[i].offset;
+    sqe->user_data = i;
+
+    ring->sq_array[index] = index;
+    tail++;
+  }
+
+  atomic_store_explicit(ring->sq_tail, tail, memory_order_release);
+
+  size_t submitted = 0;
+  size_t completed = 0;
+
+  while (completed < count) {
+    int result = (int)syscall(__NR_io_uring_enter, ring->fd, (unsigned)(count - submitted),
+                              (unsigned)(count - completed), IORING_ENTER_GETEVENTS, NULL, 0);
+
+    if (result < 0 && !is_transient_enter_error(errno)) {
+      ring_drain(ring, ops, submitted, completed + ring_reap(ring, ops));
+      return false;
+    }
+
+    if (result > 0) {
+      submitted += result;
+    }
+
+    // also after a transient error, reaping makes room in an overflowed completion queue
+    completed += ring_reap(ring, ops);
+  }
+
+  return true;
+}
+#endif
+
+/**
+ * Completes a read with pread if it was not done, failed or came back short.
+ */
+static void finish_read(ReadOp *op) {
+
+  // a read that returned 0 bytes hit the end of the file
+  if (op->result == 0) {
+    return;
+  }
+
+  size_t done = op->result > 0 ? (size_t)op->result : 0;
+
+  while (done < op->length) {
+    ssize_t result = pread(op->fd, op->buffer + done, op->length - done, op->offset + done);
+
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      op->result = -errno;
+      return;
+    } else if (result == 0) {
+      break;
+    }
+
+    done += result;
+  }
+
+  op->result = done;
+}
+
+static void run_reads(TagReader *reader, ReadOp *ops, size_t count) {
+
+  for (size_t i = 0; i < count; i++) {
+    ops[i].result = -1;
+  }
+
+#if HAVE_IO_URING
+  // ring_run returns once no read is in flight, the buffers can be reused by pread and the ring
+  // torn down
+  if (reader->use_io_uring && count > 0 && !ring_run(&reader->ring, ops, count)) {
+    ART_DIAG(ART_DIAG_WARNING, ART_DIAG_IO_FALLBACK,
+             "io_uring submission failed, falling back to pread", NULL);
+    ring_teardown(&reader->ring);
+    reader->use_io_uring = false;
+  }
+#endif
+
+  for (size_t i = 0; i < count; i++) {
+    finish_read(&ops[i]);
+  }
+}
+
+static void read_window(TagReader *reader, TagRead *reads, size_t count) {
+
+  size_t pending = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    reads[i].result = OK;
+    reads[i].tag_buffer = NULL;
+    reads[i].tag_size = 0;
+    reader->fds[i] = open(reads[i].file_path, O_RDONLY | O_CLOEXEC);
+
+    if (reader->fds[i] < 0) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open file", reads[i].file_path);
+      reads[i].result = COULD_NOT_OPEN_FILE;
+      continue;
+    }
+
+    reader->ops[pending++] = (ReadOp){
+        .read_index = i,
+        .fd = reader->fds[i],
+        .buffer = reader->headers[i],
+        .length = ID3_TAG_HEADER_SIZE,
+        .offset = 0,
+    };
+  }
+
+  run_reads(reader, reader->ops, pending);
+
+  // the body reads reuse the op array, an op is only overwritten after it has been looked at
+  size_t body_reads = 0;
+
+  for (size_t i = 0; i < pending; i++) {
+    ReadOp op = reader->ops[i];
+    TagRead *read = &reads[op.read_index];
+
+    if (op.result != (int64_t)ID3_TAG_HEADER_SIZE) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_READ_FAILED, "could not read tag header", read->file_path);
+      read->result = COULD_NOT_READ_HEADER;
+      continue;
+    }
+
+    ID3TagHeader *tag_header = (ID3TagHeader *)op.buffer;
+
+    if (!is_id3_header(tag_header)) {
+      ART_DIAG(ART_DIAG_INFO, ART_DIAG_NO_ID3, "no ID3 tag found", read->file_path);
+      read->result = NO_ID3;
+      continue;
+    }
+
+    uint32_t tag_size = convert_syncsafe_size(tag_header->size);
+    read->major_version = tag_header->version[0];
+    read->tag_buffer = malloc(tag_size > 0 ? tag_size : 1);
+
+    if (read->tag_buffer == NULL) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_ALLOC_FAILED, "allocation failed for ID3 tag",
+               read->file_path);
+      read->result = COULD_NOT_ALLOC_APIC;
+      continue;
+    }
+
+    reader->ops[body_reads++] = (ReadOp){
+        .read_index = op.read_index,
+        .fd = op.fd,
+        .buffer = read->tag_buffer,
+        .length = tag_size,
+        .offset = ID3_TAG_HEADER_SIZE,
+    };
+  }
+
+  run_reads(reader, reader->ops, body_reads);
+
+  for (size_t i = 0; i < body_reads; i++) {
+    ReadOp *op = &reader->ops[i];
+    TagRead *read = &reads[op->read_index];
+
+    if (op->result < 0) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_READ_FAILED, "failed reading ID3 tag body",
+               read->file_path);
+      free(read->tag_buffer);
+      read->tag_buffer = NULL;
+      read->result = COULD_NOT_READ_APIC;
+      continue;
+    }
+
+    read->tag_size = (uint32_t)op->result;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (reader->fds[i] >= 0) {
+      close(reader->fds[i]);
+    }
+  }
+}
+
+/**
+ * Caps the queue depth to a share of RLIMIT_NOFILE, so a window can not run out of descriptors.
+ */
+static uint32_t fd_limited_depth(uint32_t queue_depth) {
+
+  struct rlimit limit;
+
+  if (getrlimit(RLIMIT_NOFILE, &limit) != 0 || limit.rlim_cur == RLIM_INFINITY) {
+    return queue_depth;
+  }
+
+  const rlim_t share = limit.rlim_cur / FD_LIMIT_SHARE > 0 ? limit.rlim_cur / FD_LIMIT_SHARE : 1;
+  return share < queue_depth ? (uint32_t)share : queue_depth;
+}
+
+TagReader *tag_reader_create(uint32_t queue_depth, bool use_io_uring) {
+
+  if (queue_depth == 0) {
+    queue_depth = DEFAULT_QUEUE_DEPTH;
+  } else if (queue_depth > MAX_QUEUE_DEPTH) {
+    queue_depth = MAX_QUEUE_DEPTH;
+  }
+
+  queue_depth = fd_limited_depth(queue_depth);
+
+  TagReader *reader = calloc(1, sizeof(TagReader));
+
+  if (reader == NULL) {
+    return NULL;
+  }
+
+  reader->queue_depth = queue_depth;
+  reader->headers = malloc(queue_depth * sizeof(*reader->headers));
+  reader->fds = malloc(queue_depth * sizeof(int));
+  reader->ops = malloc(queue_depth * sizeof(ReadOp));
+
+  if (reader->headers == NULL || reader->fds == NULL || reader->ops == NULL) {
+    free(reader->headers);
+    free(reader->fds);
+    free(reader->ops);
+    free(reader);
+    return NULL;
+  }
+
+#if HAVE_IO_URING
+  reader->use_io_uring = use_io_uring && ring_setup(&reader->ring, queue_depth);
+
+  // the kernel may round the ring up, never down
+  if (reader->use_io_uring && reader->ring.sq_entries < queue_depth) {
+    ring_teardown(&reader->ring);
+    reader->use_io_uring = false;
+  }
+#else
+  (void)use_io_uring;
+  reader->use_io_uring = false;
+#endif
+
+  return reader;
+}
+
+void tag_reader_destroy(TagReader *reader) {
+
+#if HAVE_IO_URING
+  if (reader->use_io_uring) {
+    ring_teardown(&reader->ring);
+  }
+#endif
+
+  free(reader->headers);
+  free(reader->fds);
+  free(reader->ops);
+  free(reader);
+}
+
+bool tag_reader_uses_io_uring(const TagReader *reader) { return reader->use_io_uring; }
+
+uint32_t tag_reader_queue_depth(const TagReader *reader) { return reader->queue_depth; }
+
+void tag_reader_read(TagReader *reader, TagRead *reads, size_t count) {
+
+  for (size_t start = 0; start < count; start += reader->queue_depth) {
+    size_t window = count - start < reader->queue_depth ? count - start : reader->queue_depth;
+    read_window(reader, reads + start, window);
+  }
+}
@@ -0,0 +1,483 @@
+#if defined(__linux__)
+// copy_file_range
+#define _GNU_SOURCE
+#endif
+
+#include "../include/tag_writer.h"
+#include "../include/art_diag.h"
+#include "../include/id3_parsing.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define ID3_FLAG_UNSYNCHRONISATION 0x80
+#define ID3_FLAG_EXTENDED_HEADER 0x40
+#define ID3_FLAG_FOOTER 0x10
+
+// largest value of a 28 bit syncsafe integer
+#define ID3_MAX_SIZE 0x0FFFFFFF
+
+// bytes copied at a time when the audio cannot be copied by the kernel
+#define COPY_CHUNK_SIZE (1024 * 1024)
+
+/**
+ * Tag at the start of the file that is being written.
+ *
+ * present:       false for files without a tag, the other fields describe an empty v2.4 tag then
+ * size:          tag size from the header, without the header and footer
+ * frames_start:  offset of the first frame in body, behind the extended header
+ * audio_start:   file offset of the data following the tag (and its footer)
+ * body:          the size bytes following the tag header
+ */
+typedef struct {
+  bool present;
+  uint8_t major_version;
+  uint8_t flags;
+  uint32_t size;
+  uint32_t frames_start;
+  uint64_t audio_start;
+  uint8_t *body;
+} ExistingTag;
+
+static bool pread_all(int fd, void *buffer, size_t size, uint64_t offset) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t result = pread(fd, (uint8_t *)buffer + done, size - done, (off_t)(offset + done));
+
+    if (result <= 0) {
+      return false;
+    }
+
+    done += (size_t)result;
+  }
+
+  return true;
+}
+
+static bool write_all(int fd, const void *buffer, size_t size) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t result = write(fd, (const uint8_t *)buffer + done, size - done);
+
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+
+    if (result <= 0) {
+      return false;
+    }
+
+    done += (size_t)result;
+  }
+
+  return true;
+}
+
+static bool pwrite_all(int fd, const void *buffer, size_t size, uint64_t offset) {
+
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t result =
+        pwrite(fd, (const uint8_t *)buffer + done, size - done, (off_t)(offset + done));
+
+    if (result <= 0) {
+      return false;
+    }
+
+    done += (size_t)result;
+  }
+
+  return true;
+}
+
+static void put_syncsafe(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 21) & 0x7F;
+  out[1] = (value >> 14) & 0x7F;
+  out[2] = (value >> 7) & 0x7F;
+  out[3] = value & 0x7F;
+}
+
+static void put_frame_size(uint8_t *out, uint32_t size, uint8_t major_version) {
+
+  if (major_version == 4) {
+    put_syncsafe(out, size);
+    return;
+  }
+
+  out[0] = (uint8_t)(size >> 24);
+  out[1] = (uint8_t)(size >> 16);
+  out[2] = (uint8_t)(size >> 8);
+  out[3] = (uint8_t)size;
+}
+
+static void put_tag_header(uint8_t *out, uint8_t major_version, uint8_t flags, uint32_t size) {
+  memcpy(out, "ID3", 3);
+  out[3] = major_version;
+  out[4] = 0;
+  out[5] = flags;
+  put_syncsafe(out + 6, size);
+}
+
+static IO_ERROR read_existing_tag(int fd, ExistingTag *tag) {
+
+  uint8_t header[ID3_TAG_HEADER_SIZE];
+
+  *tag = (ExistingTag){.present = false, .major_version = 4};
+
+  // short files and files starting with audio get a new tag
+  if (!pread_all(fd, header, ID3_TAG_HEADER_SIZE, 0) || memcmp(header, "ID3", 3) != 0) {
+    return OK;
+  }
+
+  tag->present = true;
+  tag->major_version = header[3];
+  tag->flags = header[5];
+  tag->size = convert_syncsafe_size(header + 6);
+
+  if (tag->major_version != 3 && tag->major_version != 4) {
+    ART_DIAG_VALUES(ART_DIAG_ERROR, ART_DIAG_UNSUPPORTED_TAG,
+                    "only ID3v2.3 and ID3v2.4 tags can be written", NULL, tag->major_version, 0);
+    return COULD_NOT_WRITE_TAG;
+  }
+
+  if (tag->flags & ID3_FLAG_UNSYNCHRONISATION) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_UNSUPPORTED_TAG, "unsynchronised tags can not be written",
+             NULL);
+    return COULD_NOT_WRITE_TAG;
+  }
+
+  const bool footer = tag->major_version == 4 && (tag->flags & ID3_FLAG_FOOTER);
+  tag->audio_start = ID3_TAG_HEADER_SIZE + (uint64_t)tag->size + (footer ? ID3_TAG_HEADER_SIZE : 0);
+  tag->body = malloc(tag->size > 0 ? tag->size : 1);
+
+  if (tag->body == NULL) {
+    return COULD_NOT_ALLOC_APIC;
+  }
+
+  if (!pread_all(fd, tag->body, tag->size, ID3_TAG_HEADER_SIZE)) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_READ_FAILED, "could not read tag body", NULL);
+    return COULD_NOT_READ_HEADER;
+  }
+
+  if (tag->flags & ID3_FLAG_EXTENDED_HEADER) {
+    // the v2.3 size leaves out the size field itself
+    uint32_t extended_size = tag->size < 4                 ? UINT32_MAX
+                             : tag->major_version == 4 ? convert_syncsafe_size(tag->body)
+                                                       : convert_be32_size(tag->body) + 4;
+
+    if (extended_size > tag->size) {
+      ART_DIAG(ART_DIAG_ERROR, ART_DIAG_TRUNCATED, "extended header exceeds the tag", NULL);
+      return COULD_NOT_READ_HEADER;
+    }
+
+    tag->frames_start = extended_size;
+  }
+
+  return OK;
+}
+
+/**
+ * Picture type of an APIC frame body, -1 if the body is too short to hold one.
+ */
+static int32_t apic_picture_type(const uint8_t *body, uint32_t size) {
+
+  // encoding, zero terminated MIME type, picture type
+  const uint8_t *mime_end = size > 1 ? memchr(body + 1, 0, size - 1) : NULL;
+
+  if (mime_end == NULL || mime_end + 1 >= body + size) {
+    return -1;
+  }
+
+  return mime_end[1];
+}
+
+/**
+ * Frames of the new tag: every frame of the existing tag except the APIC frames of the picture's
+ * type, followed by the new APIC frame. Returns NULL if the frames could not be allocated.
+ */
+static uint8_t *build_frames(const ExistingTag *tag, const ApicPicture *picture,
+                             size_t *frames_size) {
+
+  const char *description = picture->description != NULL ? picture->description : "";
+  const size_t mime_length = strlen(picture->mime_type) + 1;
+  const size_t description_length = strlen(description) + 1;
+  const size_t apic_size = 1 + mime_length + 1 + description_length + picture->size;
+  const size_t capacity = tag->size - tag->frames_start + ID3_FRAME_HEADER_SIZE + apic_size;
+
+  if (apic_size > ID3_MAX_SIZE) {
+    return NULL;
+  }
+
+  uint8_t *frames = malloc(capacity);
+
+  if (frames == NULL) {
+    return NULL;
+  }
+
+  size_t length = 0;
+  uint32_t offset = tag->frames_start;
+
+  while (offset + ID3_FRAME_HEADER_SIZE <= tag->size) {
+    const ID3FrameHeader *frame_header = (const ID3FrameHeader *)(tag->body + offset);
+
+    // the rest of the tag is padding
+    if (frame_header->id[0] == 0) {
+      break;
+    }
+
+    uint32_t frame_size = get_frame_size(frame_header, tag->major_version);
+    uint32_t body_offset = offset + ID3_FRAME_HEADER_SIZE;
+
+    if (frame_size > tag->size - body_offset) {
+      break;
+    }
+
+    if (!is_apic(frame_header) ||
+        apic_picture_type(tag->body + body_offset, frame_size) != picture->picture_type) {
+      memcpy(frames + length, tag->body + offset, ID3_FRAME_HEADER_SIZE + frame_size);
+      length += ID3_FRAME_HEADER_SIZE + frame_size;
+    }
+
+    offset = body_offset + frame_size;
+  }
+
+  uint8_t *apic = frames + length;
+  memcpy(apic, "APIC", 4);
+  put_frame_size(apic + 4, (uint32_t)apic_size, tag->major_version);
+  apic[8] = 0;
+  apic[9] = 0;
+
+  uint8_t *body = apic + ID3_FRAME_HEADER_SIZE;
+  body[0] = 0; // ISO-8859-1
+  memcpy(body + 1, picture->mime_type, mime_length);
+  body[1 + mime_length] = picture->picture_type;
+  memcpy(body + 2 + mime_length, description, description_length);
+  memcpy(body + 2 + mime_length + description_length, picture->data, picture->size);
+
+  *frames_size = length + ID3_FRAME_HEADER_SIZE + apic_size;
+  return frames;
+}
+
+/**
+ * End of the frames of the existing tag, the bytes behind it are padding.
+ */
+static uint32_t frames_end(const ExistingTag *tag) {
+
+  uint32_t end = tag->size;
+
+  while (end > tag->frames_start && tag->body[end - 1] == 0) {
+    end--;
+  }
+
+  return end;
+}
+
+/**
+ * Writes the frames over the tag body, only the bytes that held frames before or hold them now
+ * are written, the padding behind them is already zero.
+ */
+static IO_ERROR write_in_place(int fd, const ExistingTag *tag, const uint8_t *frames,
+                               size_t frames_size, bool *written) {
+
+  const size_t old_end = frames_end(tag);
+  const size_t write_size = frames_size > old_end ? frames_size : old_end;
+
+  *written = false;
+
+  // the extended header is dropped, the frames move to the start of the body
+  if (tag->frames_start == 0 && frames_size == old_end &&
+      memcmp(tag->body, frames, frames_size) == 0) {
+    return OK;
+  }
+
+  uint8_t *region = calloc(write_size, 1);
+
+  if (region == NULL) {
+    return COULD_NOT_ALLOC_APIC;
+  }
+
+  memcpy(region, frames, frames_size);
+  bool result = pwrite_all(fd, region, write_size, ID3_TAG_HEADER_SIZE);
+  free(region);
+
+  if (result && tag->frames_start > 0) {
+    uint8_t header[ID3_TAG_HEADER_SIZE];
+    put_tag_header(header, tag->major_version, tag->flags & ~ID3_FLAG_EXTENDED_HEADER, tag->size);
+    result = pwrite_all(fd, header, ID3_TAG_HEADER_SIZE, 0);
+  }
+
+  if (!result) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WRITE_FAILED, "could not write tag", NULL);
+    return COULD_NOT_WRITE_TAG;
+  }
+
+  *written = true;
+  return OK;
+}
+
+/**
+ * Copies the rest of src starting at offset to the end of dst. The kernel copies (or shares) the
+ * data where copy_file_range is available, otherwise it goes through a buffer.
+ */
+static bool copy_audio(int src, uint64_t offset, int dst) {
+
+  struct stat st;
+
+  if (fstat(src, &st) != 0) {
+    return false;
+  }
+
+  uint64_t remaining = (uint64_t)st.st_size > offset ? (uint64_t)st.st_size - offset : 0;
+
+#if defined(__linux__)
+  off_t src_offset = (off_t)offset;
+
+  while (remaining > 0) {
+    ssize_t copied = copy_file_range(src, &src_offset, dst, NULL, remaining, 0);
+
+    if (copied <= 0) {
+      // not supported between these files (e.g. across file systems), copy the rest by hand
+      if (copied < 0 && (errno == ENOSYS || errno == EXDEV || errno == EINVAL ||
+                         errno == EOPNOTSUPP)) {
+        break;
+      }
+      return false;
+    }
+
+    remaining -= (uint64_t)copied;
+  }
+
+  offset = (uint64_t)src_offset;
+#endif
+
+  if (remaining == 0) {
+    return true;
+  }
+
+  uint8_t *chunk = malloc(COPY_CHUNK_SIZE);
+  bool result = chunk != NULL;
+
+  while (result && remaining > 0) {
+    size_t size = remaining < COPY_CHUNK_SIZE ? (size_t)remaining : COPY_CHUNK_SIZE;
+    result = pread_all(src, chunk, size, offset) && write_all(dst, chunk, size);
+    offset += size;
+    remaining -= size;
+  }
+
+  free(chunk);
+  return result;
+}
+
+/**
+ * Builds the file again next to the original with a grown tag and renames it over the original.
+ */
+static IO_ERROR rewrite_file(const char *file_path, int fd, const ExistingTag *tag,
+                             const uint8_t *frames, size_t frames_size, uint32_t padding) {
+
+  if (frames_size + padding > ID3_MAX_SIZE) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_UNSUPPORTED_TAG, "tag would exceed the maximum ID3 tag size",
+             NULL);
+    return COULD_NOT_WRITE_TAG;
+  }
+
+  const size_t path_length = strlen(file_path);
+  char *temp_path = malloc(path_length + sizeof(".tagXXXXXX"));
+
+  if (temp_path == NULL) {
+    return COULD_NOT_ALLOC_APIC;
+  }
+
+  memcpy(temp_path, file_path, path_length);
+  memcpy(temp_path + path_length, ".tagXXXXXX", sizeof(".tagXXXXXX"));
+
+  int temp_fd = mkstemp(temp_path);
+
+  if (temp_fd < 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WRITE_FAILED, "could not create temporary file", temp_path);
+    free(temp_path);
+    return COULD_NOT_WRITE_TAG;
+  }
+
+  struct stat st;
+  uint8_t header[ID3_TAG_HEADER_SIZE];
+  uint8_t *zeros = calloc(padding > 0 ? padding : 1, 1);
+
+  // the footer and the extended header are dropped, a footer would forbid the padding
+  put_tag_header(header, tag->major_version,
+                 tag->flags & ~(ID3_FLAG_EXTENDED_HEADER | ID3_FLAG_FOOTER),
+                 (uint32_t)(frames_size + padding));
+
+  bool result = zeros != NULL && fstat(fd, &st) == 0 && fchmod(temp_fd, st.st_mode & 07777) == 0 &&
+                write_all(temp_fd, header, ID3_TAG_HEADER_SIZE) &&
+                write_all(temp_fd, frames, frames_size) && write_all(temp_fd, zeros, padding) &&
+                copy_audio(fd, tag->audio_start, temp_fd) && fsync(temp_fd) == 0;
+
+  free(zeros);
+  result = close(temp_fd) == 0 && result;
+  result = result && rename(temp_path, file_path) == 0;
+
+  if (!result) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_WRITE_FAILED, "could not rewrite file", file_path);
+    unlink(temp_path);
+  }
+
+  free(temp_path);
+  return result ? OK : COULD_NOT_WRITE_TAG;
+}
+
+IO_ERROR tag_write_apic(const char *file_path, const ApicPicture *picture,
+                        const TagWriteOptions *options) {
+
+  const uint32_t padding = options != NULL && options->padding > 0 ? options->padding
+                                                                   : TAG_WRITER_DEFAULT_PADDING;
+
+  if (options != NULL && options->rewritten != NULL) {
+    *options->rewritten = false;
+  }
+
+  int fd = open(file_path, O_RDWR | O_CLOEXEC);
+
+  if (fd < 0) {
+    ART_DIAG(ART_DIAG_ERROR, ART_DIAG_OPEN_FAILED, "could not open file", file_path);
+    return COULD_NOT_OPEN_FILE;
+  }
+
+  ExistingTag tag;
+  IO_ERROR error = read_existing_tag(fd, &tag);
+  size_t frames_size = 0;
+  uint8_t *frames = NULL;
+
+  if (error == OK) {
+    frames = build_frames(&tag, picture, &frames_size);
+    error = frames == NULL ? COULD_NOT_ALLOC_APIC : OK;
+  }
+
+  if (error == OK) {
+    const bool fits = tag.present && !(tag.flags & ID3_FLAG_FOOTER) && frames_size <= tag.size;
+    bool written = false;
+
+    if (fits) {
+      error = write_in_place(fd, &tag, frames, frames_size, &written);
+    } else {
+      error = rewrite_file(file_path, fd, &tag, frames, frames_size, padding);
+    }
+
+    if (error == OK && !fits && options != NULL && options->rewritten != NULL) {
+      *options->rewritten = true;
+    }
+  }
+
+  free(frames);
+  free(tag.body);
+  close(fd);
+  return error;
+}
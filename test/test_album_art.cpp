@@ -0,0 +1,592 @@
+#include "test_fixtures.h"
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+extern "C" {
+#include "album_art.h"
+#include "decompress_jpg.h"
+#include "image.h"
+#include "image_decoder.h"
+}
+
+namespace {
+
+// A small PNG claiming to be of the given size, its IHDR checksum is fixed up so libpng believes it
+std::vector<uint8_t> forgePngSize(uint32_t width, uint32_t height, bool interlaced) {
+  auto png = encodePng(makeUniformRgb888(16, 16, 1, 2, 3), 16, 16, interlaced);
+  for (int i = 0; i < 4; i++) {
+    png[16 + i] = (uint8_t)(width >> (24 - 8 * i));
+    png[20 + i] = (uint8_t)(height >> (24 - 8 * i));
+  }
+  uint32_t crc = 0xFFFFFFFF;
+  for (size_t i = 12; i < 12 + 4 + 13; i++) {
+    crc ^= png[i];
+    for (int bit = 0; bit < 8; bit++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+  }
+  crc = ~crc;
+  for (int i = 0; i < 4; i++) {
+    png[29 + i] = (uint8_t)(crc >> (24 - 8 * i));
+  }
+  return png;
+}
+
+} // namespace
+
+class AlbumArtTest : public ::testing::Test {
+protected:
+  std::vector<uint8_t> rgb565 = std::vector<uint8_t>(RGB565_BUFFER_SIZE);
+  std::vector<PreviewPhase> phases;
+
+  static bool recordPhase(PreviewPhase phase, uint8_t *, void *user_data) {
+    ((AlbumArtTest *)user_data)->phases.push_back(phase);
+    return true;
+  }
+
+  static bool stopAfterCoarse(PreviewPhase phase, uint8_t *, void *user_data) {
+    ((AlbumArtTest *)user_data)->phases.push_back(phase);
+    return false;
+  }
+
+  // Expects every pixel of the rgb565 buffer to be the given color
+  void expectUniform(uint16_t expected) {
+    const uint16_t *pixels = (const uint16_t *)rgb565.data();
+    for (size_t i = 0; i < TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT; i++) {
+      ASSERT_EQ(pixels[i], expected) << "pixel " << i;
+    }
+  }
+
+  std::vector<uint8_t> referenceOutput(const std::string &path) {
+    std::vector<uint8_t> reference(RGB565_BUFFER_SIZE);
+    EXPECT_EQ(get_album_art(path.c_str(), reference.data()), OK);
+    return reference;
+  }
+};
+
+// Test decoding of a PNG cover, lossless so the output can be checked exactly
+TEST_F(AlbumArtTest, DecodesPngCover) {
+  auto png = encodePng(makeUniformRgb888(400, 400, 200, 100, 50), 400, 400, false);
+  auto path = writeTempFile("png_cover.mp3", makeMp3WithCover("image/png", png));
+
+  ASSERT_EQ(get_album_art(path.c_str(), rgb565.data()), OK);
+  expectUniform(toRgb565(200, 100, 50));
+}
+
+// Test decoding of a JPEG cover in an ID3v2.4 tag with a legacy MIME type
+TEST_F(AlbumArtTest, DecodesJpegCover) {
+  auto jpeg = encodeJpeg(makeUniformRgb888(400, 400, 128, 128, 128), 400, 400, false, 100);
+  auto path = writeTempFile("jpeg_cover.mp3", makeMp3WithCover("JPG", jpeg, 4));
+
+  ASSERT_EQ(get_album_art(path.c_str(), rgb565.data()), OK);
+  expectUniform(toRgb565(128, 128, 128));
+}
+
+// Test that the MIME type is not trusted blindly
+TEST_F(AlbumArtTest, SniffsUnknownMimeType) {
+  auto png = encodePng(makeUniformRgb888(200, 200, 10, 20, 30), 200, 200, false);
+  auto path = writeTempFile("sniffed_cover.mp3", makeMp3WithCover("application/octet-stream", png));
+
+  ASSERT_EQ(get_album_art(path.c_str(), rgb565.data()), OK);
+  expectUniform(toRgb565(10, 20, 30));
+}
+
+// Test error codes for files without usable tags
+TEST_F(AlbumArtTest, ReportsMissingTagAndFrame) {
+  std::vector<uint8_t> tag_body;
+  std::string title = "\x03Test Title";
+  appendFrame(tag_body, "TIT2", std::vector<uint8_t>(title.begin(), title.end()));
+
+  auto no_apic = writeTempFile("no_apic.mp3", makeMp3(tag_body));
+  EXPECT_EQ(get_album_art(no_apic.c_str(), rgb565.data()), NO_APIC);
+
+  auto no_id3 = writeTempFile("no_id3.mp3", std::vector<uint8_t>(1024, 0xFF));
+  EXPECT_EQ(get_album_art(no_id3.c_str(), rgb565.data()), NO_ID3);
+
+  std::string missing = ::testing::TempDir() + "does_not_exist.mp3";
+  EXPECT_EQ(get_album_art(missing.c_str(), rgb565.data()), COULD_NOT_OPEN_FILE);
+}
+
+// Test that a progressive JPEG reports a coarse pass and refines to the full quality result
+TEST_F(AlbumArtTest, PreviewProgressiveJpeg) {
+  auto jpeg = encodeJpeg(makeGradientRgb888(800, 800), 800, 800, true);
+  auto path = writeTempFile("progressive.mp3", makeMp3WithCover("image/jpeg", jpeg));
+
+  ASSERT_EQ(get_album_art_preview(path.c_str(), rgb565.data(), &recordPhase, this), OK);
+  ASSERT_EQ(phases.size(), 2u);
+  EXPECT_EQ(phases[0], PREVIEW_COARSE);
+  EXPECT_EQ(phases[1], PREVIEW_FINAL);
+  EXPECT_EQ(rgb565, referenceOutput(path));
+}
+
+// Test the 1/8 DCT-scaled coarse pass of baseline JPEGs
+TEST_F(AlbumArtTest, PreviewBaselineJpeg) {
+  auto jpeg = encodeJpeg(makeGradientRgb888(800, 800), 800, 800, false);
+  auto path = writeTempFile("baseline.mp3", makeMp3WithCover("image/jpeg", jpeg));
+
+  ASSERT_EQ(get_album_art_preview(path.c_str(), rgb565.data(), &recordPhase, this), OK);
+  ASSERT_EQ(phases.size(), 2u);
+  EXPECT_EQ(phases[0], PREVIEW_COARSE);
+  EXPECT_EQ(phases[1], PREVIEW_FINAL);
+  EXPECT_EQ(rgb565, referenceOutput(path));
+}
+
+// Test the first Adam7 pass of interlaced PNGs, uniform images are exact after every pass
+TEST_F(AlbumArtTest, PreviewInterlacedPng) {
+  auto png = encodePng(makeUniformRgb888(400, 400, 200, 100, 50), 400, 400, true);
+  auto path = writeTempFile("interlaced.mp3", makeMp3WithCover("image/png", png));
+
+  ASSERT_EQ(get_album_art_preview(path.c_str(), rgb565.data(), &stopAfterCoarse, this), OK);
+  ASSERT_EQ(phases.size(), 1u);
+  EXPECT_EQ(phases[0], PREVIEW_COARSE);
+  expectUniform(toRgb565(200, 100, 50));
+
+  phases.clear();
+  auto gradient = encodePng(makeGradientRgb888(400, 400), 400, 400, true);
+  auto gradient_path =
+      writeTempFile("interlaced_gradient.mp3", makeMp3WithCover("image/png", gradient));
+
+  ASSERT_EQ(get_album_art_preview(gradient_path.c_str(), rgb565.data(), &recordPhase, this), OK);
+  ASSERT_EQ(phases.size(), 2u);
+  EXPECT_EQ(phases[1], PREVIEW_FINAL);
+  EXPECT_EQ(rgb565, referenceOutput(gradient_path));
+}
+
+// Test that non-interlaced PNGs skip straight to the final phase
+TEST_F(AlbumArtTest, PreviewNonInterlacedPng) {
+  auto png = encodePng(makeGradientRgb888(400, 400), 400, 400, false);
+  auto path = writeTempFile("non_interlaced.mp3", makeMp3WithCover("image/png", png));
+
+  ASSERT_EQ(get_album_art_preview(path.c_str(), rgb565.data(), &recordPhase, this), OK);
+  ASSERT_EQ(phases.size(), 1u);
+  EXPECT_EQ(phases[0], PREVIEW_FINAL);
+  EXPECT_EQ(rgb565, referenceOutput(path));
+}
+
+// Test that the preview rejects PNGs whose header claims more rows than the data holds, before any
+// phase is reported
+TEST_F(AlbumArtTest, PreviewRejectsForgedPngSize) {
+  for (bool interlaced : {false, true}) {
+    auto png = forgePngSize(40000, 40000, interlaced);
+    auto path = writeTempFile("forged_preview.mp3", makeMp3WithCover("image/png", png));
+
+    EXPECT_NE(get_album_art_preview(path.c_str(), rgb565.data(), &recordPhase, this), OK);
+    EXPECT_TRUE(phases.empty());
+  }
+}
+
+// Test that in-memory MP3 data gives the same result as the file
+TEST_F(AlbumArtTest, DecodesFromMemory) {
+  auto jpeg = encodeJpeg(makeGradientRgb888(500, 500), 500, 500, false);
+  auto mp3 = makeMp3WithCover("image/jpeg", jpeg);
+  auto path = writeTempFile("memory_cover.mp3", mp3);
+
+  ASSERT_EQ(get_album_art_from_memory(mp3.data(), mp3.size(), rgb565.data(), NULL), OK);
+  EXPECT_EQ(rgb565, referenceOutput(path));
+
+  // the APIC frame must not be read past the end of the data
+  size_t cut = std::search(mp3.begin(), mp3.end(), jpeg.begin(), jpeg.end()) - mp3.begin();
+  cut += jpeg.size() / 2;
+  EXPECT_EQ(get_album_art_from_memory(mp3.data(), cut, rgb565.data(), NULL), COULD_NOT_READ_APIC);
+  EXPECT_EQ(get_album_art_from_memory(mp3.data(), 4, rgb565.data(), NULL), COULD_NOT_READ_HEADER);
+}
+
+// Test the reader callbacks with a source that does not report its size
+TEST_F(AlbumArtTest, DecodesFromReader) {
+  struct Source {
+    std::vector<uint8_t> data;
+    size_t position = 0;
+  };
+
+  Source source;
+  source.data = makeMp3WithCover("image/png", encodePng(makeGradientRgb888(300, 300), 300, 300,
+                                                        false));
+  auto path = writeTempFile("reader_cover.mp3", source.data);
+
+  ArtReader reader = {
+      .read = [](void *handle, uint8_t *buffer, size_t size) -> size_t {
+        Source *source = (Source *)handle;
+        size_t count = std::min(size, source->data.size() - source->position);
+        memcpy(buffer, source->data.data() + source->position, count);
+        source->position += count;
+        return count;
+      },
+      .seek = [](void *handle, uint64_t offset) -> bool {
+        Source *source = (Source *)handle;
+        source->position = std::min<uint64_t>(offset, source->data.size());
+        return offset <= source->data.size();
+      },
+      .size = nullptr,
+      .handle = &source,
+  };
+
+  ASSERT_EQ(get_album_art_from_reader(&reader, rgb565.data(), NULL), OK);
+  EXPECT_EQ(rgb565, referenceOutput(path));
+}
+
+// Test that covers which are not square fail with a reason instead of being stretched
+TEST_F(AlbumArtTest, RejectsNonSquareCovers) {
+  ArtDiagRecord diag;
+  AlbumArtOptions options = {.diag = &diag};
+
+  auto jpeg = makeMp3WithCover("image/jpeg",
+                               encodeJpeg(makeGradientRgb888(500, 400), 500, 400, false));
+  EXPECT_EQ(get_album_art_from_memory(jpeg.data(), jpeg.size(), rgb565.data(), &options),
+            IMAGE_PROCESSING_ERROR);
+  EXPECT_EQ(diag.code, ART_DIAG_NOT_SQUARE);
+  EXPECT_EQ(diag.values[0], 500u);
+  EXPECT_EQ(diag.values[1], 400u);
+
+  // PNG covers in files are streamed through the row downscaler
+  auto png = writeTempFile("non_square_cover.mp3",
+                           makeMp3WithCover("image/png", encodePng(makeGradientRgb888(300, 200),
+                                                                   300, 200, false)));
+  EXPECT_EQ(get_album_art_ex(png.c_str(), rgb565.data(), &options), IMAGE_PROCESSING_ERROR);
+  EXPECT_EQ(diag.code, ART_DIAG_NOT_SQUARE);
+
+  // pictures above the pixel budget are scaled while they are decoded
+  options.max_pixels = 100000;
+  auto large = makeMp3WithCover("image/jpeg",
+                                encodeJpeg(makeGradientRgb888(800, 600), 800, 600, false));
+  EXPECT_EQ(get_album_art_from_memory(large.data(), large.size(), rgb565.data(), &options),
+            IMAGE_PROCESSING_ERROR);
+}
+
+// Test that PNG covers streamed from the file in chunks match the decode of the whole frame
+TEST_F(AlbumArtTest, StreamsPngFromFile) {
+  struct Case {
+    uint32_t size;
+    bool interlaced;
+  };
+
+  // 700 is not a multiple of the target size, 200 is copied and interlaced images are combined
+  for (Case c : {Case{700, false}, Case{700, true}, Case{200, false}, Case{410, false}}) {
+    // noise does not compress, so the picture spans many read chunks
+    std::vector<uint8_t> rgb = makeGradientRgb888(c.size, c.size);
+    uint32_t state = c.size;
+    for (size_t i = 0; i < rgb.size(); i += 7) {
+      state = state * 1664525u + 1013904223u;
+      rgb[i] = (uint8_t)(state >> 24);
+    }
+
+    auto mp3 = makeMp3WithCover("image/png", encodePng(rgb, c.size, c.size, c.interlaced));
+    auto path = writeTempFile("streamed_png_cover.mp3", mp3);
+
+    std::vector<uint8_t> expected(RGB565_BUFFER_SIZE);
+    ASSERT_EQ(get_album_art_from_memory(mp3.data(), mp3.size(), expected.data(), NULL), OK);
+    ASSERT_EQ(get_album_art(path.c_str(), rgb565.data()), OK);
+    EXPECT_EQ(rgb565, expected) << c.size << " interlaced " << c.interlaced;
+  }
+
+  // a picture that ends early must fail instead of leaving rows undefined
+  auto png = encodePng(makeGradientRgb888(700, 700), 700, 700, false);
+  png.resize(png.size() / 2);
+  auto path = writeTempFile("streamed_png_cut.mp3", makeMp3WithCover("image/png", png));
+  EXPECT_EQ(get_album_art(path.c_str(), rgb565.data()), IMAGE_PROCESSING_ERROR);
+}
+
+// Test that the palette is the same whether the picture is streamed or decoded from a frame
+TEST_F(AlbumArtTest, ExtractsPalette) {
+  for (uint32_t size : {700u, 200u}) {
+    // top third teal, the rest orange
+    std::vector<uint8_t> rgb = makeUniformRgb888(size, size, 240, 140, 20);
+    for (size_t i = 0; i < (size_t)size * size / 3; i++) {
+      rgb[i * 3 + 0] = 20;
+      rgb[i * 3 + 1] = 150;
+      rgb[i * 3 + 2] = 140;
+    }
+
+    auto mp3 = makeMp3WithCover("image/png", encodePng(rgb, size, size, false));
+    auto path = writeTempFile("palette_cover.mp3", mp3);
+
+    Palette streamed = {.max_colors = 4};
+    AlbumArtOptions options = {.palette = &streamed};
+    ASSERT_EQ(get_album_art_ex(path.c_str(), rgb565.data(), &options), OK);
+
+    Palette decoded = {.max_colors = 4};
+    options.palette = &decoded;
+    ASSERT_EQ(get_album_art_from_memory(mp3.data(), mp3.size(), rgb565.data(), &options), OK);
+
+    ASSERT_GE(streamed.count, 2u) << size;
+    ASSERT_EQ(streamed.count, decoded.count) << size;
+    EXPECT_EQ(memcmp(streamed.colors, decoded.colors, streamed.count * sizeof(PaletteColor)), 0);
+
+    EXPECT_EQ(streamed.colors[0].r, 240) << size;
+    EXPECT_EQ(streamed.colors[0].g, 140) << size;
+    EXPECT_EQ(streamed.colors[0].b, 20) << size;
+    EXPECT_EQ(streamed.colors[1].r, 20) << size;
+    EXPECT_EQ(streamed.colors[1].g, 150) << size;
+    EXPECT_EQ(streamed.colors[1].b, 140) << size;
+  }
+}
+
+// Test that an EXIF orientation of a JPEG cover turns the converted art upright
+TEST_F(AlbumArtTest, AppliesExifOrientation) {
+  auto jpeg = encodeJpeg(makeGradientRgb888(400, 400), 400, 400, false, 95, 1);
+  auto upright =
+      referenceOutput(writeTempFile("upright_cover.mp3", makeMp3WithCover("image/jpeg", jpeg)));
+  const uint16_t *upright_pixels = (const uint16_t *)upright.data();
+
+  for (bool little_endian : {true, false}) {
+    auto tagged = withExifOrientation(jpeg, 6, little_endian);
+    auto path = writeTempFile("turned_cover.mp3", makeMp3WithCover("image/jpeg", tagged));
+
+    Image decoded = {};
+    ASSERT_TRUE(convert_jpeg_to_rgb888(tagged.data(), tagged.size(), &decoded));
+    EXPECT_EQ(decoded.orientation, ORIENTATION_ROTATE_90);
+    free(decoded.buffer);
+
+    // serial and restart interval parallel decodes
+    for (uint32_t threads : {0u, 4u}) {
+      AlbumArtOptions options = {.jpeg_decode_threads = threads};
+      ASSERT_EQ(get_album_art_ex(path.c_str(), rgb565.data(), &options), OK);
+
+      // turned clockwise: the left column of the stored picture becomes the top row
+      const uint16_t *pixels = (const uint16_t *)rgb565.data();
+      for (size_t y = 0; y < TARGET_IMG_HEIGHT; y++) {
+        for (size_t x = 0; x < TARGET_IMG_WIDTH; x++) {
+          ASSERT_EQ(pixels[x * TARGET_IMG_WIDTH + (TARGET_IMG_WIDTH - 1 - y)],
+                    upright_pixels[y * TARGET_IMG_WIDTH + x])
+              << x << "," << y << " threads " << threads;
+        }
+      }
+    }
+  }
+}
+
+// Test that small baseline JPEG covers are handed out as stored, from memory without a copy
+TEST_F(AlbumArtTest, PassesBaselineJpegThrough) {
+  auto jpeg = encodeJpeg(makeGradientRgb888(300, 300), 300, 300, false, 80);
+  auto mp3 = makeMp3WithCover("image/jpeg", jpeg);
+  auto path = writeTempFile("passthrough_cover.mp3", mp3);
+  ASSERT_LE(jpeg.size(), (size_t)PASSTHROUGH_DEFAULT_MAX_SIZE);
+
+  AlbumArtJpeg out;
+  ASSERT_EQ(get_album_art_jpeg_from_memory(mp3.data(), mp3.size(), &out, NULL), OK);
+  EXPECT_FALSE(out.transcoded);
+  EXPECT_EQ(out.owned_buffer, nullptr);
+  EXPECT_EQ(out.data, &*std::search(mp3.begin(), mp3.end(), jpeg.begin(), jpeg.end()));
+  EXPECT_EQ(out.size, jpeg.size());
+  album_art_jpeg_free(&out);
+
+  ASSERT_EQ(get_album_art_jpeg(path.c_str(), &out, NULL), OK);
+  EXPECT_FALSE(out.transcoded);
+  EXPECT_EQ(std::vector<uint8_t>(out.data, out.data + out.size), jpeg);
+  album_art_jpeg_free(&out);
+  EXPECT_EQ(out.data, nullptr);
+}
+
+// Test that other covers are transcoded to an upright baseline JPEG that looks like the RGB565
+// conversion
+TEST_F(AlbumArtTest, TranscodesOtherCovers) {
+  auto gradient = makeGradientRgb888(400, 400);
+  auto baseline = encodeJpeg(gradient, 400, 400, false, 95);
+
+  struct Case {
+    const char *name;
+    std::vector<uint8_t> mp3;
+    uint32_t max_size;
+  } cases[] = {
+      {"progressive", makeMp3WithCover("image/jpeg", encodeJpeg(gradient, 400, 400, true)), 0},
+      {"png", makeMp3WithCover("image/png", encodePng(gradient, 400, 400, false)), 0},
+      {"too big", makeMp3WithCover("image/jpeg", baseline), (uint32_t)baseline.size() - 1},
+      {"turned", makeMp3WithCover("image/jpeg", withExifOrientation(baseline, 6, true)), 0},
+  };
+
+  for (const auto &c : cases) {
+    auto path = writeTempFile("transcoded_cover.mp3", c.mp3);
+    auto reference = referenceOutput(path);
+    const uint16_t *reference_pixels = (const uint16_t *)reference.data();
+
+    PassthroughOptions options = {.max_size = c.max_size, .quality = 90};
+    AlbumArtJpeg out;
+    ASSERT_EQ(get_album_art_jpeg(path.c_str(), &out, &options), OK) << c.name;
+    EXPECT_TRUE(out.transcoded) << c.name;
+
+    Orientation orientation;
+    EXPECT_TRUE(jpeg_is_baseline(out.data, out.size, &orientation)) << c.name;
+    EXPECT_EQ(orientation, ORIENTATION_UNTAGGED) << c.name;
+
+    Image decoded = {};
+    ASSERT_TRUE(convert_jpeg_to_rgb888(out.data, out.size, &decoded)) << c.name;
+    ASSERT_EQ(decoded.img_width, (size_t)TARGET_IMG_WIDTH);
+    ASSERT_EQ(decoded.img_height, (size_t)TARGET_IMG_HEIGHT);
+
+    double error = 0;
+    for (size_t i = 0; i < TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT; i++) {
+      const uint16_t pixel = reference_pixels[i];
+      error += std::abs(decoded.buffer[i * 3 + 0] - ((pixel >> 11) << 3)) +
+               std::abs(decoded.buffer[i * 3 + 1] - (((pixel >> 5) & 0x3F) << 2)) +
+               std::abs(decoded.buffer[i * 3 + 2] - ((pixel & 0x1F) << 3));
+    }
+    EXPECT_LT(error / (TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT * 3), 6.0) << c.name;
+
+    free(decoded.buffer);
+    album_art_jpeg_free(&out);
+  }
+}
+
+// Test that pictures above the pixel budget are scaled a band of rows at a time
+TEST_F(AlbumArtTest, ScalesPicturesAbovePixelBudget) {
+  auto gradient = makeGradientRgb888(800, 800);
+
+  // the PNG scaler matches the full decode, DCT scaling of the JPEG differs slightly
+  struct Case {
+    std::vector<uint8_t> mp3;
+    bool exact;
+  } cases[] = {
+      {makeMp3WithCover("image/png", encodePng(gradient, 800, 800, false)), true},
+      {makeMp3WithCover("image/jpeg", encodeJpeg(gradient, 800, 800, false)), false},
+  };
+
+  for (const auto &c : cases) {
+    const auto &mp3 = c.mp3;
+    ArtMemoryStats unbounded = {};
+    AlbumArtOptions options = {.memory_stats = &unbounded};
+    std::vector<uint8_t> reference(RGB565_BUFFER_SIZE);
+    ASSERT_EQ(get_album_art_from_memory(mp3.data(), mp3.size(), reference.data(), &options), OK);
+    EXPECT_GE(unbounded.peak_bytes, 800u * 800u * 3u);
+
+    ArtMemoryStats bounded = {};
+    options = {.memory_stats = &bounded, .max_pixels = 100000};
+    ASSERT_EQ(get_album_art_from_memory(mp3.data(), mp3.size(), rgb565.data(), &options), OK);
+    EXPECT_LT(bounded.peak_bytes, 100000u * 3u);
+
+    const uint16_t *pixels = (const uint16_t *)rgb565.data();
+    const uint16_t *reference_pixels = (const uint16_t *)reference.data();
+    for (size_t i = 0; i < TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT; i++) {
+      if (c.exact) {
+        ASSERT_EQ(pixels[i], reference_pixels[i]) << "pixel " << i;
+      }
+      ASSERT_LE(std::abs((pixels[i] >> 11) - (reference_pixels[i] >> 11)), 1) << "pixel " << i;
+    }
+  }
+}
+
+// Test that pictures that can not be decoded within the pixel budget are rejected before their
+// pixels are allocated
+TEST_F(AlbumArtTest, RejectsPicturesAbovePixelBudget) {
+  auto gradient = makeGradientRgb888(800, 800);
+
+  auto forged = [](uint32_t width, uint32_t height, bool interlaced) {
+    return makeMp3WithCover("image/png", forgePngSize(width, height, interlaced));
+  };
+
+  struct Case {
+    const char *name;
+    std::vector<uint8_t> mp3;
+  } cases[] = {
+      {"progressive", makeMp3WithCover("image/jpeg", encodeJpeg(gradient, 800, 800, true))},
+      {"interlaced", makeMp3WithCover("image/png", encodePng(gradient, 800, 800, true))},
+      {"forged interlaced", forged(30000, 30000, true)},
+      {"forged wide", forged(30000, 10, false)},
+  };
+
+  for (const auto &c : cases) {
+    auto path = writeTempFile("budget_cover.mp3", c.mp3);
+    ArtMemoryStats stats = {};
+    AlbumArtOptions options = {.memory_stats = &stats, .max_pixels = 100000};
+
+    EXPECT_EQ(get_album_art_from_memory(c.mp3.data(), c.mp3.size(), rgb565.data(), &options),
+              IMAGE_TOO_LARGE)
+        << c.name;
+    EXPECT_LT(stats.peak_bytes, 64u * 1024u) << c.name;
+    EXPECT_EQ(get_album_art_ex(path.c_str(), rgb565.data(), &options), IMAGE_TOO_LARGE) << c.name;
+    EXPECT_LT(stats.peak_bytes, 64u * 1024u) << c.name;
+  }
+}
+
+// Test that broken and hostile covers fail the call without taking the process down, with the
+// default options that set no pixel budget
+TEST_F(AlbumArtTest, FailsCleanlyOnHostileCovers) {
+  auto jpeg = encodeJpeg(makeGradientRgb888(400, 400), 400, 400, false, 90, 1);
+  auto png = encodePng(makeGradientRgb888(400, 400), 400, 400, false);
+  std::vector<uint8_t> garbage = {0xFF, 0xD8, 0xFF};
+  garbage.resize(2000, 0x5A);
+
+  // libjpeg pads a scan that ends early, such covers may still convert
+  struct Case {
+    const char *name;
+    std::string mime_type;
+    std::vector<uint8_t> image;
+    bool fails;
+  } cases[] = {
+      {"jpeg cut in the header", "image/jpeg", {jpeg.begin(), jpeg.begin() + 100}, true},
+      {"jpeg cut in the scan", "image/jpeg", {jpeg.begin(), jpeg.begin() + jpeg.size() / 2}, false},
+      {"jpeg garbage", "image/jpeg", garbage, true},
+      {"png cut", "image/png", {png.begin(), png.begin() + png.size() / 2}, true},
+      {"png forged huge", "image/png", forgePngSize(40000, 40000, false), true},
+  };
+
+  for (const auto &c : cases) {
+    auto mp3 = makeMp3WithCover(c.mime_type, c.image);
+    auto path = writeTempFile("hostile_cover.mp3", mp3);
+
+    for (uint32_t threads : {0u, 4u}) {
+      AlbumArtOptions options = {.jpeg_decode_threads = threads};
+      IO_ERROR error = get_album_art_from_memory(mp3.data(), mp3.size(), rgb565.data(), &options);
+      if (c.fails) {
+        EXPECT_NE(error, OK) << c.name;
+      }
+    }
+
+    AlbumArtJpeg out;
+    if (get_album_art_jpeg_from_memory(mp3.data(), mp3.size(), &out, NULL) == OK) {
+      EXPECT_FALSE(c.fails && out.transcoded) << c.name;
+      album_art_jpeg_free(&out);
+    }
+
+    IO_ERROR error = get_album_art_preview(path.c_str(), rgb565.data(), &recordPhase, this);
+    if (c.fails) {
+      EXPECT_NE(error, OK) << c.name;
+    }
+
+    // the backends on their own
+    const ImageDecoder *decoder =
+        image_decoder_for(c.mime_type == "image/png" ? PNG : JPEG, c.image.data(), c.image.size());
+    ASSERT_NE(decoder, nullptr) << c.name;
+
+    Image image = {};
+    if (decoder->decode(c.image.data(), c.image.size(), &image, 4)) {
+      EXPECT_FALSE(c.fails) << c.name;
+      free(image.buffer);
+    }
+
+    ASSERT_TRUE(image_allocate(&image, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT, IMAGE_RGB888));
+    EXPECT_FALSE(c.fails && decoder->decode_scaled(c.image.data(), c.image.size(), &image))
+        << c.name;
+    free(image.buffer);
+  }
+}
+
+// Test that the parallel restart interval decode gives the same pixels as the serial decode
+TEST(ParallelJpegTest, MatchesSerialDecode) {
+  struct Case {
+    uint32_t width, height;
+    bool progressive;
+    unsigned int restart_rows;
+  };
+
+  // odd sizes leave partial MCU rows and columns, 4:2:0 chroma needs context across band edges
+  for (Case c : {Case{1001, 733, false, 1}, Case{640, 480, false, 3}, Case{640, 480, false, 0},
+                 Case{400, 300, true, 1}}) {
+    auto jpeg = encodeJpeg(makeGradientRgb888(c.width, c.height), c.width, c.height, c.progressive,
+                           90, c.restart_rows);
+
+    Image serial = {};
+    Image parallel = {};
+    ASSERT_TRUE(convert_jpeg_to_rgb888(jpeg.data(), jpeg.size(), &serial));
+    ASSERT_TRUE(convert_jpeg_to_rgb888_parallel(jpeg.data(), jpeg.size(), &parallel, 4));
+
+    ASSERT_EQ(parallel.img_width, serial.img_width);
+    ASSERT_EQ(parallel.img_height, serial.img_height);
+    EXPECT_EQ(memcmp(parallel.buffer, serial.buffer, serial.length), 0)
+        << c.width << "x" << c.height << " restart rows " << c.restart_rows;
+
+    free(serial.buffer);
+    free(parallel.buffer);
+  }
+}
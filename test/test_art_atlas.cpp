@@ -0,0 +1,159 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "art_atlas.h"
+#include "image.h"
+}
+
+class ArtAtlasTest : public ::testing::Test {
+protected:
+  ArtAtlas *atlas = nullptr;
+
+  void TearDown() override { art_atlas_destroy(atlas); }
+
+  // Copies tile index of the atlas into a packed buffer
+  std::vector<uint8_t> tilePixels(uint32_t index) {
+    const size_t bytes_per_pixel = atlas->image.format == IMAGE_RGBA8888 ? 4 : 2;
+    const AtlasTile &tile = atlas->tiles[index];
+    std::vector<uint8_t> pixels;
+
+    for (size_t y = tile.y; y < tile.y + TARGET_IMG_HEIGHT; y++) {
+      const uint8_t *row = atlas->image.buffer + y * atlas->image.stride + tile.x * bytes_per_pixel;
+      pixels.insert(pixels.end(), row, row + TARGET_IMG_WIDTH * bytes_per_pixel);
+    }
+    return pixels;
+  }
+
+  static std::vector<uint8_t> reference(const std::string &path) {
+    std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+    EXPECT_EQ(get_album_art(path.c_str(), rgb565.data()), OK) << path;
+    return rgb565;
+  }
+};
+
+// Test that files and cached thumbnails end up in their tiles like single file conversions
+TEST_F(ArtAtlasTest, RendersFilesAndThumbnails) {
+  std::vector<std::string> paths = {
+      writeTempFile("atlas_png.mp3",
+                    makeMp3WithCover("image/png", encodePng(makeGradientRgb888(400, 400), 400,
+                                                            400, false))),
+      writeTempFile("atlas_jpeg.mp3",
+                    makeMp3WithCover("image/jpeg", encodeJpeg(makeGradientRgb888(600, 600), 600,
+                                                              600, false))),
+      ::testing::TempDir() + "atlas_missing.mp3",
+  };
+
+  std::vector<uint8_t> thumbnail(RGB565_BUFFER_SIZE);
+  for (size_t i = 0; i < thumbnail.size(); i++) {
+    thumbnail[i] = (uint8_t)(i * 7);
+  }
+
+  std::vector<AtlasSource> sources = {
+      {paths[0].c_str(), nullptr},
+      {paths[1].c_str(), nullptr},
+      {paths[2].c_str(), nullptr},
+      {nullptr, thumbnail.data()},
+  };
+
+  atlas = art_atlas_create(5, 3, IMAGE_RGB565);
+  ASSERT_NE(atlas, nullptr);
+  EXPECT_EQ(atlas->image.img_width, 3u * TARGET_IMG_WIDTH);
+  EXPECT_EQ(atlas->image.img_height, 2u * TARGET_IMG_HEIGHT);
+  EXPECT_EQ(atlas->image.stride % IMAGE_ROW_ALIGNMENT, 0u);
+  EXPECT_EQ(atlas->tiles[4].x, 1u * TARGET_IMG_WIDTH);
+  EXPECT_EQ(atlas->tiles[4].y, 1u * TARGET_IMG_HEIGHT);
+
+  ArtPipelineConfig config = {.decode_workers = 2, .scale_workers = 2};
+  ASSERT_TRUE(art_atlas_render(atlas, nullptr, sources.data(), sources.size(), &config));
+
+  EXPECT_EQ(atlas->tiles[0].result, OK);
+  EXPECT_EQ(tilePixels(0), reference(paths[0]));
+  EXPECT_EQ(atlas->tiles[1].result, OK);
+  EXPECT_EQ(tilePixels(1), reference(paths[1]));
+  EXPECT_EQ(atlas->tiles[2].result, COULD_NOT_OPEN_FILE);
+  EXPECT_EQ(tilePixels(2), std::vector<uint8_t>(RGB565_BUFFER_SIZE, 0));
+  EXPECT_EQ(atlas->tiles[3].result, OK);
+  EXPECT_EQ(tilePixels(3), thumbnail);
+
+  for (uint32_t i = 0; i < 4; i++) {
+    EXPECT_TRUE(atlas->tiles[i].dirty) << i;
+  }
+  EXPECT_FALSE(atlas->tiles[4].dirty);
+  EXPECT_EQ(atlas->tiles[4].result, NO_APIC);
+}
+
+// Test that RGBA tiles hold the exact colors of the cover and of expanded thumbnails
+TEST_F(ArtAtlasTest, RendersRgbaTiles) {
+  std::string path = writeTempFile(
+      "atlas_uniform.mp3",
+      makeMp3WithCover("image/png", encodePng(makeUniformRgb888(300, 300, 10, 200, 90), 300, 300,
+                                              false)));
+  std::vector<uint8_t> white(RGB565_BUFFER_SIZE, 0xFF);
+
+  std::vector<AtlasSource> sources = {{path.c_str(), nullptr}, {nullptr, white.data()}};
+
+  atlas = art_atlas_create(2, 8, IMAGE_RGBA8888);
+  ASSERT_NE(atlas, nullptr);
+  EXPECT_EQ(atlas->columns, 2u);
+  ASSERT_TRUE(art_atlas_render(atlas, nullptr, sources.data(), sources.size(), nullptr));
+
+  auto cover = tilePixels(0);
+  auto thumbnail = tilePixels(1);
+  for (size_t i = 0; i < cover.size(); i += 4) {
+    ASSERT_EQ(cover[i + 0], 10) << i;
+    ASSERT_EQ(cover[i + 1], 200) << i;
+    ASSERT_EQ(cover[i + 2], 90) << i;
+    ASSERT_EQ(cover[i + 3], 255) << i;
+  }
+  EXPECT_EQ(thumbnail, std::vector<uint8_t>(TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT * 4, 255));
+
+  EXPECT_EQ(art_atlas_create(2, 2, IMAGE_RGB888), nullptr);
+  EXPECT_EQ(art_atlas_create(0, 2, IMAGE_RGB565), nullptr);
+  EXPECT_EQ(art_atlas_create(2, 0, IMAGE_RGB565), nullptr);
+}
+
+// Test that an update only writes and marks the tiles it renders
+TEST_F(ArtAtlasTest, UpdatesOnlyChangedTiles) {
+  std::string first = writeTempFile(
+      "atlas_first.mp3",
+      makeMp3WithCover("image/png", encodePng(makeGradientRgb888(300, 300), 300, 300, false)));
+  std::string second = writeTempFile(
+      "atlas_second.mp3",
+      makeMp3WithCover("image/png", encodePng(makeUniformRgb888(250, 250, 1, 2, 3), 250, 250,
+                                              false)));
+
+  atlas = art_atlas_create(4, 2, IMAGE_RGB565);
+  ASSERT_NE(atlas, nullptr);
+
+  std::vector<AtlasSource> sources(4, {first.c_str(), nullptr});
+  ASSERT_TRUE(art_atlas_render(atlas, nullptr, sources.data(), sources.size(), nullptr));
+  art_atlas_clear_dirty(atlas);
+
+  // marks tile 0 so a rewrite would show
+  const AtlasTile &marked = atlas->tiles[0];
+  for (size_t y = marked.y; y < marked.y + TARGET_IMG_HEIGHT; y++) {
+    memset(atlas->image.buffer + y * atlas->image.stride + marked.x * 2, 0x5A,
+           TARGET_IMG_WIDTH * 2);
+  }
+
+  const uint32_t changed[] = {2};
+  AtlasSource update = {second.c_str(), nullptr};
+  ASSERT_TRUE(art_atlas_render(atlas, changed, &update, 1, nullptr));
+
+  EXPECT_EQ(tilePixels(0), std::vector<uint8_t>(RGB565_BUFFER_SIZE, 0x5A));
+  EXPECT_EQ(tilePixels(1), reference(first));
+  EXPECT_EQ(tilePixels(2), reference(second));
+  EXPECT_EQ(tilePixels(3), reference(first));
+
+  for (uint32_t i = 0; i < 4; i++) {
+    EXPECT_EQ(atlas->tiles[i].dirty, i == 2) << i;
+  }
+
+  const uint32_t out_of_range[] = {4};
+  EXPECT_FALSE(art_atlas_render(atlas, out_of_range, &update, 1, nullptr));
+  EXPECT_FALSE(atlas->tiles[3].dirty);
+}
@@ -0,0 +1,214 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "art_bundle.h"
+#include "image.h"
+#include "rgb565_codec.h"
+}
+
+class ArtBundleTest : public ::testing::Test {
+protected:
+  std::string path;
+
+  void SetUp() override {
+    path = ::testing::TempDir() + ::testing::UnitTest::GetInstance()->current_test_info()->name() +
+           ".artbundle";
+    remove(path.c_str());
+  }
+
+  void TearDown() override { remove(path.c_str()); }
+
+  // Art data of a track or an empty vector if the bundle has none
+  static std::vector<uint8_t> blobOf(const ArtBundle *bundle, uint64_t track_id) {
+    const ArtBundleEntry *entry = art_bundle_find(bundle, track_id);
+    if (entry == nullptr) {
+      return {};
+    }
+    EXPECT_EQ(entry->blob_offset % ART_BUNDLE_ALIGNMENT, 0u);
+    const uint8_t *blob = art_bundle_blob(bundle, entry);
+    EXPECT_NE(blob, nullptr);
+    return std::vector<uint8_t>(blob, blob + entry->blob_size);
+  }
+};
+
+// Test that stored art is found by track id and identical art shares a blob
+TEST_F(ArtBundleTest, WritesAndReadsBack) {
+  std::vector<uint8_t> first(RGB565_BUFFER_SIZE, 0x11);
+  std::vector<uint8_t> second(5000, 0x22);
+
+  ArtBundleWriter *writer = art_bundle_writer_open(path.c_str());
+  ASSERT_NE(writer, nullptr);
+  ASSERT_TRUE(art_bundle_writer_add(writer, 30, first.data(), first.size(), ART_BUNDLE_RGB565));
+  ASSERT_TRUE(art_bundle_writer_add(writer, 10, second.data(), second.size(),
+                                    ART_BUNDLE_RGB565_ENCODED));
+  ASSERT_TRUE(art_bundle_writer_add(writer, 20, first.data(), first.size(), ART_BUNDLE_RGB565));
+  ASSERT_TRUE(art_bundle_writer_finish(writer));
+
+  ArtBundle *bundle = art_bundle_open(path.c_str());
+  ASSERT_NE(bundle, nullptr);
+  ASSERT_EQ(art_bundle_count(bundle), 3u);
+
+  // the index is sorted
+  EXPECT_EQ(art_bundle_entry_at(bundle, 0)->track_id, 10u);
+  EXPECT_EQ(art_bundle_entry_at(bundle, 2)->track_id, 30u);
+  EXPECT_EQ(art_bundle_entry_at(bundle, 3), nullptr);
+
+  EXPECT_EQ(blobOf(bundle, 30), first);
+  EXPECT_EQ(blobOf(bundle, 20), first);
+  EXPECT_EQ(blobOf(bundle, 10), second);
+  EXPECT_EQ(art_bundle_find(bundle, 10)->format, (uint32_t)ART_BUNDLE_RGB565_ENCODED);
+  EXPECT_EQ(art_bundle_find(bundle, 20)->blob_offset, art_bundle_find(bundle, 30)->blob_offset);
+  EXPECT_EQ(art_bundle_find(bundle, 15), nullptr);
+
+  art_bundle_close(bundle);
+}
+
+// Test that appending keeps the stored art, adds new tracks and replaces changed ones
+TEST_F(ArtBundleTest, AppendsIncrementally) {
+  std::vector<uint8_t> original(3000, 0x33);
+  std::vector<uint8_t> changed(3000, 0x44);
+  std::vector<uint8_t> added(7000, 0x55);
+
+  ArtBundleWriter *writer = art_bundle_writer_open(path.c_str());
+  ASSERT_NE(writer, nullptr);
+  for (uint64_t track = 1; track <= 100; track++) {
+    ASSERT_TRUE(art_bundle_writer_add(writer, track * 7, original.data(), original.size(),
+                                      ART_BUNDLE_RGB565));
+  }
+  ASSERT_TRUE(art_bundle_writer_finish(writer));
+
+  writer = art_bundle_writer_open(path.c_str());
+  ASSERT_NE(writer, nullptr);
+  ASSERT_TRUE(art_bundle_writer_add(writer, 14, changed.data(), changed.size(),
+                                    ART_BUNDLE_RGB565));
+  ASSERT_TRUE(art_bundle_writer_add(writer, 1000, added.data(), added.size(), ART_BUNDLE_RGB565));
+  ASSERT_TRUE(art_bundle_writer_add(writer, 1001, original.data(), original.size(),
+                                    ART_BUNDLE_RGB565));
+  ASSERT_TRUE(art_bundle_writer_finish(writer));
+
+  ArtBundle *bundle = art_bundle_open(path.c_str());
+  ASSERT_NE(bundle, nullptr);
+  EXPECT_EQ(art_bundle_count(bundle), 102u);
+  EXPECT_EQ(blobOf(bundle, 7), original);
+  EXPECT_EQ(blobOf(bundle, 14), changed);
+  EXPECT_EQ(blobOf(bundle, 700), original);
+  EXPECT_EQ(blobOf(bundle, 1000), added);
+
+  // art that is already in the bundle is not written again
+  EXPECT_EQ(art_bundle_find(bundle, 1001)->blob_offset, art_bundle_find(bundle, 7)->blob_offset);
+
+  for (size_t i = 1; i < art_bundle_count(bundle); i++) {
+    EXPECT_LT(art_bundle_entry_at(bundle, i - 1)->track_id,
+              art_bundle_entry_at(bundle, i)->track_id);
+  }
+
+  art_bundle_close(bundle);
+}
+
+// Test that a parallel build stores the converted art of every file that has some
+TEST_F(ArtBundleTest, BuildsFromFiles) {
+  std::vector<uint8_t> cover = encodePng(makeGradientRgb888(400, 400), 400, 400, false);
+  std::vector<uint8_t> no_apic_tag;
+  std::string title = "\x03Test Title";
+  appendFrame(no_apic_tag, "TIT2", std::vector<uint8_t>(title.begin(), title.end()));
+
+  std::vector<std::string> paths = {
+      writeTempFile("bundle_a.mp3", makeMp3WithCover("image/png", cover)),
+      writeTempFile("bundle_b.mp3", makeMp3WithCover("image/png", cover)),
+      writeTempFile("bundle_c.mp3",
+                    makeMp3WithCover("image/jpeg", encodeJpeg(makeGradientRgb888(300, 300), 300,
+                                                              300, false))),
+      writeTempFile("bundle_no_apic.mp3", makeMp3(no_apic_tag)),
+  };
+  std::vector<const char *> file_paths;
+  for (const std::string &file : paths) {
+    file_paths.push_back(file.c_str());
+  }
+
+  for (bool encode : {false, true}) {
+    remove(path.c_str());
+
+    ArtBundleBuildConfig config = {.pipeline = {.decode_workers = 2}, .encode = encode,
+                                   .batch_size = 3};
+    size_t added = 0;
+    ASSERT_TRUE(art_bundle_build(path.c_str(), file_paths.data(), file_paths.size(), &config,
+                                 &added));
+    EXPECT_EQ(added, 3u);
+
+    ArtBundle *bundle = art_bundle_open(path.c_str());
+    ASSERT_NE(bundle, nullptr);
+    EXPECT_EQ(art_bundle_count(bundle), 3u);
+
+    for (size_t i = 0; i < 3; i++) {
+      std::vector<uint8_t> reference(RGB565_BUFFER_SIZE);
+      ASSERT_EQ(get_album_art(file_paths[i], reference.data()), OK);
+
+      std::vector<uint8_t> blob = blobOf(bundle, art_bundle_track_id(file_paths[i]));
+      if (encode) {
+        std::vector<uint8_t> decoded(RGB565_BUFFER_SIZE);
+        ASSERT_TRUE(rgb565_decode(blob.data(), blob.size(), decoded.data(), decoded.size()));
+        EXPECT_EQ(decoded, reference) << file_paths[i];
+      } else {
+        EXPECT_EQ(blob, reference) << file_paths[i];
+      }
+    }
+
+    EXPECT_EQ(art_bundle_find(bundle, art_bundle_track_id(file_paths[0]))->blob_offset,
+              art_bundle_find(bundle, art_bundle_track_id(file_paths[1]))->blob_offset);
+    EXPECT_EQ(art_bundle_find(bundle, art_bundle_track_id(file_paths[3])), nullptr);
+    art_bundle_close(bundle);
+  }
+}
+
+// Test that a build sharing similar art stores one blob for a cover embedded at different sizes
+TEST_F(ArtBundleTest, SharesSimilarArt) {
+  std::vector<std::string> paths = {
+      writeTempFile("similar_png.mp3",
+                    makeMp3WithCover("image/png", encodePng(makeGradientRgb888(400, 400), 400,
+                                                            400, false))),
+      writeTempFile("similar_jpeg.mp3",
+                    makeMp3WithCover("image/jpeg", encodeJpeg(makeGradientRgb888(300, 300), 300,
+                                                              300, false))),
+      writeTempFile("similar_flat.mp3",
+                    makeMp3WithCover("image/png", encodePng(makeUniformRgb888(300, 300, 30, 60,
+                                                                              90),
+                                                            300, 300, false))),
+  };
+  std::vector<const char *> file_paths = {paths[0].c_str(), paths[1].c_str(), paths[2].c_str()};
+
+  ArtBundleBuildConfig config = {.pipeline = {.decode_workers = 2}, .share_similar = true,
+                                 .similar_distance = 4};
+  size_t added = 0;
+  ASSERT_TRUE(art_bundle_build(path.c_str(), file_paths.data(), file_paths.size(), &config,
+                               &added));
+  EXPECT_EQ(added, 3u);
+
+  ArtBundle *bundle = art_bundle_open(path.c_str());
+  ASSERT_NE(bundle, nullptr);
+
+  const ArtBundleEntry *png = art_bundle_find(bundle, art_bundle_track_id(file_paths[0]));
+  const ArtBundleEntry *jpeg = art_bundle_find(bundle, art_bundle_track_id(file_paths[1]));
+  const ArtBundleEntry *flat = art_bundle_find(bundle, art_bundle_track_id(file_paths[2]));
+  ASSERT_NE(png, nullptr);
+  ASSERT_NE(jpeg, nullptr);
+  ASSERT_NE(flat, nullptr);
+
+  // the files convert to slightly different pixels, without sharing they would get two blobs
+  EXPECT_EQ(png->blob_offset, jpeg->blob_offset);
+  EXPECT_NE(png->blob_offset, flat->blob_offset);
+  EXPECT_NE(png->content_hash, flat->content_hash);
+
+  art_bundle_close(bundle);
+}
+
+// Test that files that are not bundles are neither read nor appended to
+TEST_F(ArtBundleTest, RejectsOtherFiles) {
+  std::string other = writeTempFile("not_a_bundle.bin", std::vector<uint8_t>(8192, 0x7F));
+
+  EXPECT_EQ(art_bundle_open(other.c_str()), nullptr);
+  EXPECT_EQ(art_bundle_writer_open(other.c_str()), nullptr);
+  EXPECT_EQ(art_bundle_open(path.c_str()), nullptr);
+}
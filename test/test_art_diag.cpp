@@ -0,0 +1,77 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "album_art.h"
+#include "art_diag.h"
+}
+
+namespace {
+
+void collect(const ArtDiagRecord *record, void *user_data) {
+  static_cast<std::vector<ArtDiagRecord> *>(user_data)->push_back(*record);
+}
+
+class ArtDiagTest : public ::testing::Test {
+protected:
+  void TearDown() override { art_diag_set_sink(nullptr, nullptr, ART_DIAG_OFF); }
+
+  std::vector<ArtDiagRecord> records;
+  std::vector<uint8_t> rgb565 = std::vector<uint8_t>(RGB565_BUFFER_SIZE);
+};
+
+} // namespace
+
+// Test that a file without a tag is reported to the sink at its level, and filtered below it
+TEST_F(ArtDiagTest, SinkFiltersByLevel) {
+  auto path = writeTempFile("art_diag_plain.mp3", std::vector<uint8_t>(512, 0xFF));
+
+  art_diag_set_sink(&collect, &records, ART_DIAG_INFO);
+  EXPECT_NE(get_album_art(path.c_str(), rgb565.data()), OK);
+  ASSERT_FALSE(records.empty());
+  EXPECT_EQ(records[0].level, ART_DIAG_INFO);
+  EXPECT_EQ(records[0].code, ART_DIAG_NO_ID3);
+  EXPECT_STREQ(art_diag_code_name(records[0].code), "no_id3");
+
+  records.clear();
+  art_diag_set_sink(&collect, &records, ART_DIAG_WARNING);
+  EXPECT_NE(get_album_art(path.c_str(), rgb565.data()), OK);
+  for (const auto &record : records) {
+    EXPECT_GE(record.level, ART_DIAG_WARNING);
+  }
+
+  records.clear();
+  art_diag_set_sink(nullptr, &records, ART_DIAG_DEBUG);
+  EXPECT_NE(get_album_art(path.c_str(), rgb565.data()), OK);
+  EXPECT_TRUE(records.empty());
+}
+
+// Test that the record of a call holds the first failure, without a sink installed
+TEST_F(ArtDiagTest, CallRecordKeepsCause) {
+  ArtDiagRecord diag;
+  AlbumArtOptions options = {.diag = &diag};
+
+  const std::string missing = "/nonexistent/art_diag_missing.mp3";
+  EXPECT_NE(get_album_art_ex(missing.c_str(), rgb565.data(), &options), OK);
+  EXPECT_EQ(diag.code, ART_DIAG_OPEN_FAILED);
+  EXPECT_EQ(diag.level, ART_DIAG_ERROR);
+  EXPECT_EQ(std::string(diag.subject), missing);
+
+  auto gradient = makeGradientRgb888(800, 800);
+  auto progressive = makeMp3WithCover("image/jpeg", encodeJpeg(gradient, 800, 800, true));
+  options.max_pixels = 100000;
+  EXPECT_EQ(get_album_art_from_memory(progressive.data(), progressive.size(), rgb565.data(),
+                                      &options),
+            IMAGE_TOO_LARGE);
+  EXPECT_EQ(diag.code, ART_DIAG_TOO_LARGE);
+  EXPECT_EQ(diag.values[0], 800u);
+  EXPECT_EQ(diag.values[1], 800u);
+
+  auto baseline = makeMp3WithCover("image/jpeg", encodeJpeg(gradient, 800, 800, false));
+  options.max_pixels = 0;
+  EXPECT_EQ(get_album_art_from_memory(baseline.data(), baseline.size(), rgb565.data(), &options),
+            OK);
+  EXPECT_EQ(diag.code, ART_DIAG_NONE);
+}
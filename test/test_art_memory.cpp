@@ -0,0 +1,325 @@
+#include "test_fixtures.h"
+#include <atomic>
+#include <cstdlib>
+#include <functional>
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "album_art.h"
+#include "art_memory.h"
+#include "image_decoder.h"
+#include "img_processing.h"
+}
+
+namespace {
+
+struct CountingAllocator {
+  std::atomic<uint64_t> mallocs{0};
+  std::atomic<uint64_t> frees{0};
+};
+
+void *countingMalloc(void *user_data, size_t size) {
+  static_cast<CountingAllocator *>(user_data)->mallocs++;
+  return malloc(size);
+}
+
+void *countingRealloc(void *user_data, void *pointer, size_t size) {
+  (void)user_data;
+  return realloc(pointer, size);
+}
+
+void countingFree(void *user_data, void *pointer) {
+  static_cast<CountingAllocator *>(user_data)->frees++;
+  free(pointer);
+}
+
+// fails the fail_at-th allocation counted from the last reset, 0 never fails
+struct FailingAllocator {
+  std::atomic<uint64_t> calls{0};
+  std::atomic<uint64_t> mallocs{0};
+  std::atomic<uint64_t> frees{0};
+  uint64_t fail_at = 0;
+};
+
+void *failingMalloc(void *user_data, size_t size) {
+  auto *allocator = static_cast<FailingAllocator *>(user_data);
+  if (++allocator->calls == allocator->fail_at) {
+    return nullptr;
+  }
+  allocator->mallocs++;
+  return malloc(size);
+}
+
+void *failingRealloc(void *user_data, void *pointer, size_t size) {
+  auto *allocator = static_cast<FailingAllocator *>(user_data);
+  if (++allocator->calls == allocator->fail_at) {
+    return nullptr;
+  }
+  return realloc(pointer, size);
+}
+
+void failingFree(void *user_data, void *pointer) {
+  static_cast<FailingAllocator *>(user_data)->frees++;
+  free(pointer);
+}
+
+/**
+ * Runs the call once for every allocation it makes, with that allocation failing. The call gets a
+ * context allocating from a FailingAllocator and returns whether it succeeded.
+ */
+void sweepAllocationFailures(const char *name, const std::function<bool(ArtMemory *)> &call) {
+  for (uint64_t fail_at = 1;; fail_at++) {
+    FailingAllocator counter;
+    ArtAllocator allocator = {.malloc = &failingMalloc,
+                              .realloc = &failingRealloc,
+                              .free = &failingFree,
+                              .user_data = &counter};
+    ArtMemory *memory = art_memory_create(&allocator);
+    ASSERT_NE(memory, nullptr);
+    counter.calls = 0;
+    counter.fail_at = fail_at;
+
+    bool result = call(memory);
+
+    ArtMemoryStats stats = {};
+    art_memory_stats(memory, &stats);
+    EXPECT_EQ(stats.current_bytes, 0u) << name << " failing allocation " << fail_at;
+    art_memory_destroy(memory);
+    EXPECT_EQ(counter.mallocs.load(), counter.frees.load())
+        << name << " failing allocation " << fail_at;
+
+    // every allocation has failed once
+    if (counter.calls < fail_at) {
+      EXPECT_TRUE(result) << name;
+      return;
+    }
+  }
+}
+
+std::vector<uint8_t> albumArt(const std::string &path, const AlbumArtOptions *options) {
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  EXPECT_EQ(get_album_art_ex(path.c_str(), rgb565.data(), options), OK);
+  return rgb565;
+}
+
+} // namespace
+
+// Test that conversions allocating from a host allocator give the same pixels and free everything
+TEST(ArtMemoryTest, HostAllocatorMatchesLibc) {
+  struct Case {
+    std::string mime_type;
+    std::vector<uint8_t> image;
+    uint32_t threads;
+  };
+
+  auto rgb = makeGradientRgb888(512, 512);
+  std::vector<Case> cases = {
+      {"image/jpeg", encodeJpeg(rgb, 512, 512, false), 0},
+      {"image/jpeg", encodeJpeg(rgb, 512, 512, true), 0},
+      {"image/jpeg", encodeJpeg(rgb, 512, 512, false, 90, 1), 4},
+      {"image/png", encodePng(rgb, 512, 512, false), 0},
+  };
+
+  for (const auto &c : cases) {
+    auto path = writeTempFile("art_memory.mp3", makeMp3WithCover(c.mime_type, c.image));
+
+    CountingAllocator counter;
+    ArtAllocator allocator = {.malloc = &countingMalloc,
+                              .realloc = &countingRealloc,
+                              .free = &countingFree,
+                              .user_data = &counter};
+    ArtMemory *memory = art_memory_create(&allocator);
+    ASSERT_NE(memory, nullptr);
+
+    ArtMemoryStats call = {};
+    AlbumArtOptions options = {.jpeg_decode_threads = c.threads,
+                               .memory = memory,
+                               .memory_stats = &call};
+    AlbumArtOptions reference = {.jpeg_decode_threads = c.threads};
+    EXPECT_EQ(albumArt(path, &options), albumArt(path, &reference)) << c.mime_type;
+
+    EXPECT_GT(call.allocations, 0u);
+    EXPECT_GT(call.peak_bytes, 0u);
+    EXPECT_EQ(call.current_bytes, 0u);
+
+    ArtMemoryStats context = {};
+    art_memory_stats(memory, &context);
+    EXPECT_EQ(context.current_bytes, 0u);
+    EXPECT_EQ(context.allocations, call.allocations);
+    EXPECT_GE(context.peak_bytes, call.peak_bytes / (c.threads > 0 ? c.threads : 1));
+
+    // the context itself is the only block still held
+    EXPECT_EQ(counter.mallocs.load(), counter.frees.load() + 1);
+    art_memory_destroy(memory);
+    EXPECT_EQ(counter.mallocs.load(), counter.frees.load());
+  }
+}
+
+// Test that a context sums up the calls made through it
+TEST(ArtMemoryTest, ContextAccumulatesCalls) {
+  auto path = writeTempFile("art_memory_context.mp3",
+                            makeMp3WithCover("image/jpeg", encodeJpeg(makeGradientRgb888(300, 300),
+                                                                      300, 300, false)));
+
+  ArtMemory *memory = art_memory_create(nullptr);
+  ASSERT_NE(memory, nullptr);
+
+  ArtMemoryStats first = {};
+  ArtMemoryStats second = {};
+  AlbumArtOptions options = {.memory = memory, .memory_stats = &first};
+  albumArt(path, &options);
+  options.memory_stats = &second;
+  albumArt(path, &options);
+
+  ArtMemoryStats context = {};
+  art_memory_stats(memory, &context);
+  EXPECT_EQ(first.allocations, second.allocations);
+  EXPECT_EQ(first.peak_bytes, second.peak_bytes);
+  EXPECT_EQ(context.allocations, first.allocations + second.allocations);
+  EXPECT_EQ(context.peak_bytes, first.peak_bytes);
+  EXPECT_EQ(context.current_bytes, 0u);
+  art_memory_destroy(memory);
+}
+
+// Test that statistics can be asked for without a context, and that failed calls report them too
+TEST(ArtMemoryTest, StatsWithoutContext) {
+  auto path = writeTempFile("art_memory_default.mp3",
+                            makeMp3WithCover("image/png", encodePng(makeGradientRgb888(200, 200),
+                                                                    200, 200, false)));
+
+  ArtMemoryStats stats = {};
+  AlbumArtOptions options = {.memory_stats = &stats};
+  albumArt(path, &options);
+  EXPECT_GE(stats.peak_bytes, 200u * 200u * 3u);
+  EXPECT_EQ(stats.current_bytes, 0u);
+
+  auto broken = makeApicBody("image/jpeg", std::vector<uint8_t>(64, 0x42));
+  std::vector<uint8_t> tag_body;
+  appendFrame(tag_body, "APIC", broken, 3);
+  auto broken_path = writeTempFile("art_memory_broken.mp3", makeMp3(tag_body));
+
+  stats = {};
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  EXPECT_NE(get_album_art_ex(broken_path.c_str(), rgb565.data(), &options), OK);
+  EXPECT_GT(stats.allocations, 0u);
+  EXPECT_EQ(stats.current_bytes, 0u);
+}
+
+// Test that running out of host memory at any allocation fails the call without leaking
+TEST(ArtMemoryTest, FailsCleanlyAtEveryAllocation) {
+  struct Case {
+    const char *name;
+    std::vector<uint8_t> mp3;
+    uint32_t threads;
+  };
+
+  auto rgb = makeGradientRgb888(256, 256);
+  std::vector<Case> cases = {
+      {"baseline", makeMp3WithCover("image/jpeg", encodeJpeg(rgb, 256, 256, false)), 0},
+      {"progressive", makeMp3WithCover("image/jpeg", encodeJpeg(rgb, 256, 256, true)), 0},
+      {"restart intervals",
+       makeMp3WithCover("image/jpeg", encodeJpeg(rgb, 256, 256, false, 90, 1)), 2},
+      {"png", makeMp3WithCover("image/png", encodePng(rgb, 256, 256, false)), 0},
+      {"interlaced png", makeMp3WithCover("image/png", encodePng(rgb, 256, 256, true)), 0},
+  };
+
+  for (const auto &c : cases) {
+    sweepAllocationFailures(c.name, [&](ArtMemory *memory) {
+      AlbumArtOptions options = {.jpeg_decode_threads = c.threads, .memory = memory};
+      std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+      return get_album_art_from_memory(c.mp3.data(), c.mp3.size(), rgb565.data(), &options) == OK;
+    });
+  }
+
+  auto png = encodePng(rgb, 256, 256, false);
+  sweepAllocationFailures("libpng decode", [&](ArtMemory *memory) {
+    ArtMemoryScope scope;
+    art_memory_scope_enter(&scope, memory);
+    Image image = {};
+    bool result = libpng_decoder.decode(png.data(), png.size(), &image, 0);
+    art_free(result ? image.buffer : nullptr);
+    art_memory_scope_leave(&scope);
+    return result;
+  });
+
+  // planar images have no scaler without memory and must not be reported as scaled
+  std::vector<uint8_t> expected(200 * 200 * 3);
+  Image expected_dst = {
+      .buffer = expected.data(), .length = expected.size(), .img_width = 200, .img_height = 200};
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = 256, .img_height = 256};
+  ASSERT_TRUE(scale_square_image(&src, &expected_dst));
+  sweepAllocationFailures("planar downscale", [&](ArtMemory *memory) {
+    ArtMemoryScope scope;
+    art_memory_scope_enter(&scope, memory);
+    std::vector<uint8_t> planar(200 * 200 * 3);
+    Image dst = {};
+    image_set_planar(&dst, planar.data(), 200, 200);
+    bool result = scale_square_image(&src, &dst);
+    if (result) {
+      std::vector<uint8_t> merged(200 * 200 * 3);
+      interleave_rgb888(dst.planes[0], dst.planes[1], dst.planes[2], merged.data(), 200 * 200);
+      EXPECT_EQ(merged, expected);
+    }
+    art_memory_scope_leave(&scope);
+    return result;
+  });
+
+  // a PNG cover is transcoded
+  auto png_mp3 = makeMp3WithCover("image/png", png);
+  sweepAllocationFailures("passthrough", [&](ArtMemory *memory) {
+    ArtMemoryScope scope;
+    art_memory_scope_enter(&scope, memory);
+    AlbumArtJpeg jpeg;
+    bool result =
+        get_album_art_jpeg_from_memory(png_mp3.data(), png_mp3.size(), &jpeg, nullptr) == OK;
+    if (result) {
+      album_art_jpeg_free(&jpeg);
+    }
+    art_memory_scope_leave(&scope);
+    return result;
+  });
+}
+
+// Test that transcoded covers are allocated from the host allocator, also when they outgrow the
+// first output buffer
+TEST(ArtMemoryTest, TranscodesIntoHostMemory) {
+  std::vector<uint8_t> noise(256 * 256 * 3);
+  uint32_t state = 1;
+  for (auto &sample : noise) {
+    state = state * 1103515245 + 12345;
+    sample = (uint8_t)(state >> 16);
+  }
+  auto mp3 = makeMp3WithCover("image/png", encodePng(noise, 256, 256, false));
+
+  CountingAllocator counter;
+  ArtAllocator allocator = {.malloc = &countingMalloc,
+                            .realloc = &countingRealloc,
+                            .free = &countingFree,
+                            .user_data = &counter};
+  ArtMemory *memory = art_memory_create(&allocator);
+  ASSERT_NE(memory, nullptr);
+
+  ArtMemoryScope scope;
+  art_memory_scope_enter(&scope, memory);
+
+  PassthroughOptions options = {.max_size = 0, .quality = 100};
+  AlbumArtJpeg jpeg;
+  ASSERT_EQ(get_album_art_jpeg_from_memory(mp3.data(), mp3.size(), &jpeg, &options), OK);
+  EXPECT_TRUE(jpeg.transcoded);
+  EXPECT_GT(jpeg.size, 16u * 1024u);
+
+  Image decoded = {};
+  ASSERT_TRUE(libjpeg_decoder.decode(jpeg.data, jpeg.size, &decoded, 0));
+  EXPECT_EQ(decoded.img_width, (size_t)TARGET_IMG_WIDTH);
+  art_free(decoded.buffer);
+  album_art_jpeg_free(&jpeg);
+
+  art_memory_scope_leave(&scope);
+  EXPECT_GT(scope.stats.allocations, 0u);
+  EXPECT_EQ(scope.stats.current_bytes, 0u);
+
+  art_memory_destroy(memory);
+  EXPECT_EQ(counter.mallocs.load(), counter.frees.load());
+}
@@ -0,0 +1,153 @@
+#include "test_fixtures.h"
+#include <atomic>
+#include <chrono>
+#include <gtest/gtest.h>
+#include <string>
+#include <sys/resource.h>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "art_pipeline.h"
+#include "bounded_queue.h"
+#include "image.h"
+}
+
+class ArtPipelineTest : public ::testing::Test {
+protected:
+  std::atomic<int> completed{0};
+
+  static void countItem(ArtBatchItem *, void *user_data) {
+    ((ArtPipelineTest *)user_data)->completed++;
+  }
+};
+
+// Test that a mixed batch gives the same results as converting every file on its own
+TEST_F(ArtPipelineTest, MatchesSingleFileConversion) {
+  std::vector<uint8_t> no_apic_tag;
+  std::string title = "\x03Test Title";
+  appendFrame(no_apic_tag, "TIT2", std::vector<uint8_t>(title.begin(), title.end()));
+
+  std::vector<std::string> paths = {
+      writeTempFile("pipeline_png.mp3",
+                    makeMp3WithCover("image/png", encodePng(makeGradientRgb888(400, 400), 400,
+                                                            400, false))),
+      writeTempFile("pipeline_jpeg.mp3",
+                    makeMp3WithCover("image/jpeg", encodeJpeg(makeGradientRgb888(600, 600), 600,
+                                                              600, false))),
+      writeTempFile("pipeline_no_apic.mp3", makeMp3(no_apic_tag)),
+      ::testing::TempDir() + "pipeline_missing.mp3",
+      writeTempFile("pipeline_progressive.mp3",
+                    makeMp3WithCover("image/jpeg", encodeJpeg(makeGradientRgb888(300, 300), 300,
+                                                              300, true), 4)),
+  };
+
+  std::vector<std::vector<uint8_t>> outputs(paths.size(), std::vector<uint8_t>(RGB565_BUFFER_SIZE));
+  std::vector<ArtBatchItem> items;
+  for (size_t i = 0; i < paths.size(); i++) {
+    items.push_back({paths[i].c_str(), outputs[i].data(), OK});
+  }
+
+  ArtPipelineConfig config = {
+      .decode_workers = 2,
+      .scale_workers = 1,
+      .queue_depth = 1,
+      .io_queue_depth = 2,
+      .on_item_done = &countItem,
+      .user_data = this,
+  };
+  ASSERT_TRUE(art_pipeline_run(items.data(), items.size(), &config));
+  EXPECT_EQ(completed.load(), (int)items.size());
+
+  for (size_t i = 0; i < paths.size(); i++) {
+    std::vector<uint8_t> reference(RGB565_BUFFER_SIZE);
+    EXPECT_EQ(items[i].result, get_album_art(paths[i].c_str(), reference.data())) << paths[i];
+    if (items[i].result == OK) {
+      EXPECT_EQ(outputs[i], reference) << paths[i];
+    }
+  }
+}
+
+// Test that every pushed value is popped exactly once with several producers and consumers
+TEST(BoundedQueueTest, DeliversEveryValueOnce) {
+  const size_t producers = 3;
+  const size_t values_per_producer = 10000;
+  BoundedQueue *queue = bounded_queue_create(8, producers);
+  ASSERT_NE(queue, nullptr);
+
+  std::vector<std::atomic<int>> seen(producers * values_per_producer);
+  std::vector<std::thread> threads;
+
+  for (size_t p = 0; p < producers; p++) {
+    threads.emplace_back([queue, p, values_per_producer] {
+      for (size_t i = 0; i < values_per_producer; i++) {
+        // offset by one so no value is a null pointer
+        bounded_queue_push(queue, (void *)(uintptr_t)(p * values_per_producer + i + 1));
+      }
+      bounded_queue_producer_done(queue);
+    });
+  }
+
+  for (int c = 0; c < 2; c++) {
+    threads.emplace_back([queue, &seen] {
+      void *value;
+      while (bounded_queue_pop(queue, &value)) {
+        seen[(uintptr_t)value - 1]++;
+      }
+    });
+  }
+
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  bounded_queue_destroy(queue);
+
+  for (size_t i = 0; i < seen.size(); i++) {
+    ASSERT_EQ(seen[i].load(), 1) << "value " << i;
+  }
+}
+
+// Test that blocked pops and pushes park instead of polling, and are woken by the other side
+TEST(BoundedQueueTest, BlockedCallsPark) {
+  BoundedQueue *queue = bounded_queue_create(2, 1);
+  ASSERT_NE(queue, nullptr);
+
+  // context switches of the calling thread while it is blocked for the given time
+  auto switchesWhileBlocked = [](auto call) {
+    struct rusage before;
+    struct rusage after;
+    getrusage(RUSAGE_THREAD, &before);
+    call();
+    getrusage(RUSAGE_THREAD, &after);
+    return (after.ru_nvcsw + after.ru_nivcsw) - (before.ru_nvcsw + before.ru_nivcsw);
+  };
+
+  std::thread producer([&] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    bounded_queue_push(queue, (void *)1);
+
+    // the queue holds two values, the third push waits for the consumer
+    bounded_queue_push(queue, (void *)2);
+    bounded_queue_push(queue, (void *)3);
+    long switches = switchesWhileBlocked([&] { bounded_queue_push(queue, (void *)4); });
+    EXPECT_LT(switches, 100);
+    bounded_queue_producer_done(queue);
+  });
+
+  void *value = nullptr;
+  long switches = switchesWhileBlocked([&] { ASSERT_TRUE(bounded_queue_pop(queue, &value)); });
+  EXPECT_LT(switches, 100);
+  EXPECT_EQ(value, (void *)1);
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  for (uintptr_t expected = 2; expected <= 4; expected++) {
+    ASSERT_TRUE(bounded_queue_pop(queue, &value));
+    EXPECT_EQ(value, (void *)expected);
+  }
+
+  // the last producer_done wakes a parked pop
+  EXPECT_FALSE(bounded_queue_pop(queue, &value));
+
+  producer.join();
+  bounded_queue_destroy(queue);
+}
@@ -0,0 +1,157 @@
+#include "test_fixtures.h"
+#include <condition_variable>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include "art_scheduler.h"
+#include "image.h"
+}
+
+class ArtSchedulerTest : public ::testing::Test {
+protected:
+  std::string cover_path;
+
+  std::mutex mutex;
+  std::condition_variable changed;
+  bool gate_entered = false;
+  bool gate_open = false;
+  std::vector<int> completion_order;
+
+  void SetUp() override {
+    auto png = encodePng(makeGradientRgb888(400, 400), 400, 400, false);
+    cover_path = writeTempFile("scheduler_cover.mp3", makeMp3WithCover("image/png", png));
+  }
+
+  struct Tag {
+    ArtSchedulerTest *test;
+    int id;
+  };
+
+  // Keeps the only worker busy until openGate is called
+  static void gateCallback(ArtJob *, IO_ERROR, uint8_t *, void *user_data) {
+    ArtSchedulerTest *test = (ArtSchedulerTest *)user_data;
+    std::unique_lock<std::mutex> lock(test->mutex);
+    test->gate_entered = true;
+    test->changed.notify_all();
+    test->changed.wait(lock, [test] { return test->gate_open; });
+  }
+
+  static void recordCallback(ArtJob *, IO_ERROR, uint8_t *, void *user_data) {
+    Tag *tag = (Tag *)user_data;
+    std::lock_guard<std::mutex> lock(tag->test->mutex);
+    tag->test->completion_order.push_back(tag->id);
+  }
+
+  ArtJob *blockWorker(ArtScheduler *scheduler, uint8_t *buffer) {
+    ArtJob *gate =
+        art_scheduler_submit(scheduler, cover_path.c_str(), buffer, 0, &gateCallback, this);
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, [this] { return gate_entered; });
+    return gate;
+  }
+
+  void openGate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    gate_open = true;
+    changed.notify_all();
+  }
+};
+
+// Test that all jobs produce the same output as the synchronous API
+TEST_F(ArtSchedulerTest, CompletesJobs) {
+  std::vector<uint8_t> reference(RGB565_BUFFER_SIZE);
+  ASSERT_EQ(get_album_art(cover_path.c_str(), reference.data()), OK);
+
+  ArtScheduler *scheduler = art_scheduler_create(3);
+  ASSERT_NE(scheduler, nullptr);
+
+  std::vector<std::vector<uint8_t>> buffers(8, std::vector<uint8_t>(RGB565_BUFFER_SIZE));
+  std::vector<ArtJob *> jobs;
+
+  for (auto &buffer : buffers) {
+    jobs.push_back(
+        art_scheduler_submit(scheduler, cover_path.c_str(), buffer.data(), 0, NULL, NULL));
+    ASSERT_NE(jobs.back(), nullptr);
+  }
+
+  for (size_t i = 0; i < jobs.size(); i++) {
+    EXPECT_EQ(art_job_wait(jobs[i]), OK);
+    EXPECT_TRUE(art_job_is_done(jobs[i]));
+    EXPECT_EQ(buffers[i], reference);
+    art_job_release(jobs[i]);
+  }
+
+  art_scheduler_destroy(scheduler);
+}
+
+// Test that queued jobs run by priority and that reprioritized jobs move in the queue
+TEST_F(ArtSchedulerTest, RunsHighestPriorityFirst) {
+  ArtScheduler *scheduler = art_scheduler_create(1);
+  ASSERT_NE(scheduler, nullptr);
+
+  std::vector<std::vector<uint8_t>> buffers(5, std::vector<uint8_t>(RGB565_BUFFER_SIZE));
+  ArtJob *gate = blockWorker(scheduler, buffers[0].data());
+
+  Tag low = {this, 1}, high = {this, 10}, mid = {this, 5}, boosted = {this, 20};
+  const char *path = cover_path.c_str();
+  ArtJob *jobs[] = {
+      art_scheduler_submit(scheduler, path, buffers[1].data(), 1, &recordCallback, &low),
+      art_scheduler_submit(scheduler, path, buffers[2].data(), 10, &recordCallback, &high),
+      art_scheduler_submit(scheduler, path, buffers[3].data(), 5, &recordCallback, &mid),
+      art_scheduler_submit(scheduler, path, buffers[4].data(), 0, &recordCallback, &boosted),
+  };
+
+  EXPECT_TRUE(art_job_set_priority(jobs[3], 20));
+  EXPECT_FALSE(art_job_set_priority(gate, 100));
+
+  openGate();
+
+  for (ArtJob *job : jobs) {
+    EXPECT_EQ(art_job_wait(job), OK);
+    art_job_release(job);
+  }
+  art_job_wait(gate);
+  art_job_release(gate);
+
+  EXPECT_EQ(completion_order, (std::vector<int>{20, 10, 5, 1}));
+  art_scheduler_destroy(scheduler);
+}
+
+// Test cancellation of queued jobs and of jobs still pending when the scheduler is destroyed
+TEST_F(ArtSchedulerTest, CancelsQueuedJobs) {
+  ArtScheduler *scheduler = art_scheduler_create(1);
+  ASSERT_NE(scheduler, nullptr);
+
+  std::vector<std::vector<uint8_t>> buffers(3, std::vector<uint8_t>(RGB565_BUFFER_SIZE));
+  ArtJob *gate = blockWorker(scheduler, buffers[0].data());
+
+  Tag cancelled = {this, 1}, pending = {this, 2};
+  ArtJob *cancelled_job = art_scheduler_submit(scheduler, cover_path.c_str(), buffers[1].data(), 0,
+                                               &recordCallback, &cancelled);
+  ArtJob *pending_job = art_scheduler_submit(scheduler, cover_path.c_str(), buffers[2].data(), 0,
+                                             &recordCallback, &pending);
+
+  art_job_cancel(cancelled_job);
+  EXPECT_TRUE(art_job_is_done(cancelled_job));
+  EXPECT_EQ(art_job_wait(cancelled_job), CANCELLED);
+  EXPECT_FALSE(art_job_set_priority(cancelled_job, 1));
+
+  // pending_job is still queued behind the gate and gets cancelled by destroy
+  std::thread opener([this] {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    openGate();
+  });
+  art_scheduler_destroy(scheduler);
+  opener.join();
+
+  EXPECT_EQ(art_job_wait(pending_job), CANCELLED);
+  EXPECT_EQ(completion_order, (std::vector<int>{1, 2}));
+
+  art_job_release(cancelled_job);
+  art_job_release(pending_job);
+  art_job_release(gate);
+}
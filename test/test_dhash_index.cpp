@@ -0,0 +1,168 @@
+#include "test_fixtures.h"
+#include <algorithm>
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "album_art.h"
+#include "dhash_index.h"
+#include "image.h"
+#include "img_processing.h"
+}
+
+namespace {
+
+// Cover of random colour blocks, scaled copies of it keep the same structure
+std::vector<uint8_t> makeBlockCover(uint32_t width, uint32_t height, uint32_t seed) {
+  const uint32_t blocks = 12;
+  std::mt19937 random(seed);
+  std::vector<uint8_t> colours(blocks * blocks * 3);
+  for (uint8_t &value : colours) {
+    value = (uint8_t)random();
+  }
+
+  std::vector<uint8_t> rgb(width * height * 3);
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      const uint32_t block = (y * blocks / height) * blocks + x * blocks / width;
+      for (uint32_t c = 0; c < 3; c++) {
+        rgb[(y * width + x) * 3 + c] = colours[block * 3 + c];
+      }
+    }
+  }
+  return rgb;
+}
+
+uint64_t coverHash(const std::string &path) {
+  uint64_t hash = 0;
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  AlbumArtOptions options = {.art_dhash = &hash};
+  EXPECT_EQ(get_album_art_ex(path.c_str(), rgb565.data(), &options), OK) << path;
+  return hash;
+}
+
+} // namespace
+
+// Test that queries find exactly the hashes a linear scan finds, for folded and direct chunks
+TEST(DhashIndexTest, MatchesLinearScan) {
+  std::mt19937_64 random(41);
+
+  for (uint32_t max_distance : {0u, 2u, 4u, 9u}) {
+    DhashIndex *index = dhash_index_create(max_distance);
+    ASSERT_NE(index, nullptr);
+
+    // random hashes plus near copies of some of them, so every distance occurs
+    std::vector<uint64_t> hashes;
+    for (size_t i = 0; i < 20000; i++) {
+      uint64_t hash = random();
+      if (i % 4 != 0 && !hashes.empty()) {
+        hash = hashes[random() % hashes.size()];
+        for (uint64_t flips = random() % 12; flips > 0; flips--) {
+          hash ^= (uint64_t)1 << (random() % 64);
+        }
+      }
+
+      uint32_t id;
+      ASSERT_TRUE(dhash_index_add(index, hash, &id));
+      EXPECT_EQ(id, hashes.size());
+      hashes.push_back(hash);
+    }
+    EXPECT_EQ(dhash_index_count(index), hashes.size());
+
+    for (size_t query = 0; query < 300; query++) {
+      uint64_t hash = hashes[random() % hashes.size()] ^ ((uint64_t)1 << (random() % 64));
+
+      std::vector<uint32_t> expected;
+      for (size_t i = 0; i < hashes.size(); i++) {
+        if (dhash_distance(hashes[i], hash) <= max_distance) {
+          expected.push_back((uint32_t)i);
+        }
+      }
+
+      std::vector<uint32_t> found(expected.size() + 1);
+      ASSERT_EQ(dhash_index_query(index, hash, max_distance, found.data(), found.size()),
+                expected.size());
+      found.resize(expected.size());
+      std::sort(found.begin(), found.end());
+      EXPECT_EQ(found, expected);
+
+      uint32_t nearest;
+      ASSERT_EQ(dhash_index_nearest(index, hash, max_distance, &nearest), !expected.empty());
+      for (uint32_t id : expected) {
+        EXPECT_LE(dhash_distance(hashes[nearest], hash), dhash_distance(hashes[id], hash));
+      }
+    }
+
+    dhash_index_destroy(index);
+  }
+
+  EXPECT_EQ(dhash_index_create(DHASH_INDEX_MAX_DISTANCE + 1), nullptr);
+}
+
+// Test that the hash of converted art survives rescaling and recompression but tells covers apart
+TEST(DhashIndexTest, HashesConvertedCovers) {
+  auto cover = makeBlockCover(400, 400, 1);
+  auto small = makeBlockCover(300, 300, 1);
+  auto other = makeBlockCover(400, 400, 2);
+
+  uint64_t png = coverHash(
+      writeTempFile("dhash_png.mp3", makeMp3WithCover("image/png", encodePng(cover, 400, 400,
+                                                                               false))));
+  uint64_t jpeg = coverHash(writeTempFile(
+      "dhash_jpeg.mp3", makeMp3WithCover("image/jpeg", encodeJpeg(small, 300, 300, false))));
+  uint64_t different = coverHash(writeTempFile(
+      "dhash_other.mp3", makeMp3WithCover("image/png", encodePng(other, 400, 400, false))));
+
+  EXPECT_LE(dhash_distance(png, jpeg), 4u);
+  EXPECT_GE(dhash_distance(png, different), 16u);
+}
+
+// Test that the vector luma sums hash both layouts like the plain per pixel formula
+TEST(DhashIndexTest, ImageHashMatchesReference) {
+  const size_t width = 437;
+  const size_t height = 123;
+  std::mt19937 random(3);
+  std::vector<uint8_t> rgb(width * height * 3);
+  for (uint8_t &value : rgb) {
+    value = (uint8_t)random();
+  }
+
+  uint64_t expected = 0;
+  for (size_t row = 0; row < DHASH_ROWS; row++) {
+    const size_t y_start = row * height / DHASH_ROWS;
+    const size_t y_end = (row + 1) * height / DHASH_ROWS;
+    uint64_t averages[DHASH_COLUMNS];
+
+    for (size_t c = 0; c < DHASH_COLUMNS; c++) {
+      const size_t x_start = c * width / DHASH_COLUMNS;
+      const size_t x_end = (c + 1) * width / DHASH_COLUMNS;
+      uint64_t sum = 0;
+      for (size_t y = y_start; y < y_end; y++) {
+        for (size_t x = x_start; x < x_end; x++) {
+          const uint8_t *pixel = &rgb[(y * width + x) * 3];
+          sum += 77 * pixel[0] + 150 * pixel[1] + 29 * pixel[2];
+        }
+      }
+      averages[c] = sum / ((x_end - x_start) * (y_end - y_start));
+    }
+
+    for (size_t c = 0; c + 1 < DHASH_COLUMNS; c++) {
+      if (averages[c] < averages[c + 1]) {
+        expected |= (uint64_t)1 << (row * (DHASH_COLUMNS - 1) + c);
+      }
+    }
+  }
+
+  Image interleaved = {
+      .buffer = rgb.data(), .length = rgb.size(), .img_width = width, .img_height = height};
+  EXPECT_EQ(image_dhash(&interleaved), expected);
+
+  std::vector<uint8_t> planes(rgb.size());
+  Image planar = {};
+  image_set_planar(&planar, planes.data(), width, height);
+  deinterleave_rgb888(rgb.data(), planar.planes[0], planar.planes[1], planar.planes[2],
+                      width * height);
+  EXPECT_EQ(image_dhash(&planar), expected);
+}
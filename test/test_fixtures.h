@@ -0,0 +1,312 @@
+#ifndef TEST_FIXTURES_H
+#define TEST_FIXTURES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// NOTE: jpeg-turbo does not inlcude stdio
+// clang-format off
+#include <jpeglib.h>
+#include <png.h>
+// clang-format on
+
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+// Helpers that build MP3 files with embedded cover art entirely in memory, so the tests do not
+// depend on binary fixtures.
+
+// Creates a smooth RGB888 gradient that survives JPEG compression reasonably well
+inline std::vector<uint8_t> makeGradientRgb888(uint32_t width, uint32_t height) {
+  std::vector<uint8_t> rgb(width * height * 3);
+
+  for (uint32_t y = 0; y < height; y++) {
+    for (uint32_t x = 0; x < width; x++) {
+      rgb[(y * width + x) * 3 + 0] = (uint8_t)(x * 255 / width);
+      rgb[(y * width + x) * 3 + 1] = (uint8_t)(y * 255 / height);
+      rgb[(y * width + x) * 3 + 2] = (uint8_t)((x + y) * 127 / (width + height));
+    }
+  }
+  return rgb;
+}
+
+inline std::vector<uint8_t> makeUniformRgb888(uint32_t width, uint32_t height, uint8_t r,
+                                              uint8_t g, uint8_t b) {
+  std::vector<uint8_t> rgb(width * height * 3);
+
+  for (size_t i = 0; i < rgb.size(); i += 3) {
+    rgb[i + 0] = r;
+    rgb[i + 1] = g;
+    rgb[i + 2] = b;
+  }
+  return rgb;
+}
+
+inline std::vector<uint8_t> encodeJpeg(const std::vector<uint8_t> &rgb, uint32_t width,
+                                       uint32_t height, bool progressive, int quality = 95,
+                                       unsigned int restart_rows = 0) {
+  struct jpeg_compress_struct info;
+  struct jpeg_error_mgr err;
+
+  info.err = jpeg_std_error(&err);
+  jpeg_create_compress(&info);
+
+  unsigned char *out = nullptr;
+  unsigned long out_size = 0;
+  jpeg_mem_dest(&info, &out, &out_size);
+
+  info.image_width = width;
+  info.image_height = height;
+  info.input_components = 3;
+  info.in_color_space = JCS_RGB;
+
+  jpeg_set_defaults(&info);
+  jpeg_set_quality(&info, quality, TRUE);
+  info.restart_in_rows = restart_rows;
+
+  if (progressive) {
+    jpeg_simple_progression(&info);
+  }
+
+  jpeg_start_compress(&info, TRUE);
+
+  while (info.next_scanline < info.image_height) {
+    JSAMPROW row = (JSAMPROW)&rgb[info.next_scanline * width * 3];
+    jpeg_write_scanlines(&info, &row, 1);
+  }
+
+  jpeg_finish_compress(&info);
+  jpeg_destroy_compress(&info);
+
+  std::vector<uint8_t> jpeg(out, out + out_size);
+  free(out);
+  return jpeg;
+}
+
+// Inserts an APP1 segment with an EXIF Orientation tag behind the SOI marker of a JPEG, with a
+// second tag in front of it so the entry has to be searched for
+inline std::vector<uint8_t> withExifOrientation(const std::vector<uint8_t> &jpeg,
+                                                uint16_t orientation, bool little_endian) {
+  auto put16 = [&](std::vector<uint8_t> &out, uint32_t value) {
+    out.push_back(little_endian ? value & 0xFF : (value >> 8) & 0xFF);
+    out.push_back(little_endian ? (value >> 8) & 0xFF : value & 0xFF);
+  };
+  auto put32 = [&](std::vector<uint8_t> &out, uint32_t value) {
+    put16(out, little_endian ? value & 0xFFFF : value >> 16);
+    put16(out, little_endian ? value >> 16 : value & 0xFFFF);
+  };
+
+  std::vector<uint8_t> tiff = {little_endian ? (uint8_t)'I' : (uint8_t)'M',
+                               little_endian ? (uint8_t)'I' : (uint8_t)'M'};
+  put16(tiff, 42);
+  put32(tiff, 8);
+  put16(tiff, 2);
+  // ImageWidth LONG, then Orientation SHORT
+  put16(tiff, 0x0100);
+  put16(tiff, 4);
+  put32(tiff, 1);
+  put32(tiff, 400);
+  put16(tiff, 0x0112);
+  put16(tiff, 3);
+  put32(tiff, 1);
+  put16(tiff, orientation);
+  put16(tiff, 0);
+  put32(tiff, 0);
+
+  std::vector<uint8_t> segment = {0xFF, 0xE1, 0, 0, 'E', 'x', 'i', 'f', 0, 0};
+  segment.insert(segment.end(), tiff.begin(), tiff.end());
+  segment[2] = (uint8_t)((segment.size() - 2) >> 8);
+  segment[3] = (uint8_t)(segment.size() - 2);
+
+  std::vector<uint8_t> tagged(jpeg.begin(), jpeg.begin() + 2);
+  tagged.insert(tagged.end(), segment.begin(), segment.end());
+  tagged.insert(tagged.end(), jpeg.begin() + 2, jpeg.end());
+  return tagged;
+}
+
+inline void appendPngData(png_structp png_ptr, png_bytep data, png_size_t length) {
+  std::vector<uint8_t> *png = (std::vector<uint8_t> *)png_get_io_ptr(png_ptr);
+  png->insert(png->end(), data, data + length);
+}
+
+inline void flushPngData(png_structp) {}
+
+// Encodes the RGB888 image with any PNG color type: gray types take the red channel, alpha types
+// get a constant alpha, 16 bit samples repeat the byte and palettes are built from the colors
+inline std::vector<uint8_t> encodePngFormat(const std::vector<uint8_t> &rgb, uint32_t width,
+                                            uint32_t height, int color_type, int bit_depth,
+                                            bool interlaced) {
+  std::vector<uint8_t> png;
+  std::vector<png_color> palette;
+
+  size_t channels = (color_type & PNG_COLOR_MASK_COLOR) && color_type != PNG_COLOR_TYPE_PALETTE
+                        ? 3
+                        : 1;
+  bool alpha = color_type & PNG_COLOR_MASK_ALPHA;
+  size_t sample_size = bit_depth == 16 ? 2 : 1;
+  size_t row_size = width * (channels + alpha) * sample_size;
+  std::vector<uint8_t> pixels(row_size * height);
+
+  for (size_t i = 0, out = 0; i < (size_t)width * height; i++) {
+    const uint8_t *pixel = &rgb[i * 3];
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+      size_t index = 0;
+      while (index < palette.size() && (palette[index].red != pixel[0] ||
+                                        palette[index].green != pixel[1] ||
+                                        palette[index].blue != pixel[2])) {
+        index++;
+      }
+      if (index == palette.size()) {
+        palette.push_back({pixel[0], pixel[1], pixel[2]});
+      }
+      pixels[out++] = (uint8_t)index;
+      continue;
+    }
+
+    for (size_t c = 0; c < channels + alpha; c++) {
+      uint8_t value = c < channels ? pixel[c] : 0x80;
+      for (size_t b = 0; b < sample_size; b++) {
+        pixels[out++] = value;
+      }
+    }
+  }
+
+  if (palette.size() > 256) {
+    ADD_FAILURE() << "too many colors for a palette";
+    return {};
+  }
+
+  png_structp png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  png_infop info_ptr = png_create_info_struct(png_ptr);
+
+  if (setjmp(png_jmpbuf(png_ptr))) {
+    png_destroy_write_struct(&png_ptr, &info_ptr);
+    ADD_FAILURE() << "PNG encoding failed";
+    return {};
+  }
+
+  png_set_write_fn(png_ptr, &png, &appendPngData, &flushPngData);
+  png_set_IHDR(png_ptr, info_ptr, width, height, bit_depth, color_type,
+               interlaced ? PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+               PNG_FILTER_TYPE_DEFAULT);
+
+  if (color_type == PNG_COLOR_TYPE_PALETTE) {
+    png_set_PLTE(png_ptr, info_ptr, palette.data(), (int)palette.size());
+  }
+
+  std::vector<png_bytep> rows(height);
+  for (uint32_t y = 0; y < height; y++) {
+    rows[y] = (png_bytep)&pixels[y * row_size];
+  }
+
+  png_set_rows(png_ptr, info_ptr, rows.data());
+  png_write_png(png_ptr, info_ptr, PNG_TRANSFORM_IDENTITY, NULL);
+  png_destroy_write_struct(&png_ptr, &info_ptr);
+
+  return png;
+}
+
+inline std::vector<uint8_t> encodePng(const std::vector<uint8_t> &rgb, uint32_t width,
+                                      uint32_t height, bool interlaced) {
+  return encodePngFormat(rgb, width, height, PNG_COLOR_TYPE_RGB, 8, interlaced);
+}
+
+// APIC frame body: encoding, MIME type, picture type, description, picture data
+inline std::vector<uint8_t> makeApicBody(const std::string &mime_type,
+                                         const std::vector<uint8_t> &image,
+                                         const std::string &description = "cover") {
+  std::vector<uint8_t> body;
+  body.push_back(0); // ISO-8859-1
+  body.insert(body.end(), mime_type.begin(), mime_type.end());
+  body.push_back(0);
+  body.push_back(3); // front cover
+  body.insert(body.end(), description.begin(), description.end());
+  body.push_back(0);
+  body.insert(body.end(), image.begin(), image.end());
+  return body;
+}
+
+inline void appendFrame(std::vector<uint8_t> &tag_body, const char id[4],
+                        const std::vector<uint8_t> &body, uint8_t major_version = 3) {
+  uint32_t size = (uint32_t)body.size();
+
+  tag_body.insert(tag_body.end(), id, id + 4);
+  if (major_version == 4) {
+    tag_body.push_back((size >> 21) & 0x7F);
+    tag_body.push_back((size >> 14) & 0x7F);
+    tag_body.push_back((size >> 7) & 0x7F);
+    tag_body.push_back(size & 0x7F);
+  } else {
+    tag_body.push_back((size >> 24) & 0xFF);
+    tag_body.push_back((size >> 16) & 0xFF);
+    tag_body.push_back((size >> 8) & 0xFF);
+    tag_body.push_back(size & 0xFF);
+  }
+  tag_body.push_back(0);
+  tag_body.push_back(0);
+  tag_body.insert(tag_body.end(), body.begin(), body.end());
+}
+
+// Complete ID3 tag (header + frames + padding) followed by some fake MPEG frames
+inline std::vector<uint8_t> makeMp3(const std::vector<uint8_t> &tag_body, uint8_t major_version = 3,
+                                    uint32_t padding = 256) {
+  uint32_t tag_size = (uint32_t)tag_body.size() + padding;
+
+  std::vector<uint8_t> mp3 = {'I',
+                              'D',
+                              '3',
+                              major_version,
+                              0,
+                              0,
+                              (uint8_t)((tag_size >> 21) & 0x7F),
+                              (uint8_t)((tag_size >> 14) & 0x7F),
+                              (uint8_t)((tag_size >> 7) & 0x7F),
+                              (uint8_t)(tag_size & 0x7F)};
+  mp3.insert(mp3.end(), tag_body.begin(), tag_body.end());
+  mp3.insert(mp3.end(), padding, 0);
+
+  for (int i = 0; i < 64; i++) {
+    const uint8_t mpeg_frame_header[4] = {0xFF, 0xFB, 0x90, 0x64};
+    mp3.insert(mp3.end(), mpeg_frame_header, mpeg_frame_header + 4);
+    mp3.insert(mp3.end(), 413, 0x55);
+  }
+  return mp3;
+}
+
+inline std::vector<uint8_t> makeMp3WithCover(const std::string &mime_type,
+                                             const std::vector<uint8_t> &image,
+                                             uint8_t major_version = 3) {
+  std::vector<uint8_t> tag_body;
+  std::string title = "\x03Test Title";
+  appendFrame(tag_body, "TIT2", std::vector<uint8_t>(title.begin(), title.end()), major_version);
+  appendFrame(tag_body, "APIC", makeApicBody(mime_type, image), major_version);
+  return makeMp3(tag_body, major_version);
+}
+
+inline std::string writeTempFile(const std::string &name, const std::vector<uint8_t> &data) {
+  std::string path = ::testing::TempDir() + name;
+  FILE *f = fopen(path.c_str(), "wb");
+  EXPECT_NE(f, nullptr);
+  if (f != nullptr) {
+    fwrite(data.data(), 1, data.size(), f);
+    fclose(f);
+  }
+  return path;
+}
+
+inline uint16_t toRgb565(uint8_t r, uint8_t g, uint8_t b) {
+  uint16_t r5 = (r + 4) >> 3;
+  uint16_t g6 = (g + 2) >> 2;
+  uint16_t b5 = (b + 4) >> 3;
+
+  r5 = r5 > 31 ? 31 : r5;
+  g6 = g6 > 63 ? 63 : g6;
+  b5 = b5 > 31 ? 31 : b5;
+
+  return (uint16_t)((r5 << 11) | (g6 << 5) | b5);
+}
+
+#endif // TEST_FIXTURES_H
@@ -0,0 +1,305 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+extern "C" {
+#include "image_decoder.h"
+#include "img_processing.h"
+}
+
+namespace {
+
+// One picture of the conformance corpus, expected holds the source pixels
+struct CorpusImage {
+  std::string name;
+  ImageType type;
+  std::vector<uint8_t> data;
+  uint32_t width;
+  uint32_t height;
+  std::vector<uint8_t> expected;
+  // largest difference to the source pixels a backend may produce (lossy formats)
+  int tolerance;
+};
+
+// Gray images have the same value in every channel, palettes need few colors
+std::vector<uint8_t> makeGrayRgb888(uint32_t width, uint32_t height) {
+  auto rgb = makeGradientRgb888(width, height);
+  for (size_t i = 0; i < rgb.size(); i += 3) {
+    rgb[i + 1] = rgb[i + 2] = rgb[i];
+  }
+  return rgb;
+}
+
+std::vector<uint8_t> makeBandedRgb888(uint32_t width, uint32_t height) {
+  auto rgb = makeGradientRgb888(width, height);
+  for (uint8_t &value : rgb) {
+    value &= 0xC0;
+  }
+  return rgb;
+}
+
+std::vector<CorpusImage> makeCorpus() {
+  std::vector<CorpusImage> corpus;
+
+  auto addPng = [&](const std::string &name, std::vector<uint8_t> rgb, uint32_t size,
+                    int color_type, int bit_depth, bool interlaced) {
+    corpus.push_back({name, PNG,
+                      encodePngFormat(rgb, size, size, color_type, bit_depth, interlaced), size,
+                      size, rgb, 0});
+  };
+
+  auto addJpeg = [&](const std::string &name, uint32_t size, bool progressive,
+                     unsigned int restart_rows) {
+    auto rgb = makeGradientRgb888(size, size);
+    corpus.push_back({name, JPEG, encodeJpeg(rgb, size, size, progressive, 95, restart_rows), size,
+                      size, rgb, 16});
+  };
+
+  addPng("png_rgb", makeGradientRgb888(450, 450), 450, PNG_COLOR_TYPE_RGB, 8, false);
+  addPng("png_rgb_interlaced", makeGradientRgb888(450, 450), 450, PNG_COLOR_TYPE_RGB, 8, true);
+  addPng("png_rgba", makeGradientRgb888(300, 300), 300, PNG_COLOR_TYPE_RGB_ALPHA, 8, false);
+  addPng("png_rgb16", makeGradientRgb888(300, 300), 300, PNG_COLOR_TYPE_RGB, 16, false);
+  addPng("png_gray", makeGrayRgb888(300, 300), 300, PNG_COLOR_TYPE_GRAY, 8, false);
+  addPng("png_gray_alpha", makeGrayRgb888(300, 300), 300, PNG_COLOR_TYPE_GRAY_ALPHA, 8, true);
+  addPng("png_palette", makeBandedRgb888(300, 300), 300, PNG_COLOR_TYPE_PALETTE, 8, false);
+  addPng("png_small", makeGradientRgb888(120, 120), 120, PNG_COLOR_TYPE_RGB, 8, false);
+
+  addJpeg("jpeg_baseline", 450, false, 0);
+  addJpeg("jpeg_progressive", 400, true, 0);
+  addJpeg("jpeg_restart", 640, false, 1);
+  addJpeg("jpeg_small", 120, false, 0);
+
+  return corpus;
+}
+
+int maxDifference(const uint8_t *a, const uint8_t *b, size_t length) {
+  int difference = 0;
+  for (size_t i = 0; i < length; i++) {
+    difference = std::max(difference, abs((int)a[i] - (int)b[i]));
+  }
+  return difference;
+}
+
+struct RowCollector {
+  std::vector<uint8_t> pixels;
+  size_t row_size;
+  uint32_t next_row = 0;
+  uint32_t stop_after = UINT32_MAX;
+  bool in_order = true;
+
+  static bool collect(const uint8_t *row, uint32_t y, void *user_data) {
+    RowCollector *collector = (RowCollector *)user_data;
+    collector->in_order &= y == collector->next_row++;
+    collector->pixels.insert(collector->pixels.end(), row, row + collector->row_size);
+    return collector->next_row < collector->stop_after;
+  }
+};
+
+} // namespace
+
+// Every backend has to pass the same corpus, parameterised by backend name
+class DecoderConformanceTest : public ::testing::TestWithParam<const char *> {
+protected:
+  const ImageDecoder *decoder = nullptr;
+  std::vector<CorpusImage> corpus = makeCorpus();
+
+  void SetUp() override {
+    decoder = image_decoder_find(GetParam());
+    ASSERT_NE(decoder, nullptr);
+  }
+
+  bool handles(const CorpusImage &image) { return image.type == decoder->type; }
+};
+
+TEST_P(DecoderConformanceTest, ProbesOwnFormatOnly) {
+  for (const CorpusImage &image : corpus) {
+    EXPECT_EQ(decoder->probe(image.data.data(), image.data.size()), handles(image)) << image.name;
+  }
+
+  const uint8_t garbage[16] = {'n', 'o', 't', ' ', 'a', 'n', ' ', 'i', 'm', 'a', 'g', 'e'};
+  EXPECT_FALSE(decoder->probe(garbage, sizeof(garbage)));
+  EXPECT_FALSE(decoder->probe(garbage, 0));
+}
+
+TEST_P(DecoderConformanceTest, ReadsHeader) {
+  for (const CorpusImage &image : corpus) {
+    if (!handles(image)) {
+      continue;
+    }
+
+    uint32_t width = 0;
+    uint32_t height = 0;
+    ASSERT_TRUE(decoder->read_header(image.data.data(), image.data.size(), &width, &height))
+        << image.name;
+    EXPECT_EQ(width, image.width) << image.name;
+    EXPECT_EQ(height, image.height) << image.name;
+  }
+}
+
+TEST_P(DecoderConformanceTest, DecodesSourcePixels) {
+  for (const CorpusImage &image : corpus) {
+    if (!handles(image)) {
+      continue;
+    }
+
+    for (uint32_t threads : {1u, 4u}) {
+      Image decoded = {};
+      ASSERT_TRUE(decoder->decode(image.data.data(), image.data.size(), &decoded, threads))
+          << image.name;
+      ASSERT_EQ(decoded.img_width, image.width) << image.name;
+      ASSERT_EQ(decoded.img_height, image.height) << image.name;
+      ASSERT_EQ(decoded.length, image.expected.size()) << image.name;
+      EXPECT_LE(maxDifference(decoded.buffer, image.expected.data(), decoded.length),
+                image.tolerance)
+          << image.name;
+      free(decoded.buffer);
+    }
+  }
+}
+
+TEST_P(DecoderConformanceTest, DecodesRowsLikeWholeImage) {
+  for (const CorpusImage &image : corpus) {
+    if (!handles(image)) {
+      continue;
+    }
+
+    Image decoded = {};
+    ASSERT_TRUE(decoder->decode(image.data.data(), image.data.size(), &decoded, 1));
+
+    RowCollector rows = {.row_size = image.width * 3};
+    ASSERT_TRUE(decoder->decode_rows(image.data.data(), image.data.size(),
+                                     &RowCollector::collect, &rows))
+        << image.name;
+    EXPECT_TRUE(rows.in_order) << image.name;
+    ASSERT_EQ(rows.pixels.size(), decoded.length) << image.name;
+    EXPECT_EQ(memcmp(rows.pixels.data(), decoded.buffer, decoded.length), 0) << image.name;
+    free(decoded.buffer);
+
+    // the callback can stop decoding
+    RowCollector first_rows = {.row_size = image.width * 3, .stop_after = 3};
+    ASSERT_TRUE(decoder->decode_rows(image.data.data(), image.data.size(),
+                                     &RowCollector::collect, &first_rows))
+        << image.name;
+    EXPECT_EQ(first_rows.next_row, 3u) << image.name;
+  }
+}
+
+TEST_P(DecoderConformanceTest, DecodesScaledLikeScaleSquareImage) {
+  for (const CorpusImage &image : corpus) {
+    if (!handles(image)) {
+      continue;
+    }
+
+    Image decoded = {};
+    ASSERT_TRUE(decoder->decode(image.data.data(), image.data.size(), &decoded, 1));
+
+    std::vector<uint8_t> expected(RGB888_BUFFER_SIZE);
+    Image reference = {.buffer = expected.data(),
+                       .length = RGB888_BUFFER_SIZE,
+                       .img_width = TARGET_IMG_WIDTH,
+                       .img_height = TARGET_IMG_HEIGHT};
+    scale_square_image(&decoded, &reference);
+    free(decoded.buffer);
+
+    std::vector<uint8_t> scaled(RGB888_BUFFER_SIZE);
+    Image output = {.buffer = scaled.data(),
+                    .length = RGB888_BUFFER_SIZE,
+                    .img_width = TARGET_IMG_WIDTH,
+                    .img_height = TARGET_IMG_HEIGHT};
+    ASSERT_TRUE(decoder->decode_scaled(image.data.data(), image.data.size(), &output))
+        << image.name;
+
+    // decoder side scaling of lossy formats filters differently, lossless output has to match
+    EXPECT_LE(maxDifference(scaled.data(), expected.data(), scaled.size()), image.tolerance)
+        << image.name;
+  }
+}
+
+INSTANTIATE_TEST_SUITE_P(Backends, DecoderConformanceTest,
+                         ::testing::Values("libpng", "libjpeg-turbo"
+#ifdef MP3CORE_HAVE_SPNG
+                                           ,
+                                           "spng"
+#endif
+                                           ));
+
+namespace {
+
+bool rejectAll(const uint8_t *, uint32_t) { return false; }
+bool acceptAll(const uint8_t *, uint32_t) { return true; }
+
+// the registry is global, every test leaves it with the built-in backends in their order
+class DecoderRegistryTest : public ::testing::Test {
+protected:
+  void SetUp() override {
+    for (size_t i = 0; i < image_decoder_count(); i++) {
+      builtin.push_back(image_decoder_at(i));
+    }
+  }
+
+  void TearDown() override {
+    while (image_decoder_count() > 0) {
+      image_decoder_unregister(image_decoder_at(0)->name);
+    }
+
+    for (auto it = builtin.rbegin(); it != builtin.rend(); ++it) {
+      image_decoder_register(*it);
+    }
+  }
+
+  std::vector<const ImageDecoder *> builtin;
+};
+
+} // namespace
+
+// Test that registered and preferred backends are tried first for their format
+TEST_F(DecoderRegistryTest, RegistersAndPrefers) {
+  auto png = encodePng(makeGradientRgb888(64, 64), 64, 64, false);
+  size_t count = image_decoder_count();
+
+  ImageDecoder declining = libpng_decoder;
+  declining.name = "declining";
+  declining.probe = &rejectAll;
+
+  ImageDecoder accepting = libpng_decoder;
+  accepting.name = "accepting";
+  accepting.probe = &acceptAll;
+
+  ASSERT_TRUE(image_decoder_register(&declining));
+  EXPECT_FALSE(image_decoder_register(&declining));
+  EXPECT_EQ(image_decoder_count(), count + 1);
+  EXPECT_EQ(image_decoder_at(0), &declining);
+
+  // a backend that does not accept the data is skipped
+  EXPECT_NE(image_decoder_for(PNG, png.data(), png.size()), &declining);
+
+  ASSERT_TRUE(image_decoder_register(&accepting));
+  EXPECT_EQ(image_decoder_for(PNG, png.data(), png.size()), &accepting);
+  EXPECT_EQ(image_decoder_for(JPEG, png.data(), png.size()), nullptr);
+
+  ASSERT_TRUE(image_decoder_prefer("libpng"));
+  EXPECT_EQ(image_decoder_for(PNG, png.data(), png.size()), &libpng_decoder);
+  EXPECT_EQ(image_decoder_find("accepting"), &accepting);
+  EXPECT_FALSE(image_decoder_prefer("missing"));
+}
+
+// Test that unregistering keeps the order of the other backends
+TEST_F(DecoderRegistryTest, Unregisters) {
+  size_t count = image_decoder_count();
+
+  ImageDecoder accepting = libpng_decoder;
+  accepting.name = "accepting";
+  accepting.probe = &acceptAll;
+
+  ASSERT_TRUE(image_decoder_register(&accepting));
+  ASSERT_TRUE(image_decoder_unregister("accepting"));
+  EXPECT_FALSE(image_decoder_unregister("accepting"));
+  EXPECT_EQ(image_decoder_count(), count);
+  EXPECT_EQ(image_decoder_find("accepting"), nullptr);
+
+  for (size_t i = 0; i < count; i++) {
+    EXPECT_EQ(image_decoder_at(i), builtin[i]);
+  }
+}
@@ -1,7 +1,10 @@
 #include <assert.h>
+#include <cmath>
 #include <gtest/gtest.h>
+#include <memory>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 extern "C" {
 #include "img_processing.h"
@@ -19,7 +22,7 @@ protected:
 
   // Helper function to create uniform color image (RGB only)
   Image createUniformImage(uint32_t width, uint32_t height, uint8_t value) {
-    Image img;
+    Image img = {};
     img.img_width = width;
     img.img_height = height;
     img.length = width * height * 3; // RGB only
@@ -38,7 +41,7 @@ protected:
 
   // Helper function to create empty destination image
   Image createEmptyImage(uint32_t width, uint32_t height) {
-    Image img;
+    Image img = {};
     img.img_width = width;
     img.img_height = height;
     img.length = width * height * 3; // RGB only
@@ -59,7 +62,7 @@ protected:
 // Test basic downscaling functionality
 TEST_F(DownscaleAreaAverageTest, BasicDownscaling) {
   // Create a 4x4 RGB image with known values, downscale to 2x2
-  Image src;
+  Image src = {};
   src.img_width = 4;
   src.img_height = 4;
   src.length = 4 * 4 * 3;
@@ -129,7 +132,7 @@ TEST_F(DownscaleAreaAverageTest, UniformColor) {
 // Test mathematical correctness with known values
 TEST_F(DownscaleAreaAverageTest, MathematicalCorrectness) {
   // Create a 2x2 RGB image with known values, downscale to 1x1
-  Image src;
+  Image src = {};
   src.img_width = 2;
   src.img_height = 2;
   src.length = 2 * 2 * 3;
@@ -158,7 +161,7 @@ TEST_F(DownscaleAreaAverageTest, MathematicalCorrectness) {
 TEST_F(DownscaleAreaAverageTest, ExtremeDownscaling) {
   // Scale from 8x8 to 1x1 - test averaging across large area
   // Create checkerboard pattern for predictable average
-  Image src;
+  Image src = {};
   src.img_width = 8;
   src.img_height = 8;
   src.length = 8 * 8 * 3;
@@ -190,7 +193,7 @@ TEST_F(DownscaleAreaAverageTest, ExtremeDownscaling) {
 // Test specific averaging calculation
 TEST_F(DownscaleAreaAverageTest, SpecificAverageCalculation) {
   // Create a 4x4 RGB image with specific pattern
-  Image src;
+  Image src = {};
   src.img_width = 4;
   src.img_height = 4;
   src.length = 4 * 4 * 3;
@@ -238,7 +241,7 @@ TEST_F(DownscaleAreaAverageTest, SpecificAverageCalculation) {
 TEST_F(DownscaleAreaAverageTest, NonIntegerScaling) {
   // Scale from 6x6 to 2x2 (3x scaling factor - easier to verify)
   // Create a pattern where each 3x3 block has known values
-  Image src;
+  Image src = {};
   src.img_width = 6;
   src.img_height = 6;
   src.length = 6 * 6 * 3;
@@ -288,7 +291,7 @@ TEST_F(DownscaleAreaAverageTest, NonIntegerScaling) {
 // Test rectangular images (non-square)
 TEST_F(DownscaleAreaAverageTest, RectangularImages) {
   // Test with 4x2 to 2x1 scaling - create known pattern
-  Image src;
+  Image src = {};
   src.img_width = 4;
   src.img_height = 2;
   src.length = 4 * 2 * 3;
@@ -321,7 +324,7 @@ TEST_F(DownscaleAreaAverageTest, RectangularImages) {
 // Test another rectangular case - vertical rectangle
 TEST_F(DownscaleAreaAverageTest, VerticalRectangularImages) {
   // Test with 2x4 to 1x2 scaling - create known pattern
-  Image src;
+  Image src = {};
   src.img_width = 2;
   src.img_height = 4;
   src.length = 2 * 4 * 3;
@@ -357,7 +360,7 @@ TEST_F(DownscaleAreaAverageTest, VerticalRectangularImages) {
 TEST_F(DownscaleAreaAverageTest, BoundaryConditions) {
   // Test with dimensions that create fractional pixel mappings: 5x5 -> 3x3
   // This tests proper handling of partial pixel contributions
-  Image src;
+  Image src = {};
   src.img_width = 5;
   src.img_height = 5;
   src.length = 5 * 5 * 3;
@@ -467,7 +470,7 @@ TEST_F(DownscaleAreaAverageTest, LargeImageOverflowEdgeCase) {
   // Test with a scenario that could cause overflow if not handled properly
   // Use alternating max and min values to test arithmetic
 
-  Image src;
+  Image src = {};
   src.img_width = 32;
   src.img_height = 32;
   src.length = 32 * 32 * 3;
@@ -499,7 +502,7 @@ TEST_F(DownscaleAreaAverageTest, LargeImageOverflowEdgeCase) {
 // Test mixed value averaging to verify correct arithmetic
 TEST_F(DownscaleAreaAverageTest, MixedValueAveraging) {
   // Test with alternating high and low values
-  Image src;
+  Image src = {};
   src.img_width = 4;
   src.img_height = 4;
   src.length = 4 * 4 * 3;
@@ -531,7 +534,7 @@ TEST_F(DownscaleAreaAverageTest, MixedValueAveraging) {
 // Test diverse values within averaging blocks - this actually tests averaging logic
 TEST_F(DownscaleAreaAverageTest, DiverseValuesWithinBlocks) {
   // 4x4 -> 2x2 with different values in each 2x2 source block
-  Image src;
+  Image src = {};
   src.img_width = 4;
   src.img_height = 4;
   src.length = 4 * 4 * 3;
@@ -578,7 +581,7 @@ TEST_F(DownscaleAreaAverageTest, DiverseValuesWithinBlocks) {
 // Test rectangular with diverse values - ensures both coordinate mapping AND averaging work
 TEST_F(DownscaleAreaAverageTest, RectangularDiverseValues) {
   // 6x2 -> 3x1 with varied values in each 2x2 block
-  Image src;
+  Image src = {};
   src.img_width = 6;
   src.img_height = 2;
   src.length = 6 * 2 * 3;
@@ -617,7 +620,7 @@ TEST_F(DownscaleAreaAverageTest, RectangularDiverseValues) {
 // Test edge case averaging - values that could cause rounding issues
 TEST_F(DownscaleAreaAverageTest, EdgeCaseAveraging) {
   // Test values that result in fractional averages to verify rounding
-  Image src;
+  Image src = {};
   src.img_width = 2;
   src.img_height = 2;
   src.length = 2 * 2 * 3;
@@ -646,7 +649,7 @@ TEST_F(DownscaleAreaAverageTest, EdgeCaseAveraging) {
 // Test max/min value mixing to verify no overflow in intermediate calculations
 TEST_F(DownscaleAreaAverageTest, MaxMinValueMixing) {
   // Mix extreme values to test overflow handling during summation
-  Image src;
+  Image src = {};
   src.img_width = 4;
   src.img_height = 2;
   src.length = 4 * 2 * 3;
@@ -677,7 +680,7 @@ TEST_F(DownscaleAreaAverageTest, MaxMinValueMixing) {
 // Test prime number averaging to catch any mathematical errors
 TEST_F(DownscaleAreaAverageTest, PrimeNumberAveraging) {
   // Use prime numbers to avoid any "convenient" mathematical coincidences
-  Image src;
+  Image src = {};
   src.img_width = 2;
   src.img_height = 2;
   src.length = 2 * 2 * 3;
@@ -702,3 +705,589 @@ TEST_F(DownscaleAreaAverageTest, PrimeNumberAveraging) {
   freeImage(&src);
   freeImage(&dst);
 }
+
+// Fills a buffer with a pattern that differs in every byte of a pixel
+static std::vector<uint8_t> makePattern(size_t size, uint32_t seed) {
+  std::vector<uint8_t> pattern(size);
+  for (size_t i = 0; i < size; i++) {
+    seed = seed * 1664525u + 1013904223u;
+    pattern[i] = (uint8_t)(seed >> 24);
+  }
+  return pattern;
+}
+
+// Test that the SIMD kernels and their scalar tails split and merge the channels exactly
+TEST(PlanarLayoutTest, DeinterleaveRoundTrip) {
+  for (size_t pixel_count : {0, 1, 15, 16, 17, 47, 48, 200, 1001}) {
+    auto rgb = makePattern(pixel_count * 3, (uint32_t)pixel_count);
+    std::vector<uint8_t> r(pixel_count), g(pixel_count), b(pixel_count);
+
+    deinterleave_rgb888(rgb.data(), r.data(), g.data(), b.data(), pixel_count);
+
+    for (size_t i = 0; i < pixel_count; i++) {
+      ASSERT_EQ(r[i], rgb[i * 3 + 0]) << pixel_count << " pixel " << i;
+      ASSERT_EQ(g[i], rgb[i * 3 + 1]) << pixel_count << " pixel " << i;
+      ASSERT_EQ(b[i], rgb[i * 3 + 2]) << pixel_count << " pixel " << i;
+    }
+
+    std::vector<uint8_t> merged(pixel_count * 3);
+    interleave_rgb888(r.data(), g.data(), b.data(), merged.data(), pixel_count);
+    EXPECT_EQ(merged, rgb) << pixel_count;
+  }
+}
+
+// Test that the row based downscaler matches the reference for every combination of layouts
+TEST(PlanarLayoutTest, RowDownscaleMatchesReference) {
+  for (uint32_t size : {201, 437, 600, 1000}) {
+    auto rgb = makePattern(size * size * 3, size);
+    Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = size, .img_height = size};
+
+    std::vector<uint8_t> expected(200 * 200 * 3);
+    Image reference = {
+        .buffer = expected.data(), .length = expected.size(), .img_width = 200, .img_height = 200};
+    downscale_area_average(&src, &reference);
+
+    std::vector<uint8_t> planes(size * size * 3);
+    Image planar_src = {};
+    image_set_planar(&planar_src, planes.data(), size, size);
+    deinterleave_rgb888(rgb.data(), planar_src.planes[0], planar_src.planes[1],
+                        planar_src.planes[2], (size_t)size * size);
+
+    for (Image *source : {&src, &planar_src}) {
+      std::vector<uint8_t> interleaved(200 * 200 * 3);
+      Image interleaved_dst = {.buffer = interleaved.data(),
+                               .length = interleaved.size(),
+                               .img_width = 200,
+                               .img_height = 200};
+      ASSERT_TRUE(downscale_area_average_rows(source, &interleaved_dst));
+      EXPECT_EQ(interleaved, expected) << size;
+
+      std::vector<uint8_t> planar(200 * 200 * 3);
+      Image planar_dst = {};
+      image_set_planar(&planar_dst, planar.data(), 200, 200);
+      ASSERT_TRUE(downscale_area_average_rows(source, &planar_dst));
+
+      std::vector<uint8_t> merged(200 * 200 * 3);
+      interleave_rgb888(planar_dst.planes[0], planar_dst.planes[1], planar_dst.planes[2],
+                        merged.data(), 200 * 200);
+      EXPECT_EQ(merged, expected) << size;
+    }
+  }
+}
+
+// Test that packing planar pixels rounds like the scalar interleaved packer
+TEST(PlanarLayoutTest, PlanarPackMatchesScalar) {
+  auto rgb = makePattern(200 * 200 * 3, 7);
+  rgb[0] = rgb[1] = rgb[2] = 255;
+
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = 200, .img_height = 200};
+  std::vector<uint8_t> expected(200 * 200 * 2);
+  Image expected_dst = {
+      .buffer = expected.data(), .length = expected.size(), .img_width = 200, .img_height = 200};
+  rgb888_to_rgb565_scalar(&src, &expected_dst);
+
+  std::vector<uint8_t> planes(rgb.size());
+  Image planar_src = {};
+  image_set_planar(&planar_src, planes.data(), 200, 200);
+  deinterleave_rgb888(rgb.data(), planar_src.planes[0], planar_src.planes[1], planar_src.planes[2],
+                      200 * 200);
+
+  std::vector<uint8_t> packed(200 * 200 * 2);
+  Image packed_dst = {
+      .buffer = packed.data(), .length = packed.size(), .img_width = 200, .img_height = 200};
+  rgb888_planar_to_rgb565(&planar_src, &packed_dst);
+
+  EXPECT_EQ(packed, expected);
+}
+
+namespace {
+
+// Copies a window of a packed interleaved image into its own packed buffer
+std::vector<uint8_t> copyRegion(const std::vector<uint8_t> &rgb, size_t width, size_t x, size_t y,
+                                size_t region_width, size_t region_height) {
+  std::vector<uint8_t> region;
+  for (size_t row = y; row < y + region_height; row++) {
+    auto start = rgb.begin() + (row * width + x) * 3;
+    region.insert(region.end(), start, start + region_width * 3);
+  }
+  return region;
+}
+
+} // namespace
+
+// Test that scaling a crop gives the same pixels as scaling a copy of the region, for every scaler
+TEST(StridedViewTest, CropScalesLikeCopiedRegion) {
+  const size_t width = 700;
+  const size_t height = 500;
+  auto rgb = makePattern(width * height * 3, 3);
+  Image parent = {.buffer = rgb.data(), .length = rgb.size(), .img_width = width,
+                  .img_height = height};
+
+  // downscale, copy and upscale
+  for (size_t size : {420, 200, 150}) {
+    Image crop = {};
+    ASSERT_TRUE(image_crop(&parent, 37, 11, size, size, &crop));
+    EXPECT_EQ(crop.stride, width * 3);
+
+    auto region = copyRegion(rgb, width, 37, 11, size, size);
+    Image copy = {.buffer = region.data(), .length = region.size(), .img_width = size,
+                  .img_height = size};
+
+    std::vector<uint8_t> expected(200 * 200 * 3);
+    Image expected_dst = {
+        .buffer = expected.data(), .length = expected.size(), .img_width = 200, .img_height = 200};
+    scale_square_image(&copy, &expected_dst);
+
+    std::vector<uint8_t> scaled(200 * 200 * 3);
+    Image scaled_dst = {
+        .buffer = scaled.data(), .length = scaled.size(), .img_width = 200, .img_height = 200};
+    scale_square_image(&crop, &scaled_dst);
+    EXPECT_EQ(scaled, expected) << size;
+
+    if (size > 200) {
+      downscale_area_average(&crop, &scaled_dst);
+      EXPECT_EQ(scaled, expected) << size;
+    }
+  }
+
+  EXPECT_FALSE(image_crop(&parent, 600, 0, 101, 10, &parent));
+  EXPECT_FALSE(image_crop(&parent, 0, 490, 10, 11, &parent));
+}
+
+// Test that decoder padded source rows and aligned planar targets give the packed result
+TEST(StridedViewTest, PaddedRowsScaleLikePackedRows) {
+  const size_t size = 437;
+  const size_t stride = size * 3 + 13;
+  auto rgb = makePattern(size * size * 3, 5);
+
+  std::vector<uint8_t> padded(stride * size, 0xEE);
+  for (size_t y = 0; y < size; y++) {
+    memcpy(padded.data() + y * stride, rgb.data() + y * size * 3, size * 3);
+  }
+
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = size, .img_height = size};
+  Image padded_src = {};
+  image_view(&padded_src, padded.data(), size, size, stride, IMAGE_RGB888);
+
+  std::vector<uint8_t> expected(200 * 200 * 3);
+  Image expected_dst = {
+      .buffer = expected.data(), .length = expected.size(), .img_width = 200, .img_height = 200};
+  downscale_area_average(&src, &expected_dst);
+
+  Image aligned = {};
+  ASSERT_TRUE(image_allocate(&aligned, 200, 200, IMAGE_RGB888_PLANAR));
+  EXPECT_EQ(aligned.stride % IMAGE_ROW_ALIGNMENT, 0u);
+  for (int c = 0; c < 3; c++) {
+    EXPECT_EQ((uintptr_t)aligned.planes[c] % IMAGE_ROW_ALIGNMENT, 0u);
+  }
+
+  scale_square_image(&padded_src, &aligned);
+
+  // planar to interleaved through the row copy of scale_square_image
+  std::vector<uint8_t> merged(200 * 200 * 3);
+  Image merged_dst = {
+      .buffer = merged.data(), .length = merged.size(), .img_width = 200, .img_height = 200};
+  scale_square_image(&aligned, &merged_dst);
+  EXPECT_EQ(merged, expected);
+
+  std::vector<uint8_t> naive(200 * 200 * 3);
+  Image naive_dst = {
+      .buffer = naive.data(), .length = naive.size(), .img_width = 200, .img_height = 200};
+  downscale_area_average(&padded_src, &naive_dst);
+  EXPECT_EQ(naive, expected);
+
+  free(aligned.buffer);
+}
+
+// Test that images scale_square_image can not write are reported and dst is left alone
+TEST(StridedViewTest, RejectsUnscalableImages) {
+  auto rgb = makePattern(500 * 500 * 3, 7);
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = 500, .img_height = 400};
+
+  std::vector<uint8_t> target(200 * 200 * 3, 0xEE);
+  Image dst = {
+      .buffer = target.data(), .length = target.size(), .img_width = 200, .img_height = 200};
+  EXPECT_FALSE(image_scales_square(500, 400, &dst));
+  EXPECT_FALSE(scale_square_image(&src, &dst));
+
+  // the packed formats are written by the packers, not the scalers
+  src.img_height = 500;
+  std::vector<uint8_t> rgb565(200 * 200 * 2, 0xEE);
+  Image rgb565_dst = {};
+  image_view(&rgb565_dst, rgb565.data(), 200, 200, 200 * 2, IMAGE_RGB565);
+  EXPECT_FALSE(scale_square_image(&src, &rgb565_dst));
+  EXPECT_EQ(rgb565, std::vector<uint8_t>(200 * 200 * 2, 0xEE));
+  EXPECT_EQ(target, std::vector<uint8_t>(200 * 200 * 3, 0xEE));
+
+  src.img_height = 400;
+  src.img_width = 400;
+  EXPECT_TRUE(scale_square_image(&src, &dst));
+}
+
+// Test that the packers write into a window of a larger frame buffer and leave the rest alone
+TEST(StridedViewTest, PacksIntoFrameBufferWindow) {
+  const size_t fb_width = 300;
+  const size_t fb_height = 240;
+  auto rgb = makePattern(200 * 200 * 3, 9);
+
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = 200, .img_height = 200};
+  std::vector<uint8_t> expected(200 * 200 * 2);
+  Image expected_dst = {
+      .buffer = expected.data(), .length = expected.size(), .img_width = 200, .img_height = 200};
+  rgb888_to_rgb565_scalar(&src, &expected_dst);
+
+  Image planar_src = {};
+  ASSERT_TRUE(image_allocate(&planar_src, 200, 200, IMAGE_RGB888_PLANAR));
+  scale_square_image(&src, &planar_src);
+
+  std::vector<void (*)(Image *, Image *)> packers = {&rgb888_to_rgb565_scalar};
+#if __has_include(<arm_neon.h>)
+  packers.push_back(&rgb888_to_rgb565_neon);
+  packers.push_back(&rgb888_to_rgb565_neon_8vals);
+  packers.push_back(&rgb888_to_rgb565_neon_16_vals);
+#endif
+  packers.push_back(nullptr); // planar packer
+
+  for (auto packer : packers) {
+    std::vector<uint8_t> frame_buffer(fb_width * fb_height * 2, 0xAB);
+    Image frame = {};
+    image_view(&frame, frame_buffer.data(), fb_width, fb_height, fb_width * 2, IMAGE_RGB565);
+
+    Image window = {};
+    ASSERT_TRUE(image_crop(&frame, 61, 23, 200, 200, &window));
+
+    if (packer != nullptr) {
+      packer(&src, &window);
+    } else {
+      rgb888_planar_to_rgb565(&planar_src, &window);
+    }
+
+    for (size_t y = 0; y < fb_height; y++) {
+      for (size_t x = 0; x < fb_width; x++) {
+        const uint8_t *pixel = frame_buffer.data() + (y * fb_width + x) * 2;
+        bool inside = y >= 23 && y < 223 && x >= 61 && x < 261;
+
+        if (inside) {
+          const uint8_t *packed = expected.data() + ((y - 23) * 200 + x - 61) * 2;
+          ASSERT_EQ(memcmp(pixel, packed, 2), 0) << x << "," << y;
+        } else {
+          ASSERT_EQ(pixel[0], 0xAB) << x << "," << y;
+          ASSERT_EQ(pixel[1], 0xAB) << x << "," << y;
+        }
+      }
+    }
+  }
+
+  free(planar_src.buffer);
+}
+
+// Test that the vector bin kernels count every pixel like the plain formula, including row tails
+TEST(PaletteTest, HistogramMatchesReference) {
+  for (size_t width : {200, 93, 7}) {
+    auto rgb = makePattern(width * 3 * 3, (uint32_t)width);
+    Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = width, .img_height = 3};
+
+    auto reference = std::make_unique<ColorHistogram>();
+    for (size_t i = 0; i < width * 3; i++) {
+      const uint8_t *pixel = &rgb[i * 3];
+      const size_t bin = ((pixel[0] >> (8 - HISTOGRAM_BITS)) << (2 * HISTOGRAM_BITS)) |
+                         ((pixel[1] >> (8 - HISTOGRAM_BITS)) << HISTOGRAM_BITS) |
+                         (pixel[2] >> (8 - HISTOGRAM_BITS));
+      reference->counts[bin]++;
+      for (size_t c = 0; c < 3; c++) {
+        reference->sums[bin][c] += pixel[c];
+      }
+    }
+
+    std::vector<uint8_t> planar(rgb.size());
+    Image planar_src = {};
+    image_set_planar(&planar_src, planar.data(), width, 3);
+    deinterleave_rgb888(rgb.data(), planar_src.planes[0], planar_src.planes[1],
+                        planar_src.planes[2], width * 3);
+
+    for (const Image *image : {&src, &planar_src}) {
+      auto histogram = std::make_unique<ColorHistogram>();
+      color_histogram_add_rows(histogram.get(), image, 0, 3);
+      EXPECT_EQ(memcmp(histogram.get(), reference.get(), sizeof(ColorHistogram)), 0)
+          << width << " format " << image->format;
+    }
+  }
+}
+
+// Test that the histogram gathered while downscaling equals one taken of the output afterwards
+// and that median cut finds the dominant colours with their share of the pixels
+TEST(PaletteTest, FusedHistogramFindsDominantColors) {
+  const uint8_t colors[3][3] = {{200, 30, 30}, {20, 40, 180}, {240, 220, 60}};
+  std::vector<uint8_t> rgb(400 * 400 * 3);
+
+  // 60% red, 30% blue and 10% yellow columns with a little noise
+  for (size_t y = 0; y < 400; y++) {
+    for (size_t x = 0; x < 400; x++) {
+      const size_t color = x < 240 ? 0 : x < 360 ? 1 : 2;
+      for (size_t c = 0; c < 3; c++) {
+        rgb[(y * 400 + x) * 3 + c] = (uint8_t)(colors[color][c] + (x + y) % 5);
+      }
+    }
+  }
+
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = 400, .img_height = 400};
+
+  for (PixelFormat format : {IMAGE_RGB888, IMAGE_RGB888_PLANAR}) {
+    Image dst = {};
+    ASSERT_TRUE(image_allocate(&dst, 200, 200, format));
+
+    auto fused = std::make_unique<ColorHistogram>();
+    auto afterwards = std::make_unique<ColorHistogram>();
+    scale_square_image_ex(&src, &dst, fused.get(), false);
+    color_histogram_add_rows(afterwards.get(), &dst, 0, 200);
+    EXPECT_EQ(memcmp(fused.get(), afterwards.get(), sizeof(ColorHistogram)), 0);
+
+    Palette palette = {.max_colors = 3};
+    color_histogram_palette(fused.get(), &palette);
+    ASSERT_EQ(palette.count, 3u);
+
+    const uint32_t shares[3] = {60, 30, 10};
+    for (size_t i = 0; i < 3; i++) {
+      EXPECT_NEAR(palette.colors[i].r, colors[i][0], 6) << i;
+      EXPECT_NEAR(palette.colors[i].g, colors[i][1], 6) << i;
+      EXPECT_NEAR(palette.colors[i].b, colors[i][2], 6) << i;
+      EXPECT_NEAR(palette.colors[i].pixels, 200 * 200 * shares[i] / 100, 200) << i;
+    }
+
+    // a uniform image has a single colour however many are asked for
+    auto uniform = std::make_unique<ColorHistogram>();
+    std::vector<uint8_t> grey(50 * 50 * 3, 90);
+    Image grey_image = {.buffer = grey.data(), .length = grey.size(), .img_width = 50,
+                        .img_height = 50};
+    color_histogram_add_rows(uniform.get(), &grey_image, 0, 50);
+    Palette single = {.max_colors = 0};
+    color_histogram_palette(uniform.get(), &single);
+    ASSERT_EQ(single.count, 1u);
+    EXPECT_EQ(single.colors[0].r, 90);
+    EXPECT_EQ(single.colors[0].pixels, 2500u);
+
+    free(dst.buffer);
+  }
+}
+
+namespace {
+
+double srgbToLinear(uint8_t value) {
+  const double c = value / 255.0;
+  return c <= 0.04045 ? c / 12.92 : std::pow((c + 0.055) / 1.055, 2.4);
+}
+
+double linearToSrgb(double linear) {
+  const double c = linear <= 0.0031308 ? linear * 12.92 : 1.055 * std::pow(linear, 1 / 2.4) - 0.055;
+  return c * 255.0;
+}
+
+// Downscales an image in linear light into a packed destination of the given layout
+std::vector<uint8_t> downscaleLinear(Image *src, PixelFormat format, size_t size) {
+  std::vector<uint8_t> target(size * size * 3);
+  Image dst = {
+      .buffer = target.data(), .length = target.size(), .img_width = size, .img_height = size};
+
+  if (format == IMAGE_RGB888_PLANAR) {
+    image_set_planar(&dst, target.data(), size, size);
+  }
+
+  scale_square_image_ex(src, &dst, nullptr, true);
+
+  if (format != IMAGE_RGB888_PLANAR) {
+    return target;
+  }
+
+  std::vector<uint8_t> rgb(size * size * 3);
+  interleave_rgb888(dst.planes[0], dst.planes[1], dst.planes[2], rgb.data(), size * size);
+  return rgb;
+}
+
+} // namespace
+
+// Test that every sRGB value survives the round trip through linear light in uniform areas
+TEST(LinearLightTest, UniformAreasKeepTheirValue) {
+  std::vector<uint8_t> rgb(512 * 512 * 3);
+  for (size_t y = 0; y < 512; y++) {
+    for (size_t x = 0; x < 512; x++) {
+      // 32x32 blocks of every value, each covers 8x8 destination pixels
+      const uint8_t value = (uint8_t)(y / 32 * 16 + x / 32);
+      rgb[(y * 512 + x) * 3 + 0] = value;
+      rgb[(y * 512 + x) * 3 + 1] = (uint8_t)(255 - value);
+      rgb[(y * 512 + x) * 3 + 2] = value;
+    }
+  }
+
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = 512, .img_height = 512};
+  auto scaled = downscaleLinear(&src, IMAGE_RGB888_PLANAR, 128);
+
+  for (size_t y = 0; y < 128; y++) {
+    for (size_t x = 0; x < 128; x++) {
+      const uint8_t value = (uint8_t)(y / 8 * 16 + x / 8);
+      ASSERT_EQ(scaled[(y * 128 + x) * 3 + 0], value) << x << "," << y;
+      ASSERT_EQ(scaled[(y * 128 + x) * 3 + 1], 255 - value) << x << "," << y;
+      ASSERT_EQ(scaled[(y * 128 + x) * 3 + 2], value) << x << "," << y;
+    }
+  }
+}
+
+// Test that fine white on black detail keeps the brightness it has from a distance
+TEST(LinearLightTest, BrightDetailKeepsItsBrightness) {
+  std::vector<uint8_t> rgb(400 * 400 * 3);
+  for (size_t i = 0; i < 400 * 400; i++) {
+    memset(&rgb[i * 3], (i / 400 + i % 400) % 2 == 0 ? 255 : 0, 3);
+  }
+
+  Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = 400, .img_height = 400};
+
+  std::vector<uint8_t> plain(200 * 200 * 3);
+  Image plain_dst = {.buffer = plain.data(), .length = plain.size(), .img_width = 200,
+                     .img_height = 200};
+  scale_square_image(&src, &plain_dst);
+  EXPECT_EQ(plain[0], 127);
+
+  // half of the light is sRGB 188, the encoded average is much darker
+  auto linear = downscaleLinear(&src, IMAGE_RGB888, 200);
+  for (uint8_t value : linear) {
+    ASSERT_NEAR(value, 188, 1);
+  }
+}
+
+// Test that the table and SIMD path matches a floating point linear light average
+TEST(LinearLightTest, MatchesFloatingPointReference) {
+  for (uint32_t size : {201, 437, 1000}) {
+    auto rgb = makePattern(size * size * 3, size);
+    Image src = {.buffer = rgb.data(), .length = rgb.size(), .img_width = size, .img_height = size};
+
+    auto interleaved = downscaleLinear(&src, IMAGE_RGB888, 200);
+    EXPECT_EQ(downscaleLinear(&src, IMAGE_RGB888_PLANAR, 200), interleaved) << size;
+
+    const float scale = (float)size / 200;
+    for (uint32_t y = 0; y < 200; y += 7) {
+      for (uint32_t x = 0; x < 200; x += 3) {
+        const uint32_t x_end = std::min((uint32_t)((x + 1) * scale), size);
+        const uint32_t y_end = std::min((uint32_t)((y + 1) * scale), size);
+
+        for (size_t c = 0; c < 3; c++) {
+          double sum = 0;
+          uint32_t count = 0;
+          for (uint32_t sy = (uint32_t)(y * scale); sy < y_end; sy++) {
+            for (uint32_t sx = (uint32_t)(x * scale); sx < x_end; sx++) {
+              sum += srgbToLinear(rgb[((size_t)sy * size + sx) * 3 + c]);
+              count++;
+            }
+          }
+
+          ASSERT_NEAR(interleaved[(y * 200 + x) * 3 + c], linearToSrgb(sum / count), 1.0)
+              << size << " " << x << "," << y << " " << c;
+        }
+      }
+    }
+  }
+}
+
+namespace {
+
+// Where an orientation puts pixel (x, y) of an upright size x size image
+void turnPosition(Orientation orientation, size_t size, size_t &x, size_t &y) {
+  const size_t sx = x;
+  const size_t sy = y;
+  const size_t last = size - 1;
+
+  switch (orientation) {
+  case ORIENTATION_MIRROR_HORIZONTAL:
+    x = last - sx;
+    break;
+  case ORIENTATION_ROTATE_180:
+    x = last - sx;
+    y = last - sy;
+    break;
+  case ORIENTATION_MIRROR_VERTICAL:
+    y = last - sy;
+    break;
+  case ORIENTATION_TRANSPOSE:
+    x = sy;
+    y = sx;
+    break;
+  case ORIENTATION_ROTATE_90:
+    x = last - sy;
+    y = sx;
+    break;
+  case ORIENTATION_TRANSVERSE:
+    x = last - sy;
+    y = last - sx;
+    break;
+  case ORIENTATION_ROTATE_270:
+    x = sy;
+    y = last - sx;
+    break;
+  default:
+    break;
+  }
+}
+
+// Scales a square interleaved image to a packed 200x200 image of the given layout, returned
+// interleaved
+std::vector<uint8_t> scaleOriented(std::vector<uint8_t> &rgb, size_t size, Orientation orientation,
+                                   PixelFormat format, ColorHistogram *histogram = nullptr) {
+  Image src = {.buffer = rgb.data(),
+               .length = rgb.size(),
+               .img_width = size,
+               .img_height = size,
+               .orientation = orientation};
+
+  std::vector<uint8_t> target(200 * 200 * 3);
+  Image dst = {
+      .buffer = target.data(), .length = target.size(), .img_width = 200, .img_height = 200};
+
+  if (format == IMAGE_RGB888_PLANAR) {
+    image_set_planar(&dst, target.data(), 200, 200);
+  }
+
+  scale_square_image_ex(&src, &dst, histogram, false);
+
+  if (format != IMAGE_RGB888_PLANAR) {
+    return target;
+  }
+
+  std::vector<uint8_t> interleaved(200 * 200 * 3);
+  interleave_rgb888(dst.planes[0], dst.planes[1], dst.planes[2], interleaved.data(), 200 * 200);
+  return interleaved;
+}
+
+} // namespace
+
+// Test that every orientation is applied while the downscaler, copy and upscale write the output
+TEST(OrientationTest, WritesTurnedPixels) {
+  for (size_t size : {1000, 437, 200, 90}) {
+    auto rgb = makePattern(size * size * 3, (uint32_t)size);
+    auto upright = scaleOriented(rgb, size, ORIENTATION_UNTAGGED, IMAGE_RGB888);
+
+    for (int value = ORIENTATION_NORMAL; value <= ORIENTATION_ROTATE_270; value++) {
+      const Orientation orientation = (Orientation)value;
+
+      std::vector<uint8_t> expected(200 * 200 * 3);
+      for (size_t y = 0; y < 200; y++) {
+        for (size_t x = 0; x < 200; x++) {
+          size_t tx = x;
+          size_t ty = y;
+          turnPosition(orientation, 200, tx, ty);
+          memcpy(&expected[(ty * 200 + tx) * 3], &upright[(y * 200 + x) * 3], 3);
+        }
+      }
+
+      for (PixelFormat format : {IMAGE_RGB888, IMAGE_RGB888_PLANAR}) {
+        auto histogram = std::make_unique<ColorHistogram>();
+        auto turned = scaleOriented(rgb, size, orientation, format, histogram.get());
+        ASSERT_EQ(turned, expected) << size << " orientation " << value << " format " << format;
+
+        // every pixel is added to the histogram once, whichever row it ended up in
+        uint64_t pixels = 0;
+        for (uint32_t count : histogram->counts) {
+          pixels += count;
+        }
+        EXPECT_EQ(pixels, 200u * 200u) << size << " orientation " << value;
+      }
+    }
+  }
+}
@@ -0,0 +1,120 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <set>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "album_art.h"
+#include "image.h"
+#include "indexed_color.h"
+}
+
+namespace {
+
+std::vector<uint8_t> toRgb565Buffer(const std::vector<uint8_t> &rgb) {
+  std::vector<uint8_t> rgb565(rgb.size() / 3 * 2);
+  uint16_t *pixels = (uint16_t *)rgb565.data();
+  for (size_t i = 0; i < rgb.size() / 3; i++) {
+    pixels[i] = toRgb565(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+  }
+  return rgb565;
+}
+
+std::vector<uint8_t> quantize(const std::vector<uint8_t> &rgb565, size_t width, size_t height,
+                              IndexedOptions options) {
+  std::vector<uint8_t> indexed(INDEXED_SIZE(width * height));
+  EXPECT_TRUE(rgb565_to_indexed(rgb565.data(), width, height, &options, indexed.data()));
+  return indexed;
+}
+
+std::vector<uint8_t> expand(const std::vector<uint8_t> &indexed, size_t pixel_count) {
+  std::vector<uint8_t> rgb565(pixel_count * 2);
+  indexed_to_rgb565(indexed.data(), pixel_count, rgb565.data());
+  return rgb565;
+}
+
+// Sum of the per channel differences of block x block averages, in 8 bit units
+double blockError(const std::vector<uint8_t> &a, const std::vector<uint8_t> &b, size_t width,
+                  size_t height, size_t block) {
+  const uint16_t *pa = (const uint16_t *)a.data();
+  const uint16_t *pb = (const uint16_t *)b.data();
+  double error = 0;
+
+  for (size_t by = 0; by + block <= height; by += block) {
+    for (size_t bx = 0; bx + block <= width; bx += block) {
+      for (int shift : {11, 5, 0}) {
+        const int mask = shift == 5 ? 0x3F : 0x1F;
+        double sum = 0;
+        for (size_t y = by; y < by + block; y++) {
+          for (size_t x = bx; x < bx + block; x++) {
+            sum += ((pa[y * width + x] >> shift) & mask) - ((pb[y * width + x] >> shift) & mask);
+          }
+        }
+        error += std::abs(sum) / (block * block) * (shift == 5 ? 4 : 8);
+      }
+    }
+  }
+
+  return error / ((width / block) * (height / block));
+}
+
+} // namespace
+
+// Test that images with few colours are reproduced exactly and the palette is compact
+TEST(IndexedColorTest, KeepsFewColorsExact) {
+  std::vector<uint8_t> rgb565(200 * 200 * 2);
+  uint16_t *pixels = (uint16_t *)rgb565.data();
+  for (size_t i = 0; i < 200 * 200; i++) {
+    pixels[i] = (uint16_t)((i / 200 % 10 * 20 + i % 200 / 10) * 331);
+  }
+
+  std::set<uint16_t> distinct(pixels, pixels + 200 * 200);
+  ASSERT_LE(distinct.size(), 256u);
+
+  for (bool dither : {false, true}) {
+    auto indexed = quantize(rgb565, 200, 200, {.max_colors = 0, .dither = dither});
+    EXPECT_EQ(expand(indexed, 200 * 200), rgb565) << dither;
+  }
+
+  auto two = quantize(toRgb565Buffer(makeUniformRgb888(16, 16, 10, 200, 30)), 16, 16, {});
+  EXPECT_EQ(two[0] | two[1] << 8, toRgb565(10, 200, 30));
+  EXPECT_EQ(two[2] | two[3] << 8, 0);
+}
+
+// Test that gradients stay close to the source and dithering keeps their local average
+TEST(IndexedColorTest, QuantizesGradients) {
+  auto rgb565 = toRgb565Buffer(makeGradientRgb888(200, 200));
+
+  for (uint32_t max_colors : {16u, 256u}) {
+    auto plain = quantize(rgb565, 200, 200, {.max_colors = max_colors, .dither = false});
+    auto dithered = quantize(rgb565, 200, 200, {.max_colors = max_colors, .dither = true});
+
+    std::set<uint8_t> used(plain.begin() + INDEXED_MAX_COLORS * 2, plain.end());
+    EXPECT_LE(used.size(), max_colors);
+    EXPECT_GT(used.size(), max_colors / 2);
+
+    double plain_error = blockError(expand(plain, 200 * 200), rgb565, 200, 200, 4);
+    double dithered_error = blockError(expand(dithered, 200 * 200), rgb565, 200, 200, 4);
+    EXPECT_LT(plain_error, max_colors == 256 ? 12.0 : 64.0) << max_colors;
+    EXPECT_LT(dithered_error, plain_error * 0.75) << max_colors;
+  }
+}
+
+// Test that the album art entry point quantises the regular conversion
+TEST(IndexedColorTest, ConvertsAlbumArt) {
+  auto path = writeTempFile(
+      "indexed_cover.mp3",
+      makeMp3WithCover("image/png", encodePng(makeGradientRgb888(400, 400), 400, 400, false)));
+
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  ASSERT_EQ(get_album_art(path.c_str(), rgb565.data()), OK);
+
+  for (bool dither : {false, true}) {
+    std::vector<uint8_t> indexed(INDEXED_BUFFER_SIZE);
+    ASSERT_EQ(get_album_art_indexed(path.c_str(), indexed.data(), dither, nullptr), OK);
+    EXPECT_EQ(indexed, quantize(rgb565, TARGET_IMG_WIDTH, TARGET_IMG_HEIGHT,
+                                {.max_colors = INDEXED_MAX_COLORS, .dither = dither}));
+  }
+}
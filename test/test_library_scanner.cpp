@@ -0,0 +1,98 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <map>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+extern "C" {
+#include "image.h"
+#include "library_scanner.h"
+}
+
+class LibraryScannerTest : public ::testing::Test {
+protected:
+  struct Seen {
+    IO_ERROR result;
+    bool shared;
+    std::vector<uint8_t> rgb565;
+  };
+
+  std::string root;
+  std::mutex mutex;
+  std::map<std::string, Seen> seen;
+
+  void SetUp() override {
+    root = ::testing::TempDir() + "scanner_library";
+    std::vector<uint8_t> no_apic_tag;
+    appendFrame(no_apic_tag, "TIT2", {0x03, 'T'});
+
+    auto cover_a = makeMp3WithCover("image/png", encodePng(makeGradientRgb888(200, 200), 200,
+                                                           200, false));
+    auto cover_b = makeMp3WithCover("image/png", encodePng(makeUniformRgb888(64, 64, 1, 2, 3), 64,
+                                                           64, false));
+
+    for (auto dir : {"", "/album_a", "/album_a/disc_2", "/album_b", "/empty"}) {
+      mkdir((root + dir).c_str(), 0755);
+    }
+
+    writeTempFile("scanner_library/album_a/01.mp3", cover_a);
+    writeTempFile("scanner_library/album_a/02.mp3", cover_a);
+    writeTempFile("scanner_library/album_a/notes.txt", cover_a);
+    writeTempFile("scanner_library/album_a/disc_2/01.MP3", cover_b);
+    writeTempFile("scanner_library/album_b/01.mp3", cover_b);
+    writeTempFile("scanner_library/album_b/02.mp3", makeMp3(no_apic_tag));
+  }
+
+  static void record(const ScanResult *result, void *user_data) {
+    LibraryScannerTest *test = (LibraryScannerTest *)user_data;
+    Seen entry = {result->result, result->shared, {}};
+    if (result->rgb565_buffer != nullptr) {
+      entry.rgb565.assign(result->rgb565_buffer, result->rgb565_buffer + RGB565_BUFFER_SIZE);
+    }
+
+    std::lock_guard<std::mutex> lock(test->mutex);
+    EXPECT_EQ(test->seen.count(result->file_path), 0u) << result->file_path;
+    test->seen[result->file_path] = entry;
+  }
+};
+
+// Test that every MP3 is reported once with the same art get_album_art produces
+TEST_F(LibraryScannerTest, ConvertsEveryFile) {
+  const char *roots[] = {root.c_str()};
+  ScannerConfig config = {.workers = 3, .convert_art = true, .on_file = &record, .user_data = this};
+
+  ASSERT_TRUE(library_scan(roots, 1, &config));
+  ASSERT_EQ(seen.size(), 5u);
+
+  for (auto &[path, entry] : seen) {
+    std::vector<uint8_t> reference(RGB565_BUFFER_SIZE);
+    EXPECT_EQ(entry.result, get_album_art(path.c_str(), reference.data())) << path;
+    if (entry.result == OK) {
+      EXPECT_EQ(entry.rgb565, reference) << path;
+    }
+  }
+
+  // the second track of the album reuses the decoded cover of the first one
+  EXPECT_FALSE(seen[root + "/album_a/01.mp3"].shared);
+  EXPECT_TRUE(seen[root + "/album_a/02.mp3"].shared);
+  EXPECT_FALSE(seen[root + "/album_a/disc_2/01.MP3"].shared);
+  EXPECT_EQ(seen[root + "/album_b/02.mp3"].result, NO_APIC);
+}
+
+// Test enumeration without conversion and a root that does not exist
+TEST_F(LibraryScannerTest, EnumeratesOnly) {
+  std::string missing = root + "/missing";
+  const char *roots[] = {root.c_str(), missing.c_str()};
+  ScannerConfig config = {
+      .workers = 2, .convert_art = false, .on_file = &record, .user_data = this};
+
+  EXPECT_FALSE(library_scan(roots, 2, &config));
+  ASSERT_EQ(seen.size(), 5u);
+
+  for (auto &[path, entry] : seen) {
+    EXPECT_EQ(entry.result, OK);
+    EXPECT_TRUE(entry.rgb565.empty());
+  }
+}
@@ -0,0 +1,136 @@
+#include "test_fixtures.h"
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <gtest/gtest.h>
+#include <mutex>
+#include <set>
+#include <stdio.h>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+extern "C" {
+#include "image.h"
+#include "library_watch.h"
+}
+
+class LibraryWatchTest : public ::testing::Test {
+protected:
+  struct Seen {
+    WatchEventType type;
+    std::string path;
+    IO_ERROR result;
+    std::vector<uint8_t> rgb565;
+  };
+
+  std::string root;
+  std::mutex mutex;
+  std::condition_variable changed;
+  std::vector<Seen> seen;
+
+  void SetUp() override {
+    root = ::testing::TempDir() + "watch_library";
+    mkdir(root.c_str(), 0755);
+    mkdir((root + "/album").c_str(), 0755);
+    writeTempFile("watch_library/album/existing.mp3", cover(1));
+    remove((root + "/album/new.mp3").c_str());
+  }
+
+  static std::vector<uint8_t> cover(uint8_t value) {
+    auto png = encodePng(makeUniformRgb888(64, 64, value, value, value), 64, 64, false);
+    return makeMp3WithCover("image/png", png);
+  }
+
+  static void record(const WatchEvent *event, void *user_data) {
+    LibraryWatchTest *test = (LibraryWatchTest *)user_data;
+    Seen entry = {event->type, event->file_path, event->result, {}};
+    if (event->rgb565_buffer != nullptr) {
+      entry.rgb565.assign(event->rgb565_buffer, event->rgb565_buffer + RGB565_BUFFER_SIZE);
+    }
+
+    std::lock_guard<std::mutex> lock(test->mutex);
+    test->seen.push_back(entry);
+    test->changed.notify_all();
+  }
+
+  // Waits until at least count events have been seen
+  bool waitFor(size_t count) {
+    std::unique_lock<std::mutex> lock(mutex);
+    return changed.wait_for(lock, std::chrono::seconds(5), [&] { return seen.size() >= count; });
+  }
+};
+
+// Test that a burst of writes is reported once, and that added, changed and removed art is reported
+TEST_F(LibraryWatchTest, ReportsChanges) {
+  const char *roots[] = {root.c_str()};
+  WatchConfig config = {.debounce_ms = 100, .on_change = &record, .user_data = this};
+
+  LibraryWatch *watch = library_watch_start(roots, 1, &config);
+  ASSERT_NE(watch, nullptr);
+
+  std::string new_path = root + "/album/new.mp3";
+  for (uint8_t value = 10; value < 15; value++) {
+    writeTempFile("watch_library/album/new.mp3", cover(value));
+  }
+
+  ASSERT_TRUE(waitFor(1));
+  EXPECT_EQ(seen[0].type, WATCH_ART_ADDED);
+  EXPECT_EQ(seen[0].path, new_path);
+  ASSERT_EQ(seen[0].result, OK);
+  EXPECT_EQ(((const uint16_t *)seen[0].rgb565.data())[0], toRgb565(14, 14, 14));
+
+  writeTempFile("watch_library/album/existing.mp3", cover(20));
+  ASSERT_TRUE(waitFor(2));
+  EXPECT_EQ(seen[1].type, WATCH_ART_CHANGED);
+  EXPECT_EQ(seen[1].path, root + "/album/existing.mp3");
+
+  // rewriting the same picture is not a change
+  writeTempFile("watch_library/album/existing.mp3", cover(20));
+  remove(new_path.c_str());
+
+  ASSERT_TRUE(waitFor(3));
+  EXPECT_EQ(seen[2].type, WATCH_ART_REMOVED);
+  EXPECT_EQ(seen[2].path, new_path);
+
+  library_watch_stop(watch);
+  EXPECT_EQ(seen.size(), 3u);
+}
+
+// Test that the files of a directory moved into the library are each reported once, also when
+// events for them arrive in between
+TEST_F(LibraryWatchTest, ReportsMovedDirectoryOnce) {
+  const std::string outside = ::testing::TempDir() + "watch_outside";
+  const std::string moved = root + "/moved";
+  std::filesystem::remove_all(outside);
+  std::filesystem::remove_all(moved);
+  mkdir(outside.c_str(), 0755);
+
+  const size_t file_count = 40;
+  for (size_t i = 0; i < file_count; i++) {
+    writeTempFile("watch_outside/track" + std::to_string(i) + ".mp3", cover((uint8_t)i));
+  }
+
+  const char *roots[] = {root.c_str()};
+  WatchConfig config = {.debounce_ms = 200, .on_change = &record, .user_data = this};
+  LibraryWatch *watch = library_watch_start(roots, 1, &config);
+  ASSERT_NE(watch, nullptr);
+
+  ASSERT_EQ(rename(outside.c_str(), moved.c_str()), 0);
+  for (size_t i = 0; i < file_count; i += 3) {
+    writeTempFile("watch_library/moved/track" + std::to_string(i) + ".mp3", cover((uint8_t)i));
+  }
+
+  ASSERT_TRUE(waitFor(file_count));
+  library_watch_stop(watch);
+
+  std::set<std::string> paths;
+  for (const auto &entry : seen) {
+    EXPECT_EQ(entry.type, WATCH_ART_ADDED) << entry.path;
+    paths.insert(entry.path);
+  }
+  EXPECT_EQ(seen.size(), file_count);
+  EXPECT_EQ(paths.size(), file_count);
+
+  std::filesystem::remove_all(moved);
+}
@@ -0,0 +1,116 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <random>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "album_art.h"
+#include "image.h"
+#include "rgb565_codec.h"
+}
+
+namespace {
+
+std::vector<uint8_t> toRgb565Buffer(const std::vector<uint8_t> &rgb) {
+  std::vector<uint8_t> rgb565(rgb.size() / 3 * 2);
+  uint16_t *pixels = (uint16_t *)rgb565.data();
+  for (size_t i = 0; i < rgb.size() / 3; i++) {
+    pixels[i] = toRgb565(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2]);
+  }
+  return rgb565;
+}
+
+std::vector<uint8_t> encode(const std::vector<uint8_t> &rgb565, uint32_t width, uint32_t height) {
+  std::vector<uint8_t> encoded(RGB565_ENCODED_MAX_SIZE(width * height));
+  size_t size = rgb565_encode(rgb565.data(), width, height, encoded.data(), encoded.size());
+  EXPECT_GT(size, 0u);
+  encoded.resize(size);
+  return encoded;
+}
+
+} // namespace
+
+// Test that every kind of content survives the round trip, including the SIMD row tails
+TEST(Rgb565CodecTest, RoundTrips) {
+  std::mt19937 random(39);
+
+  for (auto [width, height] : std::vector<std::pair<uint32_t, uint32_t>>{
+           {1, 1}, {7, 3}, {13, 200}, {200, 200}, {333, 17}}) {
+    std::vector<uint8_t> noise(width * height * 2);
+    for (uint8_t &value : noise) {
+      value = (uint8_t)random();
+    }
+
+    std::vector<uint8_t> mixed = toRgb565Buffer(makeGradientRgb888(width, height));
+    for (size_t i = 0; i < mixed.size(); i += 97) {
+      mixed[i] ^= (uint8_t)random();
+    }
+
+    for (const auto &rgb565 : {noise, mixed, toRgb565Buffer(makeGradientRgb888(width, height)),
+                               toRgb565Buffer(makeUniformRgb888(width, height, 200, 10, 40))}) {
+      auto encoded = encode(rgb565, width, height);
+      EXPECT_LE(encoded.size(), RGB565_ENCODED_MAX_SIZE(width * height));
+
+      uint32_t decoded_width = 0;
+      uint32_t decoded_height = 0;
+      ASSERT_TRUE(rgb565_encoded_size(encoded.data(), encoded.size(), &decoded_width,
+                                      &decoded_height));
+      EXPECT_EQ(decoded_width, width);
+      EXPECT_EQ(decoded_height, height);
+
+      std::vector<uint8_t> decoded(rgb565.size());
+      ASSERT_TRUE(rgb565_decode(encoded.data(), encoded.size(), decoded.data(), decoded.size()))
+          << width << "x" << height;
+      EXPECT_EQ(decoded, rgb565) << width << "x" << height;
+    }
+  }
+}
+
+// Test that converted covers shrink and decode to the plain conversion
+TEST(Rgb565CodecTest, CompressesConvertedCovers) {
+  std::string gradient = writeTempFile(
+      "codec_gradient.mp3",
+      makeMp3WithCover("image/png", encodePng(makeGradientRgb888(400, 400), 400, 400, false)));
+  std::string flat = writeTempFile(
+      "codec_flat.mp3", makeMp3WithCover("image/png", encodePng(makeUniformRgb888(300, 300, 30,
+                                                                                  60, 90),
+                                                                300, 300, false)));
+
+  for (const std::string &path : {gradient, flat}) {
+    std::vector<uint8_t> encoded(RGB565_ENCODED_MAX_SIZE(TARGET_IMG_WIDTH * TARGET_IMG_HEIGHT));
+    size_t size = 0;
+    ASSERT_EQ(get_album_art_encoded(path.c_str(), encoded.data(), encoded.size(), &size, nullptr),
+              OK);
+    EXPECT_LE(size * 2, (size_t)RGB565_BUFFER_SIZE) << path;
+
+    std::vector<uint8_t> reference(RGB565_BUFFER_SIZE);
+    ASSERT_EQ(get_album_art(path.c_str(), reference.data()), OK);
+
+    std::vector<uint8_t> decoded(RGB565_BUFFER_SIZE);
+    ASSERT_TRUE(rgb565_decode(encoded.data(), size, decoded.data(), decoded.size()));
+    EXPECT_EQ(decoded, reference) << path;
+  }
+}
+
+// Test that damaged streams and short buffers are rejected
+TEST(Rgb565CodecTest, RejectsDamagedStreams) {
+  auto rgb565 = toRgb565Buffer(makeGradientRgb888(64, 64));
+  auto encoded = encode(rgb565, 64, 64);
+  std::vector<uint8_t> decoded(rgb565.size());
+
+  EXPECT_FALSE(rgb565_decode(encoded.data(), encoded.size() - 1, decoded.data(), decoded.size()));
+  EXPECT_FALSE(rgb565_decode(encoded.data(), encoded.size(), decoded.data(), decoded.size() - 1));
+
+  auto trailing = encoded;
+  trailing.push_back(0);
+  EXPECT_FALSE(rgb565_decode(trailing.data(), trailing.size(), decoded.data(), decoded.size()));
+
+  auto bad_magic = encoded;
+  bad_magic[0] = 'X';
+  EXPECT_FALSE(rgb565_decode(bad_magic.data(), bad_magic.size(), decoded.data(), decoded.size()));
+
+  std::vector<uint8_t> small(RGB565_ENCODED_MAX_SIZE(64 * 64) - 1);
+  EXPECT_EQ(rgb565_encode(rgb565.data(), 64, 64, small.data(), small.size()), 0u);
+  EXPECT_EQ(rgb565_encode(rgb565.data(), 0, 64, small.data(), small.size()), 0u);
+}
@@ -0,0 +1,93 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/resource.h>
+#include <vector>
+
+extern "C" {
+#include "tag_reader.h"
+}
+
+class TagReaderTest : public ::testing::Test {
+protected:
+  std::vector<std::string> paths;
+  std::vector<uint8_t> cover_tag;
+
+  void SetUp() override {
+    auto png = encodePng(makeGradientRgb888(64, 64), 64, 64, false);
+    appendFrame(cover_tag, "APIC", makeApicBody("image/png", png));
+
+    auto cover = makeMp3(cover_tag);
+    auto truncated = std::vector<uint8_t>(cover.begin(), cover.begin() + 10 + cover_tag.size() / 2);
+
+    paths = {
+        writeTempFile("reader_cover.mp3", cover),
+        writeTempFile("reader_no_id3.mp3", std::vector<uint8_t>(64, 0xFF)),
+        ::testing::TempDir() + "reader_missing.mp3",
+        writeTempFile("reader_truncated.mp3", truncated),
+        writeTempFile("reader_short.mp3", std::vector<uint8_t>{'I', 'D', '3'}),
+    };
+  }
+
+  std::vector<TagRead> readAll(bool use_io_uring) {
+    TagReader *reader = tag_reader_create(2, use_io_uring);
+    EXPECT_NE(reader, nullptr);
+
+    std::vector<TagRead> reads(paths.size());
+    for (size_t i = 0; i < paths.size(); i++) {
+      reads[i].file_path = paths[i].c_str();
+    }
+
+    tag_reader_read(reader, reads.data(), reads.size());
+    tag_reader_destroy(reader);
+    return reads;
+  }
+};
+
+// Test the results of both backends across several windows of files
+TEST_F(TagReaderTest, BackendsAgree) {
+  for (bool use_io_uring : {true, false}) {
+    auto reads = readAll(use_io_uring);
+
+    ASSERT_EQ(reads[0].result, OK);
+    EXPECT_EQ(reads[0].major_version, 3);
+    ASSERT_EQ(reads[0].tag_size, cover_tag.size() + 256);
+    EXPECT_EQ(std::vector<uint8_t>(reads[0].tag_buffer, reads[0].tag_buffer + cover_tag.size()),
+              cover_tag);
+
+    EXPECT_EQ(reads[1].result, NO_ID3);
+    EXPECT_EQ(reads[2].result, COULD_NOT_OPEN_FILE);
+
+    // a cut file keeps what could be read
+    ASSERT_EQ(reads[3].result, OK);
+    EXPECT_EQ(reads[3].tag_size, cover_tag.size() / 2);
+
+    EXPECT_EQ(reads[4].result, COULD_NOT_READ_HEADER);
+
+    for (auto &read : reads) {
+      free(read.tag_buffer);
+    }
+  }
+}
+
+// Test that a window never keeps more files open than a share of the descriptor limit allows
+TEST_F(TagReaderTest, DepthFitsDescriptorLimit) {
+  struct rlimit original;
+  ASSERT_EQ(getrlimit(RLIMIT_NOFILE, &original), 0);
+
+  struct rlimit low = original;
+  low.rlim_cur = 64;
+  ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &low), 0);
+
+  TagReader *reader = tag_reader_create(4096, true);
+  ASSERT_EQ(setrlimit(RLIMIT_NOFILE, &original), 0);
+  ASSERT_NE(reader, nullptr);
+  EXPECT_EQ(tag_reader_queue_depth(reader), 16u);
+  tag_reader_destroy(reader);
+
+  reader = tag_reader_create(8, true);
+  ASSERT_NE(reader, nullptr);
+  EXPECT_EQ(tag_reader_queue_depth(reader), 8u);
+  tag_reader_destroy(reader);
+}
@@ -0,0 +1,180 @@
+#include "test_fixtures.h"
+#include <gtest/gtest.h>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include "album_art.h"
+#include "tag_writer.h"
+}
+
+namespace {
+
+std::vector<uint8_t> readFile(const std::string &path) {
+  std::vector<uint8_t> data;
+  FILE *f = fopen(path.c_str(), "rb");
+  EXPECT_NE(f, nullptr);
+  if (f != nullptr) {
+    uint8_t chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), f)) > 0) {
+      data.insert(data.end(), chunk, chunk + n);
+    }
+    fclose(f);
+  }
+  return data;
+}
+
+size_t tagEnd(const std::vector<uint8_t> &mp3) {
+  return 10 + ((size_t)mp3[6] << 21 | (size_t)mp3[7] << 14 | (size_t)mp3[8] << 7 | mp3[9]);
+}
+
+std::vector<uint8_t> audioOf(const std::vector<uint8_t> &mp3) {
+  return std::vector<uint8_t>(mp3.begin() + tagEnd(mp3), mp3.end());
+}
+
+IO_ERROR writeCover(const std::string &path, const std::vector<uint8_t> &jpeg, bool *rewritten,
+                    uint32_t padding = 0) {
+  ApicPicture picture = {.mime_type = "image/jpeg",
+                         .picture_type = APIC_FRONT_COVER,
+                         .description = "thumbnail",
+                         .data = jpeg.data(),
+                         .size = (uint32_t)jpeg.size()};
+  TagWriteOptions options = {.padding = padding, .rewritten = rewritten};
+  return tag_write_apic(path.c_str(), &picture, &options);
+}
+
+std::vector<uint8_t> albumArt(const std::string &path) {
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  EXPECT_EQ(get_album_art(path.c_str(), rgb565.data()), OK);
+  return rgb565;
+}
+
+} // namespace
+
+// Test that a cover that fits into the tag only rewrites the tag region and replaces the old cover
+TEST(TagWriterTest, ReplacesCoverInPlace) {
+  auto large = encodeJpeg(makeGradientRgb888(400, 400), 400, 400, false, 95);
+  auto small = encodeJpeg(makeUniformRgb888(200, 200, 200, 40, 10), 200, 200, false, 80);
+  ASSERT_LT(small.size(), large.size());
+
+  for (uint8_t version : {3, 4}) {
+    auto original = makeMp3WithCover("image/jpeg", large, version);
+    auto path = writeTempFile("tag_writer_in_place.mp3", original);
+
+    bool rewritten = true;
+    ASSERT_EQ(writeCover(path, small, &rewritten), OK);
+    EXPECT_FALSE(rewritten);
+
+    auto written = readFile(path);
+    ASSERT_EQ(written.size(), original.size());
+    EXPECT_EQ(audioOf(written), audioOf(original));
+    EXPECT_EQ(std::vector<uint8_t>(written.begin() + 10, written.begin() + 31),
+              std::vector<uint8_t>(original.begin() + 10, original.begin() + 31))
+        << "TIT2 frame moved";
+
+    auto expected = writeTempFile("tag_writer_expected.mp3",
+                                  makeMp3WithCover("image/jpeg", small, version));
+    EXPECT_EQ(albumArt(path), albumArt(expected));
+
+    // writing the same cover again leaves the file alone
+    ASSERT_EQ(writeCover(path, small, &rewritten), OK);
+    EXPECT_FALSE(rewritten);
+    EXPECT_EQ(readFile(path), written);
+  }
+}
+
+// Test that a cover that does not fit rebuilds the file with padding that the next write reuses
+TEST(TagWriterTest, GrowsTagWithPadding) {
+  auto small = encodeJpeg(makeUniformRgb888(64, 64, 10, 20, 30), 64, 64, false, 80);
+  auto large = encodeJpeg(makeGradientRgb888(300, 300), 300, 300, false, 95);
+  auto original = makeMp3WithCover("image/jpeg", small, 4);
+  auto path = writeTempFile("tag_writer_grow.mp3", original);
+
+  bool rewritten = false;
+  ASSERT_EQ(writeCover(path, large, &rewritten, 8192), OK);
+  EXPECT_TRUE(rewritten);
+
+  auto grown = readFile(path);
+  EXPECT_EQ(audioOf(grown), audioOf(original));
+  EXPECT_GE(tagEnd(grown), 10 + large.size() + 8192);
+  EXPECT_EQ(grown[tagEnd(grown) - 1], 0);
+
+  auto expected =
+      writeTempFile("tag_writer_grow_expected.mp3", makeMp3WithCover("image/jpeg", large, 4));
+  EXPECT_EQ(albumArt(path), albumArt(expected));
+
+  // a slightly bigger cover now fits into the reserved padding
+  auto larger = large;
+  larger.insert(larger.end(), 1000, 0);
+  ASSERT_EQ(writeCover(path, larger, &rewritten, 8192), OK);
+  EXPECT_FALSE(rewritten);
+  EXPECT_EQ(readFile(path).size(), grown.size());
+  EXPECT_EQ(albumArt(path), albumArt(expected));
+}
+
+// Test that files without a tag get one in front of the untouched audio
+TEST(TagWriterTest, AddsTagToUntaggedFile) {
+  auto cover = encodeJpeg(makeGradientRgb888(200, 200), 200, 200, false);
+  auto tagged = makeMp3WithCover("image/jpeg", cover, 4);
+  auto audio = audioOf(tagged);
+  auto path = writeTempFile("tag_writer_untagged.mp3", audio);
+
+  std::vector<uint8_t> rgb565(RGB565_BUFFER_SIZE);
+  ASSERT_EQ(get_album_art(path.c_str(), rgb565.data()), NO_ID3);
+
+  bool rewritten = false;
+  ASSERT_EQ(writeCover(path, cover, &rewritten), OK);
+  EXPECT_TRUE(rewritten);
+
+  auto written = readFile(path);
+  EXPECT_EQ(written[3], 4);
+  EXPECT_EQ(audioOf(written), audio);
+  EXPECT_EQ(tagEnd(written), 10 + 10 + 1 + 11 + 1 + 10 + cover.size() + TAG_WRITER_DEFAULT_PADDING);
+
+  auto expected = writeTempFile("tag_writer_untagged_expected.mp3", tagged);
+  EXPECT_EQ(albumArt(path), albumArt(expected));
+}
+
+// Test that pictures of other types and other frames are kept
+TEST(TagWriterTest, KeepsOtherFrames) {
+  auto cover = encodeJpeg(makeGradientRgb888(200, 200), 200, 200, false);
+  auto back = makeApicBody("image/png", {1, 2, 3, 4}, "back");
+  back[1 + 9 + 1] = 4; // back cover
+
+  std::vector<uint8_t> tag_body;
+  std::string title = "\x03Test Title";
+  auto old_cover = makeApicBody("image/jpeg", {9, 9, 9});
+  appendFrame(tag_body, "APIC", old_cover, 3);
+  appendFrame(tag_body, "TIT2", std::vector<uint8_t>(title.begin(), title.end()), 3);
+  appendFrame(tag_body, "APIC", back, 3);
+  auto path = writeTempFile("tag_writer_frames.mp3", makeMp3(tag_body, 3, 64));
+
+  ASSERT_EQ(writeCover(path, cover, nullptr), OK);
+
+  auto written = readFile(path);
+  std::vector<uint8_t> frames(written.begin() + 10, written.begin() + tagEnd(written));
+  std::vector<uint8_t> kept(tag_body.begin() + 10 + old_cover.size(), tag_body.end());
+  ASSERT_GE(frames.size(), kept.size());
+  EXPECT_EQ(std::vector<uint8_t>(frames.begin(), frames.begin() + kept.size()), kept);
+  EXPECT_EQ(std::string(frames.begin() + kept.size(), frames.begin() + kept.size() + 4), "APIC");
+}
+
+// Test that tags the writer can not keep intact are refused without touching the file
+TEST(TagWriterTest, RefusesUnsupportedTags) {
+  auto cover = encodeJpeg(makeGradientRgb888(64, 64), 64, 64, false);
+
+  auto unsynchronised = makeMp3WithCover("image/jpeg", cover, 3);
+  unsynchronised[5] = 0x80;
+  auto old_version = makeMp3WithCover("image/jpeg", cover, 3);
+  old_version[3] = 2;
+
+  for (const auto &mp3 : {unsynchronised, old_version}) {
+    auto path = writeTempFile("tag_writer_refused.mp3", mp3);
+    EXPECT_EQ(writeCover(path, cover, nullptr), COULD_NOT_WRITE_TAG);
+    EXPECT_EQ(readFile(path), mp3);
+  }
+
+  EXPECT_EQ(writeCover(::testing::TempDir() + "tag_writer_missing.mp3", cover, nullptr),
+            COULD_NOT_OPEN_FILE);
+}